@@ -1,19 +1,30 @@
 #include "dht.h"
-#include <openssl/sha.h>
+#include "dht_persist.h"
+#include "dht_rpc.h"
+#include "dht_replica.h"
+#include "dht_hash.h"
 #include <openssl/rand.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
-// DHT関連のグローバル変数
-static pthread_t dht_thread;
-static bool dht_running = false;
+#define DHT_FIND_STACK_RESULTS 64  // dht_find_nodeがスタックに置くヒープの大きさ
+#define DHT_CONTACT_QUIET 60       // この秒数以内に見たノードは生存確認しない
 
 // DHT初期化用の内部関数
 
-// DHT初期化
-void dht_init(Node* node) {
+// 単調増加する時刻（ミリ秒）
+static uint64_t dht_monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// DHT初期化（start_maintenanceがfalseなら呼び出し側がdht_maintenance_tickを1秒ごとに呼ぶ）
+static void dht_init_data(Node* node, bool start_maintenance) {
     // DHT用のデータ構造を確保
     DhtData* dht_data = (DhtData*)malloc(sizeof(DhtData));
     if (!dht_data) {
@@ -24,17 +35,38 @@ void dht_init(Node* node) {
     // 初期化
     memset(dht_data, 0, sizeof(DhtData));
     pthread_mutex_init(&dht_data->dht_mutex, NULL);
+    pthread_mutex_init(&dht_data->store_mutex, NULL);
+    if (dht_store_init(&dht_data->store, DHT_STORE_DEFAULT_BUDGET) < 0) {
+        pthread_mutex_destroy(&dht_data->store_mutex);
+        pthread_mutex_destroy(&dht_data->dht_mutex);
+        free(dht_data);
+        return;
+    }
+    if (dht_store_init(&dht_data->cache, DHT_CACHE_DEFAULT_BUDGET) < 0) {
+        dht_store_free(&dht_data->store);
+        pthread_mutex_destroy(&dht_data->store_mutex);
+        pthread_mutex_destroy(&dht_data->dht_mutex);
+        free(dht_data);
+        return;
+    }
+    dht_data->cache_enabled = true;
     
     // ルーティングテーブルの確保
     dht_data->routing_table = (RoutingTable*)malloc(sizeof(RoutingTable));
     if (!dht_data->routing_table) {
         perror("Failed to allocate routing table");
+        dht_store_free(&dht_data->cache);
+        dht_store_free(&dht_data->store);
+        pthread_mutex_destroy(&dht_data->store_mutex);
+        pthread_mutex_destroy(&dht_data->dht_mutex);
         free(dht_data);
         return;
     }
     
-    // ルーティングテーブルの初期化
+    // ルーティングテーブルの初期化（バケットはノードを追加するときに確保する）
     memset(dht_data->routing_table, 0, sizeof(RoutingTable));
+    dht_data->routing_table->clock_base_ms = dht_monotonic_ms();
+    dht_data->routing_table->wall_base = time(NULL);
     
     // ノードIDからDHT IDを生成
     char id_str[64];
@@ -44,32 +76,71 @@ void dht_init(Node* node) {
     // ノードにDHTデータを関連付ける
     node->dht_data = dht_data;
     
+    // RPCと値の複製
+    dht_rpc_init(node);
+    if (dht_replica_init(node) < 0) {
+        printf("DHT value replication is disabled for node %d\n", node->id);
+    }
+    
     // DHT IDを表示
     char hex_id[DHT_ID_BITS/4 + 1];
     dht_id_to_hex(&dht_data->routing_table->self_id, hex_id, sizeof(hex_id));
     printf("Node %d initialized with DHT ID: %s\n", node->id, hex_id);
     
     // メンテナンススレッドを開始
-    dht_running = true;
-    if (pthread_create(&dht_thread, NULL, dht_maintenance_thread, node) != 0) {
+    if (!start_maintenance) {
+        return;
+    }
+    dht_data->maintenance_running = true;
+    if (pthread_create(&dht_data->maintenance_thread, NULL, dht_maintenance_thread, node) != 0) {
         perror("Failed to create DHT maintenance thread");
-        dht_running = false;
+        dht_data->maintenance_running = false;
     }
 }
 
+// DHT初期化
+void dht_init(Node* node) {
+    dht_init_data(node, true);
+}
+
+// メンテナンススレッドを使わずにDHTを初期化（多数のノードを1つのスレッドで動かすシミュレーション用）
+void dht_init_manual(Node* node) {
+    dht_init_data(node, false);
+}
+
 // DHT終了処理
 void dht_cleanup(Node* node) {
     if (!node->dht_data) {
         return;
     }
     
-    // メンテナンススレッドを停止
-    dht_running = false;
-    pthread_join(dht_thread, NULL);
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    dht_data->shutting_down = true;
+    
+    // メンテナンススレッドを停止（進行中のルックアップは打ち切る）
+    if (dht_data->maintenance_running) {
+        dht_data->maintenance_running = false;
+        dht_rpc_cleanup(node);
+        pthread_join(dht_data->maintenance_thread, NULL);
+    }
+    
+    // RPCと値の複製を終了
+    dht_rpc_cleanup(node);
+    dht_replica_cleanup(node);
+    pthread_mutex_destroy(&dht_data->rpc_mutex);
+    
+    // 永続化ファイルを閉じる
+    dht_persist_close(dht_data->persist);
     
     // DHT用のデータ構造を解放
-    DhtData* dht_data = (DhtData*)node->dht_data;
+    dht_store_free(&dht_data->cache);
+    dht_store_free(&dht_data->store);
+    pthread_mutex_destroy(&dht_data->store_mutex);
     pthread_mutex_destroy(&dht_data->dht_mutex);
+    for (int i = 0; i < DHT_ID_BITS; i++) {
+        free(atomic_load_explicit(&dht_data->routing_table->buckets[i], memory_order_relaxed));
+    }
+    free(dht_data->routing_table);
     free(dht_data);
     node->dht_data = NULL;
     
@@ -83,231 +154,909 @@ DhtId dht_generate_id() {
     return id;
 }
 
-// 文字列からDHT IDを生成（SHA-1ハッシュを使用）
+// 文字列からDHT IDを生成（dht_hashで選んだハッシュ、既定はSHA-1）
 DhtId dht_generate_id_from_string(const char* str) {
     DhtId id;
-    SHA1((const unsigned char*)str, strlen(str), id.bytes);
+    dht_hash_string(str, &id);
     return id;
 }
 
-// 2つのDHT ID間の距離（XORメトリック）
+// 2つのDHT ID間の距離（XORメトリックの共通プレフィックス長、同一IDならDHT_ID_BITS）
 int dht_id_distance(const DhtId* id1, const DhtId* id2) {
-    // XORの結果の最上位ビットを見つける（最初に1になるビット）
-    for (int i = 0; i < DHT_ID_BITS/8; i++) {
-        uint8_t xor_result = id1->bytes[i] ^ id2->bytes[i];
-        if (xor_result == 0) {
-            continue;
+    DhtDistance d;
+    dht_id_xor(id1, id2, &d);
+    return dht_distance_clz(&d);
+}
+
+// テーブルの時計の現在時刻（秒）
+static inline uint32_t dht_table_now(const RoutingTable* table) {
+    return (uint32_t)((dht_monotonic_ms() - table->clock_base_ms) / 1000);
+}
+
+// 時刻をテーブルの時計に変換（起点より前は0）
+static inline uint32_t dht_table_time(const RoutingTable* table, time_t t) {
+    return t > table->wall_base ? (uint32_t)(t - table->wall_base) : 0;
+}
+
+// ノード情報をルーティングテーブルのエントリに詰める（last_seenは呼び出し側で設定）
+void dht_contact_pack(DhtContact* contact, const DhtNodeInfo* info) {
+    struct in_addr addr;
+    memset(contact, 0, sizeof(DhtContact));
+    contact->id = info->id;
+    if (inet_pton(AF_INET, info->ip, &addr) == 1) {
+        contact->addr = addr.s_addr;
+    }
+    contact->port = (uint16_t)info->port;
+    contact->flags = info->stale ? DHT_CONTACT_STALE : 0;
+}
+
+// IPv4アドレスを文字列に変換（dht_find_nodeの結果ごとに呼ばれるためinet_ntopは使わない）
+static void dht_format_addr(uint32_t addr, char* out) {
+    const uint8_t* octets = (const uint8_t*)&addr;
+    char* p = out;
+    for (int i = 0; i < 4; i++) {
+        unsigned v = octets[i];
+        if (v >= 100) {
+            *p++ = (char)('0' + v / 100);
+            v %= 100;
+            *p++ = (char)('0' + v / 10);
+        } else if (v >= 10) {
+            *p++ = (char)('0' + v / 10);
+        }
+        *p++ = (char)('0' + v % 10);
+        *p++ = i < 3 ? '.' : '\0';
+    }
+}
+
+// ルーティングテーブルのエントリをノード情報に展開（last_seenは0）
+void dht_contact_unpack(const DhtContact* contact, DhtNodeInfo* info) {
+    info->id = contact->id;
+    dht_format_addr(contact->addr, info->ip);
+    info->port = contact->port;
+    info->last_seen = 0;
+    info->stale = (contact->flags & DHT_CONTACT_STALE) != 0;
+}
+
+// エントリを展開し、最後に見た時刻も時刻に戻す
+static void dht_table_unpack(const RoutingTable* table, const DhtContact* contact, DhtNodeInfo* info) {
+    dht_contact_unpack(contact, info);
+    info->last_seen = table->wall_base + contact->last_seen;
+}
+
+// バケットを取得（未確保ならNULL）
+static inline KBucket* dht_bucket_get(RoutingTable* table, int bucket_idx) {
+    return atomic_load_explicit(&table->buckets[bucket_idx], memory_order_acquire);
+}
+
+// バケットを取得し、未確保なら確保する（dht_mutexを保持していること）
+static KBucket* dht_bucket_ensure(RoutingTable* table, int bucket_idx) {
+    KBucket* bucket = atomic_load_explicit(&table->buckets[bucket_idx], memory_order_relaxed);
+    if (bucket) {
+        return bucket;
+    }
+    
+    // エントリがキャッシュラインをまたがないように64バイト境界に確保する
+    void* mem;
+    int err = posix_memalign(&mem, 64, sizeof(KBucket));
+    if (err != 0) {
+        errno = err;
+        perror("Failed to allocate k-bucket");
+        return NULL;
+    }
+    bucket = (KBucket*)mem;
+    memset(bucket, 0, sizeof(KBucket));
+    atomic_init(&bucket->seq, 0);
+    
+    // 中身を初期化してから公開する
+    atomic_store_explicit(&table->buckets[bucket_idx], bucket, memory_order_release);
+    table->bucket_count++;
+    return bucket;
+}
+
+// バケットへの書き込み開始（書き込み側はdht_mutexを保持していること）
+static inline void dht_bucket_write_begin(KBucket* bucket) {
+    unsigned seq = atomic_load_explicit(&bucket->seq, memory_order_relaxed);
+    atomic_store_explicit(&bucket->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+// バケットへの書き込み終了
+static inline void dht_bucket_write_end(KBucket* bucket) {
+    unsigned seq = atomic_load_explicit(&bucket->seq, memory_order_relaxed);
+    atomic_store_explicit(&bucket->seq, seq + 1, memory_order_release);
+}
+
+// バケットのノード一覧をロックなしで読み取る（書き込みと重なった場合は読み直す）
+static int dht_bucket_snapshot(const KBucket* bucket, DhtContact* nodes) {
+    unsigned seq_begin;
+    unsigned seq_end;
+    int count;
+    
+    do {
+        seq_begin = atomic_load_explicit(&bucket->seq, memory_order_acquire);
+        while (seq_begin & 1) {
+            sched_yield();
+            seq_begin = atomic_load_explicit(&bucket->seq, memory_order_acquire);
         }
         
-        // 最上位ビットを見つける
-        for (int j = 7; j >= 0; j--) {
-            if ((xor_result & (1 << j)) != 0) {
-                return i * 8 + (7 - j);
-            }
+        count = __atomic_load_n(&bucket->count, __ATOMIC_RELAXED);
+        if (count < 0 || count > DHT_K) {
+            count = 0;  // 書き込み途中の値（下で読み直しになる）
+        }
+        memcpy(nodes, bucket->nodes, sizeof(DhtContact) * count);
+        
+        atomic_thread_fence(memory_order_acquire);
+        seq_end = atomic_load_explicit(&bucket->seq, memory_order_relaxed);
+    } while (seq_begin != seq_end);
+    
+    return count;
+}
+
+// バケットの内容を永続化ファイルに反映（dht_mutexを保持していること）
+static void dht_persist_bucket(DhtData* dht_data, int bucket_idx) {
+    if (!dht_data->persist) {
+        return;
+    }
+    
+    RoutingTable* table = dht_data->routing_table;
+    KBucket* bucket = atomic_load_explicit(&table->buckets[bucket_idx], memory_order_relaxed);
+    DhtNodeInfo nodes[DHT_K];
+    int count = 0;
+    time_t last_updated = 0;
+    if (bucket) {
+        for (; count < bucket->count; count++) {
+            dht_table_unpack(table, &bucket->nodes[count], &nodes[count]);
+        }
+        last_updated = table->wall_base + bucket->last_updated;
+    }
+    dht_persist_write_bucket(dht_data->persist, bucket_idx, nodes, count, last_updated);
+}
+
+// 交代要員に加える（既にいれば末尾へ移し、満杯なら最も古いものを捨てる）
+static void dht_replacement_push(KBucket* bucket, const DhtContact* contact) {
+    DhtContact* cache = bucket->replacements;
+    int count = bucket->replacement_count;
+    
+    for (int i = 0; i < count; i++) {
+        if (memcmp(cache[i].id.bytes, contact->id.bytes, DHT_ID_BITS/8) == 0) {
+            memmove(&cache[i], &cache[i + 1], sizeof(DhtContact) * (count - i - 1));
+            count--;
+            break;
+        }
+    }
+    if (count == DHT_REPLACEMENT_CACHE) {
+        memmove(&cache[0], &cache[1], sizeof(DhtContact) * (count - 1));
+        count--;
+    }
+    cache[count++] = *contact;
+    bucket->replacement_count = count;
+}
+
+// 交代要員から外す
+static void dht_replacement_remove(KBucket* bucket, const DhtId* id) {
+    for (int i = 0; i < bucket->replacement_count; i++) {
+        if (memcmp(bucket->replacements[i].id.bytes, id->bytes, DHT_ID_BITS/8) == 0) {
+            memmove(&bucket->replacements[i], &bucket->replacements[i + 1],
+                    sizeof(DhtContact) * (bucket->replacement_count - i - 1));
+            bucket->replacement_count--;
+            return;
+        }
+    }
+}
+
+// 追い出し候補の生存確認を始める（PINGを送るべきならtargetに宛先を入れてtrueを返す）
+//
+// 失敗回数が最も多く、同じなら最も長く見ていないノードを選ぶ。失敗したノードは
+// 交代要員がいなくても確かめる（応答がなければ上限で外れ、ルックアップが待たされなくなる）。
+// 失敗のないノードは交代要員が待っていて、しばらく見ていない場合だけ確かめる。
+static bool dht_bucket_start_ping(Node* node, RoutingTable* table, KBucket* bucket, DhtNodeInfo* target) {
+    if (bucket->ping_deadline != 0 || bucket->count == 0) {
+        return false;
+    }
+    
+    int victim = 0;
+    for (int i = 1; i < bucket->count; i++) {
+        const DhtContact* contact = &bucket->nodes[i];
+        const DhtContact* best = &bucket->nodes[victim];
+        if (contact->fails > best->fails ||
+            (contact->fails == best->fails && contact->last_seen < best->last_seen)) {
+            victim = i;
         }
     }
     
-    // 完全に同じIDの場合
-    return DHT_ID_BITS;
+    DhtContact* contact = &bucket->nodes[victim];
+    if (contact->fails == 0 &&
+        (bucket->replacement_count == 0 || dht_table_now(table) - contact->last_seen < DHT_CONTACT_QUIET)) {
+        return false;
+    }
+    
+    dht_bucket_write_begin(bucket);
+    contact->flags |= DHT_CONTACT_PINGING;
+    dht_bucket_write_end(bucket);
+    bucket->ping_deadline = dht_rpc_now_ms(node) + DHT_RPC_TIMEOUT_MS;
+    dht_table_unpack(table, contact, target);
+    return true;
+}
+
+// ノードを外し、交代要員がいれば最後に見たものを代わりに入れる（dht_mutexを保持していること）
+static void dht_bucket_evict(Node* node, DhtData* dht_data, int bucket_idx, KBucket* bucket, int idx) {
+    RoutingTable* table = dht_data->routing_table;
+    bool promoted = bucket->replacement_count > 0;
+    
+    if (bucket->nodes[idx].flags & DHT_CONTACT_PINGING) {
+        bucket->ping_deadline = 0;
+    }
+    
+    dht_bucket_write_begin(bucket);
+    if (promoted) {
+        bucket->nodes[idx] = bucket->replacements[--bucket->replacement_count];
+        bucket->nodes[idx].flags &= ~DHT_CONTACT_PINGING;
+        bucket->nodes[idx].fails = 0;
+    } else {
+        memmove(&bucket->nodes[idx], &bucket->nodes[idx + 1], sizeof(DhtContact) * (bucket->count - idx - 1));
+        bucket->count--;
+    }
+    bucket->last_updated = dht_table_now(table);
+    dht_bucket_write_end(bucket);
+    dht_persist_bucket(dht_data, bucket_idx);
+    
+    if (promoted) {
+        DhtNodeInfo info;
+        dht_table_unpack(table, &bucket->nodes[idx], &info);
+        dht_replica_on_new_contact(node, &info);
+        
+        char hex_id[DHT_ID_BITS/4 + 1];
+        dht_id_to_hex(&info.id, hex_id, sizeof(hex_id));
+        printf("Replaced unresponsive DHT node with %s at %s:%d in bucket %d\n",
+               hex_id, info.ip, info.port, bucket_idx);
+    }
 }
 
 // ルーティングテーブルにノードを追加
+//
+// バケットが満杯なら新しいノードは交代要員として覚え、既存のノードの生存を
+// PINGで確かめる。応答待ちの間もdht_mutexは保持しない（結果はdht_check_evictionsで処理）。
 void dht_add_node(Node* node, const DhtNodeInfo* dht_node) {
     if (!node->dht_data) {
         return;
     }
     
+    // ルーティングテーブルはIPv4アドレスだけを持つ
+    struct in_addr addr;
+    if (inet_pton(AF_INET, dht_node->ip, &addr) != 1) {
+        return;
+    }
+    
     DhtData* dht_data = (DhtData*)node->dht_data;
+    RoutingTable* table = dht_data->routing_table;
     pthread_mutex_lock(&dht_data->dht_mutex);
     
     // 自分自身は追加しない
-    if (memcmp(dht_node->id.bytes, dht_data->routing_table->self_id.bytes, DHT_ID_BITS/8) == 0) {
+    if (memcmp(dht_node->id.bytes, table->self_id.bytes, DHT_ID_BITS/8) == 0) {
         pthread_mutex_unlock(&dht_data->dht_mutex);
         return;
     }
     
     // IDの距離を計算して適切なバケットを見つける
-    int bucket_idx = dht_id_distance(&dht_data->routing_table->self_id, &dht_node->id);
+    int bucket_idx = dht_id_distance(&table->self_id, &dht_node->id);
     if (bucket_idx >= DHT_ID_BITS) {
         pthread_mutex_unlock(&dht_data->dht_mutex);
         return;  // 同じIDは追加しない
     }
     
-    KBucket* bucket = &dht_data->routing_table->buckets[bucket_idx];
+    KBucket* bucket = dht_bucket_ensure(table, bucket_idx);
+    if (!bucket) {
+        pthread_mutex_unlock(&dht_data->dht_mutex);
+        return;
+    }
+    uint32_t now = dht_table_now(table);
     
     // すでに存在するか確認
     for (int i = 0; i < bucket->count; i++) {
         if (memcmp(bucket->nodes[i].id.bytes, dht_node->id.bytes, DHT_ID_BITS/8) == 0) {
-            // 既存のノードを更新
-            strncpy(bucket->nodes[i].ip, dht_node->ip, MAX_IP_STR_LEN - 1);
-            bucket->nodes[i].ip[MAX_IP_STR_LEN - 1] = '\0';
-            bucket->nodes[i].port = dht_node->port;
-            bucket->nodes[i].last_seen = time(NULL);
-            bucket->last_updated = time(NULL);
+            // 既存のノードを更新（生存確認の応答もここに来る）
+            if (bucket->nodes[i].flags & DHT_CONTACT_PINGING) {
+                bucket->ping_deadline = 0;
+            }
+            dht_bucket_write_begin(bucket);
+            bucket->nodes[i].addr = addr.s_addr;
+            bucket->nodes[i].port = (uint16_t)dht_node->port;
+            bucket->nodes[i].last_seen = now;
+            bucket->nodes[i].flags &= ~(DHT_CONTACT_STALE | DHT_CONTACT_PINGING);
+            bucket->nodes[i].fails = 0;
+            bucket->last_updated = now;
+            dht_bucket_write_end(bucket);
+            dht_persist_bucket(dht_data, bucket_idx);
             pthread_mutex_unlock(&dht_data->dht_mutex);
             return;
         }
     }
     
+    DhtContact contact;
+    dht_contact_pack(&contact, dht_node);
+    contact.last_seen = now;
+    contact.flags &= ~DHT_CONTACT_STALE;
+    
     // バケットに空きがあれば追加
+    DhtNodeInfo ping_target;
+    bool ping = false;
     if (bucket->count < DHT_K) {
-        bucket->nodes[bucket->count] = *dht_node;
-        bucket->nodes[bucket->count].last_seen = time(NULL);
+        dht_replacement_remove(bucket, &dht_node->id);
+        dht_bucket_write_begin(bucket);
+        bucket->nodes[bucket->count] = contact;
         bucket->count++;
-        bucket->last_updated = time(NULL);
+        bucket->last_updated = now;
+        dht_bucket_write_end(bucket);
+        dht_persist_bucket(dht_data, bucket_idx);
+        dht_replica_on_new_contact(node, dht_node);
         
         char hex_id[DHT_ID_BITS/4 + 1];
         dht_id_to_hex(&dht_node->id, hex_id, sizeof(hex_id));
         printf("Added DHT node %s at %s:%d to bucket %d\n", 
                hex_id, dht_node->ip, dht_node->port, bucket_idx);
     } else {
-        // バケットが満杯の場合、最も古いノードを置き換えるか、pingを送信して生存確認
-        // この簡易実装では、最も古いノードを置き換える
-        int oldest_idx = 0;
-        time_t oldest_time = bucket->nodes[0].last_seen;
+        // 満杯なら交代要員として覚え、追い出し候補の生存を確かめる
+        dht_replacement_push(bucket, &contact);
+        ping = dht_bucket_start_ping(node, table, bucket, &ping_target);
+    }
+    
+    pthread_mutex_unlock(&dht_data->dht_mutex);
+    
+    if (ping) {
+        dht_rpc_send(node, &ping_target, DHT_PING, &ping_target.id, dht_rpc_next_transaction(node), NULL, 0);
+    }
+}
+
+// ノードが問い合わせに応答しなかった（失敗回数が上限に達したら外す）
+void dht_node_failed(Node* node, const DhtId* id) {
+    if (!node->dht_data || !id) {
+        return;
+    }
+    
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    RoutingTable* table = dht_data->routing_table;
+    int bucket_idx = dht_id_distance(&table->self_id, id);
+    if (bucket_idx >= DHT_ID_BITS) {
+        return;
+    }
+    
+    pthread_mutex_lock(&dht_data->dht_mutex);
+    KBucket* bucket = atomic_load_explicit(&table->buckets[bucket_idx], memory_order_relaxed);
+    if (!bucket) {
+        pthread_mutex_unlock(&dht_data->dht_mutex);
+        return;
+    }
+    
+    for (int i = 0; i < bucket->count; i++) {
+        DhtContact* contact = &bucket->nodes[i];
+        if (memcmp(contact->id.bytes, id->bytes, DHT_ID_BITS/8) != 0) {
+            continue;
+        }
         
-        for (int i = 1; i < bucket->count; i++) {
-            if (bucket->nodes[i].last_seen < oldest_time) {
-                oldest_idx = i;
-                oldest_time = bucket->nodes[i].last_seen;
-            }
+        dht_bucket_write_begin(bucket);
+        if (contact->fails < UINT8_MAX) {
+            contact->fails++;
+        }
+        dht_bucket_write_end(bucket);
+        if (contact->fails >= DHT_CONTACT_MAX_FAILS) {
+            dht_bucket_evict(node, dht_data, bucket_idx, bucket, i);
+        }
+        pthread_mutex_unlock(&dht_data->dht_mutex);
+        return;
+    }
+    
+    // 応答しない交代要員は捨てる
+    dht_replacement_remove(bucket, id);
+    pthread_mutex_unlock(&dht_data->dht_mutex);
+}
+
+// 生存確認のPINGのタイムアウトを処理（メンテナンススレッドから毎秒呼ばれる）
+//
+// 応答がなければ失敗として数え、上限に達したら交代要員と入れ替える。
+// その後、失敗したノードや交代要員が待っているバケットでは次のPINGを送る。
+void dht_check_evictions(Node* node) {
+    if (!node->dht_data) {
+        return;
+    }
+    
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    RoutingTable* table = dht_data->routing_table;
+    DhtNodeInfo to_ping[DHT_K * 4];
+    int ping_count = 0;
+    uint64_t now_ms = dht_rpc_now_ms(node);
+    
+    pthread_mutex_lock(&dht_data->dht_mutex);
+    for (int b = 0; b < DHT_ID_BITS; b++) {
+        KBucket* bucket = atomic_load_explicit(&table->buckets[b], memory_order_relaxed);
+        if (!bucket || now_ms < bucket->ping_deadline) {
+            continue;  // 未確保か応答待ち
         }
         
-        // 一定時間経過していれば置き換え
-        if (time(NULL) - oldest_time > 3600) {  // 1時間以上経過
-            bucket->nodes[oldest_idx] = *dht_node;
-            bucket->nodes[oldest_idx].last_seen = time(NULL);
-            bucket->last_updated = time(NULL);
+        for (int i = 0; i < bucket->count && bucket->ping_deadline != 0; i++) {
+            DhtContact* contact = &bucket->nodes[i];
+            if (!(contact->flags & DHT_CONTACT_PINGING)) {
+                continue;
+            }
             
-            char hex_id[DHT_ID_BITS/4 + 1];
-            dht_id_to_hex(&dht_node->id, hex_id, sizeof(hex_id));
-            printf("Replaced old DHT node with %s at %s:%d in bucket %d\n", 
-                   hex_id, dht_node->ip, dht_node->port, bucket_idx);
+            dht_bucket_write_begin(bucket);
+            contact->flags &= ~DHT_CONTACT_PINGING;
+            if (contact->fails < UINT8_MAX) {
+                contact->fails++;
+            }
+            dht_bucket_write_end(bucket);
+            if (contact->fails >= DHT_CONTACT_MAX_FAILS) {
+                dht_bucket_evict(node, dht_data, b, bucket, i);
+            }
+            break;
+        }
+        bucket->ping_deadline = 0;
+        
+        if (ping_count < DHT_K * 4 && dht_bucket_start_ping(node, table, bucket, &to_ping[ping_count])) {
+            ping_count++;
         }
     }
-    
     pthread_mutex_unlock(&dht_data->dht_mutex);
+    
+    for (int i = 0; i < ping_count; i++) {
+        dht_rpc_send(node, &to_ping[i], DHT_PING, &to_ping[i].id, dht_rpc_next_transaction(node), NULL, 0);
+    }
+}
+
+// 最大ヒープ（根が最も遠いノード）の下方向への調整
+static void dht_heap_sift_down(DhtContact* heap, int count, int idx, const DhtId* target) {
+    while (1) {
+        int left = idx * 2 + 1;
+        int right = left + 1;
+        int largest = idx;
+        
+        if (left < count && dht_id_cmp_distance(target, &heap[left].id, &heap[largest].id) > 0) {
+            largest = left;
+        }
+        if (right < count && dht_id_cmp_distance(target, &heap[right].id, &heap[largest].id) > 0) {
+            largest = right;
+        }
+        if (largest == idx) {
+            return;
+        }
+        
+        DhtContact temp = heap[idx];
+        heap[idx] = heap[largest];
+        heap[largest] = temp;
+        idx = largest;
+    }
+}
+
+// 最大ヒープの上方向への調整
+static void dht_heap_sift_up(DhtContact* heap, int idx, const DhtId* target) {
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+        if (dht_id_cmp_distance(target, &heap[idx].id, &heap[parent].id) <= 0) {
+            return;
+        }
+        
+        DhtContact temp = heap[idx];
+        heap[idx] = heap[parent];
+        heap[parent] = temp;
+        idx = parent;
+    }
+}
+
+// バケット内のノードを最大ヒープ（サイズmax_results）に投入
+static void dht_heap_offer_bucket(const KBucket* bucket, const DhtId* target,
+                                  DhtContact* heap, int* count, int max_results) {
+    if (!bucket) {
+        return;
+    }
+    
+    DhtContact nodes[DHT_K];
+    int node_count = dht_bucket_snapshot(bucket, nodes);
+    int i = 0;
+    
+    // ヒープが埋まるまではそのまま追加
+    for (; i < node_count && *count < max_results; i++) {
+        heap[*count] = nodes[i];
+        dht_heap_sift_up(heap, *count, target);
+        (*count)++;
+    }
+    if (i == node_count) {
+        return;
+    }
+    
+    // 残りのノードの距離をまとめて計算し、最遠ノードより近いものだけ置き換える
+    DhtDistance distances[DHT_K];
+    DhtDistance farthest;
+    dht_id_distance_batch(target, &nodes[i].id, sizeof(DhtContact), node_count - i, distances);
+    dht_id_xor(target, &heap[0].id, &farthest);
+    
+    for (int j = 0; i < node_count; i++, j++) {
+        if (dht_distance_cmp(&distances[j], &farthest) < 0) {
+            heap[0] = nodes[i];
+            dht_heap_sift_down(heap, *count, 0, target);
+            dht_id_xor(target, &heap[0].id, &farthest);
+        }
+    }
 }
 
 // 指定したIDに最も近いノードを見つける
+//
+// targetが属するバケットから外側へ向かってバケット単位で走査する。
+// D = self XOR target とすると、バケットiのノードとtargetの距離は上位iビットが
+// Dと一致し、iビット目はD[i]の反転になる。したがってD[i]=1のバケットは
+// それより深い全バケットより近く、D[i]=0のバケットは深い全バケットより遠い。
+// 近い順は「D[i]=1のバケットを浅い順（先頭がtargetのバケット）」→
+// 「D[i]=0のバケットを深い順」となり、バケット間の順序は厳密なので
+// max_results個集まった時点で残りのバケットを見る必要はない。
+// ヒープは詰めたままのエントリで組み、結果に入るノードだけを最後に展開する。
+//
+// dht_mutexは取らず、各バケットをシーケンスロックで読み取る。読み取り側同士も、
+// 書き込み側（dht_mutexを保持してバケットを更新する）もお互いを待たせない。
 int dht_find_node(Node* node, const DhtId* target_id, DhtNodeInfo* result, int max_results) {
-    if (!node->dht_data || max_results <= 0) {
+    if (!node->dht_data || !target_id || !result || max_results <= 0) {
         return 0;
     }
     
     DhtData* dht_data = (DhtData*)node->dht_data;
-    pthread_mutex_lock(&dht_data->dht_mutex);
-    
-    // 結果を格納する配列
-    typedef struct {
-        DhtNodeInfo info;
-        int distance;
-    } NodeDistance;
+    RoutingTable* table = dht_data->routing_table;
+    DhtId diff;
+    for (int i = 0; i < DHT_ID_BITS/8; i++) {
+        diff.bytes[i] = table->self_id.bytes[i] ^ target_id->bytes[i];
+    }
     
-    NodeDistance* distances = (NodeDistance*)malloc(sizeof(NodeDistance) * DHT_K * DHT_ID_BITS);
-    if (!distances) {
-        pthread_mutex_unlock(&dht_data->dht_mutex);
-        return 0;
+    // 通常の要求数ならヒープはスタックに置く
+    DhtContact local_heap[DHT_FIND_STACK_RESULTS];
+    DhtContact* heap = local_heap;
+    if (max_results > DHT_FIND_STACK_RESULTS) {
+        heap = (DhtContact*)malloc(sizeof(DhtContact) * max_results);
+        if (!heap) {
+            perror("Failed to allocate lookup heap");
+            return 0;
+        }
     }
     
-    int total_nodes = 0;
+    int count = 0;
     
-    // すべてのバケットからノードを収集
-    for (int i = 0; i < DHT_ID_BITS; i++) {
-        KBucket* bucket = &dht_data->routing_table->buckets[i];
-        for (int j = 0; j < bucket->count; j++) {
-            distances[total_nodes].info = bucket->nodes[j];
-            distances[total_nodes].distance = dht_id_distance(target_id, &bucket->nodes[j].id);
-            total_nodes++;
+    // targetのバケットから、自分に近い側でtargetとビットが異なるバケットへ
+    for (int i = 0; i < DHT_ID_BITS && count < max_results; i++) {
+        if (diff.bytes[i / 8] & (1 << (7 - i % 8))) {
+            dht_heap_offer_bucket(dht_bucket_get(table, i), target_id, heap, &count, max_results);
         }
     }
     
-    // 距離でソート（XORメトリックが小さい順）
-    for (int i = 0; i < total_nodes - 1; i++) {
-        for (int j = 0; j < total_nodes - i - 1; j++) {
-            if (distances[j].distance > distances[j + 1].distance) {
-                NodeDistance temp = distances[j];
-                distances[j] = distances[j + 1];
-                distances[j + 1] = temp;
-            }
+    // 残りのバケットを深い順に
+    for (int i = DHT_ID_BITS - 1; i >= 0 && count < max_results; i--) {
+        if (!(diff.bytes[i / 8] & (1 << (7 - i % 8)))) {
+            dht_heap_offer_bucket(dht_bucket_get(table, i), target_id, heap, &count, max_results);
+        }
+    }
+    
+    // ヒープソートで近い順に並べ替え
+    for (int end = count - 1; end > 0; end--) {
+        DhtContact temp = heap[0];
+        heap[0] = heap[end];
+        heap[end] = temp;
+        dht_heap_sift_down(heap, end, 0, target_id);
+    }
+    
+    for (int i = 0; i < count; i++) {
+        dht_table_unpack(table, &heap[i], &result[i]);
+    }
+    if (heap != local_heap) {
+        free(heap);
+    }
+    
+    return count;
+}
+
+// ルーティングテーブルの全ノードをバケット順に取得（返り値は取得した数）
+int dht_routing_snapshot(Node* node, DhtNodeInfo* results, int max_results) {
+    if (!node->dht_data || !results) {
+        return 0;
+    }
+    
+    RoutingTable* table = ((DhtData*)node->dht_data)->routing_table;
+    int count = 0;
+    for (int i = 0; i < DHT_ID_BITS && count < max_results; i++) {
+        KBucket* bucket = dht_bucket_get(table, i);
+        if (!bucket) {
+            continue;
+        }
+        
+        DhtContact nodes[DHT_K];
+        int node_count = dht_bucket_snapshot(bucket, nodes);
+        for (int j = 0; j < node_count && count < max_results; j++) {
+            dht_table_unpack(table, &nodes[j], &results[count++]);
         }
     }
     
-    // 結果を返す（最大max_results個）
-    int result_count = (total_nodes < max_results) ? total_nodes : max_results;
-    for (int i = 0; i < result_count; i++) {
-        result[i] = distances[i].info;
+    return count;
+}
+
+// DHTのメモリ使用量を取得
+void dht_get_memory_stats(Node* node, DhtMemoryStats* stats) {
+    memset(stats, 0, sizeof(DhtMemoryStats));
+    if (!node->dht_data) {
+        return;
     }
     
-    free(distances);
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    RoutingTable* table = dht_data->routing_table;
+    
+    pthread_mutex_lock(&dht_data->dht_mutex);
+    stats->buckets_allocated = table->bucket_count;
+    for (int i = 0; i < DHT_ID_BITS; i++) {
+        KBucket* bucket = atomic_load_explicit(&table->buckets[i], memory_order_relaxed);
+        if (bucket) {
+            stats->contacts += bucket->count;
+        }
+    }
     pthread_mutex_unlock(&dht_data->dht_mutex);
+    stats->routing_bytes = sizeof(RoutingTable) + (size_t)stats->buckets_allocated * sizeof(KBucket);
+    
+    pthread_mutex_lock(&dht_data->store_mutex);
+    stats->store_bytes = dht_store_footprint(&dht_data->store);
+    stats->cache_bytes = dht_store_footprint(&dht_data->cache);
+    pthread_mutex_unlock(&dht_data->store_mutex);
     
-    return result_count;
+    pthread_mutex_lock(&dht_data->rpc_mutex);
+    for (DhtLookup* lookup = dht_data->lookups; lookup; lookup = lookup->next) {
+        stats->lookup_bytes += sizeof(DhtLookup);
+    }
+    pthread_mutex_unlock(&dht_data->rpc_mutex);
+    
+    stats->replication_bytes = dht_replica_footprint(node);
+    stats->total_bytes = sizeof(DhtData) + stats->routing_bytes + stats->store_bytes + stats->cache_bytes +
+                         stats->lookup_bytes + stats->replication_bytes;
 }
 
-// 値を保存
+// 値を保存（既定の有効期間）
 int dht_store_value(Node* node, const DhtId* key, const void* value, size_t value_len) {
-    if (!node->dht_data || !value || value_len > MAX_BUFFER) {
+    return dht_store_value_ttl(node, key, value, value_len, DHT_STORE_DEFAULT_TTL);
+}
+
+// 有効期間（秒）を指定して値を保存し、k近傍への複製を予約
+int dht_store_value_ttl(Node* node, const DhtId* key, const void* value, size_t value_len, int ttl) {
+    return dht_store_value_member(node, key, NULL, value, value_len, ttl);
+}
+
+// キーのメンバーとして値を保存（memberがNULLなら単一の値）
+//
+// 同じキーに異なるメンバーIDで保存した値は共存し、それぞれがttl秒のリースを持つ。
+// 同じメンバーIDで保存し直すと値を置き換えてリースを延長する。
+int dht_store_value_member(Node* node, const DhtId* key, const DhtId* member, const void* value,
+                           size_t value_len, int ttl) {
+    if (ttl <= 0) {
+        return -1;
+    }
+    
+    int result = dht_store_replica(node, key, member, value, value_len, time(NULL) + ttl);
+    if (result == 0) {
+        dht_replica_on_publish(node, key, member, ttl);
+    }
+    return result;
+}
+
+// 値をローカルの値ストアにだけ保存（他ノードからのSTOREや再公開で使う）
+int dht_store_replica(Node* node, const DhtId* key, const DhtId* member, const void* value, size_t value_len,
+                      time_t expires_at) {
+    if (!node->dht_data || !key || !value || value_len > DHT_RPC_MAX_VALUE) {
         return -1;
     }
     
     DhtData* dht_data = (DhtData*)node->dht_data;
-    pthread_mutex_lock(&dht_data->dht_mutex);
+    pthread_mutex_lock(&dht_data->store_mutex);
+    int result = dht_store_put_member(&dht_data->store, key, member, value, value_len, expires_at);
+    if (result == 0 && dht_data->persist) {
+        // 値ログの作り直しはルーティング領域もコピーするためdht_mutexも取る
+        pthread_mutex_lock(&dht_data->dht_mutex);
+        dht_persist_append_value(dht_data->persist, key, member, value, value_len, expires_at, &dht_data->store);
+        pthread_mutex_unlock(&dht_data->dht_mutex);
+    }
+    pthread_mutex_unlock(&dht_data->store_mutex);
     
-    // 既存のキーを探す
-    for (int i = 0; i < dht_data->storage_count; i++) {
-        if (dht_data->storage[i].in_use && 
-            memcmp(dht_data->storage[i].key.bytes, key->bytes, DHT_ID_BITS/8) == 0) {
-            // 既存のキーを更新
-            memcpy(dht_data->storage[i].value, value, value_len);
-            dht_data->storage[i].value_len = value_len;
-            pthread_mutex_unlock(&dht_data->dht_mutex);
-            return 0;
-        }
+    return result;
+}
+
+// 値をローカルの値ストアと経路キャッシュから削除（他ノードからの取り下げで使う）
+void dht_remove_replica(Node* node, const DhtId* key, const DhtId* member) {
+    if (!node->dht_data || !key) {
+        return;
     }
     
-    // 新しいキーを追加
-    if (dht_data->storage_count < 100) {
-        dht_data->storage[dht_data->storage_count].key = *key;
-        memcpy(dht_data->storage[dht_data->storage_count].value, value, value_len);
-        dht_data->storage[dht_data->storage_count].value_len = value_len;
-        dht_data->storage[dht_data->storage_count].in_use = true;
-        dht_data->storage_count++;
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    pthread_mutex_lock(&dht_data->store_mutex);
+    bool removed = dht_store_remove_member(&dht_data->store, key, member) == 0;
+    dht_store_remove_member(&dht_data->cache, key, member);
+    if (removed && dht_data->persist) {
+        // 期限切れの記録を追記すると再生時に削除される
+        pthread_mutex_lock(&dht_data->dht_mutex);
+        dht_persist_append_value(dht_data->persist, key, member, "", 0, time(NULL), &dht_data->store);
         pthread_mutex_unlock(&dht_data->dht_mutex);
-        return 0;
+    }
+    pthread_mutex_unlock(&dht_data->store_mutex);
+}
+
+// 自分が公開したキーのメンバーを取り下げる（memberがNULLなら単一の値）
+//
+// 再公開をやめてローカルから削除し、ルックアップで見つけたk近傍に有効期間0のSTOREを
+// 送って削除させる。届かなかったノードの値は有効期限で消える。
+int dht_withdraw_value_member(Node* node, const DhtId* key, const DhtId* member) {
+    if (!node->dht_data || !key) {
+        return -1;
     }
     
-    // ストレージが満杯
-    pthread_mutex_unlock(&dht_data->dht_mutex);
-    return -1;
+    dht_replica_on_withdraw(node, key, member);
+    dht_remove_replica(node, key, member);
+    
+    DhtNodeInfo closest[DHT_K];
+    int count = dht_lookup_nodes(node, key, closest, DHT_K, DHT_LOOKUP_DEFAULT_TIMEOUT_MS);
+    for (int i = 0; i < count; i++) {
+        dht_replica_send_store(node, &closest[i], key, member, "", 0, 0);
+    }
+    return count;
 }
 
 // 値を検索
 int dht_find_value(Node* node, const DhtId* key, void* value, size_t* value_len) {
-    if (!node->dht_data || !value || !value_len) {
+    if (!node->dht_data || !key || !value || !value_len) {
         return -1;
     }
     
     DhtData* dht_data = (DhtData*)node->dht_data;
+    pthread_mutex_lock(&dht_data->store_mutex);
+    int result = dht_store_get(&dht_data->store, key, value, value_len, time(NULL), NULL);
+    pthread_mutex_unlock(&dht_data->store_mutex);
+    
+    return result;
+}
+
+// キーのメンバーをローカルの値ストアからカーソルの位置より順に返す（返り値は返した数）
+//
+// fnは値ストアのロックを保持したまま呼ばれるため、fnの中からDHTを操作してはならない。
+int dht_find_values(Node* node, const DhtId* key, DhtStoreCursor* cursor, DhtStoreMemberFn fn, void* arg) {
+    if (!node->dht_data || !key || !cursor || !fn) {
+        return -1;
+    }
+    
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    pthread_mutex_lock(&dht_data->store_mutex);
+    int count = dht_store_scan_members(&dht_data->store, key, time(NULL), cursor, fn, arg);
+    pthread_mutex_unlock(&dht_data->store_mutex);
+    
+    return count;
+}
+
+// 値ストアのメモリ上限を設定（0で既定値）
+void dht_set_storage_budget(Node* node, size_t memory_budget) {
+    if (!node->dht_data) {
+        return;
+    }
+    
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    pthread_mutex_lock(&dht_data->store_mutex);
+    dht_store_set_budget(&dht_data->store, memory_budget);
+    pthread_mutex_unlock(&dht_data->store_mutex);
+}
+
+// 復元したノードの生存確認
+//
+// 復元後にピアリスト上で通信が確認できたアドレスのノードは生存しているとみなす。
+static bool dht_revalidate_contact(Node* node, const RoutingTable* table, DhtContact* contact,
+                                   time_t restored_at) {
+    bool alive = false;
+    
+    pthread_mutex_lock(&node->peers_mutex);
+    for (int i = 0; i < node->peer_count; i++) {
+        NodeInfo* peer = &node->peers[i];
+        if (peer->last_seen >= restored_at && peer->port == contact->port &&
+            inet_addr(peer->ip) == contact->addr) {
+            contact->last_seen = dht_table_time(table, peer->last_seen);
+            contact->flags &= ~DHT_CONTACT_STALE;
+            alive = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&node->peers_mutex);
+    
+    return alive;
+}
+
+// 永続化を有効にし、前回保存したルーティングテーブルと値を復元
+//
+// 復元したノードは生存未確認（stale）として、すぐに全てへPINGを送る。PONGを返した
+// ノードから確認済みになり、ルックアップは確認済みのノードを先に使う。残りは
+// メンテナンススレッドが猶予期間の間に確認し直す。
+int dht_enable_persistence(Node* node, const char* path) {
+    if (!node->dht_data || !path) {
+        return -1;
+    }
+    
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    RoutingTable* table = dht_data->routing_table;
+    DhtPersist* persist = dht_persist_open(path, &table->self_id);
+    if (!persist) {
+        return -1;
+    }
+    
+    DhtNodeInfo* to_ping = persist->restored
+                               ? (DhtNodeInfo*)malloc(sizeof(DhtNodeInfo) * DHT_ID_BITS * DHT_K)
+                               : NULL;
+    
+    pthread_mutex_lock(&dht_data->store_mutex);
     pthread_mutex_lock(&dht_data->dht_mutex);
     
-    // キーを探す
-    for (int i = 0; i < dht_data->storage_count; i++) {
-        if (dht_data->storage[i].in_use && 
-            memcmp(dht_data->storage[i].key.bytes, key->bytes, DHT_ID_BITS/8) == 0) {
-            // キーが見つかった
-            size_t copy_len = (*value_len < dht_data->storage[i].value_len) ? 
-                              *value_len : dht_data->storage[i].value_len;
-            memcpy(value, dht_data->storage[i].value, copy_len);
-            *value_len = copy_len;
-            pthread_mutex_unlock(&dht_data->dht_mutex);
-            return 0;
+    if (dht_data->persist) {
+        dht_persist_close(dht_data->persist);
+    }
+    dht_data->persist = persist;
+    dht_data->restored_at = time(NULL);
+    
+    int contacts = 0;
+    if (persist->restored) {
+        // 保存時とIDが異なる場合もあるため、距離からバケットを計算し直して追加する
+        for (int b = 0; b < DHT_ID_BITS; b++) {
+            const DhtPersistBucket* saved = &persist->buckets[b];
+            int count = saved->count < DHT_K ? saved->count : DHT_K;
+            for (int j = 0; j < count; j++) {
+                const DhtPersistContact* contact = &saved->nodes[j];
+                int bucket_idx = dht_id_distance(&table->self_id, &contact->id);
+                if (bucket_idx >= DHT_ID_BITS) {
+                    continue;
+                }
+                
+                DhtNodeInfo info;
+                info.id = contact->id;
+                memcpy(info.ip, contact->ip, MAX_IP_STR_LEN);
+                info.ip[MAX_IP_STR_LEN - 1] = '\0';
+                info.port = contact->port;
+                info.stale = true;
+                struct in_addr addr;
+                if (inet_pton(AF_INET, info.ip, &addr) != 1) {
+                    continue;
+                }
+                
+                KBucket* bucket = dht_bucket_ensure(table, bucket_idx);
+                if (!bucket || bucket->count >= DHT_K) {
+                    continue;
+                }
+                
+                dht_bucket_write_begin(bucket);
+                DhtContact* restored = &bucket->nodes[bucket->count];
+                dht_contact_pack(restored, &info);
+                restored->last_seen = dht_table_time(table, contact->last_seen);
+                bucket->count++;
+                bucket->last_updated = dht_table_time(table, saved->last_updated);
+                dht_bucket_write_end(bucket);
+                if (to_ping) {
+                    to_ping[contacts] = info;
+                }
+                contacts++;
+            }
         }
+        
+        dht_persist_replay_values(persist, &dht_data->store, dht_data->restored_at);
     }
     
-    // キーが見つからない
+    // 現在のルーティングテーブルをファイルに反映
+    persist->header->self_id = table->self_id;
+    for (int b = 0; b < DHT_ID_BITS; b++) {
+        dht_persist_bucket(dht_data, b);
+    }
+    int values = dht_data->store.entry_count;
+    
     pthread_mutex_unlock(&dht_data->dht_mutex);
-    return -1;
+    pthread_mutex_unlock(&dht_data->store_mutex);
+    
+    // 復元したノードの生存を確かめる（PONGが返ればdht_add_nodeで確認済みになる）
+    for (int i = 0; to_ping && i < contacts; i++) {
+        dht_rpc_send(node, &to_ping[i], DHT_PING, &to_ping[i].id, dht_rpc_next_transaction(node), NULL, 0);
+    }
+    free(to_ping);
+    
+    if (persist->restored) {
+        printf("Node %d restored %d DHT contacts and %d values from %s\n",
+               node->id, contacts, values, path);
+    }
+    return contacts;
 }
 
 // バケットの更新（定期的に呼び出される）
@@ -317,18 +1066,26 @@ void dht_refresh_buckets(Node* node) {
     }
     
     DhtData* dht_data = (DhtData*)node->dht_data;
+    RoutingTable* table = dht_data->routing_table;
+    DhtNodeInfo to_ping[DHT_K * 4];
+    int ping_count = 0;
+    
     pthread_mutex_lock(&dht_data->dht_mutex);
     
     time_t now = time(NULL);
+    int64_t table_now = dht_table_now(table);
     
-    // 各バケットを確認
+    // 各バケットを確認（未確保のバケットにはノードがない）
     for (int i = 0; i < DHT_ID_BITS; i++) {
-        KBucket* bucket = &dht_data->routing_table->buckets[i];
+        KBucket* bucket = atomic_load_explicit(&table->buckets[i], memory_order_relaxed);
+        if (!bucket || bucket->count == 0) {
+            continue;
+        }
         
         // 一定時間更新されていないバケットを更新
-        if (bucket->count > 0 && now - bucket->last_updated > DHT_REFRESH_INTERVAL) {
+        if (table_now - bucket->last_updated > DHT_REFRESH_INTERVAL) {
             // ランダムなIDを生成してそのバケットに対応するIDを作成
-            DhtId random_id = dht_data->routing_table->self_id;
+            DhtId random_id = table->self_id;
             
             // i番目のビットを反転
             int byte_idx = i / 8;
@@ -338,13 +1095,28 @@ void dht_refresh_buckets(Node* node) {
             // このIDに近いノードを探す（実際のネットワークでは他のノードに問い合わせる）
             // この簡易実装では、ローカルのルーティングテーブルのみを使用
             
-            bucket->last_updated = now;
+            bucket->last_updated = (uint32_t)table_now;
         }
         
-        // 古いノードを削除
+        // 古いノードと、猶予期間内に生存を確認できなかった復元ノードを削除
+        dht_bucket_write_begin(bucket);
         int j = 0;
+        int before = bucket->count;
+        bool revalidated = false;
         while (j < bucket->count) {
-            if (now - bucket->nodes[j].last_seen > DHT_REFRESH_INTERVAL * 2) {
+            DhtContact* contact = &bucket->nodes[j];
+            bool stale = (contact->flags & DHT_CONTACT_STALE) != 0;
+            if (stale && dht_revalidate_contact(node, table, contact, dht_data->restored_at)) {
+                revalidated = true;
+                stale = false;
+            } else if (stale && ping_count < DHT_K * 4) {
+                // PONGが返ればdht_add_nodeで確認済みになる
+                dht_table_unpack(table, contact, &to_ping[ping_count++]);
+            }
+            
+            bool expired = stale ? now - dht_data->restored_at > DHT_PERSIST_STALE_GRACE
+                                 : table_now - contact->last_seen > DHT_REFRESH_INTERVAL * 2;
+            if (expired) {
                 // 古いノードを削除
                 for (int k = j; k < bucket->count - 1; k++) {
                     bucket->nodes[k] = bucket->nodes[k + 1];
@@ -354,26 +1126,76 @@ void dht_refresh_buckets(Node* node) {
                 j++;
             }
         }
+        
+        // 空いた枠には最近見た交代要員を入れる
+        int promoted = 0;
+        while (bucket->count < DHT_K && bucket->replacement_count > 0) {
+            DhtContact* candidate = &bucket->replacements[--bucket->replacement_count];
+            if (table_now - candidate->last_seen <= DHT_REFRESH_INTERVAL * 2) {
+                bucket->nodes[bucket->count++] = *candidate;
+                promoted++;
+            }
+        }
+        
+        dht_bucket_write_end(bucket);
+        
+        for (int k = bucket->count - promoted; k < bucket->count; k++) {
+            DhtNodeInfo info;
+            dht_table_unpack(table, &bucket->nodes[k], &info);
+            dht_replica_on_new_contact(node, &info);
+        }
+        
+        if (bucket->count != before || revalidated) {
+            dht_persist_bucket(dht_data, i);
+        }
     }
     
+    // 変更をディスクへ書き出す
+    dht_persist_sync(dht_data->persist, false);
+    
     pthread_mutex_unlock(&dht_data->dht_mutex);
+    
+    // 生存未確認のノードにPINGを送る
+    for (int i = 0; i < ping_count; i++) {
+        dht_rpc_send(node, &to_ping[i], DHT_PING, &to_ping[i].id, dht_rpc_next_transaction(node), NULL, 0);
+    }
+    
+    // 期限切れの値を削除
+    pthread_mutex_lock(&dht_data->store_mutex);
+    dht_store_expire(&dht_data->store, now);
+    dht_store_expire(&dht_data->cache, now);
+    pthread_mutex_unlock(&dht_data->store_mutex);
 }
 
 // DHT メンテナンススレッド
 void* dht_maintenance_thread(void* arg) {
     Node* node = (Node*)arg;
+    DhtData* dht_data = (DhtData*)node->dht_data;
     
-    while (dht_running && node->is_running) {
-        // バケットの更新
-        dht_refresh_buckets(node);
-        
-        // 一定時間待機
-        sleep(60);  // 1分ごとに更新
+    int ticks = 0;
+    
+    while (dht_data->maintenance_running && node->is_running) {
+        dht_maintenance_tick(node, ticks);
+        ticks++;
+        sleep(1);
     }
     
     return NULL;
 }
 
+// 1秒ごとのメンテナンス（ticksは何回目の呼び出しか）
+void dht_maintenance_tick(Node* node, int ticks) {
+    // バケットの更新（1分ごと）
+    if (ticks % 60 == 0) {
+        dht_refresh_buckets(node);
+    }
+    
+    // ルックアップと生存確認のタイムアウト、値の複製（1秒ごと）
+    dht_rpc_tick(node);
+    dht_check_evictions(node);
+    dht_replica_tick(node);
+}
+
 // DHT IDを16進数文字列に変換
 void dht_id_to_hex(const DhtId* id, char* hex, size_t hex_len) {
     if (hex_len < DHT_ID_BITS/4 + 1) {
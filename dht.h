@@ -7,32 +7,84 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
+#include <stdatomic.h>
 #include "node.h"
+#include "dht_id.h"
+#include "dht_store.h"
+
+struct DhtLookup;
+struct DhtReplication;
 
 // DHT設定
-#define DHT_ID_BITS 160  // SHA-1ハッシュを使用
+// k・alpha・更新間隔はシミュレーションで比べるためコンパイル時に上書きできる（-DDHT_K=16など）
+#ifndef DHT_K
 #define DHT_K 8          // k-bucketのサイズ
+#endif
+#ifndef DHT_ALPHA
 #define DHT_ALPHA 3      // 並列ルックアップの数
+#endif
+#ifndef DHT_REFRESH_INTERVAL
 #define DHT_REFRESH_INTERVAL 3600  // バケット更新間隔（秒）
+#endif
+#define DHT_REPLACEMENT_CACHE 4    // バケットごとの交代要員の数
+#define DHT_CONTACT_MAX_FAILS 3    // 連続でこの回数応答がなければノードを外す
+#define DHT_CACHE_DEFAULT_BUDGET (256 * 1024) // 経路キャッシュの既定のメモリ上限（バイト）
+#define DHT_CACHE_MAX_TTL 600      // 経路キャッシュの有効期間の上限（秒、値を持つノードの隣）
+#define DHT_CACHE_MIN_TTL 10       // 経路キャッシュの有効期間の下限（秒）
+
+// DHTメッセージの送信と時刻取得（テストやシミュレーションでは差し替える）
+typedef struct {
+    int (*send)(void* ctx, Node* from, const struct sockaddr_in* to, const void* buf, size_t len);
+    uint64_t (*now_ms)(void* ctx);  // 単調増加する時刻（ミリ秒）
+    void* ctx;
+} DhtTransport;
 
-// DHT ID（SHA-1ハッシュ、160ビット）
+// 経路キャッシュの統計
 typedef struct {
-    uint8_t bytes[DHT_ID_BITS/8];
-} DhtId;
+    uint64_t value_lookups;      // ネットワーク上で値を探したルックアップ
+    uint64_t lookup_queries;     // そのルックアップで送った問い合わせの合計
+    uint64_t lookup_hops;        // 値を返したノードまでのホップ数の合計
+    uint64_t cache_answered;     // 経路キャッシュから値が返ったルックアップ
+    uint64_t local_cache_hits;   // 自分の経路キャッシュで済んだ読み取り
+    uint64_t served_primary;     // 値ストアから返したFIND_VALUE
+    uint64_t served_cache;       // 経路キャッシュから返したFIND_VALUE
+    uint64_t cache_stores_sent;  // 送ったCACHE_STORE
+    uint64_t cache_stores_received; // 受け取ったCACHE_STORE
+    int cached_values;           // 経路キャッシュにある値の数
+    size_t cache_bytes;          // 経路キャッシュの使用メモリ
+} DhtCacheStats;
 
 // DHT データ構造体
 typedef struct {
     struct RoutingTable* routing_table;
-    pthread_mutex_t dht_mutex;
+    pthread_mutex_t dht_mutex;   // ルーティングテーブルの書き込み側（読み取りはロック不要）
+    
+    // 値の保存用ハッシュテーブル
+    DhtValueStore store;
+    pthread_mutex_t store_mutex; // 値ストア（dht_mutexと両方取る場合はこちらが先）
+    
+    // メンテナンススレッド（ノードごと）
+    pthread_t maintenance_thread;
+    bool maintenance_running;
+    bool shutting_down;          // dht_cleanupが始まった（dht_init_manualのノードでも立てる）
+    
+    // 永続化（NULLなら無効）
+    struct DhtPersist* persist;
+    time_t restored_at;          // 永続化ファイルから復元した時刻
+    
+    // RPC（送信はtransport経由、応答待ちのルックアップはrpc_mutexで保護）
+    DhtTransport transport;
+    pthread_mutex_t rpc_mutex;   // dht_mutexと両方取る場合はこちらが先
+    struct DhtLookup* lookups;
+    atomic_uint next_transaction;
+    
+    // 値の複製
+    struct DhtReplication* replication;
     
-    // 値の保存用ハッシュテーブル（簡易実装）
-    struct {
-        DhtId key;
-        uint8_t value[MAX_BUFFER];
-        size_t value_len;
-        bool in_use;
-    } storage[100];  // 最大100個の値を保存
-    int storage_count;
+    // 経路キャッシュ（ルックアップの経路上に置かれた他のノードの値、store_mutexで保護）
+    DhtValueStore cache;
+    bool cache_enabled;
+    DhtCacheStats cache_stats;
 } DhtData;
 
 // DHT ノード情報
@@ -41,21 +93,71 @@ typedef struct {
     char ip[MAX_IP_STR_LEN];     // IPアドレス
     int port;                    // ポート
     time_t last_seen;            // 最後に見た時間
+    bool stale;                  // 永続化ファイルから復元し、まだ生存を確認していない
 } DhtNodeInfo;
 
+// ルーティングテーブルのエントリ
+//
+// アドレスはバイナリ、時刻はテーブルの時計（作成時からの単調増加の秒）で持ち、
+// 1エントリを32バイトに収める。バケットは64バイト境界に確保するため、
+// エントリがキャッシュラインをまたぐことはない。
+typedef struct {
+    DhtId id;                    // ノードのDHT ID
+    uint32_t addr;               // IPv4アドレス（ネットワークバイトオーダー）
+    uint16_t port;               // ポート
+    uint8_t flags;               // DHT_CONTACT_*
+    uint8_t fails;               // 連続して応答がなかった回数
+    uint32_t last_seen;          // 最後に見た時刻（テーブルの時計）
+} DhtContact;
+
+_Static_assert(sizeof(DhtContact) == 32, "DhtContact must stay at 32 bytes");
+
+#define DHT_CONTACT_STALE 0x01   // 永続化ファイルから復元し、まだ生存を確認していない
+#define DHT_CONTACT_PINGING 0x02 // 追い出す前の生存確認のPINGの応答待ち
+
 // k-bucket
+//
+// 書き込みはdht_mutexを保持して行い、前後でseqを1ずつ進める（奇数は書き込み中）。
+// 読み取り側はロックを取らず、seqが前後で一致するまで読み直す。
+//
+// 満杯のバケットに入れなかったノードは交代要員（replacements）として覚えておき、
+// 最も長く応答のないノードにPINGを送る。応答がないまま失敗回数が上限に達した
+// ノードは外し、最後に見た交代要員を入れる。交代要員は書き込み側だけが使う。
 typedef struct {
-    DhtNodeInfo nodes[DHT_K];    // バケット内のノード
+    DhtContact nodes[DHT_K];     // バケット内のノード
+    DhtContact replacements[DHT_REPLACEMENT_CACHE]; // 交代要員（末尾が最後に見たもの）
+    atomic_uint seq;             // シーケンスロック
     int count;                   // ノード数
-    time_t last_updated;         // 最後に更新された時間
+    int replacement_count;       // 交代要員の数
+    uint32_t last_updated;       // 最後に更新された時刻（テーブルの時計）
+    uint64_t ping_deadline;      // 生存確認のPINGの期限（RPCの時計、0なら送っていない）
 } KBucket;
 
 // DHT ルーティングテーブル
+//
+// 実際に埋まるのは自分に近い側の数十個のバケットだけなので、バケットは最初に
+// ノードを追加するときに確保する。一度確保したバケットはロックなしの読み取り側が
+// 参照している可能性があるため、テーブルを解放するまで解放しない。
 typedef struct RoutingTable {
-    KBucket buckets[DHT_ID_BITS]; // 各ビット位置に対応するバケット
+    _Atomic(KBucket*) buckets[DHT_ID_BITS]; // 各ビット位置に対応するバケット（未確保はNULL）
     DhtId self_id;                // 自分のID
+    int bucket_count;             // 確保済みのバケット数
+    uint64_t clock_base_ms;       // テーブルの時計の起点（CLOCK_MONOTONIC）
+    time_t wall_base;             // テーブルの時計の起点の時刻
 } RoutingTable;
 
+// DHTのメモリ使用量（ノードあたり）
+typedef struct {
+    size_t routing_bytes;        // ルーティングテーブル（確保済みのバケットを含む）
+    int buckets_allocated;       // 確保済みのバケット数
+    int contacts;                // ルーティングテーブルのノード数
+    size_t store_bytes;          // 値ストアの確保済みメモリ
+    size_t cache_bytes;          // 経路キャッシュの確保済みメモリ
+    size_t lookup_bytes;         // 進行中のルックアップ
+    size_t replication_bytes;    // 値の複製の状態
+    size_t total_bytes;          // DhtDataを含む合計
+} DhtMemoryStats;
+
 // DHT メッセージタイプ
 typedef enum {
     DHT_PING = 1,
@@ -64,21 +166,16 @@ typedef enum {
     DHT_FIND_NODE_REPLY,
     DHT_FIND_VALUE,
     DHT_FIND_VALUE_REPLY,
-    DHT_STORE
+    DHT_STORE,
+    DHT_STORE_REPLY,
+    DHT_CACHE_STORE
 } DhtMessageType;
 
-// DHT メッセージ
-typedef struct {
-    DhtMessageType type;         // メッセージタイプ
-    DhtId sender_id;             // 送信者ID
-    DhtId target_id;             // 対象ID（検索対象など）
-    uint32_t transaction_id;     // トランザクションID
-    uint16_t data_len;           // データ長
-    char data[MAX_BUFFER];       // データ
-} DhtMessage;
+// DHT メッセージはdht_wire.hの形式でエンコードして送る（構造体のまま送ることはない）
 
 // DHT 関数プロトタイプ
 void dht_init(Node* node);
+void dht_init_manual(Node* node);
 void dht_cleanup(Node* node);
 DhtId dht_generate_id();
 DhtId dht_generate_id_from_string(const char* str);
@@ -87,8 +184,31 @@ void dht_add_node(Node* node, const DhtNodeInfo* dht_node);
 int dht_find_node(Node* node, const DhtId* target_id, DhtNodeInfo* result, int max_results);
 int dht_store_value(Node* node, const DhtId* key, const void* value, size_t value_len);
 int dht_find_value(Node* node, const DhtId* key, void* value, size_t* value_len);
+int dht_find_values(Node* node, const DhtId* key, DhtStoreCursor* cursor, DhtStoreMemberFn fn, void* arg);
+int dht_store_value_ttl(Node* node, const DhtId* key, const void* value, size_t value_len, int ttl);
+void dht_set_storage_budget(Node* node, size_t memory_budget);
+int dht_enable_persistence(Node* node, const char* path);
+void dht_set_transport(Node* node, const DhtTransport* transport);
+int dht_lookup_nodes(Node* node, const DhtId* target, DhtNodeInfo* results, int max_results, int timeout_ms);
+int dht_get_value(Node* node, const DhtId* key, void* value, size_t* value_len);
+int dht_get_values(Node* node, const DhtId* key, DhtStoreMemberFn fn, void* arg, int max_values);
+int dht_store_value_member(Node* node, const DhtId* key, const DhtId* member, const void* value,
+                           size_t value_len, int ttl);
+int dht_store_replica(Node* node, const DhtId* key, const DhtId* member, const void* value, size_t value_len,
+                      time_t expires_at);
+void dht_remove_replica(Node* node, const DhtId* key, const DhtId* member);
+int dht_withdraw_value_member(Node* node, const DhtId* key, const DhtId* member);
+int dht_routing_snapshot(Node* node, DhtNodeInfo* results, int max_results);
+void dht_get_memory_stats(Node* node, DhtMemoryStats* stats);
+void dht_contact_pack(DhtContact* contact, const DhtNodeInfo* info);
+void dht_contact_unpack(const DhtContact* contact, DhtNodeInfo* info);
+void dht_node_failed(Node* node, const DhtId* id);
+void dht_set_path_cache(Node* node, bool enabled, size_t memory_budget);
+void dht_get_cache_stats(Node* node, DhtCacheStats* stats);
+void dht_check_evictions(Node* node);
 void dht_refresh_buckets(Node* node);
 void* dht_maintenance_thread(void* arg);
+void dht_maintenance_tick(Node* node, int ticks);
 
 // ユーティリティ関数
 void dht_id_to_hex(const DhtId* id, char* hex, size_t hex_len);
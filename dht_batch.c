@@ -0,0 +1,510 @@
+#include "dht_batch.h"
+#include "dht_rpc.h"
+#include "dht_replica.h"
+#include "dht_persist.h"
+
+// エントリの状態
+typedef enum {
+    BATCH_WAITING = 0,           // グループのFIND_NODEの完了待ち
+    BATCH_LOOKUP,                // FIND_VALUEのルックアップ中
+    BATCH_READY,                 // 完了（まだ返していない）
+    BATCH_RETURNED               // dht_batch_nextで返した
+} BatchState;
+
+// バッチ内の1件（キーの順に並べ替えて持つ）
+typedef struct {
+    DhtId key;
+    DhtId member;                // 単一の値は全て0
+    int index;                   // 要求の何番目か
+    BatchState state;
+    DhtLookup* lookup;           // FIND_VALUEのルックアップ（結果を返すまで保持）
+    bool probe;                  // lookupはグループで見つけた最も近いノードだけへの問い合わせ
+    int status;
+    bool local;
+    int replicas;
+} BatchEntry;
+
+// 近傍を共有するキーのグループ
+typedef struct {
+    int first;                   // entriesの範囲
+    int count;
+    DhtLookup* lookup;           // FIND_NODEのルックアップ（完了後はNULL）
+} BatchGroup;
+
+struct DhtBatch {
+    Node* node;
+    bool put;
+    BatchEntry* entries;
+    int count;
+    BatchGroup* groups;
+    int group_count;
+    int returned;
+    DhtBatchStats stats;
+};
+
+static const DhtId no_member;
+
+// getでグループのFIND_NODEを行う最小のキー数（範囲のノードを集める1回のルックアップは
+// キーごとのルックアップの数回分にあたり、これより少ないキーでは節約分を上回る）
+#define BATCH_GET_GROUP_MIN 4
+
+static int entry_cmp(const void* a, const void* b) {
+    return memcmp(((const BatchEntry*)a)->key.bytes, ((const BatchEntry*)b)->key.bytes, DHT_ID_BITS/8);
+}
+
+// 2つのIDの共通プレフィックス長
+static int common_prefix(const DhtId* a, const DhtId* b) {
+    DhtDistance d;
+    dht_id_xor(a, b, &d);
+    return dht_distance_clz(&d);
+}
+
+// k近傍が共通になるプレフィックス長（自分からk番目に近いノードとの共通プレフィックス長）
+static int neighborhood_bits(Node* node) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    DhtNodeInfo closest[DHT_K];
+    int count = dht_find_node(node, &dht_data->routing_table->self_id, closest, DHT_K);
+    if (count < DHT_K) {
+        return 0;  // ネットワーク全体が1つの近傍
+    }
+    return common_prefix(&dht_data->routing_table->self_id, &closest[count - 1].id);
+}
+
+// nodesからkeyに近い順にmax_results個を選ぶ
+static int pick_closest(const DhtNodeInfo* nodes, int count, const DhtId* key, DhtNodeInfo* out, int max_results) {
+    int picked = 0;
+    for (int i = 0; i < count; i++) {
+        int pos = picked;
+        while (pos > 0 && dht_id_cmp_distance(key, &nodes[i].id, &out[pos - 1].id) < 0) {
+            pos--;
+        }
+        if (pos >= max_results) {
+            continue;
+        }
+        int last = picked < max_results ? picked : max_results - 1;
+        memmove(&out[pos + 1], &out[pos], sizeof(DhtNodeInfo) * (last - pos));
+        out[pos] = nodes[i];
+        if (picked < max_results) {
+            picked++;
+        }
+    }
+    return picked;
+}
+
+// ローカルの値を1つ選ぶ（メンバーIDが0の値、なければ先頭の値）
+typedef struct {
+    uint8_t* value;
+    size_t len;
+    bool found;
+} LocalValue;
+
+static bool local_pick(const DhtId* member, const void* value, size_t value_len, time_t expires_at, void* arg) {
+    (void)member; (void)expires_at;
+    LocalValue* pick = (LocalValue*)arg;
+    memcpy(pick->value, value, value_len);
+    pick->len = value_len;
+    pick->found = true;
+    return false;
+}
+
+// 値ストア、なければ経路キャッシュから値を読む（store_mutexを保持して呼ぶ）
+static bool read_local(DhtData* dht_data, const DhtId* key, uint8_t* value, size_t* value_len) {
+    time_t now = time(NULL);
+    size_t len = *value_len;
+    if (dht_store_get(&dht_data->store, key, value, &len, now, NULL) == 0) {
+        *value_len = len;
+        return true;
+    }
+
+    LocalValue pick = { value, 0, false };
+    DhtStoreCursor cursor;
+    memset(&cursor, 0, sizeof(cursor));
+    dht_store_scan_members(&dht_data->store, key, now, &cursor, local_pick, &pick);
+    if (!pick.found && dht_data->cache_enabled) {
+        memset(&cursor, 0, sizeof(cursor));
+        dht_store_scan_members(&dht_data->cache, key, now, &cursor, local_pick, &pick);
+    }
+    *value_len = pick.found ? pick.len : 0;
+    return pick.found;
+}
+
+// バッチを作成
+static DhtBatch* batch_create(Node* node, int count, bool put) {
+    if (!node->dht_data || count <= 0) {
+        return NULL;
+    }
+
+    DhtBatch* batch = (DhtBatch*)calloc(1, sizeof(DhtBatch));
+    if (!batch) {
+        perror("Failed to allocate DHT batch");
+        return NULL;
+    }
+    batch->entries = (BatchEntry*)calloc(count, sizeof(BatchEntry));
+    batch->groups = (BatchGroup*)calloc(count, sizeof(BatchGroup));
+    if (!batch->entries || !batch->groups) {
+        perror("Failed to allocate DHT batch");
+        free(batch->entries);
+        free(batch->groups);
+        free(batch);
+        return NULL;
+    }
+
+    batch->node = node;
+    batch->put = put;
+    batch->count = count;
+    batch->stats.keys = count;
+    return batch;
+}
+
+static void batch_start_key_lookup(DhtBatch* batch, BatchEntry* entry, const DhtNodeInfo* seeds, int seed_count);
+
+// キーを並べ替えて近傍ごとにグループ分けし、ネットワークが必要なグループのFIND_NODEを始める
+//
+// getでネットワークが必要なキーがBATCH_GET_GROUP_MIN未満のグループは、グループの
+// ルックアップを省いてキーごとのルックアップをルーティングテーブルから始める。
+static void batch_start(DhtBatch* batch) {
+    qsort(batch->entries, batch->count, sizeof(BatchEntry), entry_cmp);
+    int bits = neighborhood_bits(batch->node);
+    batch->stats.prefix_bits = bits;
+
+    for (int i = 0; i < batch->count; i++) {
+        BatchGroup* group = batch->group_count > 0 ? &batch->groups[batch->group_count - 1] : NULL;
+        if (!group || common_prefix(&batch->entries[group->first].key, &batch->entries[i].key) < bits) {
+            group = &batch->groups[batch->group_count++];
+            group->first = i;
+        }
+        group->count++;
+    }
+
+    for (int g = 0; g < batch->group_count; g++) {
+        BatchGroup* group = &batch->groups[g];
+        int waiting = 0;
+        for (int i = group->first; i < group->first + group->count; i++) {
+            waiting += batch->entries[i].state == BATCH_WAITING;
+        }
+        if (waiting == 0) {
+            continue;
+        }
+        if (!batch->put && waiting < BATCH_GET_GROUP_MIN) {
+            for (int i = group->first; i < group->first + group->count; i++) {
+                if (batch->entries[i].state == BATCH_WAITING) {
+                    batch_start_key_lookup(batch, &batch->entries[i], NULL, 0);
+                }
+            }
+            continue;
+        }
+
+        // 範囲のノードを全て問い合わせ、真ん中のキーのk近傍も集める（範囲が疎なとき隣の範囲を補う）
+        const DhtId* target = &batch->entries[group->first + group->count / 2].key;
+        group->lookup = dht_lookup_start_prefix(batch->node, target, bits, DHT_LOOKUP_DEFAULT_TIMEOUT_MS);
+        batch->stats.groups++;
+        if (!group->lookup) {
+            for (int i = group->first; i < group->first + group->count; i++) {
+                if (batch->entries[i].state == BATCH_WAITING) {
+                    batch->entries[i].state = BATCH_READY;
+                    batch->entries[i].status = -1;
+                }
+            }
+        }
+    }
+}
+
+// キーのk近傍へ初回のSTOREを送る（送る値はローカルの値ストアから読む）
+static void batch_send_stores(DhtBatch* batch, BatchEntry* entry, const DhtNodeInfo* nodes, int node_count) {
+    DhtData* dht_data = (DhtData*)batch->node->dht_data;
+    DhtNodeInfo closest[DHT_K];
+    int closest_count = pick_closest(nodes, node_count, &entry->key, closest, DHT_K);
+
+    uint8_t value[MAX_BUFFER];
+    size_t value_len = sizeof(value);
+    time_t expires_at = 0;
+    pthread_mutex_lock(&dht_data->store_mutex);
+    int found = dht_store_get_member(&dht_data->store, &entry->key, &entry->member, value, &value_len,
+                                     time(NULL), &expires_at);
+    pthread_mutex_unlock(&dht_data->store_mutex);
+
+    int ttl = (int)(expires_at - time(NULL));
+    if (found == 0 && ttl > 0) {
+        entry->replicas = dht_replica_send_batch_stores(batch->node, closest, closest_count, &entry->key,
+                                                        &entry->member, value, value_len, ttl);
+        batch->stats.deferred += closest_count > 0 && entry->replicas == 0;
+    }
+    entry->state = BATCH_READY;
+}
+
+// キーごとのルックアップを始める（seedsがNULLならルーティングテーブルから）
+static void batch_start_key_lookup(DhtBatch* batch, BatchEntry* entry, const DhtNodeInfo* seeds, int seed_count) {
+    entry->lookup = dht_lookup_start_from(batch->node, &entry->key, !batch->put, DHT_LOOKUP_DEFAULT_TIMEOUT_MS,
+                                          seeds, seed_count);
+    entry->probe = false;
+    entry->state = entry->lookup ? BATCH_LOOKUP : BATCH_READY;
+    entry->status = entry->lookup ? 0 : -1;
+    if (entry->lookup) {
+        batch->stats.key_lookups++;
+    }
+}
+
+// グループの範囲のノードが分かったので、各キーのk近傍へSTOREを送るかルックアップを始める
+//
+// 範囲内でk個以上のノードが応答していれば、範囲内のキーのk近傍はその中に揃っている。
+// 揃っていない（範囲が疎な）ときは、見つかったノードから始めてキーごとにルックアップする
+// （既に近くにいるため通常は1往復で終わる）。値の検索では、見つかったノードのうちキーに
+// 最も近い1つだけに問い合わせ、値がなければキーごとのルックアップに切り替える。
+static void batch_dispatch_group(DhtBatch* batch, BatchGroup* group, const DhtNodeInfo* nodes, int node_count) {
+    int in_range = 0;
+    for (int i = 0; i < node_count; i++) {
+        in_range += common_prefix(&batch->entries[group->first].key, &nodes[i].id) >= batch->stats.prefix_bits;
+    }
+    bool covered = batch->stats.prefix_bits > 0 && in_range >= DHT_K;
+
+    for (int i = group->first; i < group->first + group->count; i++) {
+        BatchEntry* entry = &batch->entries[i];
+        if (entry->state != BATCH_WAITING) {
+            continue;
+        }
+        if (batch->put && covered) {
+            batch_send_stores(batch, entry, nodes, node_count);
+            continue;
+        }
+
+        DhtNodeInfo closest[DHT_K];
+        int closest_count = pick_closest(nodes, node_count, &entry->key, closest, DHT_K);
+        if (!batch->put && closest_count > 0) {
+            entry->lookup = dht_lookup_start_probe(batch->node, &entry->key, &closest[0],
+                                                   DHT_LOOKUP_DEFAULT_TIMEOUT_MS);
+            if (entry->lookup) {
+                entry->probe = true;
+                entry->state = BATCH_LOOKUP;
+                batch->stats.probes++;
+                continue;
+            }
+        }
+        batch_start_key_lookup(batch, entry, closest, closest_count);
+    }
+}
+
+// FIND_NODEが完了したグループを処理
+static void batch_progress_groups(DhtBatch* batch) {
+    for (int g = 0; g < batch->group_count; g++) {
+        BatchGroup* group = &batch->groups[g];
+        if (!group->lookup || !dht_lookup_is_done(batch->node, group->lookup)) {
+            continue;
+        }
+        DhtNodeInfo nodes[DHT_LOOKUP_MAX_CANDIDATES];
+        int node_count = dht_lookup_finish(batch->node, group->lookup, nodes, DHT_LOOKUP_MAX_CANDIDATES, NULL, NULL);
+        group->lookup = NULL;
+        batch_dispatch_group(batch, group, nodes, node_count);
+    }
+}
+
+// 完了したキーごとのルックアップを処理
+static void batch_progress_keys(DhtBatch* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        BatchEntry* entry = &batch->entries[i];
+        if (entry->state != BATCH_LOOKUP || !dht_lookup_is_done(batch->node, entry->lookup)) {
+            continue;
+        }
+        if (batch->put) {
+            DhtNodeInfo nodes[DHT_LOOKUP_MAX_CANDIDATES];
+            int node_count = dht_lookup_finish(batch->node, entry->lookup, nodes, DHT_LOOKUP_MAX_CANDIDATES,
+                                               NULL, NULL);
+            entry->lookup = NULL;
+            batch_send_stores(batch, entry, nodes, node_count);
+        } else if (entry->probe && !entry->lookup->value_found) {
+            dht_lookup_finish(batch->node, entry->lookup, NULL, 0, NULL, NULL);
+            entry->lookup = NULL;
+            batch->stats.probe_misses++;
+            batch_start_key_lookup(batch, entry, NULL, 0);
+        } else {
+            dht_lookup_cache_value(batch->node, entry->lookup);
+            entry->state = BATCH_READY;
+        }
+    }
+}
+
+// 完了してまだ返していないエントリ
+static BatchEntry* batch_next_ready(DhtBatch* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->entries[i].state == BATCH_READY) {
+            return &batch->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// 値をまとめて公開（ローカルへの保存は値ストアのロックを1回だけ取って行う）
+//
+// 初回のSTOREは複製のキューを通さず、グループごとのFIND_NODEが終わり次第送る。複製の
+// トークンバケットが足りないキーは複製のキューに回し、レートの範囲で後から送る。
+DhtBatch* dht_batch_put(Node* node, const DhtBatchItem* items, int count) {
+    if (!items) {
+        return NULL;
+    }
+    DhtBatch* batch = batch_create(node, count, true);
+    if (!batch) {
+        return NULL;
+    }
+
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&dht_data->store_mutex);
+    for (int i = 0; i < count; i++) {
+        BatchEntry* entry = &batch->entries[i];
+        const DhtBatchItem* item = &items[i];
+        entry->key = item->key;
+        entry->member = item->member ? *item->member : no_member;
+        entry->index = i;
+        entry->local = true;
+
+        if (!item->value || item->ttl <= 0 || item->value_len > DHT_RPC_MAX_VALUE ||
+            dht_store_put_member(&dht_data->store, &entry->key, &entry->member, item->value, item->value_len,
+                                 now + item->ttl) < 0) {
+            entry->state = BATCH_READY;
+            entry->status = -1;
+            continue;
+        }
+        if (dht_data->persist) {
+            pthread_mutex_lock(&dht_data->dht_mutex);
+            dht_persist_append_value(dht_data->persist, &entry->key, &entry->member, item->value,
+                                     item->value_len, now + item->ttl, &dht_data->store);
+            pthread_mutex_unlock(&dht_data->dht_mutex);
+        }
+    }
+    pthread_mutex_unlock(&dht_data->store_mutex);
+
+    for (int i = 0; i < count; i++) {
+        BatchEntry* entry = &batch->entries[i];
+        if (entry->state == BATCH_WAITING) {
+            if (dht_replica_on_batch_publish(node, &entry->key, &entry->member, items[i].ttl)) {
+                entry->local = false;
+            } else {
+                entry->state = BATCH_READY;  // 複製しない
+            }
+        }
+    }
+
+    batch_start(batch);
+    return batch;
+}
+
+// 値をまとめて検索（ローカルにあるキーは直ちに完了する）
+DhtBatch* dht_batch_get(Node* node, const DhtId* keys, int count) {
+    if (!keys) {
+        return NULL;
+    }
+    DhtBatch* batch = batch_create(node, count, false);
+    if (!batch) {
+        return NULL;
+    }
+
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    uint8_t value[MAX_BUFFER];
+    pthread_mutex_lock(&dht_data->store_mutex);
+    for (int i = 0; i < count; i++) {
+        BatchEntry* entry = &batch->entries[i];
+        entry->key = keys[i];
+        entry->index = i;
+        size_t value_len = sizeof(value);
+        if (read_local(dht_data, &entry->key, value, &value_len)) {
+            entry->state = BATCH_READY;
+            entry->local = true;
+            batch->stats.local++;
+        }
+    }
+    pthread_mutex_unlock(&dht_data->store_mutex);
+
+    batch_start(batch);
+    return batch;
+}
+
+// 次に完了した結果を受け取る（全て返し終えたらfalse）
+bool dht_batch_next(DhtBatch* batch, DhtBatchResult* result) {
+    if (!batch || !result) {
+        return false;
+    }
+
+    DhtData* dht_data = (DhtData*)batch->node->dht_data;
+    while (batch->returned < batch->count) {
+        // グループの処理は毎回、キーごとのルックアップの確認は返せるものがないときだけ行う
+        batch_progress_groups(batch);
+        BatchEntry* entry = batch_next_ready(batch);
+        if (!entry) {
+            batch_progress_keys(batch);
+            entry = batch_next_ready(batch);
+        }
+        if (entry) {
+            memset(result, 0, offsetof(DhtBatchResult, value));
+            result->index = entry->index;
+            result->key = entry->key;
+            result->status = entry->status;
+            result->local = entry->local;
+            result->replicas = entry->replicas;
+            result->value_len = 0;
+
+            if (!batch->put && entry->lookup) {
+                bool found = entry->lookup->value_found;
+                size_t value_len = sizeof(result->value);
+                dht_lookup_finish(batch->node, entry->lookup, NULL, 0, result->value, &value_len);
+                entry->lookup = NULL;
+                result->value_len = found ? value_len : 0;
+                result->status = found ? 0 : -1;
+            } else if (!batch->put && entry->status == 0) {
+                size_t value_len = sizeof(result->value);
+                pthread_mutex_lock(&dht_data->store_mutex);
+                bool found = read_local(dht_data, &entry->key, result->value, &value_len);
+                pthread_mutex_unlock(&dht_data->store_mutex);
+                result->value_len = found ? value_len : 0;
+                result->status = found ? 0 : -1;
+            }
+
+            entry->state = BATCH_RETURNED;
+            batch->returned++;
+            return true;
+        }
+
+        // 完了したものがなければ、まだ終わっていないルックアップの1つを待つ
+        DhtLookup* pending = NULL;
+        for (int g = 0; g < batch->group_count && !pending; g++) {
+            pending = batch->groups[g].lookup;
+        }
+        for (int i = 0; i < batch->count && !pending; i++) {
+            if (batch->entries[i].state == BATCH_LOOKUP) {
+                pending = batch->entries[i].lookup;
+            }
+        }
+        if (!pending) {
+            break;
+        }
+        dht_lookup_wait(batch->node, pending);
+    }
+    return false;
+}
+
+// バッチの統計を取得
+void dht_batch_get_stats(const DhtBatch* batch, DhtBatchStats* stats) {
+    if (!batch) {
+        memset(stats, 0, sizeof(DhtBatchStats));
+        return;
+    }
+    *stats = batch->stats;
+}
+
+// バッチを解放（進行中のルックアップは打ち切る）
+void dht_batch_free(DhtBatch* batch) {
+    if (!batch) {
+        return;
+    }
+    for (int g = 0; g < batch->group_count; g++) {
+        if (batch->groups[g].lookup) {
+            dht_lookup_finish(batch->node, batch->groups[g].lookup, NULL, 0, NULL, NULL);
+        }
+    }
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->entries[i].lookup) {
+            dht_lookup_finish(batch->node, batch->entries[i].lookup, NULL, 0, NULL, NULL);
+        }
+    }
+    free(batch->entries);
+    free(batch->groups);
+    free(batch);
+}
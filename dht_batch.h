@@ -0,0 +1,61 @@
+#ifndef DHT_BATCH_H
+#define DHT_BATCH_H
+
+#include "dht.h"
+
+// バッチ操作
+//
+// 多数のキーをまとめて公開・検索する。キーをIDの順に並べ、自分のk近傍と同じ深さの
+// プレフィックスを共有するキーを1つのグループにする。同じグループのキーはk近傍の
+// ノードもほぼ共通なので、グループごとに1回だけ、そのプレフィックスの範囲のノードを
+// 全て集める反復ルックアップを行い、見つかったノードから各キーのk近傍を選ぶ。
+// getでは各キーに最も近いノード1つだけにFIND_VALUEを送り、値がなければキーごとの
+// ルックアップに切り替える。ネットワークが必要なキーが少ないグループは、グループの
+// ルックアップを省いてキーごとにルックアップする。
+//
+// 各キーへのSTOREやFIND_VALUEはそのノードへ応答を待たずに並べて送り、結果は
+// dht_batch_nextで完了した順に受け取る。putの初回のSTOREは複製と同じトークンバケットに
+// 従い、足りなければ複製のキューに回す。
+
+// 公開する値
+typedef struct {
+    DhtId key;
+    const DhtId* member;         // メンバーID（NULLなら単一の値）
+    const void* value;
+    size_t value_len;
+    int ttl;                     // 有効期間（秒）
+} DhtBatchItem;
+
+// 1件の結果
+typedef struct {
+    int index;                   // 要求の何番目か
+    DhtId key;
+    int status;                  // 0: 成功、-1: 保存できない・値が見つからない
+    bool local;                  // ネットワークを使わずに完了した
+    int replicas;                // putでSTOREを送ったノード数
+    uint8_t value[MAX_BUFFER];   // getで見つかった値
+    size_t value_len;
+} DhtBatchResult;
+
+// バッチの統計
+typedef struct {
+    int keys;                    // キーの数
+    int groups;                  // FIND_NODEのルックアップを行ったグループ数
+    int local;                   // ローカルで完了したキー
+    int key_lookups;             // キーごとのルックアップを行ったキー（putは範囲が疎なとき）
+    int probes;                  // getでグループで見つけたノード1つだけに問い合わせたキー
+    int probe_misses;            // そのうち値がなくキーごとのルックアップに切り替えたキー
+    int prefix_bits;             // グループ分けに使ったプレフィックス長
+    int deferred;                // putでレート制限のため複製のキューに回したキー
+} DhtBatchStats;
+
+typedef struct DhtBatch DhtBatch;
+
+// バッチ操作関数プロトタイプ
+DhtBatch* dht_batch_put(Node* node, const DhtBatchItem* items, int count);
+DhtBatch* dht_batch_get(Node* node, const DhtId* keys, int count);
+bool dht_batch_next(DhtBatch* batch, DhtBatchResult* result);
+void dht_batch_get_stats(const DhtBatch* batch, DhtBatchStats* stats);
+void dht_batch_free(DhtBatch* batch);
+
+#endif /* DHT_BATCH_H */
@@ -0,0 +1,3011 @@
+#include "dht.h"
+#include "dht_rpc.h"
+#include "dht_replica.h"
+#include "dht_batch.h"
+#include "dht_hash.h"
+#include "discovery.h"
+#include "turn.h"
+#include "turn_server.h"
+#include "stun.h"
+#include "ice.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+// DHTベンチマーク
+//
+// ルーティングテーブルを実際のコードで満杯にし、各操作のスループットを測定する。
+// 使い方: ./dht_bench [-n ITERATIONS] [-s STATE_FILE]
+
+static int saved_stdout = -1;
+static int quiet_depth = 0;
+
+// 初期化中の大量のログ出力を抑制する（入れ子にできる）
+static void quiet_begin() {
+    if (quiet_depth++ > 0) {
+        return;
+    }
+    fflush(stdout);
+    saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0) {
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    }
+}
+
+static void quiet_end() {
+    if (--quiet_depth > 0) {
+        return;
+    }
+    fflush(stdout);
+    if (saved_stdout >= 0) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+        saved_stdout = -1;
+    }
+}
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ベンチマーク用のノードを作成（ソケットや受信スレッドは使わない）
+static Node* bench_create_node(int id) {
+    Node* node = (Node*)calloc(1, sizeof(Node));
+    if (!node) {
+        perror("Failed to allocate bench node");
+        return NULL;
+    }
+
+    node->id = id;
+    node->is_running = true;
+    node->socket_fd = -1;
+    strncpy(node->ip, "127.0.0.1", MAX_IP_STR_LEN - 1);
+    node->addr.sin_family = AF_INET;
+    node->addr.sin_port = htons(BASE_PORT + id);
+
+    quiet_begin();
+    dht_init(node);
+    quiet_end();
+
+    if (!node->dht_data) {
+        free(node);
+        return NULL;
+    }
+    return node;
+}
+
+// 自分のIDとbucket_idxビット目で初めて異なるランダムなIDを生成
+static DhtId bench_id_for_bucket(const DhtId* self_id, int bucket_idx) {
+    DhtId id = dht_generate_id();
+    int byte_idx = bucket_idx / 8;
+    int bit_idx = bucket_idx % 8;
+
+    // 先頭bucket_idxビットは自分と同じにする
+    memcpy(id.bytes, self_id->bytes, byte_idx);
+    uint8_t prefix_mask = (uint8_t)(0xFF << (8 - bit_idx));
+    id.bytes[byte_idx] = (self_id->bytes[byte_idx] & prefix_mask) | (id.bytes[byte_idx] & ~prefix_mask);
+
+    // bucket_idxビット目は自分と逆にする
+    uint8_t bit = (uint8_t)(1 << (7 - bit_idx));
+    id.bytes[byte_idx] = (id.bytes[byte_idx] & ~bit) | (~self_id->bytes[byte_idx] & bit);
+    return id;
+}
+
+// 全バケットをDHT_K個ずつ埋める
+static int bench_fill_routing_table(Node* node) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    DhtId self_id = dht_data->routing_table->self_id;
+    int added = 0;
+
+    quiet_begin();
+    for (int i = 0; i < DHT_ID_BITS; i++) {
+        for (int j = 0; j < DHT_K; j++) {
+            DhtNodeInfo info;
+            memset(&info, 0, sizeof(info));
+            info.id = bench_id_for_bucket(&self_id, i);
+            snprintf(info.ip, sizeof(info.ip), "10.%d.%d.%d", i, j, (i * DHT_K + j) % 250 + 1);
+            info.port = BASE_PORT + j;
+            dht_add_node(node, &info);
+        }
+    }
+    quiet_end();
+
+    DhtMemoryStats stats;
+    dht_get_memory_stats(node, &stats);
+    added = stats.contacts;
+    return added;
+}
+
+// dht_find_nodeのスループット
+static void bench_find_node(Node* node, int iterations, int max_results) {
+    DhtId* targets = (DhtId*)malloc(sizeof(DhtId) * 1024);
+    DhtNodeInfo* results = (DhtNodeInfo*)malloc(sizeof(DhtNodeInfo) * max_results);
+    if (!targets || !results) {
+        perror("Failed to allocate bench buffers");
+        free(targets);
+        free(results);
+        return;
+    }
+
+    RAND_bytes((unsigned char*)targets, sizeof(DhtId) * 1024);
+
+    long total_found = 0;
+    double start = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        total_found += dht_find_node(node, &targets[i & 1023], results, max_results);
+    }
+    double elapsed = now_sec() - start;
+
+    printf("  find_node k=%-3d %10d lookups in %7.3f s  %12.0f lookups/s  %8.1f ns/lookup  (avg %.1f results)\n",
+           max_results, iterations, elapsed, iterations / elapsed,
+           elapsed * 1e9 / iterations, (double)total_found / iterations);
+
+    free(targets);
+    free(results);
+}
+
+// バッチ距離計算カーネルのスループット（1回数ミリ秒では周波数の変化や割り込みで
+// 順位が入れ替わるため、各カーネルを温めてから最低BENCH_KERNEL_SECONDS秒測る）
+#define BENCH_KERNEL_SECONDS 0.5
+
+static void bench_distance_kernels(int iterations) {
+    const int batch = 1024;
+    DhtId* ids = (DhtId*)malloc(sizeof(DhtId) * batch);
+    DhtDistance* out = (DhtDistance*)malloc(sizeof(DhtDistance) * batch);
+    if (!ids || !out) {
+        perror("Failed to allocate bench buffers");
+        free(ids);
+        free(out);
+        return;
+    }
+
+    RAND_bytes((unsigned char*)ids, sizeof(DhtId) * batch);
+    DhtId target = dht_generate_id();
+    const char* best = dht_id_kernel_name();
+    const char* kernels[] = { "scalar", "ssse3", "avx2" };
+    int min_rounds = iterations / 100 + 1;
+
+    for (int k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+        if (dht_id_set_kernel(kernels[k]) < 0) {
+            printf("  distance_batch %-6s unsupported on this CPU\n", kernels[k]);
+            continue;
+        }
+
+        dht_id_distance_batch(&target, ids, sizeof(DhtId), batch, out);
+
+        uint64_t checksum = 0;
+        int rounds = 0;
+        double start = now_sec();
+        double elapsed = 0;
+        while (rounds < min_rounds || elapsed < BENCH_KERNEL_SECONDS) {
+            for (int r = 0; r < 256; r++, rounds++) {
+                target.bytes[0] = (uint8_t)rounds;
+                dht_id_distance_batch(&target, ids, sizeof(DhtId), batch, out);
+                checksum += out[rounds % batch].w[0];
+            }
+            elapsed = now_sec() - start;
+        }
+        double total = (double)rounds * batch;
+
+        printf("  distance_batch %-6s %10.0f ids in %7.3f s  %12.0f ids/s  %8.2f ns/id%s  (checksum %llx)\n",
+               kernels[k], total, elapsed, total / elapsed, elapsed * 1e9 / total,
+               strcmp(kernels[k], best) == 0 ? " [auto]" : "",
+               (unsigned long long)(checksum & 0xffff));
+    }
+
+    dht_id_set_kernel(best);
+    free(ids);
+    free(out);
+}
+
+// IDハッシュ（ランデブーキー程度の短い文字列）
+//
+// OpenSSLのSHA1()を毎回呼ぶ場合、dht_hash_bytes（キャッシュなし）、少数のキーを繰り返す
+// dht_hash_string（キャッシュあり）を比べる。キャッシュに無い1024個の文字列は、
+// dht_hash_stringで1つずつ計算する場合とdht_hash_stringsでまとめる場合を比べる。
+static void bench_hash(int iterations) {
+    const int batch = 1024;
+    char (*strs)[32] = malloc(sizeof(*strs) * batch);
+    const char** ptrs = (const char**)malloc(sizeof(char*) * batch);
+    DhtId* ids = (DhtId*)malloc(sizeof(DhtId) * batch);
+    if (!strs || !ptrs || !ids) {
+        perror("Failed to allocate bench buffers");
+        free(strs);
+        free(ptrs);
+        free(ids);
+        return;
+    }
+    for (int i = 0; i < batch; i++) {
+        snprintf(strs[i], sizeof(strs[i]), "rendezvous-member-%d", i);
+        ptrs[i] = strs[i];
+    }
+
+    int rounds = iterations / batch + 1;
+    double total = (double)rounds * batch;
+    uint64_t checksum = 0;
+    DhtId id;
+
+    double start = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        strs[0][0] = (char)('a' + r % 26);
+        for (int i = 0; i < batch; i++) {
+            SHA1((const unsigned char*)strs[i], strlen(strs[i]), id.bytes);
+            checksum += id.bytes[0];
+        }
+    }
+    double elapsed = now_sec() - start;
+    printf("  hash openssl_sha1 %10.0f in %7.3f s  %8.1f ns/hash\n", total, elapsed, elapsed * 1e9 / total);
+
+    start = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < batch; i++) {
+            dht_hash_bytes(strs[i], strlen(strs[i]), &id);
+            checksum += id.bytes[0];
+        }
+    }
+    elapsed = now_sec() - start;
+    printf("  hash uncached     %10.0f in %7.3f s  %8.1f ns/hash\n", total, elapsed, elapsed * 1e9 / total);
+
+    start = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < batch; i++) {
+            dht_hash_string(strs[i % 16], &id);
+            checksum += id.bytes[0];
+        }
+    }
+    elapsed = now_sec() - start;
+    printf("  hash cached       %10.0f in %7.3f s  %8.1f ns/hash  (16 hot keys)\n",
+           total, elapsed, elapsed * 1e9 / total);
+
+    // ハッシュ関数を選び直してキャッシュを毎回捨てる
+    start = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        dht_hash_set_algorithm(DHT_HASH_SHA1);
+        for (int i = 0; i < batch; i++) {
+            dht_hash_string(ptrs[i], &ids[i]);
+        }
+        checksum += ids[r % batch].bytes[0];
+    }
+    elapsed = now_sec() - start;
+    printf("  hash miss single  %10.0f in %7.3f s  %8.1f ns/hash\n", total, elapsed, elapsed * 1e9 / total);
+
+    start = now_sec();
+    for (int r = 0; r < rounds; r++) {
+        dht_hash_set_algorithm(DHT_HASH_SHA1);
+        dht_hash_strings(ptrs, batch, ids);
+        checksum += ids[r % batch].bytes[0];
+    }
+    elapsed = now_sec() - start;
+
+    DhtHashStats stats;
+    dht_hash_get_stats(&stats);
+    printf("  hash miss batch   %10.0f in %7.3f s  %8.1f ns/hash  (%s, checksum %llx)\n",
+           total, elapsed, elapsed * 1e9 / total, stats.accelerated ? "SHA-NI" : "OpenSSL",
+           (unsigned long long)(checksum & 0xffff));
+
+    free(strs);
+    free(ptrs);
+    free(ids);
+}
+
+// ワイヤーフォーマットのエンコード・デコード
+//
+// PING、k個のIPv4ノードを返すFIND_NODEの応答、64バイトの値のSTOREについて、
+// パケット長とエンコード・デコードの時間を測る。v1はバージョン1の固定長の形式
+// （51バイトのヘッダー、26バイトのノード、4バイトの有効期間）での長さ。
+// 応答は対象IDを持たない（トランザクションIDで要求と対応付ける）。
+static void bench_wire(int iterations) {
+    uint8_t packet[DHT_RPC_MAX_PACKET];
+    uint8_t payload[MAX_BUFFER];
+    DhtId sender = dht_generate_id();
+    DhtId target = dht_generate_id();
+    DhtWireContact contacts[DHT_K];
+    for (int i = 0; i < DHT_K; i++) {
+        memset(&contacts[i], 0, sizeof(DhtWireContact));
+        contacts[i].id = dht_generate_id();
+        contacts[i].family = DHT_WIRE_IPV4;
+        contacts[i].addr[0] = 10;
+        contacts[i].addr[3] = (uint8_t)i;
+        contacts[i].port = (uint16_t)(BASE_PORT + i);
+    }
+    uint8_t value[64];
+    memset(value, 'v', sizeof(value));
+
+    const char* names[] = { "ping", "find_node_reply", "store" };
+    const DhtMessageType types[] = { DHT_PING, DHT_FIND_NODE_REPLY, DHT_STORE };
+    size_t v1_sizes[] = { 51, 51 + 1 + DHT_K * 26, 51 + 4 + 20 + sizeof(value) };
+
+    for (int m = 0; m < 3; m++) {
+        size_t packet_len = 0;
+        uint64_t checksum = 0;
+
+        double start = now_sec();
+        for (int n = 0; n < iterations; n++) {
+            DhtWireWriter w;
+            dht_wire_writer_init(&w, payload, sizeof(payload));
+            if (m == 1) {
+                dht_wire_put_contacts(&w, contacts, DHT_K);
+            } else if (m == 2) {
+                dht_wire_put_varint(&w, DHT_STORE_DEFAULT_TTL);
+                dht_wire_put_id(&w, &target);
+                dht_wire_put_bytes(&w, value, sizeof(value));
+            }
+            packet_len = dht_wire_encode_packet(packet, sizeof(packet), (uint8_t)types[m], &sender,
+                                                m == 2 ? &target : NULL, (uint32_t)n * 2654435761u,
+                                                payload, w.len);
+            checksum += packet_len;
+        }
+        double encode = now_sec() - start;
+
+        start = now_sec();
+        for (int n = 0; n < iterations; n++) {
+            DhtWireHeader header;
+            if (dht_wire_decode_packet(packet, packet_len, &header) < 0) {
+                break;
+            }
+            DhtWireReader r;
+            dht_wire_reader_init(&r, header.data, header.data_len);
+            if (m == 1) {
+                DhtWireContact decoded[DHT_K];
+                int count = dht_wire_get_contacts(&r, decoded, DHT_K);
+                checksum += count > 0 ? decoded[count - 1].port : 0;
+            } else if (m == 2) {
+                DhtId member;
+                checksum += dht_wire_get_varint(&r);
+                dht_wire_get_id(&r, &member);
+                checksum += dht_wire_remaining(&r);
+            }
+            checksum += header.transaction_id;
+        }
+        double decode = now_sec() - start;
+
+        printf("  wire %-16s %4zu bytes (v1 %4zu)  encode %7.1f ns  decode %7.1f ns  (checksum %llx)\n",
+               names[m], packet_len, v1_sizes[m], encode * 1e9 / iterations, decode * 1e9 / iterations,
+               (unsigned long long)(checksum & 0xffff));
+    }
+}
+
+// マルチスレッドルックアップの設定
+typedef struct {
+    Node* node;
+    int iterations;
+    bool serialize;              // dht_mutexでルックアップを直列化（比較用）
+    long found;
+} BenchLookupWorker;
+
+typedef struct {
+    Node* node;
+    DhtNodeInfo* contacts;
+    int contact_count;
+    atomic_bool stop;
+    long updates;
+} BenchWriter;
+
+static void* bench_lookup_worker(void* arg) {
+    BenchLookupWorker* worker = (BenchLookupWorker*)arg;
+    DhtData* dht_data = (DhtData*)worker->node->dht_data;
+    DhtNodeInfo results[DHT_K];
+    DhtId target = dht_generate_id();
+
+    for (int i = 0; i < worker->iterations; i++) {
+        target.bytes[i & 15] ^= (uint8_t)(i * 131);
+        if (worker->serialize) {
+            pthread_mutex_lock(&dht_data->dht_mutex);
+        }
+        worker->found += dht_find_node(worker->node, &target, results, DHT_K);
+        if (worker->serialize) {
+            pthread_mutex_unlock(&dht_data->dht_mutex);
+        }
+    }
+    return NULL;
+}
+
+// ルックアップと並行して既存ノードを更新し続ける
+static void* bench_writer(void* arg) {
+    BenchWriter* writer = (BenchWriter*)arg;
+    int i = 0;
+
+    while (!atomic_load(&writer->stop)) {
+        dht_add_node(writer->node, &writer->contacts[i]);
+        i = (i + 1) % writer->contact_count;
+        writer->updates++;
+    }
+    return NULL;
+}
+
+// 複数スレッドからのdht_find_nodeのスループット（書き込みスレッドと並行）
+static void bench_find_node_threads(Node* node, int iterations, int threads, bool serialize) {
+    BenchLookupWorker workers[16];
+    pthread_t tids[16];
+    BenchWriter writer;
+    pthread_t writer_tid;
+
+    // 書き込みスレッドは既存ノードの更新だけを行う（ログ出力なし）
+    DhtNodeInfo contacts[DHT_K];
+    writer.contact_count = dht_routing_snapshot(node, contacts, DHT_K);
+    writer.node = node;
+    writer.contacts = contacts;
+    writer.updates = 0;
+    atomic_init(&writer.stop, false);
+    if (writer.contact_count == 0 || pthread_create(&writer_tid, NULL, bench_writer, &writer) != 0) {
+        return;
+    }
+
+    double start = now_sec();
+    for (int t = 0; t < threads; t++) {
+        workers[t].node = node;
+        workers[t].iterations = iterations;
+        workers[t].serialize = serialize;
+        workers[t].found = 0;
+        pthread_create(&tids[t], NULL, bench_lookup_worker, &workers[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    double elapsed = now_sec() - start;
+
+    atomic_store(&writer.stop, true);
+    pthread_join(writer_tid, NULL);
+
+    double total = (double)iterations * threads;
+    printf("  find_node %-7s %2d threads %10.0f lookups in %7.3f s  %12.0f lookups/s  (%ld concurrent updates)\n",
+           serialize ? "mutex" : "seqlock", threads, total, elapsed, total / elapsed, writer.updates);
+}
+
+static void bench_destroy_node(Node* node) {
+    quiet_begin();
+    dht_cleanup(node);
+    quiet_end();
+    free(node);
+}
+
+// 1つのキーに多数のメンバーを置いたときの追加・更新・ページ取得
+static bool bench_count_member(const DhtId* member, const void* value, size_t value_len, time_t expires_at,
+                               void* arg) {
+    (void)member; (void)value; (void)value_len; (void)expires_at;
+    int* remaining = (int*)arg;
+    if (*remaining == 0) {
+        return false;
+    }
+    (*remaining)--;
+    return true;
+}
+
+static void bench_members(int member_count, int page_size) {
+    DhtValueStore store;
+    if (dht_store_init(&store, 0) < 0) {
+        return;
+    }
+    dht_store_set_budget(&store, (size_t)member_count * 1024);
+    dht_store_set_max_members(&store, member_count);
+
+    DhtId key = dht_generate_id_from_string("popular-rendezvous-key");
+    DhtId* members = (DhtId*)malloc(sizeof(DhtId) * member_count);
+    if (!members) {
+        dht_store_free(&store);
+        return;
+    }
+    for (int i = 0; i < member_count; i++) {
+        RAND_bytes(members[i].bytes, sizeof(members[i].bytes));
+    }
+    const char value[] = "12,192.168.1.12,8012,203.0.113.7,40112,1";
+    time_t now = time(NULL);
+
+    double start = now_sec();
+    for (int i = 0; i < member_count; i++) {
+        dht_store_put_member(&store, &key, &members[i], value, sizeof(value), now + 3600);
+    }
+    double insert_time = now_sec() - start;
+
+    // リースの更新（同じメンバーIDで上書き）
+    start = now_sec();
+    for (int i = 0; i < member_count; i++) {
+        dht_store_put_member(&store, &key, &members[(i * 7919) % member_count], value, sizeof(value), now + 7200);
+    }
+    double renew_time = now_sec() - start;
+
+    // 全メンバーをページ単位で取得
+    DhtStoreCursor cursor;
+    memset(&cursor, 0, sizeof(cursor));
+    int pages = 0;
+    int returned = 0;
+    start = now_sec();
+    do {
+        int remaining = page_size;
+        returned += dht_store_scan_members(&store, &key, now, &cursor, bench_count_member, &remaining);
+        pages++;
+    } while (!cursor.done);
+    double page_time = now_sec() - start;
+
+    printf("  members %6d  insert %6.0f ns  renew %6.0f ns  page(%d) %6.0f ns  (%d pages, %d returned)\n",
+           member_count, insert_time * 1e9 / member_count, renew_time * 1e9 / member_count, page_size,
+           page_time * 1e9 / pages, pages, returned);
+
+    free(members);
+    dht_store_free(&store);
+}
+
+// 1プロセスで多数のノードを動かしたときのノードあたりのメモリ量
+//
+// 各ノードに他の全ノードを連絡先として追加する。ノード数が少なければ埋まるのは
+// 自分に近い側のバケットの一部だけなので、確保されるバケットもそれだけになる。
+static void bench_memory(int node_count) {
+    Node** nodes = (Node**)calloc(node_count, sizeof(Node*));
+    if (!nodes) {
+        perror("Failed to allocate bench nodes");
+        return;
+    }
+
+    int created = 0;
+    for (; created < node_count; created++) {
+        nodes[created] = bench_create_node(1000 + created);
+        if (!nodes[created]) {
+            break;
+        }
+    }
+
+    quiet_begin();
+    for (int i = 0; i < created; i++) {
+        for (int j = 0; j < created; j++) {
+            DhtNodeInfo info;
+            memset(&info, 0, sizeof(info));
+            info.id = ((DhtData*)nodes[j]->dht_data)->routing_table->self_id;
+            strncpy(info.ip, "127.0.0.1", MAX_IP_STR_LEN - 1);
+            info.port = BASE_PORT + 1000 + j;
+            dht_add_node(nodes[i], &info);
+        }
+    }
+    quiet_end();
+
+    DhtMemoryStats total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < created; i++) {
+        DhtMemoryStats stats;
+        dht_get_memory_stats(nodes[i], &stats);
+        total.routing_bytes += stats.routing_bytes;
+        total.buckets_allocated += stats.buckets_allocated;
+        total.contacts += stats.contacts;
+        total.store_bytes += stats.store_bytes;
+        total.replication_bytes += stats.replication_bytes;
+        total.total_bytes += stats.total_bytes;
+    }
+
+    if (created > 0) {
+        printf("memory (%d nodes in one process):\n", created);
+        printf("  routing table  %8zu bytes/node  (%.1f buckets, %.1f contacts, %zu bytes/contact slot)\n",
+               total.routing_bytes / created, (double)total.buckets_allocated / created,
+               (double)total.contacts / created, sizeof(DhtContact));
+        printf("  preallocated   %8zu bytes/node  (%d buckets x k=%d x DhtNodeInfo)\n",
+               (size_t)DHT_ID_BITS * DHT_K * sizeof(DhtNodeInfo), DHT_ID_BITS, DHT_K);
+        printf("  value store    %8zu bytes/node\n", total.store_bytes / created);
+        printf("  replication    %8zu bytes/node\n", total.replication_bytes / created);
+        printf("  DHT total      %8zu bytes/node\n", total.total_bytes / created);
+    }
+
+    // メンテナンススレッドは1秒ごとに終了を確認するため、先に全ノードを止めてから待つ
+    for (int i = 0; i < created; i++) {
+        nodes[i]->is_running = false;
+    }
+    sleep(2);
+    for (int i = 0; i < created; i++) {
+        bench_destroy_node(nodes[i]);
+    }
+    free(nodes);
+}
+
+// チャーン時の可用性ベンチマーク用のメモリ内ネットワーク
+//
+// 送信はキューに積むだけで、配送は専用スレッドが行う（送信側がrpc_mutexを
+// 保持したまま宛先の処理が走らないようにするため）。停止したノードへの
+// パケットと、停止したノードからのパケットは捨てる。
+#define BENCH_NET_MAX_NODES 256
+
+typedef struct BenchPacket {
+    int to;
+    struct sockaddr_in from;
+    size_t len;
+    struct BenchPacket* next;
+    uint8_t data[];
+} BenchPacket;
+
+typedef struct {
+    Node* nodes[BENCH_NET_MAX_NODES];
+    bool alive[BENCH_NET_MAX_NODES];
+    int base_id;
+    BenchPacket* head;
+    BenchPacket* tail;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool running;
+    Node* delivering;            // 配送スレッドが処理中のノード
+    uint64_t delivered;
+    uint64_t dropped;
+} BenchNet;
+
+static int bench_net_index(BenchNet* net, int port) {
+    int idx = port - BASE_PORT - net->base_id;
+    return (idx >= 0 && idx < BENCH_NET_MAX_NODES) ? idx : -1;
+}
+
+static int bench_net_send(void* ctx, Node* from, const struct sockaddr_in* to, const void* buf, size_t len) {
+    BenchNet* net = (BenchNet*)ctx;
+    int to_idx = bench_net_index(net, ntohs(to->sin_port));
+    int from_idx = bench_net_index(net, ntohs(from->addr.sin_port));
+    if (to_idx < 0 || from_idx < 0) {
+        return -1;
+    }
+
+    BenchPacket* packet = (BenchPacket*)malloc(sizeof(BenchPacket) + len);
+    if (!packet) {
+        return -1;
+    }
+    packet->to = to_idx;
+    packet->from = from->addr;
+    inet_pton(AF_INET, "127.0.0.1", &packet->from.sin_addr);
+    packet->len = len;
+    packet->next = NULL;
+    memcpy(packet->data, buf, len);
+
+    pthread_mutex_lock(&net->mutex);
+    if (net->tail) {
+        net->tail->next = packet;
+    } else {
+        net->head = packet;
+    }
+    net->tail = packet;
+    pthread_cond_signal(&net->cond);
+    pthread_mutex_unlock(&net->mutex);
+    return 0;
+}
+
+static void* bench_net_pump(void* arg) {
+    BenchNet* net = (BenchNet*)arg;
+
+    pthread_mutex_lock(&net->mutex);
+    while (net->running || net->head) {
+        if (!net->head) {
+            pthread_cond_wait(&net->cond, &net->mutex);
+            continue;
+        }
+        BenchPacket* packet = net->head;
+        net->head = packet->next;
+        if (!net->head) {
+            net->tail = NULL;
+        }
+        int from_idx = bench_net_index(net, ntohs(packet->from.sin_port));
+        bool deliver = net->nodes[packet->to] && net->alive[packet->to] && net->alive[from_idx];
+        Node* to = net->nodes[packet->to];
+        net->delivering = deliver ? to : NULL;
+        pthread_mutex_unlock(&net->mutex);
+
+        if (deliver) {
+            dht_handle_packet(to, packet->data, packet->len, &packet->from);
+        }
+        free(packet);
+
+        pthread_mutex_lock(&net->mutex);
+        net->delivering = NULL;
+        if (deliver) {
+            net->delivered++;
+        } else {
+            net->dropped++;
+        }
+    }
+    pthread_mutex_unlock(&net->mutex);
+    return NULL;
+}
+
+// 作成済みのノードをidx番目としてネットワークにつなぐ（ポートはbase_id + idxに合わせる）
+static void bench_net_attach(BenchNet* net, int idx, Node* node, bool replication) {
+    DhtTransport transport = { bench_net_send, NULL, net };
+    dht_set_transport(node, &transport);
+    dht_set_replication(node, replication, 1024 * 1024);
+
+    pthread_mutex_lock(&net->mutex);
+    net->nodes[idx] = node;
+    net->alive[idx] = true;
+    pthread_mutex_unlock(&net->mutex);
+}
+
+// ノードをネットワークから外す（配送中ならその完了を待つ。解放は呼び出し側）
+static void bench_net_detach(BenchNet* net, int idx) {
+    pthread_mutex_lock(&net->mutex);
+    Node* node = net->nodes[idx];
+    net->nodes[idx] = NULL;
+    net->alive[idx] = false;
+    while (node && net->delivering == node) {
+        pthread_mutex_unlock(&net->mutex);
+        usleep(100);
+        pthread_mutex_lock(&net->mutex);
+    }
+    pthread_mutex_unlock(&net->mutex);
+}
+
+// ネットワークにノードを加え、既存の生きているノードのうちcontacts個を教える
+static Node* bench_net_join(BenchNet* net, int idx, int contacts, bool replication) {
+    Node* node = bench_create_node(net->base_id + idx);
+    if (!node) {
+        return NULL;
+    }
+    bench_net_attach(net, idx, node, replication);
+
+    DhtNodeInfo self;
+    memset(&self, 0, sizeof(self));
+    self.id = ((DhtData*)node->dht_data)->routing_table->self_id;
+    strncpy(self.ip, "127.0.0.1", MAX_IP_STR_LEN - 1);
+    self.port = ntohs(node->addr.sin_port);
+
+    // 既存ノードを教え、相手にも自分を知らせてから自分のIDを探して近傍を埋める
+    int added = 0;
+    for (int i = 0; i < BENCH_NET_MAX_NODES && added < contacts; i++) {
+        int peer = (idx + 1 + i * 7) % BENCH_NET_MAX_NODES;
+        if (peer == idx || !net->nodes[peer] || !net->alive[peer]) {
+            continue;
+        }
+        DhtNodeInfo info;
+        memset(&info, 0, sizeof(info));
+        info.id = ((DhtData*)net->nodes[peer]->dht_data)->routing_table->self_id;
+        strncpy(info.ip, "127.0.0.1", MAX_IP_STR_LEN - 1);
+        info.port = ntohs(net->nodes[peer]->addr.sin_port);
+        dht_add_node(node, &info);
+        dht_rpc_send(node, &info, DHT_PING, &info.id, dht_rpc_next_transaction(node), NULL, 0);
+        added++;
+    }
+
+    DhtNodeInfo closest[DHT_K];
+    dht_lookup_nodes(node, &self.id, closest, DHT_K, DHT_LOOKUP_DEFAULT_TIMEOUT_MS);
+    return node;
+}
+
+// 全ノードの複製キューが空になるまで待つ
+static void bench_net_settle(BenchNet* net, int max_sec) {
+    for (int waited = 0; waited < max_sec * 10; waited++) {
+        int pending = 0;
+        for (int i = 0; i < BENCH_NET_MAX_NODES; i++) {
+            if (net->nodes[i] && net->alive[i]) {
+                DhtReplicationStats stats;
+                dht_get_replication_stats(net->nodes[i], &stats);
+                pending += stats.queue_depth;
+            }
+        }
+        // 新しいノードの引き継ぎ判定は次のtickで行われるため、空になってからも少し待つ
+        if (pending == 0 && waited >= 20) {
+            return;
+        }
+        usleep(100000);
+    }
+}
+
+// 生きているノードから全てのキーを読み、見つかった割合を返す
+//
+// 停止したノードへの問い合わせはタイムアウトを待つため、ルックアップは全て並行に走らせる。
+static double bench_net_read_all(BenchNet* net, const DhtId* keys, int key_count, double* avg_ms) {
+    DhtLookup** lookups = (DhtLookup**)calloc(key_count, sizeof(DhtLookup*));
+    Node** readers = (Node**)calloc(key_count, sizeof(Node*));
+    double* finished = (double*)calloc(key_count, sizeof(double));
+    if (!lookups || !readers || !finished) {
+        free(lookups);
+        free(readers);
+        free(finished);
+        *avg_ms = 0;
+        return 0;
+    }
+
+    int found = 0;
+    int pending = 0;
+    int reader = 0;
+    double start = now_sec();
+
+    for (int k = 0; k < key_count; k++) {
+        do {
+            reader = (reader + 1) % BENCH_NET_MAX_NODES;
+        } while (!net->nodes[reader] || !net->alive[reader]);
+        readers[k] = net->nodes[reader];
+
+        uint8_t value[MAX_BUFFER];
+        size_t value_len = sizeof(value);
+        if (dht_find_value(readers[k], &keys[k], value, &value_len) == 0) {
+            found++;
+            finished[k] = start;
+            continue;
+        }
+        lookups[k] = dht_lookup_start(readers[k], &keys[k], true, DHT_LOOKUP_DEFAULT_TIMEOUT_MS);
+        pending += lookups[k] != NULL;
+    }
+
+    while (pending > 0) {
+        usleep(1000);
+        for (int k = 0; k < key_count; k++) {
+            if (!lookups[k] || !dht_lookup_is_done(readers[k], lookups[k])) {
+                continue;
+            }
+            uint8_t value[MAX_BUFFER];
+            size_t value_len = sizeof(value);
+            dht_lookup_finish(readers[k], lookups[k], NULL, 0, value, &value_len);
+            found += value_len > 0;
+            finished[k] = now_sec();
+            lookups[k] = NULL;
+            pending--;
+        }
+    }
+
+    double elapsed = 0;
+    for (int k = 0; k < key_count; k++) {
+        elapsed += finished[k] > start ? finished[k] - start : 0;
+    }
+    *avg_ms = key_count > 0 ? elapsed * 1000.0 / key_count : 0;
+
+    free(lookups);
+    free(readers);
+    free(finished);
+    return key_count > 0 ? (double)found / key_count : 0;
+}
+
+// 生きているノードのルーティングテーブルに残っている停止したノードの数
+static int bench_net_dead_contacts(BenchNet* net, int* total) {
+    DhtNodeInfo contacts[DHT_ID_BITS * DHT_K];
+    int dead = 0;
+    *total = 0;
+    for (int i = 0; i < BENCH_NET_MAX_NODES; i++) {
+        if (!net->nodes[i] || !net->alive[i]) {
+            continue;
+        }
+        int count = dht_routing_snapshot(net->nodes[i], contacts, DHT_ID_BITS * DHT_K);
+        for (int j = 0; j < count; j++) {
+            int idx = bench_net_index(net, contacts[j].port);
+            dead += idx >= 0 && !net->alive[idx];
+        }
+        *total += count;
+    }
+    return dead;
+}
+
+// ノードの停止（以後のパケットは捨てる。スレッドは動いたままにする）
+static void bench_net_kill(BenchNet* net, int idx) {
+    pthread_mutex_lock(&net->mutex);
+    net->alive[idx] = false;
+    pthread_mutex_unlock(&net->mutex);
+}
+
+// 後片付け（配送を止めてから全てのノードを解放）
+static void bench_net_stop(BenchNet* net, pthread_t pump) {
+    pthread_mutex_lock(&net->mutex);
+    memset(net->alive, 0, sizeof(net->alive));
+    net->running = false;
+    pthread_cond_signal(&net->cond);
+    pthread_mutex_unlock(&net->mutex);
+    pthread_join(pump, NULL);
+    // メンテナンススレッドは1秒ごとに終了を確認するため、先に全ノードを止めてから待つ
+    for (int i = 0; i < BENCH_NET_MAX_NODES; i++) {
+        if (net->nodes[i]) {
+            net->nodes[i]->is_running = false;
+        }
+    }
+    sleep(2);
+    for (int i = 0; i < BENCH_NET_MAX_NODES; i++) {
+        if (net->nodes[i]) {
+            dht_cleanup(net->nodes[i]);
+            free(net->nodes[i]);
+        }
+    }
+    while (net->head) {
+        BenchPacket* packet = net->head;
+        net->head = packet->next;
+        free(packet);
+    }
+}
+
+// コールドスタートと、永続化ファイルからのウォームスタートの比較
+//
+// node_count個のノードのネットワークに状態を保存するノードを加え、値を公開してから
+// 止める。止まっている間にノードの1/4が去った後、同じネットワークで再起動し、起動から
+// 他のノードが公開した値の最初のネットワーク越しの取得（dht_get_value）が成功するまでを
+// 測る。コールドスタートは起動時に指定されたノードを1つだけ知っている状態（node_networkの
+// -pで止まる前と同じノードを指定した）から、ウォームスタートは永続化ファイルを復元した
+// 状態から始める。指定したノードも1/4は去っているので、そのときコールドスタートは
+// タイムアウトまで待って失敗する（node_networkでは最初のディスカバリー周期の
+// DISCOVERY_INTERVAL秒を待つことになる）。メモリ内ネットワークに遅延はないので、
+// 生きているノードからの起動の時間の差はほぼ配送したパケットの数の差になる。
+typedef struct {
+    double total_ms;
+    double found_ms;             // 取得に成功した起動だけの合計
+    double max_ms;
+    uint64_t packets;
+    int restored;
+    int values;
+    int found;
+    int trials;
+} BenchBoot;
+
+static void bench_restart_boot(BenchNet* net, int idx, const char* state_path, const DhtNodeInfo* bootstrap,
+                               const DhtId* key, BenchBoot* boot) {
+    char value[128];
+    size_t value_len = 0;
+    bool found = false;
+    pthread_mutex_lock(&net->mutex);
+    uint64_t delivered = net->delivered;
+    pthread_mutex_unlock(&net->mutex);
+
+    double start = now_sec();
+    Node* node = bench_create_node(net->base_id + idx);
+    if (!node) {
+        return;
+    }
+    quiet_begin();
+    bench_net_attach(net, idx, node, false);
+    int restored = state_path ? dht_enable_persistence(node, state_path) : 0;
+    if (bootstrap) {
+        dht_add_node(node, bootstrap);
+    }
+    for (int attempt = 0; attempt < 10 && !found; attempt++) {
+        value_len = sizeof(value);
+        found = dht_get_value(node, key, value, &value_len) == 0;
+    }
+    quiet_end();
+    double elapsed_ms = (now_sec() - start) * 1e3;
+
+    pthread_mutex_lock(&net->mutex);
+    boot->packets += net->delivered - delivered;
+    pthread_mutex_unlock(&net->mutex);
+    boot->total_ms += elapsed_ms;
+    boot->found_ms += found ? elapsed_ms : 0;
+    boot->max_ms = elapsed_ms > boot->max_ms ? elapsed_ms : boot->max_ms;
+    boot->restored += restored;
+    boot->values += ((DhtData*)node->dht_data)->store.entry_count;
+    boot->found += found;
+    boot->trials++;
+
+    bench_net_detach(net, idx);
+    node->is_running = false;
+    bench_destroy_node(node);
+}
+
+// ファイルの複製（試行ごとに同じ永続化ファイルから復元するため）
+static bool bench_copy_file(const char* from, const char* to) {
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    bool ok = in >= 0 && out >= 0;
+    char buf[65536];
+    ssize_t len;
+    while (ok && (len = read(in, buf, sizeof(buf))) > 0) {
+        ok = write(out, buf, len) == len;
+    }
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0) {
+        close(out);
+    }
+    return ok;
+}
+
+static void bench_restart(const char* state_path, int node_count, int value_count, int trials) {
+    BenchNet* net = (BenchNet*)calloc(1, sizeof(BenchNet));
+    DhtId* keys = (DhtId*)calloc(trials, sizeof(DhtId));
+    char boot_path[256 + 8];
+    snprintf(boot_path, sizeof(boot_path), "%s.boot", state_path);
+    if (!net || !keys || node_count + 2 > BENCH_NET_MAX_NODES) {
+        free(net);
+        free(keys);
+        return;
+    }
+    unlink(state_path);
+
+    net->base_id = 3000;
+    net->running = true;
+    pthread_mutex_init(&net->mutex, NULL);
+    pthread_cond_init(&net->cond, NULL);
+    pthread_t pump;
+    pthread_create(&pump, NULL, bench_net_pump, net);
+
+    quiet_begin();
+    for (int i = 0; i < node_count; i++) {
+        bench_net_join(net, i, 16, true);
+    }
+
+    // 状態を保存するノードを加え、半分の値を公開する（複製として受け取った値も永続化される）
+    int seed_idx = node_count;
+    Node* seed = bench_net_join(net, seed_idx, 16, true);
+    bool enabled = seed && dht_enable_persistence(seed, state_path) >= 0;
+    for (int i = 0; i < value_count && enabled; i++) {
+        char key_str[64];
+        char value[128];
+        snprintf(key_str, sizeof(key_str), "bench-value-%d", i);
+        int len = snprintf(value, sizeof(value), "value %d stored before restart", i);
+        DhtId key = dht_generate_id_from_string(key_str);
+        dht_store_value(i % 2 ? seed : net->nodes[i % node_count], &key, value, len);
+    }
+    bench_net_settle(net, 30);
+
+    // 計測には保存するノードが持っていない値を使う（どちらもネットワークから取得する）
+    int key_count = 0;
+    for (int i = 0; i < value_count && enabled && key_count < trials; i++) {
+        char key_str[64];
+        char value[128];
+        size_t value_len = sizeof(value);
+        snprintf(key_str, sizeof(key_str), "bench-value-%d", i);
+        keys[key_count] = dht_generate_id_from_string(key_str);
+        key_count += dht_find_value(seed, &keys[key_count], value, &value_len) < 0;
+    }
+    if (seed) {
+        bench_net_detach(net, seed_idx);
+        seed->is_running = false;
+        bench_destroy_node(seed);
+    }
+
+    // 止まっている間にノードの1/4が去る
+    for (int i = 0; i < node_count; i += 4) {
+        bench_net_kill(net, i);
+    }
+    quiet_end();
+
+    // 試行ごとに別の値を取得し、コールドスタートは止まる前のネットワークのノードを
+    // 順に指定して始める（t * 5なので4回に1回は去ったノードになる）
+    BenchBoot cold;
+    BenchBoot warm;
+    memset(&cold, 0, sizeof(cold));
+    memset(&warm, 0, sizeof(warm));
+    for (int t = 0; t < key_count; t++) {
+        Node* known = net->nodes[(t * 5) % node_count];
+        DhtNodeInfo bootstrap;
+        memset(&bootstrap, 0, sizeof(bootstrap));
+        bootstrap.id = ((DhtData*)known->dht_data)->routing_table->self_id;
+        strncpy(bootstrap.ip, "127.0.0.1", MAX_IP_STR_LEN - 1);
+        bootstrap.port = ntohs(known->addr.sin_port);
+        bench_restart_boot(net, node_count + 1, NULL, &bootstrap, &keys[t], &cold);
+        if (bench_copy_file(state_path, boot_path)) {
+            bench_restart_boot(net, node_count + 1, boot_path, NULL, &keys[t], &warm);
+        }
+    }
+
+    printf("restart (%d nodes, %d values, 25%% of the nodes left while down, %d boots):\n", node_count,
+           value_count, key_count);
+    if (cold.trials > 0 && warm.trials > 0) {
+        printf("  cold start  time to first lookup avg %7.3f ms max %7.3f ms, found avg %7.3f ms  "
+               "(1 contact, %d/%d found, %5.1f packets)\n",
+               cold.total_ms / cold.trials, cold.max_ms, cold.found ? cold.found_ms / cold.found : 0, cold.found,
+               cold.trials, (double)cold.packets / cold.trials);
+        printf("  warm start  time to first lookup avg %7.3f ms max %7.3f ms, found avg %7.3f ms  "
+               "(%d contacts, %d values restored, %d/%d found, %5.1f packets)\n",
+               warm.total_ms / warm.trials, warm.max_ms, warm.found ? warm.found_ms / warm.found : 0,
+               warm.restored / warm.trials, warm.values / warm.trials, warm.found, warm.trials,
+               (double)warm.packets / warm.trials);
+    } else {
+        printf("  failed to set up the saved state\n");
+    }
+
+    quiet_begin();
+    bench_net_stop(net, pump);
+    quiet_end();
+    pthread_cond_destroy(&net->cond);
+    pthread_mutex_destroy(&net->mutex);
+    free(net);
+    free(keys);
+    unlink(state_path);
+    unlink(boot_path);
+}
+
+// チャーン時の値の可用性
+//
+// node_count個のノードでkey_count個の値を公開し、ノードの1/4を停止した後と、
+// 同数の新しいノードが加わってからさらに1/4を停止した後に、生きているノードから
+// 全てのキーを読む。replicationがfalseなら値は公開したノードにしか置かれない。
+static void bench_churn(int node_count, int key_count, bool replication) {
+    BenchNet* net = (BenchNet*)calloc(1, sizeof(BenchNet));
+    DhtId* keys = (DhtId*)malloc(sizeof(DhtId) * key_count);
+    if (!net || !keys || node_count * 2 > BENCH_NET_MAX_NODES) {
+        free(net);
+        free(keys);
+        return;
+    }
+
+    net->base_id = 1000;
+    net->running = true;
+    pthread_mutex_init(&net->mutex, NULL);
+    pthread_cond_init(&net->cond, NULL);
+    pthread_t pump;
+    pthread_create(&pump, NULL, bench_net_pump, net);
+
+    quiet_begin();
+    for (int i = 0; i < node_count; i++) {
+        bench_net_join(net, i, 16, replication);
+    }
+
+    // 値の公開（ノードを順に使う）
+    for (int k = 0; k < key_count; k++) {
+        char key_str[32];
+        char value[64];
+        snprintf(key_str, sizeof(key_str), "churn-key-%d", k);
+        snprintf(value, sizeof(value), "churn-value-%d", k);
+        keys[k] = dht_generate_id_from_string(key_str);
+        dht_store_value(net->nodes[k % node_count], &keys[k], value, strlen(value));
+    }
+    bench_net_settle(net, 30);
+
+    // 1回目のチャーン：1/4を停止
+    int killed = 0;
+    for (int i = 0; i < node_count && killed < node_count / 4; i += 4, killed++) {
+        bench_net_kill(net, i);
+    }
+    double latency1;
+    double avail1 = bench_net_read_all(net, keys, key_count, &latency1);
+
+    // 新しいノードの参加（近傍に入ったノードへ値が引き継がれる）
+    for (int i = 0; i < node_count / 4; i++) {
+        bench_net_join(net, node_count + i, 16, replication);
+    }
+    bench_net_settle(net, 30);
+
+    // 2回目のチャーン：元のノードからさらに1/4を停止
+    killed = 0;
+    for (int i = 1; i < node_count && killed < node_count / 4; i += 4, killed++) {
+        bench_net_kill(net, i);
+    }
+    double latency2;
+    double avail2 = bench_net_read_all(net, keys, key_count, &latency2);
+    int dead_total;
+    int dead2 = bench_net_dead_contacts(net, &dead_total);
+
+    // 応答しなかったノードの生存確認が終わるのを待ってからもう一度読む
+    sleep(DHT_CONTACT_MAX_FAILS * DHT_RPC_TIMEOUT_MS / 1000 + 2);
+    double latency3;
+    double avail3 = bench_net_read_all(net, keys, key_count, &latency3);
+    int dead_total3;
+    int dead3 = bench_net_dead_contacts(net, &dead_total3);
+
+    uint64_t publish_bytes = 0;
+    uint64_t repair_bytes = 0;
+    uint64_t handoffs = 0;
+    double replicas = 0;
+    int publishers = 0;
+    for (int i = 0; i < BENCH_NET_MAX_NODES; i++) {
+        if (!net->nodes[i]) {
+            continue;
+        }
+        DhtReplicationStats stats;
+        dht_get_replication_stats(net->nodes[i], &stats);
+        publish_bytes += stats.publish_bytes;
+        repair_bytes += stats.repair_bytes;
+        handoffs += stats.handoffs;
+        if (stats.published_keys > 0) {
+            replicas += stats.avg_replicas;
+            publishers++;
+        }
+    }
+
+    bench_net_stop(net, pump);
+    quiet_end();
+
+    printf("churn (%d nodes, %d keys, replication %s):\n", node_count, key_count, replication ? "on" : "off");
+    printf("  after 25%% failed:             %5.1f%% readable, %.2f ms/get\n", avail1 * 100, latency1);
+    printf("  after join + 25%% more failed: %5.1f%% readable, %.2f ms/get  (%d of %d contacts dead)\n",
+           avail2 * 100, latency2, dead2, dead_total);
+    printf("  read again:                   %5.1f%% readable, %.2f ms/get  (%d of %d contacts dead)\n",
+           avail3 * 100, latency3, dead3, dead_total3);
+    if (replication) {
+        printf("  replicas/key %.1f, publish %llu bytes, repair %llu bytes, %llu handoffs\n",
+               publishers > 0 ? replicas / publishers : 0, (unsigned long long)publish_bytes,
+               (unsigned long long)repair_bytes, (unsigned long long)handoffs);
+    }
+
+    pthread_cond_destroy(&net->cond);
+    pthread_mutex_destroy(&net->mutex);
+    free(keys);
+    free(net);
+}
+
+// 人気のあるキーの読み取り
+//
+// node_count個のノードで1つのキーを公開し、ノードを順に使ってreads回読む。
+// 値を返したノードまでのホップ数と、値を持つk個のノードが受けたFIND_VALUEの
+// 偏りを、経路キャッシュの有無で比べる。
+static void bench_hot_key(int node_count, int reads, bool cache) {
+    BenchNet* net = (BenchNet*)calloc(1, sizeof(BenchNet));
+    if (!net || node_count > BENCH_NET_MAX_NODES) {
+        free(net);
+        return;
+    }
+
+    net->base_id = 2000;
+    net->running = true;
+    pthread_mutex_init(&net->mutex, NULL);
+    pthread_cond_init(&net->cond, NULL);
+    pthread_t pump;
+    pthread_create(&pump, NULL, bench_net_pump, net);
+
+    quiet_begin();
+    for (int i = 0; i < node_count; i++) {
+        Node* node = bench_net_join(net, i, 16, true);
+        if (node) {
+            dht_set_path_cache(node, cache, 0);
+        }
+    }
+
+    DhtId key = dht_generate_id_from_string("hot-key");
+    const char* value = "hot-value";
+    dht_store_value(net->nodes[0], &key, value, strlen(value));
+    bench_net_settle(net, 30);
+
+    int found = 0;
+    double start = now_sec();
+    for (int r = 0; r < reads; r++) {
+        uint8_t buf[MAX_BUFFER];
+        size_t buf_len = sizeof(buf);
+        found += dht_get_value(net->nodes[(r * 7 + 1) % node_count], &key, buf, &buf_len) == 0;
+    }
+    double elapsed = now_sec() - start;
+
+    DhtCacheStats total;
+    memset(&total, 0, sizeof(total));
+    uint64_t max_served = 0;
+    for (int i = 0; i < node_count; i++) {
+        DhtCacheStats stats;
+        dht_get_cache_stats(net->nodes[i], &stats);
+        total.value_lookups += stats.value_lookups;
+        total.lookup_queries += stats.lookup_queries;
+        total.lookup_hops += stats.lookup_hops;
+        total.cache_answered += stats.cache_answered;
+        total.local_cache_hits += stats.local_cache_hits;
+        total.served_primary += stats.served_primary;
+        total.served_cache += stats.served_cache;
+        total.cache_stores_sent += stats.cache_stores_sent;
+        if (stats.served_primary > max_served) {
+            max_served = stats.served_primary;
+        }
+    }
+
+    bench_net_stop(net, pump);
+    quiet_end();
+
+    double lookups = total.value_lookups > 0 ? (double)total.value_lookups : 1;
+    printf("hot key (%d nodes, %d reads, path cache %s): %d found, %.2f ms/get\n", node_count, reads,
+           cache ? "on" : "off", found, elapsed * 1000.0 / reads);
+    printf("  %llu network lookups: %.2f hops, %.2f queries each, %.1f%% answered by caches, %llu local hits\n",
+           (unsigned long long)total.value_lookups, total.lookup_hops / lookups, total.lookup_queries / lookups,
+           total.cache_answered * 100.0 / lookups, (unsigned long long)total.local_cache_hits);
+    printf("  FIND_VALUE served: %llu by replicas (max %llu at one node), %llu by caches (%llu CACHE_STOREs)\n",
+           (unsigned long long)total.served_primary, (unsigned long long)max_served,
+           (unsigned long long)total.served_cache, (unsigned long long)total.cache_stores_sent);
+
+    pthread_cond_destroy(&net->cond);
+    pthread_mutex_destroy(&net->mutex);
+    free(net);
+}
+
+// バッチ操作
+//
+// node_count個のノードでkey_count個の値を1つのノードから公開し、別のノードから
+// 全て読む。1件ずつのdht_store_value / dht_get_valueと、dht_batch_put / dht_batch_getを
+// 時間と配送したパケット数で比べる（公開は複製のキューが空になるまでを数える）。
+static void bench_batch(int node_count, int key_count, bool batch) {
+    BenchNet* net = (BenchNet*)calloc(1, sizeof(BenchNet));
+    DhtId* keys = (DhtId*)malloc(sizeof(DhtId) * key_count);
+    DhtBatchItem* items = (DhtBatchItem*)malloc(sizeof(DhtBatchItem) * key_count);
+    char (*values)[32] = malloc(sizeof(*values) * key_count);
+    DhtBatchResult* result = (DhtBatchResult*)malloc(sizeof(DhtBatchResult));
+    if (!net || !keys || !items || !values || !result || node_count > BENCH_NET_MAX_NODES) {
+        free(net);
+        free(keys);
+        free(items);
+        free(values);
+        free(result);
+        return;
+    }
+
+    net->base_id = 3000;
+    net->running = true;
+    pthread_mutex_init(&net->mutex, NULL);
+    pthread_cond_init(&net->cond, NULL);
+    pthread_t pump;
+    pthread_create(&pump, NULL, bench_net_pump, net);
+
+    quiet_begin();
+    for (int i = 0; i < node_count; i++) {
+        bench_net_join(net, i, 16, true);
+    }
+    bench_net_settle(net, 30);
+
+    for (int k = 0; k < key_count; k++) {
+        char key_str[32];
+        snprintf(key_str, sizeof(key_str), "batch-key-%d", k);
+        snprintf(values[k], sizeof(values[k]), "batch-value-%d", k);
+        keys[k] = dht_generate_id_from_string(key_str);
+        items[k].key = keys[k];
+        items[k].member = NULL;
+        items[k].value = values[k];
+        items[k].value_len = strlen(values[k]);
+        items[k].ttl = DHT_STORE_DEFAULT_TTL;
+    }
+
+    // 公開
+    Node* writer = net->nodes[0];
+    uint64_t delivered = net->delivered;
+    double start = now_sec();
+    DhtBatchStats put_stats;
+    memset(&put_stats, 0, sizeof(put_stats));
+    int replicas = 0;
+    if (batch) {
+        DhtBatch* put = dht_batch_put(writer, items, key_count);
+        while (dht_batch_next(put, result)) {
+            replicas += result->replicas;
+        }
+        dht_batch_get_stats(put, &put_stats);
+        dht_batch_free(put);
+    } else {
+        for (int k = 0; k < key_count; k++) {
+            dht_store_value(writer, &keys[k], values[k], strlen(values[k]));
+        }
+    }
+    double put_ms = (now_sec() - start) * 1000.0;
+    bench_net_settle(net, 60);
+    uint64_t put_packets = net->delivered - delivered;
+
+    // 読み取り
+    Node* reader = net->nodes[node_count / 2];
+    delivered = net->delivered;
+    start = now_sec();
+    int found = 0;
+    DhtBatchStats get_stats;
+    memset(&get_stats, 0, sizeof(get_stats));
+    if (batch) {
+        DhtBatch* get = dht_batch_get(reader, keys, key_count);
+        while (dht_batch_next(get, result)) {
+            found += result->status == 0 && result->value_len == strlen(values[result->index]) &&
+                     memcmp(result->value, values[result->index], result->value_len) == 0;
+        }
+        dht_batch_get_stats(get, &get_stats);
+        dht_batch_free(get);
+    } else {
+        for (int k = 0; k < key_count; k++) {
+            uint8_t buf[MAX_BUFFER];
+            size_t buf_len = sizeof(buf);
+            found += dht_get_value(reader, &keys[k], buf, &buf_len) == 0 && buf_len == strlen(values[k]) &&
+                     memcmp(buf, values[k], buf_len) == 0;
+        }
+    }
+    double get_ms = (now_sec() - start) * 1000.0;
+    uint64_t get_packets = net->delivered - delivered;
+
+    bench_net_stop(net, pump);
+    quiet_end();
+
+    printf("%s (%d nodes, %d keys):\n", batch ? "batch put/get" : "sequential put/get", node_count, key_count);
+    printf("  put: %8.1f ms, %6llu packets until replicated", put_ms, (unsigned long long)put_packets);
+    if (batch) {
+        printf("  (%d groups at %d bits, %d key lookups, %d STOREs, %d deferred)", put_stats.groups,
+               put_stats.prefix_bits, put_stats.key_lookups, replicas, put_stats.deferred);
+    }
+    printf("\n  get: %8.1f ms, %6llu packets, %d of %d found", get_ms, (unsigned long long)get_packets, found,
+           key_count);
+    if (batch) {
+        printf("  (%d groups, %d local, %d probes, %d missed, %d key lookups)", get_stats.groups, get_stats.local,
+               get_stats.probes, get_stats.probe_misses, get_stats.key_lookups);
+    }
+    printf("\n");
+
+    pthread_cond_destroy(&net->cond);
+    pthread_mutex_destroy(&net->mutex);
+    free(keys);
+    free(items);
+    free(values);
+    free(result);
+    free(net);
+}
+
+// ---- TURNリレー ----
+
+// 最小限のTURNサーバー（AllocateとChannelBindとCreatePermissionに成功を返し、
+// Send IndicationとChannelDataのデータをリレー用のソケットから相手へ送る）と、
+// 受け取ったパケットを数える相手
+#define BENCH_RELAY_RCVBUF (8 * 1024 * 1024)
+#define BENCH_RELAY_DEFERRED 256         // 遅らせて返す応答の数
+
+typedef struct {
+    int server_fd;
+    int relay_fd;
+    int peer_fd;
+    struct sockaddr_in server_addr;
+    struct sockaddr_in relay_addr;
+    struct sockaddr_in peer_addr;
+    uint16_t channel_numbers[TURN_MAX_CHANNELS];
+    struct sockaddr_in channel_peers[TURN_MAX_CHANNELS];
+    int channel_count;
+    int permission_delay_ms;     // CreatePermissionの応答を遅らせる時間
+    uint8_t deferred[BENCH_RELAY_DEFERRED][20];
+    struct sockaddr_in deferred_to[BENCH_RELAY_DEFERRED];
+    double deferred_due[BENCH_RELAY_DEFERRED];
+    int deferred_count;
+    int permission_requests;     // 受け取ったCreatePermissionの数
+    int permission_peers;        // それに載っていた相手の数
+    volatile bool running;
+    uint64_t received;
+    uint64_t received_bytes;
+    double last_received;
+    Node* ice_node;              // 相手のICE（候補の更新を受け取る。NULLなら数えるだけ）
+} BenchRelay;
+
+static int bench_udp_socket(struct sockaddr_in* addr) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("Failed to create bench socket");
+        return -1;
+    }
+    int rcvbuf = BENCH_RELAY_RCVBUF;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct timeval tv = { 0, 100000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(*addr);
+    if (bind(fd, (struct sockaddr*)addr, len) < 0 || getsockname(fd, (struct sockaddr*)addr, &len) < 0) {
+        perror("Failed to bind bench socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// XOR-PEER-ADDRESS・XOR-RELAYED-ADDRESSの値（8バイト）
+static void bench_xor_address(const uint8_t* p, struct sockaddr_in* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(((p[2] << 8) | p[3]) ^ (0x2112A442 >> 16));
+    uint32_t ip;
+    memcpy(&ip, p + 4, 4);
+    addr->sin_addr.s_addr = ip ^ htonl(0x2112A442);
+}
+
+static void bench_relay_reply(BenchRelay* relay, const uint8_t* request, uint16_t type,
+                              const struct sockaddr_in* to, bool relayed_address) {
+    uint8_t reply[32];
+    int len = 20;
+    memcpy(reply, request, 20);
+    reply[0] = type >> 8;
+    reply[1] = type & 0xFF;
+    if (relayed_address) {
+        reply[len++] = TURN_ATTR_XOR_RELAYED_ADDRESS >> 8;
+        reply[len++] = TURN_ATTR_XOR_RELAYED_ADDRESS & 0xFF;
+        reply[len++] = 0;
+        reply[len++] = 8;
+        reply[len++] = 0;
+        reply[len++] = 1;
+        uint16_t port = htons(ntohs(relay->relay_addr.sin_port) ^ (0x2112A442 >> 16));
+        memcpy(reply + len, &port, 2);
+        uint32_t ip = relay->relay_addr.sin_addr.s_addr ^ htonl(0x2112A442);
+        memcpy(reply + len + 2, &ip, 4);
+        len += 6;
+    }
+    reply[2] = (len - 20) >> 8;
+    reply[3] = (len - 20) & 0xFF;
+    sendto(relay->server_fd, reply, len, 0, (const struct sockaddr*)to, sizeof(*to));
+}
+
+static void* bench_relay_server(void* arg) {
+    BenchRelay* relay = (BenchRelay*)arg;
+    uint8_t buf[TURN_MAX_BUFFER];
+    while (relay->running) {
+        // 期限の来た遅延応答を返す
+        double now = now_sec();
+        for (int i = 0; i < relay->deferred_count;) {
+            if (now >= relay->deferred_due[i]) {
+                sendto(relay->server_fd, relay->deferred[i], 20, 0, (const struct sockaddr*)&relay->deferred_to[i],
+                       sizeof(struct sockaddr_in));
+                relay->deferred_count--;
+                memcpy(relay->deferred[i], relay->deferred[relay->deferred_count], 20);
+                relay->deferred_to[i] = relay->deferred_to[relay->deferred_count];
+                relay->deferred_due[i] = relay->deferred_due[relay->deferred_count];
+            } else {
+                i++;
+            }
+        }
+
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int len = (int)recvfrom(relay->server_fd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &from_len);
+        if (len < 4) {
+            continue;
+        }
+
+        // ChannelData
+        if ((buf[0] & 0xC0) == 0x40) {
+            uint16_t number = (buf[0] << 8) | buf[1];
+            int data_len = (buf[2] << 8) | buf[3];
+            for (int i = 0; i < relay->channel_count && data_len <= len - 4; i++) {
+                if (relay->channel_numbers[i] == number) {
+                    sendto(relay->relay_fd, buf + 4, data_len, 0, (const struct sockaddr*)&relay->channel_peers[i],
+                           sizeof(struct sockaddr_in));
+                    break;
+                }
+            }
+            continue;
+        }
+        if (len < 20) {
+            continue;
+        }
+
+        // STUNメッセージ（属性を順に読む）
+        uint16_t type = (buf[0] << 8) | buf[1];
+        int end = 20 + ((buf[2] << 8) | buf[3]);
+        struct sockaddr_in peer;
+        bool has_peer = false;
+        const uint8_t* data = NULL;
+        int data_len = 0;
+        int number = -1;
+        int peer_count = 0;
+        for (int offset = 20; offset + 4 <= end && end <= len;) {
+            uint16_t attr_type = (buf[offset] << 8) | buf[offset + 1];
+            int attr_len = (buf[offset + 2] << 8) | buf[offset + 3];
+            const uint8_t* value = buf + offset + 4;
+            if (attr_type == TURN_ATTR_XOR_PEER_ADDRESS && attr_len >= 8) {
+                bench_xor_address(value, &peer);
+                has_peer = true;
+                peer_count++;
+            } else if (attr_type == TURN_ATTR_DATA) {
+                data = value;
+                data_len = attr_len;
+            } else if (attr_type == TURN_ATTR_CHANNEL_NUMBER && attr_len >= 2) {
+                number = (value[0] << 8) | value[1];
+            }
+            offset += 4 + ((attr_len + 3) & ~3);
+        }
+
+        if (type == TURN_BINDING_REQUEST) {
+            bench_relay_reply(relay, buf, TURN_BINDING_RESPONSE, &from, false);
+        } else if (type == TURN_ALLOCATION_REQUEST) {
+            bench_relay_reply(relay, buf, TURN_ALLOCATION_RESPONSE, &from, true);
+        } else if (type == TURN_REFRESH_REQUEST) {
+            bench_relay_reply(relay, buf, TURN_REFRESH_RESPONSE, &from, false);
+        } else if (type == TURN_CHANNEL_BIND_REQUEST && has_peer && number >= 0) {
+            if (relay->channel_count < TURN_MAX_CHANNELS) {
+                relay->channel_numbers[relay->channel_count] = (uint16_t)number;
+                relay->channel_peers[relay->channel_count++] = peer;
+            }
+            bench_relay_reply(relay, buf, TURN_CHANNEL_BIND_RESPONSE, &from, false);
+        } else if (type == TURN_CREATE_PERMISSION_REQUEST && relay->permission_delay_ms == 0) {
+            relay->permission_requests++;
+            relay->permission_peers += peer_count;
+            bench_relay_reply(relay, buf, TURN_CREATE_PERMISSION_RESPONSE, &from, false);
+        } else if (type == TURN_CREATE_PERMISSION_REQUEST && relay->deferred_count < BENCH_RELAY_DEFERRED) {
+            relay->permission_requests++;
+            relay->permission_peers += peer_count;
+            uint8_t* reply = relay->deferred[relay->deferred_count];
+            memcpy(reply, buf, 20);
+            reply[0] = TURN_CREATE_PERMISSION_RESPONSE >> 8;
+            reply[1] = TURN_CREATE_PERMISSION_RESPONSE & 0xFF;
+            reply[2] = reply[3] = 0;
+            relay->deferred_to[relay->deferred_count] = from;
+            relay->deferred_due[relay->deferred_count++] = now_sec() + relay->permission_delay_ms / 1000.0;
+        } else if (type == TURN_SEND_INDICATION && has_peer && data) {
+            sendto(relay->relay_fd, data, data_len, 0, (const struct sockaddr*)&peer, sizeof(peer));
+        }
+    }
+    return NULL;
+}
+
+static void* bench_relay_peer(void* arg) {
+    BenchRelay* relay = (BenchRelay*)arg;
+    uint8_t buf[TURN_MAX_BUFFER];
+    while (relay->running) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int len = (int)recvfrom(relay->peer_fd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &from_len);
+        if (len > 0 && relay->ice_node && ice_handle_packet(relay->ice_node, buf, len, &from)) {
+            continue;
+        }
+        if (len > 0) {
+            relay->received++;
+            relay->received_bytes += len;
+            relay->last_received = now_sec();
+        }
+    }
+    return NULL;
+}
+
+// ベンチマーク用のサーバーと相手を起動し、クライアントのアロケーションまで済ませる
+static bool bench_relay_open(BenchRelay* relay, Node* node, pthread_t* threads) {
+    relay->server_fd = bench_udp_socket(&relay->server_addr);
+    relay->relay_fd = bench_udp_socket(&relay->relay_addr);
+    relay->peer_fd = bench_udp_socket(&relay->peer_addr);
+    node->id = 1;
+    node->is_running = true;
+
+    // 遅延応答を返すときはサーバーの受信を細かく区切る
+    if (relay->permission_delay_ms > 0 && relay->server_fd >= 0) {
+        struct timeval tv = { 0, 1000 };
+        setsockopt(relay->server_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    relay->running = true;
+    pthread_create(&threads[0], NULL, bench_relay_server, relay);
+    pthread_create(&threads[1], NULL, bench_relay_peer, relay);
+
+    quiet_begin();
+    bool ready = relay->server_fd >= 0 && relay->relay_fd >= 0 && relay->peer_fd >= 0 &&
+                 turn_init(node, "127.0.0.1", ntohs(relay->server_addr.sin_port), "bench", "bench") == 0 &&
+                 turn_allocate(node) == 0;
+    quiet_end();
+    return ready;
+}
+
+static void bench_relay_close(BenchRelay* relay, Node* node, pthread_t* threads) {
+    quiet_begin();
+    turn_cleanup(node);
+    quiet_end();
+    relay->running = false;
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    close(relay->server_fd);
+    close(relay->relay_fd);
+    close(relay->peer_fd);
+}
+
+// TURNサーバー経由で相手へpackets個のpayloadバイトのデータを送る
+//
+// チャネルを使わなければ全てSend Indication、使えば先にバインドしてChannelDataで送る。
+// クライアントの送信にかかる時間と、相手に届いたデータのスループットを測る。
+static void bench_turn_relay(int packets, int payload, bool channels) {
+    BenchRelay* relay = (BenchRelay*)calloc(1, sizeof(BenchRelay));
+    Node* node = (Node*)calloc(1, sizeof(Node));
+    uint8_t* data = (uint8_t*)calloc(1, payload);
+    if (!relay || !node || !data) {
+        free(relay);
+        free(node);
+        free(data);
+        return;
+    }
+    pthread_t threads[2];
+    bool ready = bench_relay_open(relay, node, threads);
+
+    char peer_ip[MAX_IP_STR_LEN];
+    inet_ntop(AF_INET, &relay->peer_addr.sin_addr, peer_ip, sizeof(peer_ip));
+    int peer_port = ntohs(relay->peer_addr.sin_port);
+
+    quiet_begin();
+    if (ready) {
+        turn_set_channel_binding(node, channels);
+        ready = !channels || turn_bind_channel(node, peer_ip, peer_port) == 0;
+    }
+
+    double start = now_sec();
+    double send_sec = 0;
+    int sent = 0;
+    if (ready) {
+        for (int i = 0; i < packets; i++) {
+            memcpy(data, &i, sizeof(i));
+            sent += turn_send_data(node, peer_ip, peer_port, data, payload) == 0;
+        }
+        send_sec = now_sec() - start;
+
+        // 中継が終わるまで待つ
+        uint64_t last = 0;
+        do {
+            last = relay->received;
+            usleep(200000);
+        } while (relay->received != last);
+    }
+    quiet_end();
+
+    if (ready) {
+        double relay_sec = relay->received > 0 ? relay->last_received - start : 1;
+        printf("  turn %-15s %7d x %4d B: send %6.0f ns/packet, relayed %6.1f%% at %8.0f packets/s "
+               "%7.1f MB/s, %d bytes/packet to server\n",
+               channels ? "channel data" : "send indication", packets, payload, send_sec * 1e9 / packets,
+               relay->received * 100.0 / packets, relay->received / relay_sec,
+               relay->received_bytes / relay_sec / 1e6,
+               channels ? TURN_CHANNEL_HEADER + payload : 20 + 12 + 4 + ((payload + 3) & ~3));
+    } else {
+        printf("  turn %-15s failed to set up the relay\n", channels ? "channel data" : "send indication");
+    }
+
+    bench_relay_close(relay, node, threads);
+    free(relay);
+    free(node);
+    free(data);
+}
+
+// 要求の間もデータを送り続ける相手
+typedef struct {
+    Node* node;
+    char peer_ip[MAX_IP_STR_LEN];
+    int peer_port;
+    volatile bool running;
+    volatile bool paused;        // 止めている間は送らない（届いた数を数え終えるため）
+    uint64_t sent;
+    uint64_t failed;             // turn_send_dataが失敗した数
+    double max_gap;              // 送信の間隔の最大（秒）
+} BenchSender;
+
+static void* bench_sender_thread(void* arg) {
+    BenchSender* sender = (BenchSender*)arg;
+    uint8_t data[100] = { 0 };
+    double last = now_sec();
+    while (sender->running) {
+        if (sender->paused) {
+            usleep(100);
+            last = now_sec();
+            continue;
+        }
+        if (turn_send_data(sender->node, sender->peer_ip, sender->peer_port, data, sizeof(data)) < 0) {
+            sender->failed++;
+        }
+        double now = now_sec();
+        if (now - last > sender->max_gap) {
+            sender->max_gap = now - last;
+        }
+        last = now;
+        sender->sent++;
+        usleep(100);
+    }
+    return NULL;
+}
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int remaining;
+    int failed;
+} BenchRequests;
+
+static void bench_request_done(Node* node, int result, void* arg) {
+    (void)node;
+    BenchRequests* requests = (BenchRequests*)arg;
+    pthread_mutex_lock(&requests->mutex);
+    requests->failed += result != 0;
+    if (--requests->remaining == 0) {
+        pthread_cond_signal(&requests->cond);
+    }
+    pthread_mutex_unlock(&requests->mutex);
+}
+
+// サーバーがdelay_msかけて応答するCreatePermissionをrequests個出す
+//
+// 1つずつ完了を待つ場合と、全て同時に出してコールバックで待つ場合の所要時間と、
+// その間Send Indicationでデータを送り続けるスレッドの送信が止まった最長の時間を測る。
+// 送信も新しい相手へのCreatePermissionを出すので、requestsがTURN_MAX_TRANSACTIONS以上なら
+// 要求の表に入りきらない分は、表が空いたときにまとめて出し直される。
+static void bench_turn_requests(int requests, int delay_ms) {
+    for (int pipelined = 0; pipelined <= 1; pipelined++) {
+        BenchRelay* relay = (BenchRelay*)calloc(1, sizeof(BenchRelay));
+        Node* node = (Node*)calloc(1, sizeof(Node));
+        if (!relay || !node) {
+            free(relay);
+            free(node);
+            return;
+        }
+        relay->permission_delay_ms = delay_ms;
+        pthread_t threads[2];
+        if (!bench_relay_open(relay, node, threads)) {
+            printf("  turn requests failed to set up the relay\n");
+            bench_relay_close(relay, node, threads);
+            free(relay);
+            free(node);
+            return;
+        }
+
+        quiet_begin();
+        turn_set_channel_binding(node, false);
+        BenchSender sender;
+        memset(&sender, 0, sizeof(sender));
+        sender.node = node;
+        inet_ntop(AF_INET, &relay->peer_addr.sin_addr, sender.peer_ip, sizeof(sender.peer_ip));
+        sender.peer_port = ntohs(relay->peer_addr.sin_port);
+        sender.running = true;
+        pthread_t sender_thread;
+        pthread_create(&sender_thread, NULL, bench_sender_thread, &sender);
+        usleep(50000);
+
+        double start = now_sec();
+        int failed = 0;
+        if (pipelined) {
+            BenchRequests pending;
+            pthread_mutex_init(&pending.mutex, NULL);
+            pthread_cond_init(&pending.cond, NULL);
+            pending.remaining = requests;
+            pending.failed = 0;
+            for (int i = 0; i < requests; i++) {
+                char peer_ip[MAX_IP_STR_LEN];
+                snprintf(peer_ip, sizeof(peer_ip), "10.0.%d.%d", i / 250, i % 250 + 1);
+                if (turn_create_permission_async(node, peer_ip, bench_request_done, &pending) < 0) {
+                    bench_request_done(node, -1, &pending);
+                }
+            }
+            pthread_mutex_lock(&pending.mutex);
+            while (pending.remaining > 0) {
+                pthread_cond_wait(&pending.cond, &pending.mutex);
+            }
+            failed = pending.failed;
+            pthread_mutex_unlock(&pending.mutex);
+            pthread_mutex_destroy(&pending.mutex);
+            pthread_cond_destroy(&pending.cond);
+        } else {
+            for (int i = 0; i < requests; i++) {
+                char peer_ip[MAX_IP_STR_LEN];
+                snprintf(peer_ip, sizeof(peer_ip), "10.0.%d.%d", i / 250, i % 250 + 1);
+                failed += turn_create_permission(node, peer_ip) != 0;
+            }
+        }
+        double elapsed = now_sec() - start;
+
+        sender.running = false;
+        pthread_join(sender_thread, NULL);
+        quiet_end();
+
+        printf("  turn %-10s %3d permissions (%d ms each): %7.1f ms, %d failed, "
+               "longest send stall %6.2f ms over %llu sends\n",
+               pipelined ? "pipelined" : "sequential", requests, delay_ms, elapsed * 1000, failed,
+               sender.max_gap * 1000, (unsigned long long)sender.sent);
+
+        bench_relay_close(relay, node, threads);
+        free(relay);
+        free(node);
+    }
+}
+
+// peers個の新しい相手へ1つずつデータを送り、CreatePermissionの要求数と時間を測る
+//
+// 送信の前に毎回turn_create_permissionで完了を待つ場合と、送信に任せる（パーミッションの
+// 表を引き、ない相手はその場で要求する）場合を比べる。その後、全てのパーミッションの
+// 期限を更新の時期まで進め、リフレッシュスレッドがまとめて更新する要求の数を数える。
+static void bench_turn_permissions(int peers, int delay_ms) {
+    for (int explicit_permission = 1; explicit_permission >= 0; explicit_permission--) {
+        BenchRelay* relay = (BenchRelay*)calloc(1, sizeof(BenchRelay));
+        Node* node = (Node*)calloc(1, sizeof(Node));
+        if (!relay || !node) {
+            free(relay);
+            free(node);
+            return;
+        }
+        relay->permission_delay_ms = delay_ms;
+        pthread_t threads[2];
+        if (!bench_relay_open(relay, node, threads)) {
+            printf("  turn permissions failed to set up the relay\n");
+            bench_relay_close(relay, node, threads);
+            free(relay);
+            free(node);
+            return;
+        }
+
+        quiet_begin();
+        turn_set_channel_binding(node, false);
+        uint8_t data[100] = { 0 };
+        double start = now_sec();
+        for (int i = 0; i < peers; i++) {
+            char peer_ip[MAX_IP_STR_LEN];
+            snprintf(peer_ip, sizeof(peer_ip), "127.0.%d.%d", 1 + i / 250, i % 250 + 1);
+            if (explicit_permission) {
+                turn_create_permission(node, peer_ip);
+            }
+            turn_send_data(node, peer_ip, 9, data, sizeof(data));
+        }
+        double send_sec = now_sec() - start;
+
+        // 全てのパーミッションができるまで待つ
+        int created = 0;
+        for (int wait = 0; wait < 200 && created < peers; wait++) {
+            created = 0;
+            for (int i = 0; i < peers; i++) {
+                char peer_ip[MAX_IP_STR_LEN];
+                snprintf(peer_ip, sizeof(peer_ip), "127.0.%d.%d", 1 + i / 250, i % 250 + 1);
+                created += turn_has_permission(node, peer_ip);
+            }
+            if (created < peers) {
+                usleep(5000);
+            }
+        }
+        double ready_sec = now_sec() - start;
+        int requests = relay->permission_requests;
+        int requested_peers = relay->permission_peers;
+
+        // 期限を更新の時期まで進め、次のリフレッシュスレッドの周期で更新させる
+        TurnClient* client = &((TurnData*)node->turn_data)->clients[0];
+        pthread_mutex_lock(&client->channel_mutex);
+        for (int i = 0; i < client->permission_count; i++) {
+            client->permissions[i].expiry = time(NULL) + TURN_PERMISSION_REFRESH_MARGIN - 1;
+        }
+        pthread_mutex_unlock(&client->channel_mutex);
+        usleep(1500000 + delay_ms * 1000);
+        quiet_end();
+
+        printf("  turn %-13s %3d new peers: sends done %7.2f ms, all permitted %7.2f ms (%d/%d), "
+               "%d requests; refresh %d requests for %d peers\n",
+               explicit_permission ? "explicit" : "on first send", peers, send_sec * 1000, ready_sec * 1000,
+               created, peers, requests, relay->permission_requests - requests,
+               relay->permission_peers - requested_peers);
+
+        bench_relay_close(relay, node, threads);
+        free(relay);
+        free(node);
+    }
+}
+
+// 受け取ったデータを送り元へ返す相手
+typedef struct {
+    int fd;
+    struct sockaddr_in addr;
+    volatile bool running;
+} BenchEcho;
+
+static void* bench_echo_thread(void* arg) {
+    BenchEcho* echo = (BenchEcho*)arg;
+    uint8_t buf[TURN_MAX_BUFFER];
+    while (echo->running) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int len = (int)recvfrom(echo->fd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &from_len);
+        if (len > 0) {
+            sendto(echo->fd, buf, len, 0, (struct sockaddr*)&from, from_len);
+        }
+    }
+    return NULL;
+}
+
+// 中継されて戻ってきたデータを数える
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int received;
+} BenchPong;
+
+static void bench_pong(Node* node, const char* from_ip, int from_port, const void* data, int data_len,
+                       void* arg) {
+    (void)node;
+    (void)from_ip;
+    (void)from_port;
+    (void)data;
+    (void)data_len;
+    BenchPong* pong = (BenchPong*)arg;
+    pthread_mutex_lock(&pong->mutex);
+    pong->received++;
+    pthread_cond_signal(&pong->cond);
+    pthread_mutex_unlock(&pong->mutex);
+}
+
+static int bench_compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// 往復時間を並べ替えて中央値と99パーセンタイルを返す
+static void bench_percentiles(double* rtts, int count, double* p50, double* p99) {
+    qsort(rtts, count, sizeof(double), bench_compare_double);
+    *p50 = count > 0 ? rtts[count / 2] : 0;
+    *p99 = count > 0 ? rtts[count * 99 / 100] : 0;
+}
+
+// 組み込みのTURNサーバー（turn_server.c）をループバックで使い、turn_*クライアントから
+// 相手へpackets個のデータを中継するスループットと、往復時間の増分を測る
+//
+// 往復時間はクライアント → サーバー → 相手 → サーバー → クライアントのpings回の
+// ピンポンで、同じ相手と直接UDPでやり取りした往復時間と比べる。
+static void bench_turn_server(int packets, int payload, int pings) {
+    Node* server_node = (Node*)calloc(1, sizeof(Node));
+    Node* node = (Node*)calloc(1, sizeof(Node));
+    BenchRelay* peer = (BenchRelay*)calloc(1, sizeof(BenchRelay));
+    uint8_t* data = (uint8_t*)calloc(1, payload);
+    double* rtts = (double*)calloc(pings, sizeof(double));
+    if (!server_node || !node || !peer || !data || !rtts) {
+        free(server_node);
+        free(node);
+        free(peer);
+        free(data);
+        free(rtts);
+        return;
+    }
+    strcpy(server_node->ip, "127.0.0.1");
+    node->id = 1;
+    node->is_running = true;
+
+    quiet_begin();
+    bool ready = turn_server_start(server_node, 0, "127.0.0.1", "bench", "bench") == 0;
+    if (ready) {
+        turn_server_set_rate_limit(server_node, 0);
+        ready = turn_init(node, "127.0.0.1", turn_server_get_port(server_node), "bench", "bench") == 0 &&
+                turn_allocate(node) == 0;
+    }
+    quiet_end();
+    if (!ready) {
+        printf("  turn server failed to start the relay\n");
+        quiet_begin();
+        turn_cleanup(node);
+        turn_server_stop(server_node);
+        quiet_end();
+        free(server_node);
+        free(node);
+        free(peer);
+        free(data);
+        free(rtts);
+        return;
+    }
+
+    // スループット（Send IndicationとChannelData）
+    peer->peer_fd = bench_udp_socket(&peer->peer_addr);
+    peer->running = true;
+    pthread_t peer_thread;
+    pthread_create(&peer_thread, NULL, bench_relay_peer, peer);
+    char peer_ip[MAX_IP_STR_LEN];
+    inet_ntop(AF_INET, &peer->peer_addr.sin_addr, peer_ip, sizeof(peer_ip));
+    int peer_port = ntohs(peer->peer_addr.sin_port);
+
+    for (int channels = 0; channels <= 1; channels++) {
+        quiet_begin();
+        turn_set_channel_binding(node, channels);
+        bool bound = channels ? turn_bind_channel(node, peer_ip, peer_port) == 0
+                              : turn_create_permission(node, peer_ip) == 0;
+        quiet_end();
+        if (!bound) {
+            printf("  turn server %-15s failed to set up the peer\n", channels ? "channel data" : "send indication");
+            continue;
+        }
+
+        peer->received = 0;
+        peer->received_bytes = 0;
+        double start = now_sec();
+        int sent = 0;
+        for (int i = 0; i < packets; i++) {
+            memcpy(data, &i, sizeof(i));
+            sent += turn_send_data(node, peer_ip, peer_port, data, payload) == 0;
+        }
+        uint64_t last = 0;
+        do {
+            last = peer->received;
+            usleep(200000);
+        } while (peer->received != last);
+
+        double relay_sec = peer->received > 0 ? peer->last_received - start : 1;
+        printf("  turn server %-15s %7d x %4d B: relayed %6.1f%% at %8.0f packets/s %7.1f MB/s\n",
+               channels ? "channel data" : "send indication", packets, payload, peer->received * 100.0 / packets,
+               peer->received / relay_sec, peer->received_bytes / relay_sec / 1e6);
+    }
+    peer->running = false;
+    pthread_join(peer_thread, NULL);
+    close(peer->peer_fd);
+
+    // 往復時間（直接UDPと、チャネル経由の中継）
+    BenchEcho echo;
+    echo.fd = bench_udp_socket(&echo.addr);
+    echo.running = true;
+    pthread_t echo_thread;
+    pthread_create(&echo_thread, NULL, bench_echo_thread, &echo);
+    char echo_ip[MAX_IP_STR_LEN];
+    inet_ntop(AF_INET, &echo.addr.sin_addr, echo_ip, sizeof(echo_ip));
+    int echo_port = ntohs(echo.addr.sin_port);
+
+    struct sockaddr_in direct_addr;
+    int direct_fd = bench_udp_socket(&direct_addr);
+    int direct_count = 0;
+    for (int i = 0; i < pings && direct_fd >= 0; i++) {
+        double start = now_sec();
+        sendto(direct_fd, data, payload, 0, (struct sockaddr*)&echo.addr, sizeof(echo.addr));
+        if (recv(direct_fd, data, payload, 0) > 0) {
+            rtts[direct_count++] = (now_sec() - start) * 1e6;
+        }
+    }
+    double direct_p50, direct_p99;
+    bench_percentiles(rtts, direct_count, &direct_p50, &direct_p99);
+    if (direct_fd >= 0) {
+        close(direct_fd);
+    }
+
+    BenchPong pong;
+    pthread_mutex_init(&pong.mutex, NULL);
+    pthread_cond_init(&pong.cond, NULL);
+    pong.received = 0;
+    turn_set_data_handler(node, bench_pong, &pong);
+    quiet_begin();
+    bool bound = turn_bind_channel(node, echo_ip, echo_port) == 0;
+    quiet_end();
+    int relay_count = 0;
+    quiet_begin();
+    for (int i = 0; i < pings && bound; i++) {
+        double start = now_sec();
+        pthread_mutex_lock(&pong.mutex);
+        int expected = pong.received + 1;
+        pthread_mutex_unlock(&pong.mutex);
+        turn_send_data(node, echo_ip, echo_port, data, payload);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&pong.mutex);
+        while (pong.received < expected &&
+               pthread_cond_timedwait(&pong.cond, &pong.mutex, &deadline) == 0) {
+        }
+        bool answered = pong.received >= expected;
+        pthread_mutex_unlock(&pong.mutex);
+        if (answered) {
+            rtts[relay_count++] = (now_sec() - start) * 1e6;
+        }
+    }
+    quiet_end();
+    double relay_p50, relay_p99;
+    bench_percentiles(rtts, relay_count, &relay_p50, &relay_p99);
+
+    TurnServerStats stats;
+    turn_server_get_stats(server_node, &stats);
+    printf("  turn server round trip %4d B: direct p50 %6.1f us p99 %6.1f us (%d/%d), "
+           "relayed p50 %6.1f us p99 %6.1f us (%d/%d), added p50 %6.1f us; "
+           "%llu packets in %llu batches\n",
+           payload, direct_p50, direct_p99, direct_count, pings, relay_p50, relay_p99, relay_count, pings,
+           relay_p50 - direct_p50, (unsigned long long)stats.relayed_packets,
+           (unsigned long long)stats.batches);
+
+    quiet_begin();
+    turn_cleanup(node);
+    turn_server_stop(server_node);
+    quiet_end();
+    echo.running = false;
+    pthread_join(echo_thread, NULL);
+    close(echo.fd);
+    pthread_mutex_destroy(&pong.mutex);
+    pthread_cond_destroy(&pong.cond);
+    free(server_node);
+    free(node);
+    free(peer);
+    free(data);
+    free(rtts);
+}
+
+// クライアントとTURNサーバーの間に入り、クライアントからのパケットをdelay_ms遅らせる中継
+//
+// dropを立てると両方向とも黙って捨てる（応答しなくなったサーバー）。止めるとクライアント側の
+// ソケットを閉じるので、クライアントにはICMPのport unreachableが返る（落ちたサーバー）。
+#define BENCH_PROXY_QUEUE 1024
+
+typedef struct {
+    int client_fd;               // クライアントが送る先
+    int server_fd;               // サーバーへconnect済み
+    struct sockaddr_in addr;
+    struct sockaddr_in client;
+    bool has_client;
+    int delay_ms;
+    uint8_t (*queue)[TURN_MAX_BUFFER];
+    int queue_len[BENCH_PROXY_QUEUE];
+    double queue_due[BENCH_PROXY_QUEUE];
+    int queue_head;
+    int queue_count;
+    volatile bool drop;
+    volatile bool running;
+    pthread_t thread;
+} BenchProxy;
+
+static void* bench_proxy_thread(void* arg) {
+    BenchProxy* proxy = (BenchProxy*)arg;
+    uint8_t buf[TURN_MAX_BUFFER];
+    while (proxy->running) {
+        struct pollfd fds[2] = { { proxy->client_fd, POLLIN, 0 }, { proxy->server_fd, POLLIN, 0 } };
+        poll(fds, 2, 1);
+
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int len;
+        while ((len = (int)recvfrom(proxy->client_fd, buf, sizeof(buf), MSG_DONTWAIT,
+                                    (struct sockaddr*)&from, &from_len)) > 0) {
+            if (proxy->drop || proxy->queue_count == BENCH_PROXY_QUEUE) {
+                continue;
+            }
+            proxy->client = from;
+            proxy->has_client = true;
+            int slot = (proxy->queue_head + proxy->queue_count++) % BENCH_PROXY_QUEUE;
+            memcpy(proxy->queue[slot], buf, len);
+            proxy->queue_len[slot] = len;
+            proxy->queue_due[slot] = now_sec() + proxy->delay_ms / 1000.0;
+        }
+        while ((len = (int)recv(proxy->server_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            if (!proxy->drop && proxy->has_client) {
+                sendto(proxy->client_fd, buf, len, 0, (struct sockaddr*)&proxy->client, sizeof(proxy->client));
+            }
+        }
+
+        // 遅延は一定なので、キューの先頭から期限の来たものを送る
+        double now = now_sec();
+        while (proxy->queue_count > 0 && proxy->queue_due[proxy->queue_head] <= now) {
+            if (!proxy->drop) {
+                send(proxy->server_fd, proxy->queue[proxy->queue_head], proxy->queue_len[proxy->queue_head], 0);
+            }
+            proxy->queue_head = (proxy->queue_head + 1) % BENCH_PROXY_QUEUE;
+            proxy->queue_count--;
+        }
+    }
+    return NULL;
+}
+
+static bool bench_proxy_start(BenchProxy* proxy, int server_port, int delay_ms) {
+    memset(proxy, 0, sizeof(*proxy));
+    proxy->queue = calloc(BENCH_PROXY_QUEUE, TURN_MAX_BUFFER);
+    proxy->client_fd = bench_udp_socket(&proxy->addr);
+    struct sockaddr_in local;
+    proxy->server_fd = bench_udp_socket(&local);
+    proxy->delay_ms = delay_ms;
+    if (!proxy->queue || proxy->client_fd < 0 || proxy->server_fd < 0) {
+        return false;
+    }
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.sin_port = htons(server_port);
+    if (connect(proxy->server_fd, (struct sockaddr*)&server, sizeof(server)) < 0) {
+        return false;
+    }
+    proxy->running = true;
+    pthread_create(&proxy->thread, NULL, bench_proxy_thread, proxy);
+    return true;
+}
+
+static void bench_proxy_stop(BenchProxy* proxy) {
+    if (proxy->running) {
+        proxy->running = false;
+        pthread_join(proxy->thread, NULL);
+    }
+    if (proxy->client_fd >= 0) {
+        close(proxy->client_fd);
+        proxy->client_fd = -1;
+    }
+    if (proxy->server_fd >= 0) {
+        close(proxy->server_fd);
+        proxy->server_fd = -1;
+    }
+    free(proxy->queue);
+    proxy->queue = NULL;
+}
+
+// 相手から中継を通してクライアントへ送り続ける（宛先は相手のICEのリモート候補。
+// 候補の更新を受け取ると新しいリレーアドレスに送る）
+typedef struct {
+    Node* ice_node;
+    int fd;
+    volatile bool running;
+    volatile bool paused;
+    uint64_t sent;
+    uint64_t received;           // クライアントのデータハンドラが受け取った数
+} BenchInbound;
+
+static void* bench_inbound_thread(void* arg) {
+    BenchInbound* inbound = (BenchInbound*)arg;
+    IceSession* session = &((IceData*)inbound->ice_node->ice_data)->session;
+    uint8_t data[100] = { 0 };
+    while (inbound->running) {
+        if (inbound->paused) {
+            usleep(100);
+            continue;
+        }
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        pthread_mutex_lock(&session->mutex);
+        inet_aton(session->remote_candidates[0].ip, &addr.sin_addr);
+        addr.sin_port = htons(session->remote_candidates[0].port);
+        pthread_mutex_unlock(&session->mutex);
+        sendto(inbound->fd, data, sizeof(data), 0, (struct sockaddr*)&addr, sizeof(addr));
+        inbound->sent++;
+        usleep(100);
+    }
+    return NULL;
+}
+
+static void bench_inbound_handler(Node* node, const char* from_ip, int from_port, const void* data, int data_len,
+                                  void* arg) {
+    (void)node;
+    (void)from_ip;
+    (void)from_port;
+    (void)data;
+    (void)data_len;
+    __atomic_add_fetch(&((BenchInbound*)arg)->received, 1, __ATOMIC_RELAXED);
+}
+
+// プライマリのサーバーの番号（なければ-1）
+static int bench_turn_primary(Node* node, TurnServerInfo* servers, int count) {
+    count = turn_get_servers(node, servers, count);
+    for (int i = 0; i < count; i++) {
+        if (servers[i].primary) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 両方向に送信を続けたままプライマリのサーバーを止め（kill）、または黙らせて（drop）、
+// スタンバイへ切り替わるまでの時間と失われたパケットを測る（結果はlineに書く。
+// 計測中はクライアントの出力を抑えているため）。相手から届く分は、ICEの候補の更新で
+// 相手が新しいリレーアドレスに送り始めるまで失われる。
+static void bench_turn_failover_run(Node* node, BenchProxy* proxies, BenchSender* sender, BenchRelay* peer,
+                                    BenchInbound* inbound, bool kill, double max_sec, char* line,
+                                    size_t line_size) {
+    TurnServerInfo servers[TURN_MAX_SERVERS];
+    int before = bench_turn_primary(node, servers, TURN_MAX_SERVERS);
+    if (before < 0) {
+        snprintf(line, line_size, "  turn failover %-4s no primary server\n", kill ? "kill" : "drop");
+        return;
+    }
+    uint64_t sent = sender->sent;
+    uint64_t failed = sender->failed;
+    uint64_t received = peer->received;
+    uint64_t inbound_sent = inbound->sent;
+    uint64_t inbound_received = __atomic_load_n(&inbound->received, __ATOMIC_RELAXED);
+    double start = now_sec();
+    if (kill) {
+        bench_proxy_stop(&proxies[before]);
+    } else {
+        proxies[before].drop = true;
+    }
+
+    int after = before;
+    double switched = 0;
+    while (now_sec() - start < max_sec) {
+        after = bench_turn_primary(node, servers, TURN_MAX_SERVERS);
+        if (after != before) {
+            switched = now_sec() - start;
+            break;
+        }
+        usleep(1000);
+    }
+    usleep(500000);
+
+    // 切り替えの後0.5秒の送信が全て届いていれば、失われたのは切り替えまでの分
+    // （送信を止めて、途中のものが届くのを待ってから数える）
+    sender->paused = true;
+    inbound->paused = true;
+    usleep(200000);
+    sent = sender->sent - sent;
+    failed = sender->failed - failed;
+    inbound_sent = inbound->sent - inbound_sent;
+    received = peer->received - received;
+    inbound_received = __atomic_load_n(&inbound->received, __ATOMIC_RELAXED) - inbound_received;
+    sender->paused = false;
+    inbound->paused = false;
+    uint64_t lost = sent > received ? sent - received : 0;
+    uint64_t inbound_lost = inbound_sent > inbound_received ? inbound_sent - inbound_received : 0;
+    if (after == before) {
+        snprintf(line, line_size, "  turn failover %-4s server %d: no failover within %.1f s\n",
+                 kill ? "kill" : "drop", before, max_sec);
+        return;
+    }
+    snprintf(line, line_size,
+             "  turn failover %-4s server %d -> %d: switched after %7.1f ms, out %6llu/%6llu lost, "
+             "in %6llu/%6llu lost, %llu send errors\n",
+             kill ? "kill" : "drop", before, after, switched * 1000, (unsigned long long)lost,
+             (unsigned long long)sent, (unsigned long long)inbound_lost, (unsigned long long)inbound_sent,
+             (unsigned long long)failed);
+}
+
+// 組み込みのTURNサーバーを遅延の異なる中継の後ろに3つ置き、turn_init_serversで登録して、
+// RTTの最小のサーバーが選ばれるか、選ぶまでの時間、落ちたときの切り替えを測る
+static void bench_turn_failover(void) {
+    static const int delays[3] = { 20, 2, 8 };
+    Node* server_nodes[3] = { NULL, NULL, NULL };
+    BenchProxy* proxies = (BenchProxy*)calloc(3, sizeof(BenchProxy));
+    Node* node = (Node*)calloc(1, sizeof(Node));
+    BenchRelay* peer = (BenchRelay*)calloc(1, sizeof(BenchRelay));
+    BenchSender* sender = (BenchSender*)calloc(1, sizeof(BenchSender));
+    BenchInbound* inbound = (BenchInbound*)calloc(1, sizeof(BenchInbound));
+    Node* peer_node = (Node*)calloc(1, sizeof(Node));
+    char names[3][MAX_IP_STR_LEN + 8];
+    const char* servers[3];
+    bool ready = proxies && node && peer && sender && inbound && peer_node;
+    for (int i = 0; i < 3 && proxies; i++) {
+        proxies[i].client_fd = proxies[i].server_fd = -1;
+    }
+    for (int i = 0; i < 3 && ready; i++) {
+        server_nodes[i] = (Node*)calloc(1, sizeof(Node));
+        ready = server_nodes[i] != NULL;
+        if (ready) {
+            strcpy(server_nodes[i]->ip, "127.0.0.1");
+            quiet_begin();
+            ready = turn_server_start(server_nodes[i], 0, "127.0.0.1", "bench", "bench") == 0;
+            quiet_end();
+        }
+        ready = ready && bench_proxy_start(&proxies[i], turn_server_get_port(server_nodes[i]), delays[i]);
+        if (ready) {
+            snprintf(names[i], sizeof(names[i]), "127.0.0.1:%d", ntohs(proxies[i].addr.sin_port));
+            servers[i] = names[i];
+        }
+    }
+
+    double start = now_sec();
+    double allocate_sec = 0;
+    if (ready) {
+        node->id = 1;
+        node->is_running = true;
+        strcpy(node->ip, "127.0.0.1");
+        quiet_begin();
+        ready = turn_init_servers(node, servers, 3, "bench", "bench") == 0 && turn_allocate(node) == 0;
+        quiet_end();
+        allocate_sec = now_sec() - start;
+    }
+
+    if (ready) {
+        // スタンバイのアロケーションを待つ
+        TurnServerInfo info[TURN_MAX_SERVERS];
+        int count = 0;
+        bool standby = false;
+        quiet_begin();
+        for (int i = 0; i < 100 && !standby; i++) {
+            count = turn_get_servers(node, info, TURN_MAX_SERVERS);
+            for (int j = 0; j < count; j++) {
+                standby = standby || (info[j].standby && info[j].allocated);
+            }
+            usleep(10000);
+        }
+        quiet_end();
+        printf("  turn failover select: allocated in %6.1f ms;", allocate_sec * 1000);
+        for (int i = 0; i < count; i++) {
+            printf(" server %d (%2d ms delay) rtt %5.1f ms%s", i, delays[i], info[i].rtt_ms,
+                   info[i].primary ? " primary" : info[i].standby ? " standby" : "");
+            printf(i + 1 < count ? "," : "\n");
+        }
+
+        peer->peer_fd = bench_udp_socket(&peer->peer_addr);
+        peer->ice_node = peer_node;
+        sender->node = node;
+        inet_ntop(AF_INET, &peer->peer_addr.sin_addr, sender->peer_ip, sizeof(sender->peer_ip));
+        sender->peer_port = ntohs(peer->peer_addr.sin_port);
+
+        char kill_line[256] = "";
+        char drop_line[256] = "";
+        char relayed_ip[MAX_IP_STR_LEN];
+        int relayed_port = 0;
+        quiet_begin();
+        // 両端のICEを接続済みにする（クライアントはRelay候補、相手はそのリレーアドレスへ送る）
+        peer_node->id = 2;
+        strcpy(peer_node->ip, "127.0.0.1");
+        ice_init(peer_node);
+        ice_init(node);
+        char ufrag[ICE_UFRAG_LEN + 1];
+        char pwd[ICE_PWD_LEN + 1];
+        ice_get_local_credentials(node, ufrag, sizeof(ufrag), pwd, sizeof(pwd));
+        ice_set_remote_credentials(peer_node, ufrag, pwd);
+        ice_get_local_credentials(peer_node, ufrag, sizeof(ufrag), pwd, sizeof(pwd));
+        ice_set_remote_credentials(node, ufrag, pwd);
+        turn_get_relayed_address(node, relayed_ip, &relayed_port);
+        ice_add_remote_candidate(peer_node, ICE_CANDIDATE_RELAY, relayed_ip, relayed_port, 0);
+        ice_gather_candidates(node);
+        IceSession* session = &((IceData*)node->ice_data)->session;
+        pthread_mutex_lock(&session->mutex);
+        for (int i = 0; i < session->local_candidate_count; i++) {
+            if (session->local_candidates[i].type == ICE_CANDIDATE_RELAY) {
+                session->selected_pair[0] = session->local_candidates[i];
+            }
+        }
+        session->selected_pair[1].type = ICE_CANDIDATE_SRFLX;
+        strcpy(session->selected_pair[1].ip, sender->peer_ip);
+        session->selected_pair[1].port = sender->peer_port;
+        session->state = ICE_STATE_CONNECTED;
+        pthread_mutex_unlock(&session->mutex);
+
+        peer->running = true;
+        pthread_t peer_thread;
+        pthread_create(&peer_thread, NULL, bench_relay_peer, peer);
+        inbound->ice_node = peer_node;
+        inbound->fd = peer->peer_fd;
+        turn_set_data_handler(node, bench_inbound_handler, inbound);
+        turn_set_channel_binding(node, true);
+        bool bound = turn_bind_channel(node, sender->peer_ip, sender->peer_port) == 0;
+        pthread_t sender_thread;
+        pthread_t inbound_thread;
+        sender->running = bound;
+        inbound->running = bound;
+        if (bound) {
+            pthread_create(&sender_thread, NULL, bench_sender_thread, sender);
+            pthread_create(&inbound_thread, NULL, bench_inbound_thread, inbound);
+
+            // スタンバイがチャネルを写してバインドするのを待つ
+            sleep(3);
+            bench_turn_failover_run(node, proxies, sender, peer, inbound, true, 5, kill_line, sizeof(kill_line));
+
+            // 空いたスタンバイが埋まり、チャネルを写すのを待つ
+            sleep(TURN_PROBE_INTERVAL + 3);
+            bench_turn_failover_run(node, proxies, sender, peer, inbound, false, TURN_PROBE_INTERVAL * 3,
+                                    drop_line, sizeof(drop_line));
+
+            sender->running = false;
+            inbound->running = false;
+            pthread_join(sender_thread, NULL);
+            pthread_join(inbound_thread, NULL);
+        }
+        quiet_end();
+        if (bound) {
+            printf("%s%s", kill_line, drop_line);
+        } else {
+            printf("  turn failover failed to bind the channel\n");
+        }
+
+        count = turn_get_servers(node, info, TURN_MAX_SERVERS);
+        printf("  turn failover stats:");
+        for (int i = 0; i < count; i++) {
+            printf(" server %d %llu probes %llu unanswered %llu failures%s", i, (unsigned long long)info[i].probes,
+                   (unsigned long long)info[i].probe_failures, (unsigned long long)info[i].failures,
+                   i + 1 < count ? "," : "\n");
+        }
+        peer->running = false;
+        pthread_join(peer_thread, NULL);
+        close(peer->peer_fd);
+    } else {
+        printf("  turn failover failed to start the servers\n");
+    }
+
+    quiet_begin();
+    if (node && node->ice_data) {
+        ice_cleanup(node);
+    }
+    if (peer_node && peer_node->ice_data) {
+        ice_cleanup(peer_node);
+    }
+    turn_cleanup(node);
+    for (int i = 0; i < 3; i++) {
+        if (proxies) {
+            bench_proxy_stop(&proxies[i]);
+        }
+        if (server_nodes[i]) {
+            turn_server_stop(server_nodes[i]);
+            free(server_nodes[i]);
+        }
+    }
+    quiet_end();
+    free(proxies);
+    free(node);
+    free(peer);
+    free(sender);
+    free(inbound);
+    free(peer_node);
+}
+
+// 中継への切り替えから最初のデータが相手に届くまでの時間
+//
+// 遅延の異なる中継の後ろに置いたserver_count個のサーバーを使う。事前アロケーションが
+// なければ、切り替えの時点でturn_allocateとturn_bind_channelを待ってから送る（従来の
+// 同期的な手順）。あればturn_preallocで済ませておき、切り替えの時点では送るだけにする。
+// どちらも届くまで1ミリ秒ごとに送り続ける。サーバーはクライアントを中継のアドレスで
+// 見分けるので、中継は試行ごとに作り直す。
+static void bench_turn_prealloc(int server_count, int trials) {
+    static const int delays[3] = { 10, 25, 40 };
+    Node* server_nodes[3] = { NULL, NULL, NULL };
+    BenchProxy* proxies = (BenchProxy*)calloc(3, sizeof(BenchProxy));
+    double* samples = (double*)calloc(trials, sizeof(double));
+    char names[3][MAX_IP_STR_LEN + 8];
+    const char* servers[3];
+    bool ready = proxies && samples && server_count <= 3;
+    for (int i = 0; i < 3 && proxies; i++) {
+        proxies[i].client_fd = proxies[i].server_fd = -1;
+    }
+    for (int i = 0; i < server_count && ready; i++) {
+        server_nodes[i] = (Node*)calloc(1, sizeof(Node));
+        ready = server_nodes[i] != NULL;
+        if (ready) {
+            strcpy(server_nodes[i]->ip, "127.0.0.1");
+            quiet_begin();
+            ready = turn_server_start(server_nodes[i], 0, "127.0.0.1", "bench", "bench") == 0;
+            quiet_end();
+        }
+    }
+
+    for (int prealloc = 0; prealloc <= 1 && ready; prealloc++) {
+        int count = 0;
+        double setup_sec = 0;
+        for (int trial = 0; trial < trials; trial++) {
+            Node* node = (Node*)calloc(1, sizeof(Node));
+            BenchRelay* peer = (BenchRelay*)calloc(1, sizeof(BenchRelay));
+            if (!node || !peer) {
+                free(node);
+                free(peer);
+                break;
+            }
+            node->id = 1;
+            node->is_running = true;
+            peer->peer_fd = bench_udp_socket(&peer->peer_addr);
+            peer->running = true;
+            pthread_t peer_thread;
+            pthread_create(&peer_thread, NULL, bench_relay_peer, peer);
+            char peer_ip[MAX_IP_STR_LEN];
+            inet_ntop(AF_INET, &peer->peer_addr.sin_addr, peer_ip, sizeof(peer_ip));
+            int peer_port = ntohs(peer->peer_addr.sin_port);
+            uint8_t data[100] = { 0 };
+            bool ok = true;
+            for (int i = 0; i < server_count && ok; i++) {
+                ok = bench_proxy_start(&proxies[i], turn_server_get_port(server_nodes[i]), delays[i]);
+                snprintf(names[i], sizeof(names[i]), "127.0.0.1:%d", ntohs(proxies[i].addr.sin_port));
+                servers[i] = names[i];
+            }
+
+            quiet_begin();
+            ok = ok && turn_init_servers(node, servers, server_count, "bench", "bench") == 0;
+            double start = now_sec();
+            if (ok && prealloc) {
+                // ノードの起動時に始め、切り替えの前に終わっている
+                ok = turn_prealloc(node, NULL, NULL) == 0;
+                char relayed_ip[MAX_IP_STR_LEN];
+                int relayed_port;
+                while (ok && turn_get_relayed_address(node, relayed_ip, &relayed_port) < 0 &&
+                       now_sec() - start < 5) {
+                    usleep(1000);
+                }
+                setup_sec += now_sec() - start;
+                start = now_sec();
+            } else if (ok) {
+                ok = turn_allocate(node) == 0 && turn_bind_channel(node, peer_ip, peer_port) == 0;
+            }
+            while (ok && peer->received == 0 && now_sec() - start < 2) {
+                turn_send_data(node, peer_ip, peer_port, data, sizeof(data));
+                usleep(1000);
+            }
+            quiet_end();
+            if (ok && peer->received > 0) {
+                samples[count++] = (peer->last_received - start) * 1000;
+            }
+
+            quiet_begin();
+            turn_cleanup(node);
+            quiet_end();
+            for (int i = 0; i < server_count; i++) {
+                bench_proxy_stop(&proxies[i]);
+            }
+            peer->running = false;
+            pthread_join(peer_thread, NULL);
+            close(peer->peer_fd);
+            free(node);
+            free(peer);
+        }
+
+        double p50, p99;
+        bench_percentiles(samples, count, &p50, &p99);
+        printf("  turn first relayed packet %d server(s) %-13s: p50 %6.1f ms max %6.1f ms (%d/%d)",
+               server_count, prealloc ? "preallocated" : "on demand", p50, count > 0 ? samples[count - 1] : 0,
+               count, trials);
+        if (prealloc && count > 0) {
+            printf(", preallocation took %.1f ms at startup", setup_sec * 1000 / trials);
+        }
+        printf("\n");
+    }
+    if (!ready) {
+        printf("  turn first relayed packet failed to start the servers\n");
+    }
+
+    quiet_begin();
+    for (int i = 0; i < 3; i++) {
+        if (proxies) {
+            bench_proxy_stop(&proxies[i]);
+        }
+        if (server_nodes[i]) {
+            turn_server_stop(server_nodes[i]);
+            free(server_nodes[i]);
+        }
+    }
+    quiet_end();
+    free(proxies);
+    free(samples);
+}
+
+// ベンチマーク用のSTUNサーバー（Bindingにdelay_ms遅れて応答し、要求のloss_percent%を捨てる）
+#define BENCH_STUN_QUEUE 256
+
+typedef struct {
+    int fd;
+    struct sockaddr_in addr;
+    int delay_ms;
+    int loss_percent;
+    uint8_t replies[BENCH_STUN_QUEUE][32];
+    struct sockaddr_in reply_to[BENCH_STUN_QUEUE];
+    double reply_due[BENCH_STUN_QUEUE];
+    int reply_head;
+    int reply_count;
+    unsigned int seed;
+    uint64_t requests;
+    volatile bool running;
+    pthread_t thread;
+} BenchStun;
+
+static void* bench_stun_thread(void* arg) {
+    BenchStun* stun = (BenchStun*)arg;
+    uint8_t buf[512];
+    while (stun->running) {
+        struct pollfd pfd = { stun->fd, POLLIN, 0 };
+        poll(&pfd, 1, 1);
+
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int len;
+        while ((len = (int)recvfrom(stun->fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&from,
+                                    &from_len)) > 0) {
+            from_len = sizeof(from);
+            if (len < STUN_HEADER_SIZE || ((buf[0] << 8) | buf[1]) != STUN_BINDING_REQUEST) {
+                continue;
+            }
+            stun->requests++;
+            if ((int)(rand_r(&stun->seed) % 100) < stun->loss_percent || stun->reply_count == BENCH_STUN_QUEUE) {
+                continue;
+            }
+
+            // 応答（XOR-MAPPED-ADDRESSだけ）
+            int slot = (stun->reply_head + stun->reply_count++) % BENCH_STUN_QUEUE;
+            uint8_t* reply = stun->replies[slot];
+            reply[0] = STUN_BINDING_RESPONSE >> 8;
+            reply[1] = STUN_BINDING_RESPONSE & 0xFF;
+            reply[2] = 0;
+            reply[3] = 12;
+            memcpy(reply + 4, buf + 4, 16);
+            reply[20] = STUN_ATTR_XOR_MAPPED_ADDRESS >> 8;
+            reply[21] = STUN_ATTR_XOR_MAPPED_ADDRESS & 0xFF;
+            reply[22] = 0;
+            reply[23] = 8;
+            reply[24] = 0;
+            reply[25] = 0x01;
+            uint16_t port = htons(ntohs(from.sin_port) ^ (STUN_MAGIC_COOKIE >> 16));
+            uint32_t ip = from.sin_addr.s_addr ^ htonl(STUN_MAGIC_COOKIE);
+            memcpy(reply + 26, &port, 2);
+            memcpy(reply + 28, &ip, 4);
+            stun->reply_to[slot] = from;
+            stun->reply_due[slot] = now_sec() + stun->delay_ms / 1000.0;
+        }
+
+        // 遅延は一定なので、先頭から期限の来た応答を送る
+        double now = now_sec();
+        while (stun->reply_count > 0 && stun->reply_due[stun->reply_head] <= now) {
+            sendto(stun->fd, stun->replies[stun->reply_head], 32, 0,
+                   (struct sockaddr*)&stun->reply_to[stun->reply_head], sizeof(struct sockaddr_in));
+            stun->reply_head = (stun->reply_head + 1) % BENCH_STUN_QUEUE;
+            stun->reply_count--;
+        }
+    }
+    return NULL;
+}
+
+// STUNの応答をソケットごとに受け取る（ノードの受信スレッドの代わり）
+typedef struct {
+    int* fds;
+    int count;
+    volatile bool running;
+} BenchStunReader;
+
+static void* bench_stun_reader(void* arg) {
+    BenchStunReader* reader = (BenchStunReader*)arg;
+    struct pollfd pfds[64];
+    for (int i = 0; i < reader->count; i++) {
+        pfds[i].fd = reader->fds[i];
+        pfds[i].events = POLLIN;
+    }
+    uint8_t buf[512];
+    while (reader->running) {
+        if (poll(pfds, reader->count, 10) <= 0) {
+            continue;
+        }
+        for (int i = 0; i < reader->count; i++) {
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            int len = (int)recvfrom(pfds[i].fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*)&from, &from_len);
+            if (len > 0) {
+                stun_handle_packet(pfds[i].fd, buf, len, &from);
+            }
+        }
+    }
+    return NULL;
+}
+
+// 起動時の対応付けの完了を待つ
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int remaining;
+    int failed;
+    double* latencies;
+    int latency_count;
+} BenchStunWait;
+
+static void bench_stun_done(int socket_fd, const StunResult* result, void* arg) {
+    (void)socket_fd;
+    BenchStunWait* wait = (BenchStunWait*)arg;
+    pthread_mutex_lock(&wait->mutex);
+    if (result) {
+        wait->latencies[wait->latency_count++] = result->latency_ms;
+    } else {
+        wait->failed++;
+    }
+    wait->remaining--;
+    pthread_cond_signal(&wait->cond);
+    pthread_mutex_unlock(&wait->mutex);
+}
+
+// sockets個のソケット（ノード）の公開アドレスを起動時に調べる時間
+//
+// 遅延20/30/50 ms、要求の損失loss_percent%のSTUNサーバーを使う。逐次なら以前の
+// init_networkと同じくノードごとに1つのサーバーに問い合わせて待つ。並行なら全ノードの
+// 問い合わせを同時に始め、server_count個のサーバーのうち最初の応答を使う。最後に同じ
+// ソケットで問い合わせ直し、キャッシュから答えられることを確かめる。
+static void bench_stun(int sockets, int server_count, bool parallel, int loss_percent) {
+    static const int delays[3] = { 20, 30, 50 };
+    BenchStun* servers = (BenchStun*)calloc(3, sizeof(BenchStun));
+    int* fds = (int*)calloc(sockets, sizeof(int));
+    double* latencies = (double*)calloc(sockets, sizeof(double));
+    if (!servers || !fds || !latencies || sockets > 64) {
+        free(servers);
+        free(fds);
+        free(latencies);
+        return;
+    }
+    char list[128] = "";
+    for (int i = 0; i < server_count; i++) {
+        servers[i].fd = bench_udp_socket(&servers[i].addr);
+        servers[i].delay_ms = delays[i];
+        servers[i].loss_percent = loss_percent;
+        servers[i].seed = 1234 + i;
+        servers[i].running = true;
+        pthread_create(&servers[i].thread, NULL, bench_stun_thread, &servers[i]);
+        size_t used = strlen(list);
+        snprintf(list + used, sizeof(list) - used, "%s127.0.0.1:%d", i > 0 ? "," : "",
+                 ntohs(servers[i].addr.sin_port));
+    }
+    struct sockaddr_in addr;
+    for (int i = 0; i < sockets; i++) {
+        fds[i] = bench_udp_socket(&addr);
+    }
+
+    quiet_begin();
+    stun_init();
+    quiet_end();
+    BenchStunReader reader = { fds, sockets, true };
+    pthread_t reader_thread;
+    pthread_create(&reader_thread, NULL, bench_stun_reader, &reader);
+
+    BenchStunWait wait;
+    pthread_mutex_init(&wait.mutex, NULL);
+    pthread_cond_init(&wait.cond, NULL);
+    wait.remaining = sockets;
+    wait.failed = 0;
+    wait.latencies = latencies;
+    wait.latency_count = 0;
+
+    quiet_begin();
+    double start = now_sec();
+    if (parallel) {
+        for (int i = 0; i < sockets; i++) {
+            if (stun_discover_async(fds[i], list, bench_stun_done, &wait) < 0) {
+                bench_stun_done(fds[i], NULL, &wait);
+            }
+        }
+        pthread_mutex_lock(&wait.mutex);
+        while (wait.remaining > 0) {
+            pthread_cond_wait(&wait.cond, &wait.mutex);
+        }
+        pthread_mutex_unlock(&wait.mutex);
+    } else {
+        for (int i = 0; i < sockets; i++) {
+            StunResult result;
+            bool ok = stun_discover(fds[i], list, &result) == 0;
+            bench_stun_done(fds[i], ok ? &result : NULL, &wait);
+        }
+    }
+    double total_ms = (now_sec() - start) * 1000;
+
+    // 2回目はキャッシュから
+    int cached = 0;
+    double cached_start = now_sec();
+    for (int i = 0; i < sockets; i++) {
+        StunResult result;
+        cached += stun_discover(fds[i], list, &result) == 0 && result.cached;
+    }
+    double cached_ms = (now_sec() - cached_start) * 1000;
+    quiet_end();
+
+    uint64_t requests = 0;
+    for (int i = 0; i < server_count; i++) {
+        requests += servers[i].requests;
+    }
+    double p50, p99;
+    int mapped = wait.latency_count;
+    bench_percentiles(latencies, mapped, &p50, &p99);
+    printf("  stun %2d sockets %-10s %d server(s) %2d%% loss: startup %7.1f ms, per socket p50 %6.1f ms "
+           "max %6.1f ms, %d/%d mapped, %.1f requests/socket, cached %d/%d in %.2f ms\n",
+           sockets, parallel ? "parallel" : "sequential", server_count, loss_percent, total_ms, p50,
+           mapped > 0 ? latencies[mapped - 1] : 0, mapped, sockets, (double)requests / sockets, cached, sockets,
+           cached_ms);
+
+    reader.running = false;
+    pthread_join(reader_thread, NULL);
+    quiet_begin();
+    stun_cleanup();
+    quiet_end();
+    for (int i = 0; i < server_count; i++) {
+        servers[i].running = false;
+        pthread_join(servers[i].thread, NULL);
+        close(servers[i].fd);
+    }
+    for (int i = 0; i < sockets; i++) {
+        close(fds[i]);
+    }
+    pthread_mutex_destroy(&wait.mutex);
+    pthread_cond_destroy(&wait.cond);
+    free(servers);
+    free(fds);
+    free(latencies);
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = 200000;
+    char state_path[256];
+    int opt;
+
+    snprintf(state_path, sizeof(state_path), "/tmp/dht_bench_%d.state", (int)getpid());
+
+    while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = atoi(optarg);
+                if (iterations <= 0) {
+                    fprintf(stderr, "Invalid iteration count\n");
+                    return 1;
+                }
+                break;
+            case 's':
+                strncpy(state_path, optarg, sizeof(state_path) - 1);
+                state_path[sizeof(state_path) - 1] = '\0';
+                break;
+            default:
+                printf("Usage: %s [-n ITERATIONS] [-s STATE_FILE]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    Node* node = bench_create_node(1);
+    if (!node) {
+        return 1;
+    }
+
+    int contacts = bench_fill_routing_table(node);
+    printf("DHT benchmark: routing table populated with %d contacts (%d buckets x k=%d)\n",
+           contacts, DHT_ID_BITS, DHT_K);
+
+    bench_find_node(node, iterations, DHT_K);
+    bench_find_node(node, iterations, 20);
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        bench_find_node_threads(node, iterations / threads, threads, true);
+        bench_find_node_threads(node, iterations / threads, threads, false);
+    }
+    bench_distance_kernels(iterations);
+    bench_hash(iterations);
+    bench_wire(iterations);
+    for (int members = 100; members <= 100000; members *= 10) {
+        bench_members(members, 16);
+    }
+    bench_memory(256);
+    bench_restart(state_path, 64, 256, 16);
+    bench_churn(64, 128, false);
+    bench_churn(64, 128, true);
+    bench_hot_key(256, 1024, false);
+    bench_hot_key(256, 1024, true);
+    bench_batch(64, 256, false);
+    bench_batch(64, 256, true);
+    for (int payload = 100; payload <= 1000; payload *= 10) {
+        bench_turn_relay(iterations, payload, false);
+        bench_turn_relay(iterations, payload, true);
+    }
+    bench_turn_requests(TURN_MAX_TRANSACTIONS, 20);
+    bench_turn_requests(TURN_MAX_TRANSACTIONS * 2, 20);
+    bench_turn_permissions(100, 5);
+    for (int payload = 100; payload <= 1000; payload *= 10) {
+        bench_turn_server(iterations, payload, 1000);
+    }
+    bench_turn_failover();
+    bench_turn_prealloc(1, 10);
+    bench_turn_prealloc(3, 10);
+    bench_stun(16, 1, false, 0);
+    bench_stun(16, 1, false, 10);
+    bench_stun(16, 1, true, 10);
+    bench_stun(16, 3, true, 10);
+
+    // メンテナンススレッドは待たずに終了する
+    return 0;
+}
@@ -0,0 +1,399 @@
+#include "dht_hash.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <openssl/evp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define DHT_HASH_HAVE_SHANI 1
+#endif
+
+// IDのハッシュ
+//
+// OpenSSLのSHA1()は呼び出しごとにアルゴリズムを取得し直すため、短い文字列では本体の
+// 計算より準備の方が重い。取得は最初に1回だけ行い、SHA-1はSHA拡張命令があれば
+// 自前で計算する。hash_mutexはキャッシュとハッシュ関数の変更だけを守り、現在の
+// ハッシュ関数と統計はアトミックに読み書きする（キャッシュしないハッシュはロックを取らない）。
+
+// キャッシュのエントリ
+typedef struct {
+    char str[DHT_HASH_CACHE_MAX_LEN + 1];
+    uint8_t len;
+    uint32_t generation;         // ハッシュ関数を変えるたびに増やし、古いエントリを無効にする
+    DhtId id;
+} HashCacheEntry;
+
+static pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
+static HashCacheEntry hash_cache[DHT_HASH_CACHE_SIZE];
+static uint32_t hash_generation = 1;
+static DhtHashAlgorithm hash_algorithm = DHT_HASH_SHA1;
+static DhtHashFn hash_custom;
+static _Atomic(DhtHashFn) hash_fn;  // NULLなら既定のSHA-1
+static atomic_uint_fast64_t stat_hashes;
+static uint64_t stat_cache_hits;     // キャッシュの統計はhash_mutexで守る
+static uint64_t stat_cache_misses;
+
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+static const EVP_MD* md_sha1;
+static const EVP_MD* md_sha256;
+static bool use_shani;
+
+// ---- SHA拡張命令によるSHA-1 ----
+
+#ifdef DHT_HASH_HAVE_SHANI
+
+static bool cpu_has_shani(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+        return false;
+    }
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ebx & bit_SHA) != 0;
+}
+
+// 4ラウンド分（メッセージの拡張も2グループ先まで進める。末尾の余分な拡張は使われない）
+#define SHA1_ROUNDS4(abcd, e_cur, e_next, m0, m1, m2, m3, f)  \
+    e_cur = _mm_sha1nexte_epu32(e_cur, m0);                  \
+    e_next = abcd;                                           \
+    m1 = _mm_sha1msg2_epu32(m1, m0);                         \
+    abcd = _mm_sha1rnds4_epu32(abcd, e_cur, f);              \
+    m3 = _mm_sha1msg1_epu32(m3, m0);                         \
+    m2 = _mm_xor_si128(m2, m0);
+
+// ラウンド12-79
+#define SHA1_ROUNDS_12_79 \
+    SHA1_LANES(e1, e0, m3, m0, m1, m2, 0) \
+    SHA1_LANES(e0, e1, m0, m1, m2, m3, 0) \
+    SHA1_LANES(e1, e0, m1, m2, m3, m0, 1) \
+    SHA1_LANES(e0, e1, m2, m3, m0, m1, 1) \
+    SHA1_LANES(e1, e0, m3, m0, m1, m2, 1) \
+    SHA1_LANES(e0, e1, m0, m1, m2, m3, 1) \
+    SHA1_LANES(e1, e0, m1, m2, m3, m0, 1) \
+    SHA1_LANES(e0, e1, m2, m3, m0, m1, 2) \
+    SHA1_LANES(e1, e0, m3, m0, m1, m2, 2) \
+    SHA1_LANES(e0, e1, m0, m1, m2, m3, 2) \
+    SHA1_LANES(e1, e0, m1, m2, m3, m0, 2) \
+    SHA1_LANES(e0, e1, m2, m3, m0, m1, 2) \
+    SHA1_LANES(e1, e0, m3, m0, m1, m2, 3) \
+    SHA1_LANES(e0, e1, m0, m1, m2, m3, 3) \
+    SHA1_LANES(e1, e0, m1, m2, m3, m0, 3) \
+    SHA1_LANES(e0, e1, m2, m3, m0, m1, 3) \
+    SHA1_LANES(e1, e0, m3, m0, m1, m2, 3)
+
+// 状態を読み込み、ラウンド0-11を計算する
+#define SHA1_BEGIN(l, state, block)                                                     \
+    __m128i abcd_##l = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(state)), 0x1B); \
+    __m128i e0_##l = _mm_set_epi32((int)(state)[4], 0, 0, 0);                            \
+    __m128i e1_##l;                                                                     \
+    const __m128i abcd_save_##l = abcd_##l;                                             \
+    const __m128i e0_save_##l = e0_##l;                                                 \
+    __m128i m0_##l = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block)), mask);      \
+    __m128i m1_##l = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block) + 1), mask);  \
+    __m128i m2_##l = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block) + 2), mask);  \
+    __m128i m3_##l = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block) + 3), mask);  \
+    e0_##l = _mm_add_epi32(e0_##l, m0_##l);                                             \
+    e1_##l = abcd_##l;                                                                  \
+    abcd_##l = _mm_sha1rnds4_epu32(abcd_##l, e0_##l, 0);                                \
+    e1_##l = _mm_sha1nexte_epu32(e1_##l, m1_##l);                                       \
+    e0_##l = abcd_##l;                                                                  \
+    abcd_##l = _mm_sha1rnds4_epu32(abcd_##l, e1_##l, 0);                                \
+    m0_##l = _mm_sha1msg1_epu32(m0_##l, m1_##l);                                        \
+    e0_##l = _mm_sha1nexte_epu32(e0_##l, m2_##l);                                       \
+    e1_##l = abcd_##l;                                                                  \
+    abcd_##l = _mm_sha1rnds4_epu32(abcd_##l, e0_##l, 0);                                \
+    m1_##l = _mm_sha1msg1_epu32(m1_##l, m2_##l);                                        \
+    m0_##l = _mm_xor_si128(m0_##l, m2_##l);
+
+// 初期状態を足して書き戻す
+#define SHA1_END(l, state)                                                              \
+    e0_##l = _mm_sha1nexte_epu32(e0_##l, e0_save_##l);                                  \
+    abcd_##l = _mm_add_epi32(abcd_##l, abcd_save_##l);                                  \
+    _mm_storeu_si128((__m128i*)(state), _mm_shuffle_epi32(abcd_##l, 0x1B));             \
+    (state)[4] = (uint32_t)_mm_extract_epi32(e0_##l, 3);
+
+#define SHA1_LANE(l, ec, en, m0, m1, m2, m3, f) \
+    SHA1_ROUNDS4(abcd_##l, ec##_##l, en##_##l, m0##_##l, m1##_##l, m2##_##l, m3##_##l, f)
+
+// 1つの状態に1ブロックを加える
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha1_shani_block(uint32_t* state, const uint8_t* block) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+#define SHA1_LANES(ec, en, m0, m1, m2, m3, f) SHA1_LANE(a, ec, en, m0, m1, m2, m3, f)
+    SHA1_BEGIN(a, state, block)
+    SHA1_ROUNDS_12_79
+    SHA1_END(a, state)
+#undef SHA1_LANES
+}
+
+#undef SHA1_LANE
+#undef SHA1_END
+#undef SHA1_BEGIN
+#undef SHA1_ROUNDS_12_79
+#undef SHA1_ROUNDS4
+
+static const uint32_t sha1_init[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+// 最後の1ブロックか2ブロック（パディングと長さ）を作る。返り値はブロック数
+static int sha1_tail(const uint8_t* data, size_t len, uint8_t* tail) {
+    size_t rest = len % 64;
+    int blocks = rest < 56 ? 1 : 2;
+    memset(tail, 0, 128);
+    memcpy(tail, data + len - rest, rest);
+    tail[rest] = 0x80;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[blocks * 64 - 1 - i] = (uint8_t)(bits >> (i * 8));
+    }
+    return blocks;
+}
+
+static void sha1_output(const uint32_t* state, uint8_t* out) {
+    for (int i = 0; i < 5; i++) {
+        out[i * 4] = (uint8_t)(state[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)state[i];
+    }
+}
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha1_shani(const void* data, size_t len, uint8_t* out) {
+    uint32_t state[5];
+    memcpy(state, sha1_init, sizeof(sha1_init));
+
+    const uint8_t* p = (const uint8_t*)data;
+    for (size_t done = 0; done + 64 <= len; done += 64) {
+        sha1_shani_block(state, p + done);
+    }
+    uint8_t tail[128];
+    int blocks = sha1_tail(p, len, tail);
+    for (int i = 0; i < blocks; i++) {
+        sha1_shani_block(state, tail + i * 64);
+    }
+    sha1_output(state, out);
+}
+
+#endif /* DHT_HASH_HAVE_SHANI */
+
+// ---- ハッシュ関数 ----
+
+static void hash_init_once(void) {
+    md_sha1 = EVP_sha1();
+    md_sha256 = EVP_sha256();
+#ifdef DHT_HASH_HAVE_SHANI
+    use_shani = cpu_has_shani();
+#endif
+}
+
+static void hash_evp(const EVP_MD* md, const void* data, size_t len, uint8_t* out) {
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    if (EVP_Digest(data, len, digest, &digest_len, md, NULL) != 1 || digest_len < DHT_ID_BITS/8) {
+        memset(out, 0, DHT_ID_BITS/8);
+        return;
+    }
+    memcpy(out, digest, DHT_ID_BITS/8);
+}
+
+static void hash_sha1(const void* data, size_t len, uint8_t* out) {
+#ifdef DHT_HASH_HAVE_SHANI
+    if (use_shani) {
+        sha1_shani(data, len, out);
+        return;
+    }
+#endif
+    hash_evp(md_sha1, data, len, out);
+}
+
+static void hash_sha256(const void* data, size_t len, uint8_t* out) {
+    hash_evp(md_sha256, data, len, out);
+}
+
+// 選ばれているハッシュ関数（hash_mutexを保持して呼ぶ）
+static DhtHashFn select_function(void) {
+    switch (hash_algorithm) {
+        case DHT_HASH_SHA256:
+            return hash_sha256;
+        case DHT_HASH_CUSTOM:
+            return hash_custom ? hash_custom : hash_sha1;
+        default:
+            return hash_sha1;
+    }
+}
+
+// ハッシュ関数を選ぶ（ノードを作る前に呼ぶ。キャッシュは捨てる）
+void dht_hash_set_algorithm(DhtHashAlgorithm algorithm) {
+    pthread_mutex_lock(&hash_mutex);
+    hash_algorithm = algorithm;
+    atomic_store(&hash_fn, select_function());
+    hash_generation++;
+    pthread_mutex_unlock(&hash_mutex);
+}
+
+// 任意のハッシュ関数を使う（NULLならSHA-1に戻す）
+void dht_hash_set_function(DhtHashFn fn) {
+    pthread_mutex_lock(&hash_mutex);
+    hash_custom = fn;
+    hash_algorithm = fn ? DHT_HASH_CUSTOM : DHT_HASH_SHA1;
+    atomic_store(&hash_fn, select_function());
+    hash_generation++;
+    pthread_mutex_unlock(&hash_mutex);
+}
+
+DhtHashAlgorithm dht_hash_get_algorithm(void) {
+    pthread_mutex_lock(&hash_mutex);
+    DhtHashAlgorithm algorithm = hash_algorithm;
+    pthread_mutex_unlock(&hash_mutex);
+    return algorithm;
+}
+
+// 現在のハッシュ関数
+static DhtHashFn current_function(void) {
+    DhtHashFn fn = atomic_load(&hash_fn);
+    return fn ? fn : hash_sha1;
+}
+
+// バイト列のハッシュ（キャッシュしない）
+void dht_hash_bytes(const void* data, size_t len, DhtId* out) {
+    pthread_once(&hash_once, hash_init_once);
+    atomic_fetch_add_explicit(&stat_hashes, 1, memory_order_relaxed);
+    current_function()(data, len, out->bytes);
+}
+
+// ---- キャッシュ ----
+
+// キャッシュのスロット（8バイトずつ掛け合わせる。バイト単位のFNVより短い依存チェーンで済む）
+static uint32_t cache_slot(const char* str, size_t len) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, str + i, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+    }
+    if (i < len) {
+        uint64_t w = 0;
+        memcpy(&w, str + i, len - i);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+    }
+    return (uint32_t)(h >> 56) & (DHT_HASH_CACHE_SIZE - 1);
+}
+
+// キャッシュを引く（hash_mutexを保持して呼ぶ）
+static bool cache_lookup(const char* str, size_t len, uint32_t slot, DhtId* out) {
+    HashCacheEntry* entry = &hash_cache[slot];
+    if (entry->generation != hash_generation || entry->len != len || memcmp(entry->str, str, len) != 0) {
+        stat_cache_misses++;
+        return false;
+    }
+    *out = entry->id;
+    stat_cache_hits++;
+    return true;
+}
+
+// キャッシュに入れる（hash_mutexを保持して呼ぶ。計算中にハッシュ関数が変わっていれば入れない）
+static void cache_insert(const char* str, size_t len, uint32_t slot, const DhtId* id, uint32_t generation) {
+    if (generation != hash_generation) {
+        return;
+    }
+    HashCacheEntry* entry = &hash_cache[slot];
+    memcpy(entry->str, str, len);
+    entry->len = (uint8_t)len;
+    entry->generation = generation;
+    entry->id = *id;
+}
+
+// 文字列のハッシュ（短い文字列はキャッシュする）
+void dht_hash_string(const char* str, DhtId* out) {
+    size_t len = strlen(str);
+    if (len > DHT_HASH_CACHE_MAX_LEN) {
+        dht_hash_bytes(str, len, out);
+        return;
+    }
+
+    pthread_once(&hash_once, hash_init_once);
+    uint32_t slot = cache_slot(str, len);
+    pthread_mutex_lock(&hash_mutex);
+    if (cache_lookup(str, len, slot, out)) {
+        pthread_mutex_unlock(&hash_mutex);
+        return;
+    }
+    DhtHashFn fn = current_function();
+    uint32_t generation = hash_generation;
+    pthread_mutex_unlock(&hash_mutex);
+    atomic_fetch_add_explicit(&stat_hashes, 1, memory_order_relaxed);
+
+    fn(str, len, out->bytes);
+
+    pthread_mutex_lock(&hash_mutex);
+    cache_insert(str, len, slot, out, generation);
+    pthread_mutex_unlock(&hash_mutex);
+}
+
+// キャッシュに無かった文字列
+typedef struct {
+    int index;
+    size_t len;
+    uint32_t slot;
+} HashMiss;
+
+// 複数の文字列をまとめてハッシュ
+//
+// DHT_HASH_BATCH個ずつ、キャッシュをロック1回でまとめて引き、無かったものを計算して
+// ロック1回でまとめて入れる（1つずつなら文字列ごとに2回ロックを取る）。
+void dht_hash_strings(const char* const* strs, int count, DhtId* out) {
+    pthread_once(&hash_once, hash_init_once);
+
+    HashMiss misses[DHT_HASH_BATCH];
+    for (int base = 0; base < count; base += DHT_HASH_BATCH) {
+        int n = count - base < DHT_HASH_BATCH ? count - base : DHT_HASH_BATCH;
+        int miss_count = 0;
+
+        pthread_mutex_lock(&hash_mutex);
+        for (int i = base; i < base + n; i++) {
+            size_t len = strlen(strs[i]);
+            uint32_t slot = len <= DHT_HASH_CACHE_MAX_LEN ? cache_slot(strs[i], len) : 0;
+            if (len > DHT_HASH_CACHE_MAX_LEN || !cache_lookup(strs[i], len, slot, &out[i])) {
+                misses[miss_count].index = i;
+                misses[miss_count].len = len;
+                misses[miss_count].slot = slot;
+                miss_count++;
+            }
+        }
+        DhtHashFn fn = current_function();
+        uint32_t generation = hash_generation;
+        pthread_mutex_unlock(&hash_mutex);
+        if (miss_count == 0) {
+            continue;
+        }
+        atomic_fetch_add_explicit(&stat_hashes, miss_count, memory_order_relaxed);
+
+        for (int m = 0; m < miss_count; m++) {
+            fn(strs[misses[m].index], misses[m].len, out[misses[m].index].bytes);
+        }
+
+        pthread_mutex_lock(&hash_mutex);
+        for (int m = 0; m < miss_count; m++) {
+            if (misses[m].len <= DHT_HASH_CACHE_MAX_LEN) {
+                cache_insert(strs[misses[m].index], misses[m].len, misses[m].slot, &out[misses[m].index],
+                             generation);
+            }
+        }
+        pthread_mutex_unlock(&hash_mutex);
+    }
+}
+
+// ハッシュの統計を取得
+void dht_hash_get_stats(DhtHashStats* stats) {
+    pthread_once(&hash_once, hash_init_once);
+    stats->hashes = atomic_load_explicit(&stat_hashes, memory_order_relaxed);
+    pthread_mutex_lock(&hash_mutex);
+    stats->cache_hits = stat_cache_hits;
+    stats->cache_misses = stat_cache_misses;
+    pthread_mutex_unlock(&hash_mutex);
+    stats->accelerated = use_shani && current_function() == hash_sha1;
+}
@@ -0,0 +1,47 @@
+#ifndef DHT_HASH_H
+#define DHT_HASH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "dht_id.h"
+
+// IDのハッシュ
+//
+// ノードIDやランデブーキーのIDは文字列のハッシュで作る。ハッシュ関数は差し替えられるが、
+// 同じネットワークの全ノードで同じものを使う必要がある（既定は従来どおりSHA-1）。
+//
+// 短い文字列は直近のものを直接マップのキャッシュに置き、同じキーの再計算を省く。
+// SHA-1はCPUがSHA拡張命令を持っていれば自前の実装で計算する。
+#define DHT_HASH_CACHE_SIZE 256      // キャッシュのエントリ数（2の冪）
+#define DHT_HASH_CACHE_MAX_LEN 63    // キャッシュする文字列の最大長
+#define DHT_HASH_BATCH 32            // dht_hash_stringsが1回のロックで引く文字列の数
+
+// ハッシュ関数（dataのハッシュの先頭DHT_ID_BITSビットをoutに書く）
+typedef void (*DhtHashFn)(const void* data, size_t len, uint8_t* out);
+
+// ハッシュ関数の種類
+typedef enum {
+    DHT_HASH_SHA1 = 0,           // SHA-1（既定、既存のネットワークと互換）
+    DHT_HASH_SHA256,             // SHA-256の先頭160ビット
+    DHT_HASH_CUSTOM              // dht_hash_set_functionで指定した関数
+} DhtHashAlgorithm;
+
+// ハッシュの統計
+typedef struct {
+    uint64_t hashes;             // 計算したハッシュの数
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    bool accelerated;            // SHA拡張命令を使っている
+} DhtHashStats;
+
+// IDハッシュ関数プロトタイプ
+void dht_hash_set_algorithm(DhtHashAlgorithm algorithm);
+void dht_hash_set_function(DhtHashFn fn);
+DhtHashAlgorithm dht_hash_get_algorithm(void);
+void dht_hash_bytes(const void* data, size_t len, DhtId* out);
+void dht_hash_string(const char* str, DhtId* out);
+void dht_hash_strings(const char* const* strs, int count, DhtId* out);
+void dht_hash_get_stats(DhtHashStats* stats);
+
+#endif /* DHT_HASH_H */
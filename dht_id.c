@@ -0,0 +1,202 @@
+#include "dht_id.h"
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DHT_ID_HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+// DHT IDのバッチ距離計算
+//
+// 1つのtargetから多数のIDへの距離をまとめて計算するカーネル群。
+// 初回呼び出し時にCPUがサポートするカーネルを実際に測り、最速のものを選択する
+// （命令セットが新しいほど速いとは限らない。AVX2版は2IDを1つのレジスタに組み立てる
+// 分の命令が増え、CPUによってはSSSE3版より遅い）。
+
+// バッチ距離計算（スカラー版）
+static void distance_batch_scalar(const DhtId* target, const void* ids, size_t stride,
+                                  size_t count, DhtDistance* out) {
+    const uint8_t* p = (const uint8_t*)ids;
+    for (size_t i = 0; i < count; i++) {
+        dht_id_xor(target, (const DhtId*)(p + i * stride), &out[i]);
+    }
+}
+
+#ifdef DHT_ID_HAVE_X86_KERNELS
+
+// 64ビットレーンごとのバイト反転（ビッグエンディアン→ホストオーダー）
+#define DHT_BSWAP64_LANES 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+
+// バッチ距離計算（SSSE3版、1IDあたり先頭16バイトを1命令でXOR・反転）
+__attribute__((target("ssse3")))
+static void distance_batch_ssse3(const DhtId* target, const void* ids, size_t stride,
+                                 size_t count, DhtDistance* out) {
+    const uint8_t* p = (const uint8_t*)ids;
+    const __m128i shuffle = _mm_setr_epi8(DHT_BSWAP64_LANES);
+    const __m128i t = _mm_loadu_si128((const __m128i*)target->bytes);
+    const uint32_t t2 = dht_load_be32(target->bytes + 16);
+
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t* id = p + i * stride;
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)id), t);
+        _mm_storeu_si128((__m128i*)out[i].w, _mm_shuffle_epi8(x, shuffle));
+        out[i].w[2] = dht_load_be32(id + 16) ^ t2;
+    }
+}
+
+// バッチ距離計算（AVX2版、2IDを1つの256ビットレジスタで処理）
+__attribute__((target("avx2")))
+static void distance_batch_avx2(const DhtId* target, const void* ids, size_t stride,
+                                size_t count, DhtDistance* out) {
+    const uint8_t* p = (const uint8_t*)ids;
+    const __m256i shuffle = _mm256_setr_epi8(DHT_BSWAP64_LANES, DHT_BSWAP64_LANES);
+    const __m128i t128 = _mm_loadu_si128((const __m128i*)target->bytes);
+    const __m256i t = _mm256_broadcastsi128_si256(t128);
+    const uint32_t t2 = dht_load_be32(target->bytes + 16);
+
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        const uint8_t* id0 = p + i * stride;
+        const uint8_t* id1 = id0 + stride;
+        __m256i x = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)id0)),
+            _mm_loadu_si128((const __m128i*)id1), 1);
+        x = _mm256_shuffle_epi8(_mm256_xor_si256(x, t), shuffle);
+        _mm_storeu_si128((__m128i*)out[i].w, _mm256_castsi256_si128(x));
+        _mm_storeu_si128((__m128i*)out[i + 1].w, _mm256_extracti128_si256(x, 1));
+        out[i].w[2] = dht_load_be32(id0 + 16) ^ t2;
+        out[i + 1].w[2] = dht_load_be32(id1 + 16) ^ t2;
+    }
+
+    if (i < count) {
+        const uint8_t* id = p + i * stride;
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)id), t128);
+        _mm_storeu_si128((__m128i*)out[i].w, _mm_shuffle_epi8(x, _mm256_castsi256_si128(shuffle)));
+        out[i].w[2] = dht_load_be32(id + 16) ^ t2;
+    }
+}
+
+#endif /* DHT_ID_HAVE_X86_KERNELS */
+
+// バッチ距離計算カーネルの一覧（測った速さが同じなら先のもの）
+typedef void (*DhtDistanceBatchFn)(const DhtId*, const void*, size_t, size_t, DhtDistance*);
+
+typedef struct {
+    const char* name;
+    DhtDistanceBatchFn fn;
+    bool (*supported)(void);
+} DhtIdKernel;
+
+static bool kernel_always_supported(void) {
+    return true;
+}
+
+#ifdef DHT_ID_HAVE_X86_KERNELS
+static bool kernel_avx2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool kernel_ssse3_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+#endif
+
+static const DhtIdKernel dht_id_kernels[] = {
+#ifdef DHT_ID_HAVE_X86_KERNELS
+    { "avx2", distance_batch_avx2, kernel_avx2_supported },
+    { "ssse3", distance_batch_ssse3, kernel_ssse3_supported },
+#endif
+    { "scalar", distance_batch_scalar, kernel_always_supported }
+};
+
+#define DHT_ID_KERNEL_COUNT ((int)(sizeof(dht_id_kernels) / sizeof(dht_id_kernels[0])))
+
+#define DHT_ID_CALIBRATE_IDS 1024   // 選択時に測るバッチの大きさ
+#define DHT_ID_CALIBRATE_ROUNDS 32  // 選択時に測る回数（カーネルごとに最短の時間を使う）
+#define DHT_ID_CALIBRATE_WARMUP_NS 100000 // 測る前に回し続ける時間（AVXのユニットが起きるまで）
+
+static const DhtIdKernel* active_kernel = NULL;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static uint64_t kernel_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// CPUがサポートするカーネルを測り、最速のものを選択
+// （まず各カーネルをDHT_ID_CALIBRATE_WARMUP_NSの間回してキャッシュと実行ユニットを温め、
+// その後はクロック変動が全カーネルに等しく効くよう1回ずつ交互に測って最短の時間で比べる。
+// 全体で1ミリ秒未満）
+static void select_best_kernel(void) {
+    static DhtId ids[DHT_ID_CALIBRATE_IDS];
+    static DhtDistance out[DHT_ID_CALIBRATE_IDS];
+    for (int i = 0; i < DHT_ID_CALIBRATE_IDS; i++) {
+        for (int j = 0; j < DHT_ID_BITS/8; j++) {
+            ids[i].bytes[j] = (uint8_t)(i * 31 + j * 7);
+        }
+    }
+    DhtId target = ids[DHT_ID_CALIBRATE_IDS / 2];
+
+    uint64_t kernel_ns[DHT_ID_KERNEL_COUNT];
+    for (int k = 0; k < DHT_ID_KERNEL_COUNT; k++) {
+        kernel_ns[k] = UINT64_MAX;
+        if (!dht_id_kernels[k].supported()) {
+            continue;
+        }
+        uint64_t warmup_start = kernel_now_ns();
+        while (kernel_now_ns() - warmup_start < DHT_ID_CALIBRATE_WARMUP_NS) {
+            dht_id_kernels[k].fn(&target, ids, sizeof(DhtId), DHT_ID_CALIBRATE_IDS, out);
+        }
+    }
+
+    for (int r = 0; r < DHT_ID_CALIBRATE_ROUNDS; r++) {
+        for (int k = 0; k < DHT_ID_KERNEL_COUNT; k++) {
+            if (!dht_id_kernels[k].supported()) {
+                continue;
+            }
+            uint64_t start = kernel_now_ns();
+            dht_id_kernels[k].fn(&target, ids, sizeof(DhtId), DHT_ID_CALIBRATE_IDS, out);
+            uint64_t elapsed = kernel_now_ns() - start;
+            if (elapsed < kernel_ns[k]) {
+                kernel_ns[k] = elapsed;
+            }
+        }
+    }
+
+    // スカラー版は常にサポートされているので必ずどれかが選ばれる
+    for (int k = 0; k < DHT_ID_KERNEL_COUNT; k++) {
+        if (kernel_ns[k] != UINT64_MAX &&
+            (active_kernel == NULL || kernel_ns[k] < kernel_ns[active_kernel - dht_id_kernels])) {
+            active_kernel = &dht_id_kernels[k];
+        }
+    }
+}
+
+// 1つのtargetから多数のIDへの距離を計算（idsはstrideバイト間隔で並ぶ）
+void dht_id_distance_batch(const DhtId* target, const void* ids, size_t stride,
+                           size_t count, DhtDistance* out) {
+    pthread_once(&kernel_once, select_best_kernel);
+    active_kernel->fn(target, ids, stride, count, out);
+}
+
+// 使用中のカーネル名
+const char* dht_id_kernel_name(void) {
+    pthread_once(&kernel_once, select_best_kernel);
+    return active_kernel->name;
+}
+
+// カーネルを名前で強制的に切り替える（ベンチマーク用）
+int dht_id_set_kernel(const char* name) {
+    pthread_once(&kernel_once, select_best_kernel);
+    for (int i = 0; i < DHT_ID_KERNEL_COUNT; i++) {
+        if (strcmp(dht_id_kernels[i].name, name) == 0 && dht_id_kernels[i].supported()) {
+            active_kernel = &dht_id_kernels[i];
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,112 @@
+#ifndef DHT_ID_H
+#define DHT_ID_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#define DHT_ID_BITS 160  // SHA-1ハッシュを使用
+
+// DHT ID（SHA-1ハッシュ、160ビット）
+typedef struct {
+    uint8_t bytes[DHT_ID_BITS/8];
+} DhtId;
+
+// XOR距離（先頭から64+64+32ビットのホストオーダーのワード、w[0]から順に比較）
+typedef struct {
+    uint64_t w[3];
+} DhtDistance;
+
+// ID演算
+//
+// 160ビットIDは先頭から64+64+32ビットのホストオーダーのワードに分けて扱う。
+// これによりXOR距離の比較は整数比較3回、共通プレフィックス長はCLZ1回で済む。
+// ルーティングのたびに呼ばれるため、ヘッダ内でインライン展開する。
+
+// ビッグエンディアンのバイト列をホストオーダーに変換
+static inline uint64_t dht_load_be64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t dht_load_be32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+// 2つのIDのXOR距離
+static inline void dht_id_xor(const DhtId* a, const DhtId* b, DhtDistance* out) {
+    out->w[0] = dht_load_be64(a->bytes) ^ dht_load_be64(b->bytes);
+    out->w[1] = dht_load_be64(a->bytes + 8) ^ dht_load_be64(b->bytes + 8);
+    out->w[2] = dht_load_be32(a->bytes + 16) ^ dht_load_be32(b->bytes + 16);
+}
+
+// 距離の先頭の0ビット数（= 共通プレフィックス長、同一なら DHT_ID_BITS）
+static inline int dht_distance_clz(const DhtDistance* d) {
+    if (d->w[0]) {
+        return __builtin_clzll(d->w[0]);
+    }
+    if (d->w[1]) {
+        return 64 + __builtin_clzll(d->w[1]);
+    }
+    if (d->w[2]) {
+        return 128 + __builtin_clzll(d->w[2]) - 32;
+    }
+    return DHT_ID_BITS;
+}
+
+// 距離の三方比較（aの方が小さければ負）
+static inline int dht_distance_cmp(const DhtDistance* a, const DhtDistance* b) {
+    if (a->w[0] != b->w[0]) {
+        return (a->w[0] < b->w[0]) ? -1 : 1;
+    }
+    if (a->w[1] != b->w[1]) {
+        return (a->w[1] < b->w[1]) ? -1 : 1;
+    }
+    if (a->w[2] != b->w[2]) {
+        return (a->w[2] < b->w[2]) ? -1 : 1;
+    }
+    return 0;
+}
+
+// targetから見てaがbより近ければ負、遠ければ正、同じなら0
+static inline int dht_id_cmp_distance(const DhtId* target, const DhtId* a, const DhtId* b) {
+    uint64_t t0 = dht_load_be64(target->bytes);
+    uint64_t a0 = dht_load_be64(a->bytes) ^ t0;
+    uint64_t b0 = dht_load_be64(b->bytes) ^ t0;
+    if (a0 != b0) {
+        return (a0 < b0) ? -1 : 1;
+    }
+
+    uint64_t t1 = dht_load_be64(target->bytes + 8);
+    uint64_t a1 = dht_load_be64(a->bytes + 8) ^ t1;
+    uint64_t b1 = dht_load_be64(b->bytes + 8) ^ t1;
+    if (a1 != b1) {
+        return (a1 < b1) ? -1 : 1;
+    }
+
+    uint32_t t2 = dht_load_be32(target->bytes + 16);
+    uint32_t a2 = dht_load_be32(a->bytes + 16) ^ t2;
+    uint32_t b2 = dht_load_be32(b->bytes + 16) ^ t2;
+    if (a2 != b2) {
+        return (a2 < b2) ? -1 : 1;
+    }
+    return 0;
+}
+
+// バッチ距離計算（dht_id.cで初回に各カーネルを測って最速のものを選択）
+void dht_id_distance_batch(const DhtId* target, const void* ids, size_t stride,
+                           size_t count, DhtDistance* out);
+const char* dht_id_kernel_name(void);
+int dht_id_set_kernel(const char* name);
+
+#endif /* DHT_ID_H */
@@ -0,0 +1,307 @@
+#include "dht_persist.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// DHT状態の永続化
+//
+// ルーティングテーブルと値ストアをmmapしたファイルに保存する。
+// 起動時はファイルをマップするだけで前回のルーティングテーブルが得られるため、
+// ディスカバリーを待たずにすぐルックアップできる。書き込みはマップ上で直接行い、
+// メンテナンススレッドが定期的にmsyncする。
+
+// 値ログのレコードサイズ（8バイト境界に揃える）
+static inline size_t record_size(size_t value_len) {
+    return (sizeof(DhtPersistRecord) + value_len + 7) & ~(size_t)7;
+}
+
+// ルーティング領域のサイズ
+static inline size_t routing_size() {
+    return sizeof(DhtPersistBucket) * DHT_ID_BITS;
+}
+
+// ファイルをマップ
+static uint8_t* persist_map(int fd, size_t len) {
+    void* map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to mmap DHT state file");
+        return NULL;
+    }
+    return (uint8_t*)map;
+}
+
+// 空のファイルレイアウトを作成
+static int persist_format(int fd, const DhtId* self_id, size_t log_cap, uint64_t generation,
+                          uint8_t** map_out, size_t* len_out) {
+    size_t routing_off = (sizeof(DhtPersistHeader) + 63) & ~(size_t)63;
+    size_t log_off = (routing_off + routing_size() + 4095) & ~(size_t)4095;
+    size_t len = log_off + log_cap;
+
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)len) < 0) {
+        perror("Failed to size DHT state file");
+        return -1;
+    }
+
+    uint8_t* map = persist_map(fd, len);
+    if (!map) {
+        return -1;
+    }
+
+    DhtPersistHeader* header = (DhtPersistHeader*)map;
+    header->magic = DHT_PERSIST_MAGIC;
+    header->version = DHT_PERSIST_VERSION;
+    header->id_bits = DHT_ID_BITS;
+    header->bucket_size = DHT_K;
+    header->self_id = *self_id;
+    header->routing_off = routing_off;
+    header->log_off = log_off;
+    header->log_cap = log_cap;
+    header->log_used = 0;
+    header->generation = generation;
+
+    *map_out = map;
+    *len_out = len;
+    return 0;
+}
+
+// ヘッダの検証
+static bool persist_header_valid(const DhtPersistHeader* header, size_t file_len) {
+    return header->magic == DHT_PERSIST_MAGIC &&
+           header->version == DHT_PERSIST_VERSION &&
+           header->id_bits == DHT_ID_BITS &&
+           header->bucket_size == DHT_K &&
+           header->routing_off >= sizeof(DhtPersistHeader) &&
+           header->routing_off + routing_size() <= header->log_off &&
+           header->log_used <= header->log_cap &&
+           header->log_off + header->log_cap <= file_len;
+}
+
+// ハンドルにマッピングを設定
+static void persist_attach(DhtPersist* persist, uint8_t* map, size_t len) {
+    persist->map = map;
+    persist->map_len = len;
+    persist->header = (DhtPersistHeader*)map;
+    persist->buckets = (DhtPersistBucket*)(map + persist->header->routing_off);
+}
+
+// 永続化ファイルを開く（存在しないか壊れていれば作り直す）
+DhtPersist* dht_persist_open(const char* path, const DhtId* self_id) {
+    DhtPersist* persist = (DhtPersist*)calloc(1, sizeof(DhtPersist));
+    if (!persist) {
+        perror("Failed to allocate DHT persistence");
+        return NULL;
+    }
+
+    strncpy(persist->path, path, sizeof(persist->path) - 1);
+    persist->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (persist->fd < 0) {
+        perror("Failed to open DHT state file");
+        free(persist);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(persist->fd, &st) == 0 && (size_t)st.st_size >= sizeof(DhtPersistHeader)) {
+        uint8_t* map = persist_map(persist->fd, (size_t)st.st_size);
+        if (map && persist_header_valid((DhtPersistHeader*)map, (size_t)st.st_size)) {
+            persist_attach(persist, map, (size_t)st.st_size);
+            persist->restored = true;
+            return persist;
+        }
+        if (map) {
+            munmap(map, (size_t)st.st_size);
+        }
+        printf("DHT state file %s is invalid or from another version, recreating\n", path);
+    }
+
+    uint8_t* map;
+    size_t len;
+    if (persist_format(persist->fd, self_id, DHT_PERSIST_INITIAL_LOG, 0, &map, &len) < 0) {
+        close(persist->fd);
+        free(persist);
+        return NULL;
+    }
+    persist_attach(persist, map, len);
+    return persist;
+}
+
+// 永続化ファイルを閉じる
+void dht_persist_close(DhtPersist* persist) {
+    if (!persist) {
+        return;
+    }
+    dht_persist_sync(persist, true);
+    munmap(persist->map, persist->map_len);
+    close(persist->fd);
+    free(persist);
+}
+
+// 変更をディスクへ書き出す（waitがfalseなら非同期）
+void dht_persist_sync(DhtPersist* persist, bool wait) {
+    if (persist && persist->map) {
+        msync(persist->map, persist->map_len, wait ? MS_SYNC : MS_ASYNC);
+    }
+}
+
+// バケットの内容をルーティング領域に書き込む
+void dht_persist_write_bucket(DhtPersist* persist, int bucket_idx, const DhtNodeInfo* nodes, int count,
+                              time_t last_updated) {
+    if (!persist || bucket_idx < 0 || bucket_idx >= DHT_ID_BITS || count < 0 || count > DHT_K) {
+        return;
+    }
+
+    DhtPersistBucket* out = &persist->buckets[bucket_idx];
+    for (int i = 0; i < count; i++) {
+        DhtPersistContact* contact = &out->nodes[i];
+        contact->id = nodes[i].id;
+        memset(contact->ip, 0, MAX_IP_STR_LEN);
+        strncpy(contact->ip, nodes[i].ip, MAX_IP_STR_LEN - 1);
+        contact->port = nodes[i].port;
+        contact->last_seen = nodes[i].last_seen;
+    }
+    if (count < DHT_K) {
+        memset(&out->nodes[count], 0, sizeof(DhtPersistContact) * (DHT_K - count));
+    }
+    out->last_updated = last_updated;
+    out->count = count;
+}
+
+// レコードを値ログの末尾に書き込む（容量の確認は呼び出し側）
+static void persist_write_record(uint8_t* log, uint64_t* used, const DhtId* key, const DhtId* member,
+                                 const void* value, size_t value_len, time_t expires_at) {
+    DhtPersistRecord* record = (DhtPersistRecord*)(log + *used);
+    record->value_len = (uint32_t)value_len;
+    record->expires_at = expires_at;
+    record->key = *key;
+    if (member) {
+        record->member = *member;
+    } else {
+        memset(&record->member, 0, sizeof(record->member));
+    }
+    memcpy(record + 1, value, value_len);
+    // 値本体を書いてからマジックを書き、途中で落ちたレコードは読み飛ばされるようにする
+    __atomic_store_n(&record->magic, DHT_PERSIST_RECORD_MAGIC, __ATOMIC_RELEASE);
+    *used += record_size(value_len);
+}
+
+// 値ログの作り直しに使うコンテキスト
+typedef struct {
+    uint8_t* log;
+    uint64_t used;
+    size_t live_bytes;
+} DhtPersistCompact;
+
+static void compact_measure(const DhtId* key, const DhtId* member, const void* value, size_t value_len,
+                            time_t expires_at, void* arg) {
+    (void)key; (void)member; (void)value; (void)expires_at;
+    ((DhtPersistCompact*)arg)->live_bytes += record_size(value_len);
+}
+
+static void compact_copy(const DhtId* key, const DhtId* member, const void* value, size_t value_len,
+                         time_t expires_at, void* arg) {
+    DhtPersistCompact* ctx = (DhtPersistCompact*)arg;
+    persist_write_record(ctx->log, &ctx->used, key, member, value, value_len, expires_at);
+}
+
+// 生きている値だけで新しいファイルを作り、アトミックに置き換える
+static int persist_compact(DhtPersist* persist, const DhtValueStore* live) {
+    DhtPersistCompact ctx = { NULL, 0, 0 };
+    dht_store_foreach(live, compact_measure, &ctx);
+
+    // 作り直した後に少なくとも半分は空きが残るようにする
+    size_t log_cap = persist->header->log_cap;
+    while (log_cap < ctx.live_bytes * 2) {
+        log_cap *= 2;
+    }
+
+    char tmp_path[sizeof(persist->path) + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", persist->path);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to create DHT state file");
+        return -1;
+    }
+
+    uint8_t* map;
+    size_t len;
+    if (persist_format(fd, &persist->header->self_id, log_cap, persist->header->generation + 1,
+                       &map, &len) < 0) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    DhtPersistHeader* header = (DhtPersistHeader*)map;
+    memcpy(map + header->routing_off, persist->buckets, routing_size());
+    ctx.log = map + header->log_off;
+    dht_store_foreach(live, compact_copy, &ctx);
+    header->log_used = ctx.used;
+
+    if (msync(map, len, MS_SYNC) < 0 || rename(tmp_path, persist->path) < 0) {
+        perror("Failed to replace DHT state file");
+        munmap(map, len);
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    munmap(persist->map, persist->map_len);
+    close(persist->fd);
+    persist->fd = fd;
+    persist_attach(persist, map, len);
+    return 0;
+}
+
+// 値をログに追記
+//
+// liveは追記する値を反映済みの値ストアで、ログが満杯のときはliveの内容で
+// ログを作り直す（作り直したログには追記する値も含まれる）。
+int dht_persist_append_value(DhtPersist* persist, const DhtId* key, const DhtId* member, const void* value,
+                             size_t value_len, time_t expires_at, const DhtValueStore* live) {
+    if (!persist) {
+        return -1;
+    }
+
+    DhtPersistHeader* header = persist->header;
+    if (header->log_used + record_size(value_len) > header->log_cap) {
+        return persist_compact(persist, live);
+    }
+
+    persist_write_record(persist->map + header->log_off, &header->log_used,
+                         key, member, value, value_len, expires_at);
+    return 0;
+}
+
+// 値ログを先頭から読み込んで値ストアに復元（返り値は復元後の値の数）
+int dht_persist_replay_values(DhtPersist* persist, DhtValueStore* store, time_t now) {
+    if (!persist) {
+        return 0;
+    }
+
+    const uint8_t* log = persist->map + persist->header->log_off;
+    uint64_t used = persist->header->log_used;
+    uint64_t offset = 0;
+
+    while (offset + sizeof(DhtPersistRecord) <= used) {
+        const DhtPersistRecord* record = (const DhtPersistRecord*)(log + offset);
+        if (record->magic != DHT_PERSIST_RECORD_MAGIC ||
+            offset + record_size(record->value_len) > used) {
+            // 書きかけのレコード以降は捨てる
+            printf("DHT state file %s: truncated value log at offset %llu\n",
+                   persist->path, (unsigned long long)offset);
+            persist->header->log_used = offset;
+            break;
+        }
+
+        // 後のレコードほど新しいので、順に上書きすれば最新の値が残る
+        if (record->expires_at > now) {
+            dht_store_put_member(store, &record->key, &record->member, record + 1, record->value_len,
+                                 record->expires_at);
+        } else {
+            dht_store_remove_member(store, &record->key, &record->member);
+        }
+        offset += record_size(record->value_len);
+    }
+
+    return store->entry_count;
+}
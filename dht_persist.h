@@ -0,0 +1,78 @@
+#ifndef DHT_PERSIST_H
+#define DHT_PERSIST_H
+
+#include "dht.h"
+
+// 永続化ファイルの設定
+#define DHT_PERSIST_MAGIC 0x53544844u          // "DHTS"
+#define DHT_PERSIST_VERSION 2
+#define DHT_PERSIST_RECORD_MAGIC 0x56544844u   // "DHTV"
+#define DHT_PERSIST_INITIAL_LOG (256 * 1024)   // 値ログの初期サイズ（バイト）
+#define DHT_PERSIST_STALE_GRACE 900            // 復元したノードを確認できるまでの猶予（秒）
+
+// ファイルヘッダ
+//
+// ファイルは「ヘッダ」「ルーティング領域」「値ログ」の順に並ぶ。
+// ルーティング領域はDHT_ID_BITS個のバケットを固定長で持ち、変更のあったバケットだけを
+// その場で書き換える。値ログは追記専用で、満杯になると生きている値だけで作り直す。
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t id_bits;            // レイアウト確認用（DHT_ID_BITS）
+    uint32_t bucket_size;        // レイアウト確認用（DHT_K）
+    DhtId self_id;               // 保存したノードのDHT ID
+    uint32_t reserved;
+    uint64_t routing_off;        // ルーティング領域のオフセット
+    uint64_t log_off;            // 値ログのオフセット
+    uint64_t log_cap;            // 値ログの容量
+    uint64_t log_used;           // 値ログの使用済みバイト数
+    uint64_t generation;         // 値ログを作り直した回数
+} DhtPersistHeader;
+
+// 保存形式のノード情報
+typedef struct {
+    DhtId id;
+    char ip[MAX_IP_STR_LEN];
+    int32_t port;
+    int64_t last_seen;
+} DhtPersistContact;
+
+// 保存形式のバケット
+typedef struct {
+    int32_t count;
+    int32_t reserved;
+    int64_t last_updated;
+    DhtPersistContact nodes[DHT_K];
+} DhtPersistBucket;
+
+// 値ログのレコード（直後に値本体が続き、8バイト境界に揃える）
+typedef struct {
+    uint32_t magic;
+    uint32_t value_len;
+    int64_t expires_at;
+    DhtId key;
+    DhtId member;                // メンバーID（単一の値は全て0）
+} DhtPersistRecord;
+
+// 永続化ハンドル
+typedef struct DhtPersist {
+    int fd;
+    char path[256];
+    uint8_t* map;                // ファイル全体のマッピング
+    size_t map_len;
+    DhtPersistHeader* header;
+    DhtPersistBucket* buckets;
+    bool restored;               // 既存のファイルから読み込んだか
+} DhtPersist;
+
+// 永続化関数プロトタイプ
+DhtPersist* dht_persist_open(const char* path, const DhtId* self_id);
+void dht_persist_close(DhtPersist* persist);
+void dht_persist_write_bucket(DhtPersist* persist, int bucket_idx, const DhtNodeInfo* nodes, int count,
+                              time_t last_updated);
+int dht_persist_append_value(DhtPersist* persist, const DhtId* key, const DhtId* member, const void* value,
+                             size_t value_len, time_t expires_at, const DhtValueStore* live);
+int dht_persist_replay_values(DhtPersist* persist, DhtValueStore* store, time_t now);
+void dht_persist_sync(DhtPersist* persist, bool wait);
+
+#endif /* DHT_PERSIST_H */
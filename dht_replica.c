@@ -0,0 +1,720 @@
+#include "dht_replica.h"
+#include "dht_rpc.h"
+
+// DHT値の複製
+//
+// Kademliaと同様に、値はルックアップで見つけたk個の最近傍ノードにSTOREする。
+// 自分が公開した値は有効期限より前に再公開し、保持している値は定期的にk近傍へ
+// 送り直す。ルーティングテーブルに新しいノードが加わり、そのノードがある値の
+// k近傍に入った場合は、その値を引き継ぐ。複製トラフィックはトークンバケットで
+// DHT_REPAIR_RATEバイト/秒に制限する。k近傍のルックアップは待たずに始め
+// （最大DHT_REPLICA_LOOKUPS件）、完了したものから後のtickでSTOREを送る。
+
+// 再公開の間隔（有効期限の3/4、上限DHT_REPUBLISH_INTERVAL）
+static time_t republish_interval(int ttl) {
+    time_t interval = (time_t)ttl * 3 / 4;
+    if (interval < 1) {
+        interval = 1;
+    }
+    return interval < DHT_REPUBLISH_INTERVAL ? interval : DHT_REPUBLISH_INTERVAL;
+}
+
+// STORE1件あたりの送信バイト数
+static size_t store_cost(size_t value_len) {
+    return DHT_WIRE_MAX_HEADER + DHT_RPC_STORE_PREFIX + value_len;
+}
+
+static const DhtId no_member;
+
+// キーとメンバーIDが一致するか
+static inline bool same_value(const DhtId* key_a, const DhtId* member_a, const DhtId* key_b, const DhtId* member_b) {
+    return memcmp(key_a->bytes, key_b->bytes, DHT_ID_BITS/8) == 0 &&
+           memcmp(member_a->bytes, member_b->bytes, DHT_ID_BITS/8) == 0;
+}
+
+// 複製の初期化
+int dht_replica_init(Node* node) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    DhtReplication* replication = (DhtReplication*)calloc(1, sizeof(DhtReplication));
+    if (!replication) {
+        perror("Failed to allocate DHT replication state");
+        return -1;
+    }
+
+    pthread_mutex_init(&replication->mutex, NULL);
+    replication->enabled = true;
+    replication->rate = DHT_REPAIR_RATE;
+    replication->tokens = DHT_REPAIR_RATE;
+    replication->next_replicate = time(NULL) + DHT_REPLICATE_INTERVAL;
+    dht_data->replication = replication;
+    return 0;
+}
+
+// 複製の終了処理
+void dht_replica_cleanup(Node* node) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    DhtReplication* replication = dht_data->replication;
+    if (!replication) {
+        return;
+    }
+
+    // 進行中のルックアップ（dht_rpc_cleanupで打ち切られている）を解放
+    for (int i = 0; replication->lookups && i < DHT_REPLICA_LOOKUPS; i++) {
+        if (replication->lookups[i].lookup) {
+            dht_lookup_finish(node, replication->lookups[i].lookup, NULL, 0, NULL, NULL);
+        }
+    }
+
+    pthread_mutex_destroy(&replication->mutex);
+    free(replication->queue);
+    free(replication->lookups);
+    free(replication->pending_acks);
+    free(replication->published);
+    free(replication);
+    dht_data->replication = NULL;
+}
+
+// タスクをキューに追加（replication->mutexを保持して呼ぶ）
+static void queue_push(DhtReplication* replication, const DhtReplicaTask* task) {
+    if (!replication->queue) {
+        replication->queue = (DhtReplicaTask*)malloc(sizeof(DhtReplicaTask) * DHT_REPLICA_QUEUE_SIZE);
+    }
+    if (!replication->queue || replication->queue_count == DHT_REPLICA_QUEUE_SIZE) {
+        replication->stats.dropped_tasks++;
+        return;
+    }
+    int idx = (replication->queue_head + replication->queue_count) % DHT_REPLICA_QUEUE_SIZE;
+    replication->queue[idx] = *task;
+    replication->queue_count++;
+}
+
+// 自分が公開した値を記録（replication->mutexを保持して呼ぶ）
+static bool record_publish(DhtReplication* replication, const DhtId* key, const DhtId* member, int ttl) {
+    DhtPublishedKey* entry = NULL;
+    for (int i = 0; i < replication->published_count; i++) {
+        if (same_value(&replication->published[i].key, &replication->published[i].member, key, member)) {
+            entry = &replication->published[i];
+            break;
+        }
+    }
+
+    if (!entry) {
+        if (replication->published_count == replication->published_cap) {
+            int new_cap = replication->published_cap ? replication->published_cap * 2 : 16;
+            DhtPublishedKey* grown = (DhtPublishedKey*)realloc(replication->published,
+                                                              sizeof(DhtPublishedKey) * new_cap);
+            if (!grown) {
+                return false;
+            }
+            replication->published = grown;
+            replication->published_cap = new_cap;
+        }
+        entry = &replication->published[replication->published_count++];
+        entry->key = *key;
+        entry->member = *member;
+        entry->replicas = 0;
+    }
+
+    entry->ttl = ttl;
+    entry->next_republish = time(NULL) + republish_interval(ttl);
+    return true;
+}
+
+// 自分が公開した値を記録し、複製を予約
+void dht_replica_on_publish(Node* node, const DhtId* key, const DhtId* member, int ttl) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    DhtReplication* replication = dht_data->replication;
+    if (!replication) {
+        return;
+    }
+    if (!member) {
+        member = &no_member;
+    }
+
+    pthread_mutex_lock(&replication->mutex);
+    if (record_publish(replication, key, member, ttl) && replication->enabled) {
+        DhtReplicaTask task;
+        memset(&task, 0, sizeof(task));
+        task.type = DHT_REPLICA_PUBLISH;
+        task.key = *key;
+        task.member = *member;
+        task.initial = true;
+        queue_push(replication, &task);
+    }
+    pthread_mutex_unlock(&replication->mutex);
+}
+
+// 自分が公開した値の取り下げ（再公開をやめる）
+void dht_replica_on_withdraw(Node* node, const DhtId* key, const DhtId* member) {
+    DhtReplication* replication = ((DhtData*)node->dht_data)->replication;
+    if (!replication) {
+        return;
+    }
+    if (!member) {
+        member = &no_member;
+    }
+
+    pthread_mutex_lock(&replication->mutex);
+    for (int i = 0; i < replication->published_count; i++) {
+        if (same_value(&replication->published[i].key, &replication->published[i].member, key, member)) {
+            replication->published[i] = replication->published[--replication->published_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&replication->mutex);
+}
+
+// バッチで公開した値を記録（初回のSTOREは呼び出し側がdht_replica_send_batch_storesで送る）
+//
+// 返り値は複製が有効か（falseなら送らない）。
+bool dht_replica_on_batch_publish(Node* node, const DhtId* key, const DhtId* member, int ttl) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    DhtReplication* replication = dht_data->replication;
+    if (!replication) {
+        return false;
+    }
+    if (!member) {
+        member = &no_member;
+    }
+
+    pthread_mutex_lock(&replication->mutex);
+    bool send = record_publish(replication, key, member, ttl) && replication->enabled;
+    pthread_mutex_unlock(&replication->mutex);
+    return send;
+}
+
+// ルーティングテーブルに新しいノードが加わった（dht_mutexを保持して呼ばれる）
+void dht_replica_on_new_contact(Node* node, const DhtNodeInfo* contact) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    DhtReplication* replication = dht_data->replication;
+    if (!replication) {
+        return;
+    }
+
+    pthread_mutex_lock(&replication->mutex);
+    if (replication->enabled && replication->new_contact_count < DHT_REPLICA_NEW_CONTACTS) {
+        dht_contact_pack(&replication->new_contacts[replication->new_contact_count++], contact);
+    }
+    pthread_mutex_unlock(&replication->mutex);
+}
+
+// STOREへの応答
+void dht_replica_on_store_reply(Node* node, uint32_t transaction_id, bool accepted) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    DhtReplication* replication = dht_data->replication;
+    if (!replication) {
+        return;
+    }
+
+    pthread_mutex_lock(&replication->mutex);
+    if (accepted) {
+        replication->stats.stores_acked++;
+    }
+
+    for (int i = 0; replication->pending_acks && i < DHT_REPLICA_PENDING_ACKS; i++) {
+        if (replication->pending_acks[i].transaction_id != transaction_id) {
+            continue;
+        }
+        replication->pending_acks[i].transaction_id = 0;
+        if (!accepted) {
+            break;
+        }
+        for (int j = 0; j < replication->published_count; j++) {
+            if (same_value(&replication->published[j].key, &replication->published[j].member,
+                           &replication->pending_acks[i].key, &replication->pending_acks[i].member)) {
+                replication->published[j].replicas++;
+                break;
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&replication->mutex);
+}
+
+// 値の読み出し（返り値は残りの有効期間、なければ0）
+static int read_local_value(DhtData* dht_data, const DhtId* key, const DhtId* member,
+                            uint8_t* value, size_t* value_len) {
+    time_t expires_at;
+    pthread_mutex_lock(&dht_data->store_mutex);
+    int result = dht_store_get_member(&dht_data->store, key, member, value, value_len, time(NULL), &expires_at);
+    pthread_mutex_unlock(&dht_data->store_mutex);
+
+    if (result < 0) {
+        return 0;
+    }
+    return (int)(expires_at - time(NULL));
+}
+
+// 値をSTOREで送る
+static void send_store(Node* node, DhtReplication* replication, const DhtNodeInfo* to, const DhtId* key,
+                       const DhtId* member, const uint8_t* value, size_t value_len, int ttl,
+                       bool initial_publish, bool track_ack) {
+    uint8_t data[MAX_BUFFER];
+    DhtWireWriter w;
+    dht_wire_writer_init(&w, data, sizeof(data));
+    dht_wire_put_varint(&w, (uint32_t)ttl);
+    dht_wire_put_id(&w, member);
+    dht_wire_put_bytes(&w, value, value_len);
+    if (w.error) {
+        return;
+    }
+
+    uint32_t transaction_id = dht_rpc_next_transaction(node);
+    if (transaction_id == 0) {
+        transaction_id = dht_rpc_next_transaction(node);  // 0は未使用の印
+    }
+
+    pthread_mutex_lock(&replication->mutex);
+    if (track_ack && !replication->pending_acks) {
+        replication->pending_acks = (DhtPendingAck*)calloc(DHT_REPLICA_PENDING_ACKS, sizeof(DhtPendingAck));
+    }
+    if (track_ack && replication->pending_acks) {
+        replication->pending_acks[replication->pending_next].transaction_id = transaction_id;
+        replication->pending_acks[replication->pending_next].key = *key;
+        replication->pending_acks[replication->pending_next].member = *member;
+        replication->pending_next = (replication->pending_next + 1) % DHT_REPLICA_PENDING_ACKS;
+    }
+    size_t cost = store_cost(value_len);
+    replication->tokens -= (double)cost;
+    replication->stats.stores_sent++;
+    if (initial_publish) {
+        replication->stats.publish_bytes += cost;
+    } else {
+        replication->stats.repair_bytes += cost;
+    }
+    pthread_mutex_unlock(&replication->mutex);
+
+    dht_rpc_send(node, to, DHT_STORE, key, transaction_id, data, (uint16_t)w.len);
+}
+
+// トークンの補充（最大1秒分。replication->mutexを保持して呼ぶ）
+static void refill_tokens(DhtReplication* replication, uint64_t now_ms) {
+    if (replication->last_refill_ms != 0) {
+        replication->tokens += (double)replication->rate * (now_ms - replication->last_refill_ms) / 1000.0;
+    }
+    if (replication->tokens > (double)replication->rate) {
+        replication->tokens = (double)replication->rate;
+    }
+    replication->last_refill_ms = now_ms;
+}
+
+// バッチで公開した値の初回のSTOREをk近傍へ送る（返り値は送った数）
+//
+// 複製のキューと同じトークンバケットに従う。トークンが足りなければ送らずに初回の公開を
+// キューに回し、メンテナンススレッドがレートの範囲で送る（返り値は0）。
+int dht_replica_send_batch_stores(Node* node, const DhtNodeInfo* to, int count, const DhtId* key,
+                                  const DhtId* member, const void* value, size_t value_len, int ttl) {
+    DhtReplication* replication = ((DhtData*)node->dht_data)->replication;
+    if (!replication || count <= 0) {
+        return 0;
+    }
+    if (!member) {
+        member = &no_member;
+    }
+
+    pthread_mutex_lock(&replication->mutex);
+    if (!replication->enabled) {
+        pthread_mutex_unlock(&replication->mutex);
+        return 0;
+    }
+    refill_tokens(replication, dht_rpc_now_ms(node));
+    double needed = (double)store_cost(value_len) * count;
+    if (needed > (double)replication->rate) {
+        needed = (double)replication->rate;
+    }
+    if (replication->tokens < needed) {
+        DhtReplicaTask task;
+        memset(&task, 0, sizeof(task));
+        task.type = DHT_REPLICA_PUBLISH;
+        task.key = *key;
+        task.member = *member;
+        task.initial = true;
+        queue_push(replication, &task);
+        replication->stats.throttled++;
+        pthread_mutex_unlock(&replication->mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&replication->mutex);
+
+    for (int i = 0; i < count; i++) {
+        send_store(node, replication, &to[i], key, member, (const uint8_t*)value, value_len, ttl, true, true);
+    }
+    return count;
+}
+
+// 値をSTOREで1件送る（トラフィックはレート制限のトークンから差し引くが、待たない）
+void dht_replica_send_store(Node* node, const DhtNodeInfo* to, const DhtId* key, const DhtId* member,
+                            const void* value, size_t value_len, int ttl) {
+    DhtReplication* replication = ((DhtData*)node->dht_data)->replication;
+    if (!replication) {
+        return;
+    }
+    send_store(node, replication, to, key, member ? member : &no_member, (const uint8_t*)value, value_len, ttl,
+               true, true);
+}
+
+// 公開・複製タスクの開始（k近傍のルックアップを始める。replication->lookupsの空きを
+// 予約し、reservedのトークンを差し引いてから呼ぶ）
+static void start_replicate_task(Node* node, DhtReplication* replication, const DhtReplicaTask* task,
+                                 const uint8_t* value, size_t value_len, double reserved) {
+    int ttl = 0;
+    bool original = false;
+    if (task->type == DHT_REPLICA_PUBLISH) {
+        pthread_mutex_lock(&replication->mutex);
+        for (int i = 0; i < replication->published_count; i++) {
+            DhtPublishedKey* entry = &replication->published[i];
+            if (same_value(&entry->key, &entry->member, &task->key, &task->member)) {
+                ttl = entry->ttl;
+                entry->replicas = 0;
+                original = true;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&replication->mutex);
+
+        // 再公開ではローカルの有効期限も延ばす
+        if (original && !task->initial) {
+            dht_store_replica(node, &task->key, &task->member, value, value_len, time(NULL) + ttl);
+        }
+    }
+
+    DhtLookup* lookup = dht_lookup_start(node, &task->key, false, DHT_LOOKUP_DEFAULT_TIMEOUT_MS);
+
+    pthread_mutex_lock(&replication->mutex);
+    if (!lookup) {
+        replication->lookup_count--;
+        replication->tokens += reserved;
+        pthread_mutex_unlock(&replication->mutex);
+        return;
+    }
+    for (int i = 0; i < DHT_REPLICA_LOOKUPS; i++) {
+        DhtReplicaLookup* slot = &replication->lookups[i];
+        if (!slot->lookup) {
+            slot->task = *task;
+            slot->lookup = lookup;
+            slot->ttl = ttl;
+            slot->original = original;
+            slot->reserved = reserved;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&replication->mutex);
+}
+
+// 完了したルックアップのk近傍へSTOREを送る
+static void finish_replicate_lookups(Node* node, DhtReplication* replication) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    uint8_t value[MAX_BUFFER - DHT_RPC_STORE_PREFIX];
+
+    for (int i = 0; replication->lookups && i < DHT_REPLICA_LOOKUPS; i++) {
+        DhtReplicaLookup* slot = &replication->lookups[i];
+        if (!slot->lookup || !dht_lookup_is_done(node, slot->lookup)) {
+            continue;
+        }
+        DhtNodeInfo closest[DHT_K];
+        int count = dht_lookup_finish(node, slot->lookup, closest, DHT_K, NULL, NULL);
+
+        pthread_mutex_lock(&replication->mutex);
+        DhtReplicaLookup done = *slot;
+        slot->lookup = NULL;
+        replication->lookup_count--;
+        replication->tokens += done.reserved;
+        bool enabled = replication->enabled;
+        pthread_mutex_unlock(&replication->mutex);
+
+        // ルックアップの間に期限切れか追い出しになった値は送らない
+        size_t value_len = sizeof(value);
+        int remaining = read_local_value(dht_data, &done.task.key, &done.task.member, value, &value_len);
+        if (!enabled || remaining <= 0) {
+            continue;
+        }
+        for (int j = 0; j < count; j++) {
+            send_store(node, replication, &closest[j], &done.task.key, &done.task.member, value, value_len,
+                       done.original ? done.ttl : remaining, done.task.initial, done.original);
+        }
+    }
+}
+
+// 保持している値のキーを集める
+typedef struct {
+    DhtId* keys;
+    DhtId* members;
+    int count;
+    int cap;
+} DhtKeyList;
+
+static void collect_key(const DhtId* key, const DhtId* member, const void* value, size_t value_len,
+                        time_t expires_at, void* arg) {
+    (void)value; (void)value_len; (void)expires_at;
+    DhtKeyList* list = (DhtKeyList*)arg;
+    if (list->count < list->cap) {
+        list->keys[list->count] = *key;
+        list->members[list->count] = *member;
+        list->count++;
+    }
+}
+
+static DhtKeyList collect_local_keys(DhtData* dht_data) {
+    DhtKeyList list = { NULL, NULL, 0, 0 };
+    pthread_mutex_lock(&dht_data->store_mutex);
+    int cap = dht_data->store.entry_count;
+    if (cap > 0) {
+        list.keys = (DhtId*)malloc(sizeof(DhtId) * cap);
+        list.members = (DhtId*)malloc(sizeof(DhtId) * cap);
+        if (list.keys && list.members) {
+            list.cap = cap;
+            dht_store_foreach(&dht_data->store, collect_key, &list);
+        }
+    }
+    pthread_mutex_unlock(&dht_data->store_mutex);
+    return list;
+}
+
+// 新しいノードにkeyを渡すべきか（新しいノードがk近傍に入り、自分も担当している）
+static bool should_hand_off(Node* node, const DhtId* key, const DhtContact* contact) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    DhtNodeInfo closest[DHT_K];
+    int count = dht_find_node(node, key, closest, DHT_K);
+
+    bool contact_in_range = false;
+    for (int i = 0; i < count; i++) {
+        if (memcmp(closest[i].id.bytes, contact->id.bytes, DHT_ID_BITS/8) == 0) {
+            contact_in_range = true;
+            break;
+        }
+    }
+    if (!contact_in_range) {
+        return false;
+    }
+
+    // 自分よりkeyに近いノードがk個以上いれば、引き継ぎは彼らに任せる
+    return count < DHT_K ||
+           dht_id_cmp_distance(key, &dht_data->routing_table->self_id, &closest[count - 1].id) < 0;
+}
+
+// 複製の定期処理（メンテナンススレッドから毎秒呼ばれる）
+void dht_replica_tick(Node* node) {
+    if (!node->dht_data) {
+        return;
+    }
+
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    DhtReplication* replication = dht_data->replication;
+    if (!replication) {
+        return;
+    }
+
+    uint64_t now_ms = dht_rpc_now_ms(node);
+    time_t now = time(NULL);
+    bool replicate_all = false;
+    DhtContact new_contacts[DHT_REPLICA_NEW_CONTACTS];
+    int new_contact_count = 0;
+
+    // 前のtickまでに始めたルックアップの結果を送る（無効にされていれば捨てる）
+    finish_replicate_lookups(node, replication);
+
+    pthread_mutex_lock(&replication->mutex);
+    if (!replication->enabled) {
+        pthread_mutex_unlock(&replication->mutex);
+        return;
+    }
+
+    refill_tokens(replication, now_ms);
+
+    // 再公開の時期が来た値
+    for (int i = 0; i < replication->published_count; i++) {
+        DhtPublishedKey* entry = &replication->published[i];
+        if (entry->next_republish <= now) {
+            DhtReplicaTask task;
+            memset(&task, 0, sizeof(task));
+            task.type = DHT_REPLICA_PUBLISH;
+            task.key = entry->key;
+            task.member = entry->member;
+            queue_push(replication, &task);
+            entry->next_republish = now + republish_interval(entry->ttl);
+        }
+    }
+
+    if (now >= replication->next_replicate) {
+        replication->next_replicate = now + DHT_REPLICATE_INTERVAL;
+        replication->stats.republish_rounds++;
+        replicate_all = true;
+    }
+
+    new_contact_count = replication->new_contact_count;
+    memcpy(new_contacts, replication->new_contacts, sizeof(DhtContact) * new_contact_count);
+    replication->new_contact_count = 0;
+    pthread_mutex_unlock(&replication->mutex);
+
+    // 保持している値の再複製と、新しいノードへの引き継ぎを予約
+    if (replicate_all || new_contact_count > 0) {
+        DhtKeyList keys = collect_local_keys(dht_data);
+        for (int i = 0; i < keys.count; i++) {
+            DhtReplicaTask task;
+            memset(&task, 0, sizeof(task));
+            task.key = keys.keys[i];
+            task.member = keys.members[i];
+
+            if (replicate_all) {
+                task.type = DHT_REPLICA_REPLICATE;
+                pthread_mutex_lock(&replication->mutex);
+                queue_push(replication, &task);
+                pthread_mutex_unlock(&replication->mutex);
+            }
+
+            for (int j = 0; j < new_contact_count; j++) {
+                if (should_hand_off(node, &keys.keys[i], &new_contacts[j])) {
+                    task.type = DHT_REPLICA_HANDOFF;
+                    task.contact = new_contacts[j];
+                    pthread_mutex_lock(&replication->mutex);
+                    queue_push(replication, &task);
+                    pthread_mutex_unlock(&replication->mutex);
+                }
+            }
+        }
+        free(keys.keys);
+        free(keys.members);
+    }
+
+    // トークンの範囲でタスクを処理（送信分のトークンかルックアップの空きがなければ次回へ）
+    uint8_t value[MAX_BUFFER - DHT_RPC_STORE_PREFIX];
+    while (!dht_data->shutting_down) {
+        DhtReplicaTask task;
+        pthread_mutex_lock(&replication->mutex);
+        if (replication->queue_count == 0) {
+            pthread_mutex_unlock(&replication->mutex);
+            break;
+        }
+        task = replication->queue[replication->queue_head];
+        pthread_mutex_unlock(&replication->mutex);
+
+        size_t value_len = sizeof(value);
+        int ttl = read_local_value(dht_data, &task.key, &task.member, value, &value_len);
+
+        pthread_mutex_lock(&replication->mutex);
+        double needed = 0;
+        if (ttl > 0) {
+            // 1回の送信量が上限を超える場合は、トークンが満タンになるまで待つ
+            needed = (double)store_cost(value_len) * (task.type == DHT_REPLICA_HANDOFF ? 1 : DHT_K);
+            if (needed > (double)replication->rate) {
+                needed = (double)replication->rate;
+            }
+            if (replication->tokens < needed) {
+                replication->stats.throttled++;
+                pthread_mutex_unlock(&replication->mutex);
+                break;
+            }
+            if (task.type != DHT_REPLICA_HANDOFF) {
+                if (!replication->lookups) {
+                    replication->lookups = (DhtReplicaLookup*)calloc(DHT_REPLICA_LOOKUPS, sizeof(DhtReplicaLookup));
+                }
+                if (!replication->lookups || replication->lookup_count == DHT_REPLICA_LOOKUPS) {
+                    pthread_mutex_unlock(&replication->mutex);
+                    break;
+                }
+                // 送るのはルックアップの完了後なので、それまでの分のトークンを先に差し引く
+                replication->lookup_count++;
+                replication->tokens -= needed;
+            }
+        }
+        replication->queue_head = (replication->queue_head + 1) % DHT_REPLICA_QUEUE_SIZE;
+        replication->queue_count--;
+        if (ttl > 0 && task.type == DHT_REPLICA_HANDOFF) {
+            replication->stats.handoffs++;
+        }
+        pthread_mutex_unlock(&replication->mutex);
+
+        if (ttl <= 0) {
+            continue;  // 期限切れか追い出された
+        }
+
+        if (task.type == DHT_REPLICA_HANDOFF) {
+            DhtNodeInfo contact;
+            dht_contact_unpack(&task.contact, &contact);
+            send_store(node, replication, &contact, &task.key, &task.member, value, value_len, ttl,
+                       false, false);
+        } else {
+            start_replicate_task(node, replication, &task, value, value_len, needed);
+        }
+    }
+}
+
+// 複製の統計を取得
+void dht_get_replication_stats(Node* node, DhtReplicationStats* stats) {
+    memset(stats, 0, sizeof(DhtReplicationStats));
+    if (!node->dht_data) {
+        return;
+    }
+
+    DhtReplication* replication = ((DhtData*)node->dht_data)->replication;
+    if (!replication) {
+        return;
+    }
+
+    pthread_mutex_lock(&replication->mutex);
+    *stats = replication->stats;
+    stats->published_keys = replication->published_count;
+    stats->queue_depth = replication->queue_count + replication->lookup_count;
+    stats->lookups = replication->lookup_count;
+    stats->min_replicas = replication->published_count > 0 ? DHT_K : 0;
+
+    int total = 0;
+    for (int i = 0; i < replication->published_count; i++) {
+        int replicas = replication->published[i].replicas;
+        total += replicas;
+        if (replicas < stats->min_replicas) {
+            stats->min_replicas = replicas;
+        }
+    }
+    if (replication->published_count > 0) {
+        stats->avg_replicas = (double)total / replication->published_count;
+    }
+    pthread_mutex_unlock(&replication->mutex);
+}
+
+// 複製の状態が確保しているメモリ量
+size_t dht_replica_footprint(Node* node) {
+    if (!node->dht_data) {
+        return 0;
+    }
+
+    DhtReplication* replication = ((DhtData*)node->dht_data)->replication;
+    if (!replication) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&replication->mutex);
+    size_t bytes = sizeof(DhtReplication) + sizeof(DhtPublishedKey) * (size_t)replication->published_cap;
+    if (replication->queue) {
+        bytes += sizeof(DhtReplicaTask) * DHT_REPLICA_QUEUE_SIZE;
+    }
+    if (replication->lookups) {
+        bytes += sizeof(DhtReplicaLookup) * DHT_REPLICA_LOOKUPS;
+    }
+    if (replication->pending_acks) {
+        bytes += sizeof(DhtPendingAck) * DHT_REPLICA_PENDING_ACKS;
+    }
+    pthread_mutex_unlock(&replication->mutex);
+    return bytes;
+}
+
+// 複製の有効・無効とレート上限の設定（rateが0なら既定値）
+void dht_set_replication(Node* node, bool enabled, size_t rate) {
+    if (!node->dht_data) {
+        return;
+    }
+
+    DhtReplication* replication = ((DhtData*)node->dht_data)->replication;
+    if (!replication) {
+        return;
+    }
+
+    pthread_mutex_lock(&replication->mutex);
+    replication->enabled = enabled;
+    replication->rate = rate ? rate : DHT_REPAIR_RATE;
+    if (!enabled) {
+        replication->queue_count = 0;
+        replication->new_contact_count = 0;
+    }
+    pthread_mutex_unlock(&replication->mutex);
+}
@@ -0,0 +1,117 @@
+#ifndef DHT_REPLICA_H
+#define DHT_REPLICA_H
+
+#include "dht.h"
+
+// 複製の設定
+#define DHT_REPLICATE_INTERVAL 3600      // 保持している全ての値をk近傍へ複製し直す間隔（秒）
+#define DHT_REPUBLISH_INTERVAL 86400     // 自分が公開した値の再公開間隔の上限（秒）
+#define DHT_REPAIR_RATE (32 * 1024)      // 複製トラフィックの上限（バイト/秒）
+#define DHT_REPLICA_QUEUE_SIZE 1024      // 複製タスクキューの長さ
+#define DHT_REPLICA_PENDING_ACKS 256     // 応答待ちのSTOREの記録数
+#define DHT_REPLICA_NEW_CONTACTS 64      // 引き継ぎ判定待ちの新しいノード数
+#define DHT_REPLICA_LOOKUPS 32           // 同時に進める公開・複製のルックアップ数
+
+// 複製タスクの種類
+typedef enum {
+    DHT_REPLICA_PUBLISH = 0,     // 自分が公開した値をk近傍へ送る
+    DHT_REPLICA_REPLICATE,       // 保持している値をk近傍へ送り直す
+    DHT_REPLICA_HANDOFF          // 近傍に加わったノードへ値を渡す
+} DhtReplicaTaskType;
+
+// 複製タスク
+typedef struct {
+    DhtReplicaTaskType type;
+    DhtId key;
+    DhtId member;                // キーのメンバーID（単一の値は全て0）
+    DhtContact contact;          // HANDOFFの送信先
+    bool initial;                // 初回の公開（再公開ではない）
+} DhtReplicaTask;
+
+// 自分が公開した値
+typedef struct {
+    DhtId key;
+    DhtId member;
+    int ttl;                     // 公開時に指定した有効期間（秒）
+    time_t next_republish;
+    int replicas;                // 直近の公開でSTOREを受理したノード数
+} DhtPublishedKey;
+
+// 複製の統計
+typedef struct {
+    int published_keys;          // 自分が公開している値の数
+    double avg_replicas;         // 公開した値あたりの平均レプリカ数
+    int min_replicas;            // 最もレプリカが少ない値のレプリカ数
+    int queue_depth;             // 未処理の複製タスク数（ルックアップ中を含む）
+    int lookups;                 // ルックアップ中の公開・複製タスク数
+    uint64_t stores_sent;        // 送信したSTORE数
+    uint64_t stores_acked;       // 受理されたSTORE数
+    uint64_t publish_bytes;      // 初回公開の送信バイト数
+    uint64_t repair_bytes;       // 再公開・再複製・引き継ぎの送信バイト数
+    uint64_t republish_rounds;   // 再公開・再複製の周回数
+    uint64_t handoffs;           // 新しいノードへの引き継ぎ数
+    uint64_t throttled;          // レート制限で次回に回した回数
+    uint64_t dropped_tasks;      // キューが満杯で捨てたタスク数
+} DhtReplicationStats;
+
+// k近傍のルックアップ中の公開・複製タスク
+typedef struct {
+    DhtReplicaTask task;
+    struct DhtLookup* lookup;    // NULLなら空き
+    int ttl;                     // 自分が公開した値なら公開時の有効期間（0なら残りの有効期間を送る）
+    bool original;               // 自分が公開した値（STOREの受理を数える）
+    double reserved;             // 開始時に差し引いたトークン（完了時に戻し、実際の送信分を引く）
+} DhtReplicaLookup;
+
+// 応答待ちのSTORE
+typedef struct {
+    uint32_t transaction_id;
+    DhtId key;
+    DhtId member;
+} DhtPendingAck;
+
+// 複製の状態
+//
+// キューと応答待ちの記録は大きいため、使い始めたときに確保する（値を公開も保持も
+// しないノードでは確保しない）。公開・複製タスクのk近傍のルックアップはメンテナンス
+// スレッドを止めないように非同期に始め、完了したものは次のtickでSTOREを送る。
+typedef struct DhtReplication {
+    pthread_mutex_t mutex;
+    bool enabled;
+    DhtReplicaTask* queue;       // DHT_REPLICA_QUEUE_SIZE件のリングバッファ
+    int queue_head;
+    int queue_count;
+    DhtReplicaLookup* lookups;   // DHT_REPLICA_LOOKUPS件（メンテナンススレッドだけが書き換える）
+    int lookup_count;
+    DhtPublishedKey* published;
+    int published_count;
+    int published_cap;
+    DhtPendingAck* pending_acks; // DHT_REPLICA_PENDING_ACKS件のリングバッファ
+    int pending_next;
+    DhtContact new_contacts[DHT_REPLICA_NEW_CONTACTS];
+    int new_contact_count;
+    double tokens;               // レート制限のトークン（バイト）
+    uint64_t last_refill_ms;
+    size_t rate;                 // 複製トラフィックの上限（バイト/秒）
+    time_t next_replicate;
+    DhtReplicationStats stats;
+} DhtReplication;
+
+// 複製関数プロトタイプ
+int dht_replica_init(Node* node);
+void dht_replica_cleanup(Node* node);
+void dht_replica_on_publish(Node* node, const DhtId* key, const DhtId* member, int ttl);
+void dht_replica_on_withdraw(Node* node, const DhtId* key, const DhtId* member);
+bool dht_replica_on_batch_publish(Node* node, const DhtId* key, const DhtId* member, int ttl);
+int dht_replica_send_batch_stores(Node* node, const DhtNodeInfo* to, int count, const DhtId* key,
+                                  const DhtId* member, const void* value, size_t value_len, int ttl);
+void dht_replica_send_store(Node* node, const DhtNodeInfo* to, const DhtId* key, const DhtId* member,
+                            const void* value, size_t value_len, int ttl);
+void dht_replica_on_new_contact(Node* node, const DhtNodeInfo* contact);
+void dht_replica_on_store_reply(Node* node, uint32_t transaction_id, bool accepted);
+void dht_replica_tick(Node* node);
+void dht_get_replication_stats(Node* node, DhtReplicationStats* stats);
+void dht_set_replication(Node* node, bool enabled, size_t rate);
+size_t dht_replica_footprint(Node* node);
+
+#endif /* DHT_REPLICA_H */
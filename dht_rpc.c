@@ -0,0 +1,1087 @@
+#include "dht_rpc.h"
+#include "dht_replica.h"
+#include <errno.h>
+
+// DHT RPC
+//
+// ノードのUDPソケット上でDHTメッセージを送受信する。送信は差し替え可能な
+// トランスポート（既定はsendto）を通すため、シミュレーターからも同じコードを動かせる。
+// パケットの形式はdht_wire.hで定義し、受信スレッドは先頭の"DHT"で通常のMessageと区別する。
+
+// 既定のトランスポート（ノードのソケットから送信）
+static int default_send(void* ctx, Node* from, const struct sockaddr_in* to, const void* buf, size_t len) {
+    (void)ctx;
+    if (from->socket_fd < 0) {
+        return -1;
+    }
+    ssize_t sent = sendto(from->socket_fd, buf, len, 0, (const struct sockaddr*)to, sizeof(*to));
+    return sent == (ssize_t)len ? 0 : -1;
+}
+
+static uint64_t default_now_ms(void* ctx) {
+    (void)ctx;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// RPCの初期化（dht_initから呼ばれる）
+void dht_rpc_init(Node* node) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    pthread_mutex_init(&dht_data->rpc_mutex, NULL);
+    dht_data->transport.send = default_send;
+    dht_data->transport.now_ms = default_now_ms;
+    dht_data->transport.ctx = NULL;
+    dht_data->lookups = NULL;
+
+    uint32_t seed;
+    DhtId random_id = dht_generate_id();
+    memcpy(&seed, random_id.bytes, sizeof(seed));
+    atomic_init(&dht_data->next_transaction, seed);
+}
+
+// RPCの終了処理（進行中のルックアップは打ち切る）
+void dht_rpc_cleanup(Node* node) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+
+    pthread_mutex_lock(&dht_data->rpc_mutex);
+    for (DhtLookup* lookup = dht_data->lookups; lookup; lookup = lookup->next) {
+        lookup->done = true;
+        pthread_cond_broadcast(&lookup->cond);
+    }
+    pthread_mutex_unlock(&dht_data->rpc_mutex);
+}
+
+// トランスポートの差し替え
+void dht_set_transport(Node* node, const DhtTransport* transport) {
+    if (!node->dht_data || !transport) {
+        return;
+    }
+
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    pthread_mutex_lock(&dht_data->rpc_mutex);
+    dht_data->transport = *transport;
+    if (!dht_data->transport.send) {
+        dht_data->transport.send = default_send;
+    }
+    if (!dht_data->transport.now_ms) {
+        dht_data->transport.now_ms = default_now_ms;
+    }
+    pthread_mutex_unlock(&dht_data->rpc_mutex);
+}
+
+// 現在時刻（ミリ秒、トランスポートの時計）
+uint64_t dht_rpc_now_ms(Node* node) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    return dht_data->transport.now_ms(dht_data->transport.ctx);
+}
+
+// 新しいトランザクションID
+uint32_t dht_rpc_next_transaction(Node* node) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    return atomic_fetch_add(&dht_data->next_transaction, 1);
+}
+
+// DHTパケットかどうか
+bool dht_is_packet(const void* buf, size_t len) {
+    return dht_wire_is_packet(buf, len);
+}
+
+// メッセージを送信
+int dht_rpc_send(Node* node, const DhtNodeInfo* to, DhtMessageType type, const DhtId* target,
+                 uint32_t transaction_id, const void* data, uint16_t data_len) {
+    if (!node->dht_data || data_len > MAX_BUFFER) {
+        return -1;
+    }
+
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(to->port);
+    if (inet_pton(AF_INET, to->ip, &addr.sin_addr) != 1) {
+        return -1;
+    }
+
+    uint8_t packet[DHT_RPC_MAX_PACKET];
+    size_t packet_len = dht_wire_encode_packet(packet, sizeof(packet), (uint8_t)type,
+                                               &dht_data->routing_table->self_id, target, transaction_id,
+                                               data, data_len);
+    if (packet_len == 0) {
+        return -1;
+    }
+
+    return dht_data->transport.send(dht_data->transport.ctx, node, &addr, packet, packet_len);
+}
+
+// ノード一覧をエンコード
+static void encode_contacts(DhtWireWriter* w, const DhtNodeInfo* nodes, int count) {
+    DhtWireContact contacts[DHT_K];
+    int written = 0;
+
+    for (int i = 0; i < count && written < DHT_K; i++) {
+        DhtWireContact* contact = &contacts[written];
+        memset(contact, 0, sizeof(DhtWireContact));
+        if (inet_pton(AF_INET, nodes[i].ip, contact->addr) == 1) {
+            contact->family = DHT_WIRE_IPV4;
+        } else if (inet_pton(AF_INET6, nodes[i].ip, contact->addr) == 1) {
+            contact->family = DHT_WIRE_IPV6;
+        } else {
+            continue;
+        }
+        contact->id = nodes[i].id;
+        contact->port = (uint16_t)nodes[i].port;
+        written++;
+    }
+
+    dht_wire_put_contacts(w, contacts, written);
+}
+
+// ノード一覧をデコード
+//
+// 送信はIPv4のソケットだけなので、IPv6のノードは読み飛ばす。
+static int decode_contacts(DhtWireReader* r, DhtNodeInfo* nodes, int max_nodes) {
+    DhtWireContact contacts[DHT_K];
+    int count = dht_wire_get_contacts(r, contacts, max_nodes < DHT_K ? max_nodes : DHT_K);
+    int decoded = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (contacts[i].family != DHT_WIRE_IPV4) {
+            continue;
+        }
+        DhtNodeInfo* info = &nodes[decoded++];
+        memset(info, 0, sizeof(DhtNodeInfo));
+        info->id = contacts[i].id;
+        inet_ntop(AF_INET, contacts[i].addr, info->ip, MAX_IP_STR_LEN);
+        info->port = contacts[i].port;
+    }
+    return decoded;
+}
+
+// ルックアップに候補を追加（距離順を保つ）
+static void lookup_insert(DhtLookup* lookup, const DhtNodeInfo* info, const DhtId* self_id, uint8_t hops) {
+    if (memcmp(info->id.bytes, self_id->bytes, DHT_ID_BITS/8) == 0) {
+        return;
+    }
+
+    int pos = lookup->candidate_count;
+    for (int i = 0; i < lookup->candidate_count; i++) {
+        int cmp = dht_id_cmp_distance(&lookup->target, &info->id, &lookup->candidates[i].info.id);
+        if (cmp == 0) {
+            return;  // 既に候補にある
+        }
+        if (cmp < 0 && pos == lookup->candidate_count) {
+            pos = i;
+        }
+    }
+
+    if (pos >= DHT_LOOKUP_MAX_CANDIDATES) {
+        return;
+    }
+    if (lookup->candidate_count == DHT_LOOKUP_MAX_CANDIDATES) {
+        // 最も遠い候補を捨てる（応答待ちなら以後の応答は無視される）
+        if (lookup->candidates[DHT_LOOKUP_MAX_CANDIDATES - 1].state == DHT_CANDIDATE_WAITING) {
+            lookup->in_flight--;
+        }
+        lookup->candidate_count--;
+    }
+
+    memmove(&lookup->candidates[pos + 1], &lookup->candidates[pos],
+            sizeof(DhtLookupCandidate) * (lookup->candidate_count - pos));
+    DhtLookupCandidate* candidate = &lookup->candidates[pos];
+    memset(candidate, 0, sizeof(DhtLookupCandidate));
+    candidate->info = *info;
+    candidate->state = DHT_CANDIDATE_NEW;
+    candidate->hops = hops;
+    lookup->candidate_count++;
+}
+
+// ルックアップを進める（rpc_mutexを保持して呼ぶ）
+// 候補がルックアップの対象範囲のプレフィックスを共有しているか
+static bool lookup_in_prefix(const DhtLookup* lookup, const DhtId* id) {
+    if (lookup->prefix_bits <= 0) {
+        return false;
+    }
+    DhtDistance d;
+    dht_id_xor(&lookup->target, id, &d);
+    return dht_distance_clz(&d) >= lookup->prefix_bits;
+}
+
+static void lookup_step(Node* node, DhtLookup* lookup, uint64_t now) {
+    if (lookup->done) {
+        return;
+    }
+
+    // タイムアウトした問い合わせを失敗とする
+    for (int i = 0; i < lookup->candidate_count; i++) {
+        DhtLookupCandidate* candidate = &lookup->candidates[i];
+        if (candidate->state == DHT_CANDIDATE_WAITING && now - candidate->sent_at >= DHT_RPC_TIMEOUT_MS) {
+            candidate->state = DHT_CANDIDATE_FAILED;
+            lookup->in_flight--;
+            dht_node_failed(node, &candidate->info.id);  // rpc_mutexを保持したままdht_mutexを取る
+        }
+    }
+
+    if (lookup->value_found || now >= lookup->deadline) {
+        lookup->done = true;
+        pthread_cond_broadcast(&lookup->cond);
+        return;
+    }
+
+    // 近い方からDHT_K個の生きている候補のうち、未問い合わせのものへ問い合わせる
+    // （prefix_bitsがあれば、プレフィックスを共有する候補は全て問い合わせる。候補は近い順なので先頭に並ぶ）
+    DhtMessageType type = lookup->find_value ? DHT_FIND_VALUE : DHT_FIND_NODE;
+    uint8_t cursor[DHT_RPC_CURSOR_LEN];
+    DhtWireWriter cursor_writer;
+    dht_wire_writer_init(&cursor_writer, cursor, sizeof(cursor));
+    dht_wire_put_varint(&cursor_writer, lookup->cursor.seq);
+    dht_wire_put_id(&cursor_writer, &lookup->cursor.member);
+    // 生存未確認（永続化ファイルから復元した）の候補は確認済みの候補の後に回し、
+    // DHT_ALPHA - 1個までしか同時に問い合わせない（死んでいてもルックアップは止まらない）
+    int stale_in_flight = 0;
+    for (int i = 0; i < lookup->candidate_count; i++) {
+        stale_in_flight += lookup->candidates[i].state == DHT_CANDIDATE_WAITING && lookup->candidates[i].info.stale;
+    }
+    bool pending = false;
+    for (int pass = 0; pass < 2; pass++) {
+        int seen = 0;
+        for (int i = 0; i < lookup->candidate_count; i++) {
+            DhtLookupCandidate* candidate = &lookup->candidates[i];
+            if (seen >= DHT_K && !lookup_in_prefix(lookup, &candidate->info.id)) {
+                break;
+            }
+            if (candidate->state == DHT_CANDIDATE_FAILED) {
+                continue;
+            }
+            seen++;
+
+            if (candidate->state == DHT_CANDIDATE_WAITING) {
+                pending = true;
+            } else if (candidate->state == DHT_CANDIDATE_NEW) {
+                pending = true;
+                if (lookup->in_flight >= DHT_ALPHA || candidate->info.stale != (pass == 1) ||
+                    (candidate->info.stale && stale_in_flight >= DHT_ALPHA - 1)) {
+                    continue;
+                }
+                candidate->transaction_id = dht_rpc_next_transaction(node);
+                candidate->sent_at = now;
+                if (dht_rpc_send(node, &candidate->info, type, &lookup->target, candidate->transaction_id,
+                                 lookup->find_value ? cursor : NULL,
+                                 lookup->find_value ? (uint16_t)cursor_writer.len : 0) == 0) {
+                    candidate->state = DHT_CANDIDATE_WAITING;
+                    lookup->in_flight++;
+                    lookup->queries_sent++;
+                    stale_in_flight += candidate->info.stale;
+                } else {
+                    candidate->state = DHT_CANDIDATE_FAILED;
+                    seen--;
+                }
+            }
+        }
+    }
+
+    if (!pending) {
+        lookup->done = true;
+        pthread_cond_broadcast(&lookup->cond);
+    }
+}
+
+// 値のページの先頭
+//
+// 状態(1: 値ストア、2: 経路キャッシュ) + 件数(varint) + 続きの有無(1)
+// + カーソルの通し番号(varint) + カーソルのメンバーID(20) の後に、
+// メンバーID(20) + 残りの有効期間(varint) + 長さ(varint) + 値 が件数分並ぶ。
+typedef struct {
+    uint8_t status;
+    int count;
+    bool more;
+    DhtStoreCursor cursor;
+    size_t entries;              // 最初の値の位置
+} PageHeader;
+
+static size_t page_encode_header(uint8_t* out, size_t cap, const PageHeader* header) {
+    DhtWireWriter w;
+    dht_wire_writer_init(&w, out, cap);
+    dht_wire_put_u8(&w, header->status);
+    dht_wire_put_varint(&w, (uint32_t)header->count);
+    dht_wire_put_u8(&w, header->more ? 1 : 0);
+    dht_wire_put_varint(&w, header->cursor.seq);
+    dht_wire_put_id(&w, &header->cursor.member);
+    return w.error ? 0 : w.len;
+}
+
+static bool page_decode_header(const uint8_t* page, size_t page_len, PageHeader* header) {
+    DhtWireReader r;
+    dht_wire_reader_init(&r, page, page_len);
+    memset(header, 0, sizeof(PageHeader));
+    header->status = dht_wire_get_u8(&r);
+    header->count = (int)dht_wire_get_varint(&r);
+    header->more = dht_wire_get_u8(&r) != 0;
+    header->cursor.seq = dht_wire_get_varint(&r);
+    dht_wire_get_id(&r, &header->cursor.member);
+    header->entries = r.pos;
+    return !r.error && header->status != 0;
+}
+
+// 値のページの値を順にfnへ渡す（返り値はfnに渡した値の数）
+static int page_scan(const uint8_t* page, size_t page_len, time_t now, DhtStoreMemberFn fn, void* arg) {
+    PageHeader header;
+    if (!page_decode_header(page, page_len, &header)) {
+        return 0;
+    }
+
+    DhtWireReader r;
+    dht_wire_reader_init(&r, page, page_len);
+    r.pos = header.entries;
+    int visited = 0;
+
+    for (int i = 0; i < header.count; i++) {
+        DhtId member;
+        dht_wire_get_id(&r, &member);
+        uint32_t ttl = dht_wire_get_varint(&r);
+        uint32_t len = dht_wire_get_varint(&r);
+        const uint8_t* value = dht_wire_take(&r, len);
+        if (!value) {
+            break;
+        }
+        if (!fn(&member, value, len, now + ttl, arg)) {
+            break;
+        }
+        visited++;
+    }
+    return visited;
+}
+
+// ページに値が全て収まっているか
+static bool page_is_complete(const uint8_t* page, size_t page_len) {
+    PageHeader header;
+    return page_decode_header(page, page_len, &header) && !header.more;
+}
+
+// 値のページを走査（返り値はfnに渡した値の数）
+int dht_lookup_scan_page(const DhtLookup* lookup, DhtStoreMemberFn fn, void* arg) {
+    if (!lookup->value_found) {
+        return 0;
+    }
+    return page_scan(lookup->value, lookup->value_len, time(NULL), fn, arg);
+}
+
+// ページから単一の値を選ぶ（メンバーIDが0の値、なければ先頭の値）
+typedef struct {
+    void* value;
+    size_t cap;                  // valueのバッファサイズ
+    size_t len;
+    bool found;
+} PageValue;
+
+static bool page_pick_value(const DhtId* member, const void* value, size_t value_len, time_t expires_at,
+                            void* arg) {
+    (void)expires_at;
+    PageValue* pick = (PageValue*)arg;
+    static const DhtId no_member;
+    bool exact = memcmp(member->bytes, no_member.bytes, DHT_ID_BITS/8) == 0;
+
+    if (!pick->found || exact) {
+        pick->len = pick->cap < value_len ? pick->cap : value_len;
+        memcpy(pick->value, value, pick->len);
+        pick->found = true;
+    }
+    return !exact;
+}
+
+// ルックアップを作成して開始
+//
+// 初期候補はseeds（NULLなら自分のルーティングテーブルから選ぶ）。pinnedなら候補を増やさず、
+// seedsのノードだけにcursorの位置から問い合わせる。
+static DhtLookup* lookup_create(Node* node, const DhtId* target, bool find_value, int timeout_ms,
+                                const DhtNodeInfo* seeds, int seed_count, bool pinned,
+                                const DhtStoreCursor* cursor, int prefix_bits) {
+    if (!node->dht_data || !target) {
+        return NULL;
+    }
+
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    DhtLookup* lookup = (DhtLookup*)calloc(1, sizeof(DhtLookup));
+    if (!lookup) {
+        perror("Failed to allocate DHT lookup");
+        return NULL;
+    }
+
+    lookup->target = *target;
+    lookup->find_value = find_value;
+    if (cursor) {
+        lookup->cursor = *cursor;
+    }
+    pthread_cond_init(&lookup->cond, NULL);
+
+    lookup->pinned = pinned;
+    lookup->prefix_bits = prefix_bits;
+    DhtNodeInfo closest[DHT_K];
+    if (!seeds) {
+        seed_count = dht_find_node(node, target, closest, DHT_K);
+        seeds = closest;
+    }
+
+    pthread_mutex_lock(&dht_data->rpc_mutex);
+    uint64_t now = dht_data->transport.now_ms(dht_data->transport.ctx);
+    lookup->deadline = now + (timeout_ms > 0 ? timeout_ms : DHT_LOOKUP_DEFAULT_TIMEOUT_MS);
+    for (int i = 0; i < seed_count; i++) {
+        lookup_insert(lookup, &seeds[i], &dht_data->routing_table->self_id, 1);
+    }
+    lookup->next = dht_data->lookups;
+    dht_data->lookups = lookup;
+    lookup_step(node, lookup, now);
+    pthread_mutex_unlock(&dht_data->rpc_mutex);
+
+    return lookup;
+}
+
+// ルックアップを開始（結果はdht_lookup_finishで受け取る）
+DhtLookup* dht_lookup_start(Node* node, const DhtId* target, bool find_value, int timeout_ms) {
+    return lookup_create(node, target, find_value, timeout_ms, NULL, 0, false, NULL, 0);
+}
+
+// 初期候補を指定してルックアップを開始（近くのキーのルックアップで見つけたノードから始める）
+DhtLookup* dht_lookup_start_from(Node* node, const DhtId* target, bool find_value, int timeout_ms,
+                                 const DhtNodeInfo* seeds, int seed_count) {
+    return lookup_create(node, target, find_value, timeout_ms, seeds, seed_count, false, NULL, 0);
+}
+
+// toの1ノードだけにFIND_VALUEを送るルックアップを開始（候補を増やさない。既にk近傍が
+// 分かっているキーの値を1往復で取る）
+DhtLookup* dht_lookup_start_probe(Node* node, const DhtId* target, const DhtNodeInfo* to, int timeout_ms) {
+    return lookup_create(node, target, true, timeout_ms, to, 1, true, NULL, 0);
+}
+
+// targetとprefix_bitsビットのプレフィックスを共有するノードを全て探すルックアップを開始
+// （近いキーをまとめて扱うときに、その範囲の全てのキーのk近傍を1回で集める）
+DhtLookup* dht_lookup_start_prefix(Node* node, const DhtId* target, int prefix_bits, int timeout_ms) {
+    return lookup_create(node, target, false, timeout_ms, NULL, 0, false, NULL, prefix_bits);
+}
+
+// ルックアップが完了したか（タイムアウトの処理も行う）
+bool dht_lookup_is_done(Node* node, DhtLookup* lookup) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+
+    pthread_mutex_lock(&dht_data->rpc_mutex);
+    lookup_step(node, lookup, dht_data->transport.now_ms(dht_data->transport.ctx));
+    bool done = lookup->done;
+    pthread_mutex_unlock(&dht_data->rpc_mutex);
+
+    return done;
+}
+
+// ルックアップを終了し、応答のあったノードを近い順に返す
+int dht_lookup_finish(Node* node, DhtLookup* lookup, DhtNodeInfo* results, int max_results,
+                      void* value, size_t* value_len) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+
+    pthread_mutex_lock(&dht_data->rpc_mutex);
+    for (DhtLookup** p = &dht_data->lookups; *p; p = &(*p)->next) {
+        if (*p == lookup) {
+            *p = lookup->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dht_data->rpc_mutex);
+
+    int count = 0;
+    for (int i = 0; i < lookup->candidate_count && results && count < max_results; i++) {
+        if (lookup->candidates[i].state == DHT_CANDIDATE_RESPONDED) {
+            results[count++] = lookup->candidates[i].info;
+        }
+    }
+
+    if (value && value_len) {
+        PageValue first = { value, *value_len, 0, false };
+        if (lookup->value_found) {
+            dht_lookup_scan_page(lookup, page_pick_value, &first);
+        }
+        *value_len = first.found ? first.len : 0;
+    }
+
+    pthread_cond_destroy(&lookup->cond);
+    free(lookup);
+    return count;
+}
+
+// ルックアップの完了を待つ
+static DhtLookup* lookup_wait(Node* node, DhtLookup* lookup) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+
+    pthread_mutex_lock(&dht_data->rpc_mutex);
+    while (!lookup->done) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 20 * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&lookup->cond, &dht_data->rpc_mutex, &ts);
+        lookup_step(node, lookup, dht_data->transport.now_ms(dht_data->transport.ctx));
+    }
+    pthread_mutex_unlock(&dht_data->rpc_mutex);
+
+    return lookup;
+}
+
+// ルックアップの完了を待つ
+void dht_lookup_wait(Node* node, DhtLookup* lookup) {
+    lookup_wait(node, lookup);
+}
+
+// 指定したIDに最も近いノードをネットワーク上で探す（反復ルックアップ）
+int dht_lookup_nodes(Node* node, const DhtId* target, DhtNodeInfo* results, int max_results, int timeout_ms) {
+    DhtLookup* lookup = dht_lookup_start(node, target, false, timeout_ms);
+    if (!lookup) {
+        return 0;
+    }
+    lookup_wait(node, lookup);
+    return dht_lookup_finish(node, lookup, results, max_results, NULL, NULL);
+}
+
+// 値のルックアップを統計に加え、値が1ページに収まっていれば経路上のノードにキャッシュさせる
+//
+// 送り先は値を返さなかったうちで最も近い応答済みの候補。キャッシュの有効期間は
+// 値を返したノードより共通プレフィックスが1ビット短くなるごとに半分にする
+// （キーから遠いノードほど多くのルックアップが通り、古い値が広まりやすいため）。
+static void lookup_cache_path(Node* node, DhtLookup* lookup, bool complete) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    uint8_t payload[MAX_BUFFER];
+    size_t payload_len = 0;
+    DhtNodeInfo to;
+    memset(&to, 0, sizeof(to));
+
+    pthread_mutex_lock(&dht_data->store_mutex);
+    bool enabled = dht_data->cache_enabled;
+    pthread_mutex_unlock(&dht_data->store_mutex);
+
+    pthread_mutex_lock(&dht_data->rpc_mutex);
+    int queries = lookup->queries_sent;
+    bool found = lookup->value_found;
+    bool cached = lookup->value_cached;
+    int hops = lookup->value_hops;
+    for (int i = 0; found && complete && enabled && i < lookup->candidate_count; i++) {
+        const DhtLookupCandidate* candidate = &lookup->candidates[i];
+        if (candidate->state != DHT_CANDIDATE_RESPONDED ||
+            memcmp(candidate->info.id.bytes, lookup->value_from.id.bytes, DHT_ID_BITS/8) == 0) {
+            continue;
+        }
+
+        DhtDistance from_distance;
+        DhtDistance to_distance;
+        dht_id_xor(&lookup->target, &lookup->value_from.id, &from_distance);
+        dht_id_xor(&lookup->target, &candidate->info.id, &to_distance);
+        int levels = dht_distance_clz(&from_distance) - dht_distance_clz(&to_distance);
+        uint32_t ttl = DHT_CACHE_MAX_TTL;
+        if (levels > 0) {
+            ttl = levels < 31 ? ttl >> levels : 0;
+        }
+        if (ttl < DHT_CACHE_MIN_TTL) {
+            ttl = DHT_CACHE_MIN_TTL;
+        }
+
+        DhtWireWriter w;
+        dht_wire_writer_init(&w, payload, sizeof(payload));
+        dht_wire_put_varint(&w, ttl);
+        dht_wire_put_bytes(&w, lookup->value, lookup->value_len);
+        if (!w.error) {
+            to = candidate->info;
+            payload_len = w.len;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&dht_data->rpc_mutex);
+
+    bool sent = payload_len > 0 &&
+                dht_rpc_send(node, &to, DHT_CACHE_STORE, &lookup->target, dht_rpc_next_transaction(node),
+                             payload, (uint16_t)payload_len) == 0;
+
+    pthread_mutex_lock(&dht_data->store_mutex);
+    dht_data->cache_stats.value_lookups++;
+    dht_data->cache_stats.lookup_queries += queries;
+    if (found) {
+        dht_data->cache_stats.lookup_hops += hops;
+        dht_data->cache_stats.cache_answered += cached;
+    }
+    dht_data->cache_stats.cache_stores_sent += sent;
+    pthread_mutex_unlock(&dht_data->store_mutex);
+}
+
+// 完了した値のルックアップを統計と経路キャッシュに反映（dht_lookup_finishの前に呼ぶ）
+void dht_lookup_cache_value(Node* node, DhtLookup* lookup) {
+    if (!node->dht_data || !lookup || !lookup->find_value || lookup->pinned) {
+        return;
+    }
+    lookup_cache_path(node, lookup, lookup->value_found && page_is_complete(lookup->value, lookup->value_len));
+}
+
+// 自分の経路キャッシュにあるキーの値をfnへ渡す（返り値はfnに渡した値の数）
+static int cache_scan_local(Node* node, const DhtId* key, DhtStoreMemberFn fn, void* arg) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    DhtStoreCursor cursor;
+    memset(&cursor, 0, sizeof(cursor));
+
+    pthread_mutex_lock(&dht_data->store_mutex);
+    int count = 0;
+    if (dht_data->cache_enabled) {
+        count = dht_store_scan_members(&dht_data->cache, key, time(NULL), &cursor, fn, arg);
+        if (count > 0) {
+            dht_data->cache_stats.local_cache_hits++;
+        }
+    }
+    pthread_mutex_unlock(&dht_data->store_mutex);
+
+    return count > 0 ? count : 0;
+}
+
+// 経路キャッシュの有効・無効とメモリ上限を設定（0で既定値）
+void dht_set_path_cache(Node* node, bool enabled, size_t memory_budget) {
+    if (!node->dht_data) {
+        return;
+    }
+
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    pthread_mutex_lock(&dht_data->store_mutex);
+    dht_data->cache_enabled = enabled;
+    dht_store_set_budget(&dht_data->cache, memory_budget ? memory_budget : DHT_CACHE_DEFAULT_BUDGET);
+    if (!enabled) {
+        // キャッシュの値は全てDHT_CACHE_MAX_TTL以内に期限が来る
+        dht_store_expire(&dht_data->cache, time(NULL) + DHT_CACHE_MAX_TTL);
+    }
+    pthread_mutex_unlock(&dht_data->store_mutex);
+}
+
+// 経路キャッシュの統計を取得
+void dht_get_cache_stats(Node* node, DhtCacheStats* stats) {
+    memset(stats, 0, sizeof(DhtCacheStats));
+    if (!node->dht_data) {
+        return;
+    }
+
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    pthread_mutex_lock(&dht_data->store_mutex);
+    *stats = dht_data->cache_stats;
+    stats->cached_values = dht_data->cache.entry_count;
+    stats->cache_bytes = dht_store_memory_used(&dht_data->cache);
+    pthread_mutex_unlock(&dht_data->store_mutex);
+}
+
+// dht_get_valuesの件数制限
+typedef struct {
+    DhtStoreMemberFn fn;
+    void* arg;
+    int remaining;
+} ValueLimit;
+
+static bool limit_visit(const DhtId* member, const void* value, size_t value_len, time_t expires_at, void* arg) {
+    ValueLimit* limit = (ValueLimit*)arg;
+    if (limit->remaining <= 0 || !limit->fn(member, value, value_len, expires_at, limit->arg)) {
+        return false;
+    }
+    limit->remaining--;
+    return true;
+}
+
+// 値を取得（ローカルになければネットワーク上で探す）
+int dht_get_value(Node* node, const DhtId* key, void* value, size_t* value_len) {
+    if (!node->dht_data || !key || !value || !value_len) {
+        return -1;
+    }
+
+    size_t local_len = *value_len;
+    if (dht_find_value(node, key, value, &local_len) == 0) {
+        *value_len = local_len;
+        return 0;
+    }
+
+    // 単一の値がなければ、ローカルにあるメンバーの先頭を返す
+    PageValue first = { value, *value_len, 0, false };
+    DhtStoreCursor cursor;
+    memset(&cursor, 0, sizeof(cursor));
+    ValueLimit limit = { page_pick_value, &first, 1 };
+    dht_find_values(node, key, &cursor, limit_visit, &limit);
+    if (!first.found) {
+        cache_scan_local(node, key, page_pick_value, &first);
+    }
+    if (first.found) {
+        *value_len = first.len;
+        return 0;
+    }
+
+    DhtLookup* lookup = dht_lookup_start(node, key, true, DHT_LOOKUP_DEFAULT_TIMEOUT_MS);
+    if (!lookup) {
+        return -1;
+    }
+    lookup_wait(node, lookup);
+    bool found = lookup->value_found;
+    dht_lookup_cache_value(node, lookup);
+    dht_lookup_finish(node, lookup, NULL, 0, value, value_len);
+
+    return found ? 0 : -1;
+}
+
+// 自分がキーのk近傍に入っているか（ルーティングテーブル上で自分より近いノードがk個未満）
+static bool is_responsible(Node* node, const DhtId* key) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    DhtNodeInfo closest[DHT_K];
+    int count = dht_find_node(node, key, closest, DHT_K);
+    return count < DHT_K ||
+           dht_id_cmp_distance(key, &dht_data->routing_table->self_id, &closest[count - 1].id) < 0;
+}
+
+// キーの値を全て取得（ローカルになければネットワーク上で探し、ページを順に取得する）
+//
+// 返り値はfnに渡した値の数で、max_values個に達するかfnがfalseを返すと止まる。
+int dht_get_values(Node* node, const DhtId* key, DhtStoreMemberFn fn, void* arg, int max_values) {
+    if (!node->dht_data || !key || !fn || max_values <= 0) {
+        return -1;
+    }
+
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    ValueLimit limit = { fn, arg, max_values };
+
+    // 自分がキーのk近傍でなければ、手元にあるのは自分が公開した一部のメンバーだけかもしれない
+    pthread_mutex_lock(&dht_data->store_mutex);
+    bool local = dht_store_member_count(&dht_data->store, key) > 0;
+    pthread_mutex_unlock(&dht_data->store_mutex);
+    if (local && is_responsible(node, key)) {
+        DhtStoreCursor cursor;
+        memset(&cursor, 0, sizeof(cursor));
+        int count = dht_find_values(node, key, &cursor, limit_visit, &limit);
+        if (count > 0) {
+            return count;
+        }
+    }
+
+    // 経路キャッシュには1ページに収まった値だけが全て置かれている
+    if (!local) {
+        int count = cache_scan_local(node, key, limit_visit, &limit);
+        if (count > 0) {
+            return count;
+        }
+    }
+
+    DhtLookup* lookup = dht_lookup_start(node, key, true, DHT_LOOKUP_DEFAULT_TIMEOUT_MS);
+    int total = 0;
+    while (lookup) {
+        lookup_wait(node, lookup);
+        dht_lookup_cache_value(node, lookup);
+        if (!lookup->value_found) {
+            dht_lookup_finish(node, lookup, NULL, 0, NULL, NULL);
+            break;
+        }
+
+        PageHeader header;
+        page_decode_header(lookup->value, lookup->value_len, &header);
+        int visited = dht_lookup_scan_page(lookup, limit_visit, &limit);
+        total += visited;
+        bool more = header.more && visited == header.count && limit.remaining > 0;
+        DhtStoreCursor cursor = header.cursor;
+        cursor.done = false;
+        DhtNodeInfo from = lookup->value_from;
+        dht_lookup_finish(node, lookup, NULL, 0, NULL, NULL);
+
+        // 続きのページは同じノードに問い合わせる
+        lookup = more ? lookup_create(node, key, true, DHT_LOOKUP_DEFAULT_TIMEOUT_MS, &from, 1, true, &cursor, 0)
+                      : NULL;
+    }
+
+    return total;
+}
+
+// 全てのルックアップのタイムアウトを処理（メンテナンススレッドから呼ばれる）
+void dht_rpc_tick(Node* node) {
+    if (!node->dht_data) {
+        return;
+    }
+
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    pthread_mutex_lock(&dht_data->rpc_mutex);
+    uint64_t now = dht_data->transport.now_ms(dht_data->transport.ctx);
+    for (DhtLookup* lookup = dht_data->lookups; lookup; lookup = lookup->next) {
+        lookup_step(node, lookup, now);
+    }
+    pthread_mutex_unlock(&dht_data->rpc_mutex);
+}
+
+// 値のページの書き込み
+typedef struct {
+    uint8_t* buf;
+    size_t cap;
+    size_t len;
+    int count;
+    time_t now;
+} PageWriter;
+
+static bool page_write_member(const DhtId* member, const void* value, size_t value_len, time_t expires_at,
+                              void* arg) {
+    PageWriter* writer = (PageWriter*)arg;
+    uint32_t ttl = expires_at > writer->now ? (uint32_t)(expires_at - writer->now) : 0;
+    size_t need = DHT_ID_BITS/8 + dht_wire_varint_len(ttl) + dht_wire_varint_len((uint32_t)value_len) + value_len;
+    if (writer->count == 255 || writer->len + need > writer->cap) {
+        return false;  // 残りは次のページ
+    }
+
+    DhtWireWriter w;
+    dht_wire_writer_init(&w, writer->buf + writer->len, need);
+    dht_wire_put_id(&w, member);
+    dht_wire_put_varint(&w, ttl);
+    dht_wire_put_varint(&w, (uint32_t)value_len);
+    dht_wire_put_bytes(&w, value, value_len);
+    writer->len += need;
+    writer->count++;
+    return true;
+}
+
+// CACHE_STOREで受け取った値の書き込み
+typedef struct {
+    DhtValueStore* cache;
+    const DhtId* key;
+    time_t expires_at;           // キャッシュの有効期限（値の有効期限の方が早ければそちら）
+} CacheWriter;
+
+static bool cache_write_member(const DhtId* member, const void* value, size_t value_len, time_t expires_at,
+                               void* arg) {
+    CacheWriter* writer = (CacheWriter*)arg;
+    time_t expires = expires_at < writer->expires_at ? expires_at : writer->expires_at;
+    return dht_store_put_member(writer->cache, writer->key, member, value, value_len, expires) == 0;
+}
+
+// 応答の送り主が問い合わせた候補か（アドレスとヘッダーのノードIDが一致する）
+static bool reply_from_candidate(const DhtLookupCandidate* candidate, const DhtNodeInfo* sender) {
+    return candidate->info.port == sender->port && strcmp(candidate->info.ip, sender->ip) == 0 &&
+           memcmp(candidate->info.id.bytes, sender->id.bytes, DHT_ID_BITS/8) == 0;
+}
+
+// ルックアップへの応答を処理
+//
+// トランザクションIDは通し番号で推測できるので、問い合わせた候補以外から届いた応答は
+// 捨てる（本物の応答はそのまま待つ）。
+static void handle_lookup_reply(Node* node, const DhtNodeInfo* sender, uint32_t transaction_id,
+                                const uint8_t* data, size_t data_len, bool is_value_reply) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+
+    pthread_mutex_lock(&dht_data->rpc_mutex);
+    for (DhtLookup* lookup = dht_data->lookups; lookup; lookup = lookup->next) {
+        for (int i = 0; i < lookup->candidate_count; i++) {
+            DhtLookupCandidate* candidate = &lookup->candidates[i];
+            if (candidate->transaction_id != transaction_id || candidate->state != DHT_CANDIDATE_WAITING ||
+                !reply_from_candidate(candidate, sender)) {
+                continue;
+            }
+
+            candidate->state = DHT_CANDIDATE_RESPONDED;
+            lookup->in_flight--;
+
+            PageHeader header;
+            if (is_value_reply && data_len <= sizeof(lookup->value) && page_decode_header(data, data_len, &header)) {
+                // 値のページが見つかった（2なら経路キャッシュから）
+                lookup->value_len = data_len;
+                memcpy(lookup->value, data, data_len);
+                lookup->value_from = candidate->info;
+                lookup->value_cached = data[0] == 2;
+                lookup->value_hops = candidate->hops;
+                lookup->value_found = true;
+            } else if (!lookup->pinned) {
+                DhtWireReader r;
+                dht_wire_reader_init(&r, data, data_len);
+                if (is_value_reply) {
+                    dht_wire_get_u8(&r);  // 状態（0: 値なし）
+                }
+                uint8_t hops = candidate->hops < UINT8_MAX ? candidate->hops + 1 : UINT8_MAX;
+                DhtNodeInfo nodes[DHT_K];
+                int count = decode_contacts(&r, nodes, DHT_K);
+                for (int j = 0; j < count; j++) {
+                    lookup_insert(lookup, &nodes[j], &dht_data->routing_table->self_id, hops);
+                }
+            }
+
+            lookup_step(node, lookup, dht_data->transport.now_ms(dht_data->transport.ctx));
+            pthread_mutex_unlock(&dht_data->rpc_mutex);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&dht_data->rpc_mutex);
+}
+
+// PONGを返したノードをルックアップの候補でも確認済みにし、空いた問い合わせ枠を使う
+static void lookup_verified(Node* node, const DhtId* id) {
+    DhtData* dht_data = (DhtData*)node->dht_data;
+
+    pthread_mutex_lock(&dht_data->rpc_mutex);
+    for (DhtLookup* lookup = dht_data->lookups; lookup; lookup = lookup->next) {
+        bool changed = false;
+        for (int i = 0; i < lookup->candidate_count; i++) {
+            DhtLookupCandidate* candidate = &lookup->candidates[i];
+            if (candidate->info.stale && memcmp(candidate->info.id.bytes, id->bytes, DHT_ID_BITS/8) == 0) {
+                candidate->info.stale = false;
+                changed = true;
+            }
+        }
+        if (changed) {
+            lookup_step(node, lookup, dht_data->transport.now_ms(dht_data->transport.ctx));
+        }
+    }
+    pthread_mutex_unlock(&dht_data->rpc_mutex);
+}
+
+// 受信したDHTパケットを処理
+int dht_handle_packet(Node* node, const void* buf, size_t len, const struct sockaddr_in* from) {
+    if (!node->dht_data || !dht_is_packet(buf, len)) {
+        return -1;
+    }
+
+    DhtWireHeader header;
+    if (dht_wire_decode_packet(buf, len, &header) < 0) {
+        return -1;  // 切り詰められたパケットか、未対応のバージョン
+    }
+
+    DhtMessageType type = (DhtMessageType)header.type;
+    DhtNodeInfo sender;
+    memset(&sender, 0, sizeof(sender));
+    sender.id = header.sender_id;
+    DhtId target = header.target_id;
+    uint32_t transaction_id = header.transaction_id;
+    const uint8_t* data = header.data;
+    size_t data_len = header.data_len;
+    DhtWireReader r;
+    dht_wire_reader_init(&r, data, data_len);
+
+    inet_ntop(AF_INET, &from->sin_addr, sender.ip, MAX_IP_STR_LEN);
+    sender.port = ntohs(from->sin_port);
+
+    // 通信してきたノードはルーティングテーブルに加える
+    dht_add_node(node, &sender);
+
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    uint8_t reply[MAX_BUFFER];
+
+    switch (type) {
+        case DHT_PING:
+            dht_rpc_send(node, &sender, DHT_PONG, NULL, transaction_id, NULL, 0);
+            break;
+
+        case DHT_PONG:
+            // ルーティングテーブルの生存確認はdht_add_nodeで済んでいる
+            lookup_verified(node, &sender.id);
+            break;
+
+        case DHT_FIND_NODE: {
+            DhtNodeInfo nodes[DHT_K];
+            int count = dht_find_node(node, &target, nodes, DHT_K);
+            DhtWireWriter w;
+            dht_wire_writer_init(&w, reply, sizeof(reply));
+            encode_contacts(&w, nodes, count);
+            dht_rpc_send(node, &sender, DHT_FIND_NODE_REPLY, NULL, transaction_id, reply, (uint16_t)w.len);
+            break;
+        }
+
+        case DHT_FIND_VALUE: {
+            // カーソルの位置から値のページを返す（値がなければ近いノード）
+            DhtStoreCursor cursor;
+            memset(&cursor, 0, sizeof(cursor));
+            if (data_len > 0) {
+                cursor.seq = dht_wire_get_varint(&r);
+                dht_wire_get_id(&r, &cursor.member);
+                if (r.error) {
+                    memset(&cursor, 0, sizeof(cursor));
+                }
+            }
+
+            PageWriter writer = { reply, sizeof(reply), DHT_RPC_PAGE_HEADER, 0, time(NULL) };
+            uint8_t status = 1;
+            pthread_mutex_lock(&dht_data->store_mutex);
+            dht_store_scan_members(&dht_data->store, &target, writer.now, &cursor, page_write_member, &writer);
+            if (writer.count == 0 && cursor.seq == 0 && dht_data->cache_enabled) {
+                // 値ストアになければ経路キャッシュから返す（キャッシュの値は1ページに収まる）
+                memset(&cursor, 0, sizeof(cursor));
+                dht_store_scan_members(&dht_data->cache, &target, writer.now, &cursor, page_write_member, &writer);
+                status = 2;
+            }
+            if (writer.count > 0) {
+                if (status == 2) {
+                    dht_data->cache_stats.served_cache++;
+                } else {
+                    dht_data->cache_stats.served_primary++;
+                }
+            }
+            pthread_mutex_unlock(&dht_data->store_mutex);
+
+            const uint8_t* page = reply;
+            size_t page_len;
+            if (writer.count > 0 || cursor.seq != 0) {
+                // 先頭は値を書き終えてから、値の直前に詰めて置く
+                PageHeader page_header = { status, writer.count, !cursor.done, cursor, 0 };
+                uint8_t head[DHT_RPC_PAGE_HEADER];
+                size_t head_len = page_encode_header(head, sizeof(head), &page_header);
+                memcpy(reply + DHT_RPC_PAGE_HEADER - head_len, head, head_len);
+                page = reply + DHT_RPC_PAGE_HEADER - head_len;
+                page_len = writer.len - (DHT_RPC_PAGE_HEADER - head_len);
+            } else {
+                DhtNodeInfo nodes[DHT_K];
+                int count = dht_find_node(node, &target, nodes, DHT_K);
+                DhtWireWriter w;
+                dht_wire_writer_init(&w, reply, sizeof(reply));
+                dht_wire_put_u8(&w, 0);
+                encode_contacts(&w, nodes, count);
+                page_len = w.len;
+            }
+            dht_rpc_send(node, &sender, DHT_FIND_VALUE_REPLY, NULL, transaction_id, page, (uint16_t)page_len);
+            break;
+        }
+
+        case DHT_STORE: {
+            // レプリカとして保存（有効期間は送信側の残り時間、0はメンバーの取り下げ）
+            uint8_t status = 0;
+            uint32_t ttl = dht_wire_get_varint(&r);
+            DhtId member;
+            dht_wire_get_id(&r, &member);
+            if (!r.error && ttl == 0) {
+                dht_remove_replica(node, &target, &member);
+                status = 1;
+            } else if (!r.error && ttl <= INT32_MAX &&
+                       dht_store_replica(node, &target, &member, data + r.pos, dht_wire_remaining(&r),
+                                         time(NULL) + ttl) == 0) {
+                status = 1;
+            }
+            dht_rpc_send(node, &sender, DHT_STORE_REPLY, NULL, transaction_id, &status, 1);
+            break;
+        }
+
+        case DHT_CACHE_STORE: {
+            // 経路キャッシュに置く（値ストアにあるキーは置かない。古いメンバーは入れ替える）
+            uint32_t ttl = dht_wire_get_varint(&r);
+            if (r.error) {
+                break;
+            }
+            CacheWriter writer = { &dht_data->cache, &target, time(NULL) + ttl };
+            pthread_mutex_lock(&dht_data->store_mutex);
+            if (dht_data->cache_enabled && dht_store_member_count(&dht_data->store, &target) == 0) {
+                dht_data->cache_stats.cache_stores_received++;
+                dht_store_remove(&dht_data->cache, &target);
+                page_scan(data + r.pos, dht_wire_remaining(&r), time(NULL), cache_write_member, &writer);
+            }
+            pthread_mutex_unlock(&dht_data->store_mutex);
+            break;
+        }
+
+        case DHT_STORE_REPLY:
+            dht_replica_on_store_reply(node, transaction_id, data_len >= 1 && data[0] == 1);
+            break;
+
+        case DHT_FIND_NODE_REPLY:
+            handle_lookup_reply(node, &sender, transaction_id, data, data_len, false);
+            break;
+
+        case DHT_FIND_VALUE_REPLY:
+            handle_lookup_reply(node, &sender, transaction_id, data, data_len, true);
+            break;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
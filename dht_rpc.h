@@ -0,0 +1,96 @@
+#ifndef DHT_RPC_H
+#define DHT_RPC_H
+
+#include "dht.h"
+#include "dht_wire.h"
+
+// DHT RPC設定（メッセージの形式はdht_wire.hを参照、以下の長さは可変長整数が最長の場合）
+#define DHT_RPC_MAX_PACKET (DHT_WIRE_MAX_HEADER + MAX_BUFFER)
+#define DHT_RPC_STORE_PREFIX (DHT_WIRE_VARINT_MAX + 20) // STOREの有効期間 + メンバーID
+#define DHT_RPC_CURSOR_LEN (DHT_WIRE_VARINT_MAX + 20)   // ページのカーソル（通し番号 + メンバーID）
+#define DHT_RPC_PAGE_HEADER (4 + DHT_WIRE_VARINT_MAX + 20) // 値のページの先頭（状態 + 件数 + 続き + カーソル）
+#define DHT_RPC_MEMBER_HEADER (20 + DHT_WIRE_VARINT_MAX + 2) // ページ内の値の先頭（メンバーID + 有効期間 + 長さ）
+#define DHT_RPC_CACHE_PREFIX DHT_WIRE_VARINT_MAX       // CACHE_STOREの有効期間（続いて値のページ）
+#define DHT_RPC_MAX_VALUE (MAX_BUFFER - DHT_RPC_PAGE_HEADER - DHT_RPC_MEMBER_HEADER) // 1ページに収まる値の長さ
+#define DHT_RPC_TIMEOUT_MS 1000              // 応答待ちのタイムアウト
+#define DHT_LOOKUP_MAX_CANDIDATES (DHT_K * 4) // ルックアップで保持する候補数
+#define DHT_LOOKUP_DEFAULT_TIMEOUT_MS 5000   // ルックアップ全体のタイムアウト
+
+// ルックアップ候補の状態
+typedef enum {
+    DHT_CANDIDATE_NEW = 0,       // 未問い合わせ
+    DHT_CANDIDATE_WAITING,       // 応答待ち
+    DHT_CANDIDATE_RESPONDED,     // 応答あり
+    DHT_CANDIDATE_FAILED         // タイムアウト
+} DhtCandidateState;
+
+// ルックアップ候補
+typedef struct {
+    DhtNodeInfo info;
+    DhtCandidateState state;
+    uint64_t sent_at;            // 問い合わせ時刻（ミリ秒）
+    uint32_t transaction_id;
+    uint8_t hops;                // 自分から何回の応答を経て知ったか（初期候補は1）
+} DhtLookupCandidate;
+
+// 反復ルックアップ（FIND_NODE / FIND_VALUE）
+//
+// 目的のIDに近い候補を距離順に保持し、常に最大DHT_ALPHA個の問い合わせを並行させる。
+// 応答は受信スレッドで、タイムアウトはdht_rpc_tickで処理する。近い方からDHT_K個の
+// 候補が全て応答した時点（FIND_VALUEでは値が見つかった時点）で完了する。生存未確認の
+// 候補（info.stale）は確認済みの候補の後に問い合わせ、同時にDHT_ALPHA - 1個までとする。
+//
+// FIND_VALUEの応答は値のページで、続きはpinnedなルックアップ（候補を値を返した
+// ノード1つに固定し、cursorから再開する）で取得する。
+//
+// 値が1ページに収まったときは、値を返さなかったうちで最も近い応答済みの候補へ
+// CACHE_STOREで値を送り、経路キャッシュに置かせる。同じキーを探す他のノードの
+// ルックアップは値を持つノードに着く前にそのノードを通るため、人気のあるキーほど
+// 早く見つかり、値を持つk個のノードへの問い合わせも減る。
+typedef struct DhtLookup {
+    DhtId target;
+    bool find_value;
+    bool pinned;                 // 候補を増やさない（ページの続きの取得）
+    int prefix_bits;             // 0でなければ、このプレフィックスを共有する候補も全て問い合わせる
+    DhtStoreCursor cursor;       // FIND_VALUEで要求するページの位置
+    DhtLookupCandidate candidates[DHT_LOOKUP_MAX_CANDIDATES];
+    int candidate_count;
+    int in_flight;
+    bool done;
+    uint64_t deadline;           // 打ち切り時刻（ミリ秒）
+    int queries_sent;
+    bool value_found;
+    uint8_t value[MAX_BUFFER];   // 値のページ（DHT_RPC_PAGE_HEADER以降に値が並ぶ）
+    size_t value_len;
+    DhtNodeInfo value_from;      // ページを返したノード
+    bool value_cached;           // ページが経路キャッシュから返された
+    int value_hops;              // ページを返したノードのホップ数
+    pthread_cond_t cond;         // 完了通知
+    struct DhtLookup* next;
+} DhtLookup;
+
+// DHT RPC関数プロトタイプ
+void dht_rpc_init(Node* node);
+void dht_rpc_cleanup(Node* node);
+bool dht_is_packet(const void* buf, size_t len);
+int dht_handle_packet(Node* node, const void* buf, size_t len, const struct sockaddr_in* from);
+int dht_rpc_send(Node* node, const DhtNodeInfo* to, DhtMessageType type, const DhtId* target,
+                 uint32_t transaction_id, const void* data, uint16_t data_len);
+uint32_t dht_rpc_next_transaction(Node* node);
+uint64_t dht_rpc_now_ms(Node* node);
+void dht_rpc_tick(Node* node);
+
+// 非同期ルックアップ
+DhtLookup* dht_lookup_start(Node* node, const DhtId* target, bool find_value, int timeout_ms);
+DhtLookup* dht_lookup_start_from(Node* node, const DhtId* target, bool find_value, int timeout_ms,
+                                 const DhtNodeInfo* seeds, int seed_count);
+DhtLookup* dht_lookup_start_probe(Node* node, const DhtId* target, const DhtNodeInfo* to, int timeout_ms);
+DhtLookup* dht_lookup_start_prefix(Node* node, const DhtId* target, int prefix_bits, int timeout_ms);
+bool dht_lookup_is_done(Node* node, DhtLookup* lookup);
+void dht_lookup_wait(Node* node, DhtLookup* lookup);
+int dht_lookup_finish(Node* node, DhtLookup* lookup, DhtNodeInfo* results, int max_results,
+                      void* value, size_t* value_len);
+int dht_lookup_scan_page(const DhtLookup* lookup, DhtStoreMemberFn fn, void* arg);
+void dht_lookup_cache_value(Node* node, DhtLookup* lookup);
+
+#endif /* DHT_RPC_H */
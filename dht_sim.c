@@ -0,0 +1,1211 @@
+#include "dht.h"
+#include "dht_rpc.h"
+#include "dht_replica.h"
+#include "dht_hash.h"
+#include "pubsub.h"
+#include <fcntl.h>
+#include <getopt.h>
+
+// DHTシミュレーター
+//
+// 多数の仮想ノードを1つのプロセス・1つのスレッドで動かす。各ノードは実際のルーティング
+// テーブル・値ストア・RPCのコードを使い、パケットはメモリ上のイベントキューに入れて
+// 仮想時刻に沿って配送する（片道の遅延、損失率、チャーンを設定できる）。ノードの
+// メンテナンスはスレッドを使わず、仮想時刻の1秒ごとにdht_maintenance_tickを呼ぶ。
+//
+// 手順:
+//   1. ノードを作り、ルーティングテーブルを埋める（既定では全ノードのIDから各バケットに
+//      k個ずつ入れる。-jなら既存ノードを教えて自分のIDを探すことで1つずつ参加させる）
+//   2. キーを公開する（ランダムなノードからFIND_NODEのルックアップを行い、k近傍へSTORE）
+//   3. ランダムなノードからランダムなキーをFIND_VALUEのルックアップで読む
+//      （この間、指定した割合でノードを入れ替える）
+//   4. チャーンがあれば、入れ替えを止めた後に全てのキーを1回ずつ読む（読めるまま残ったか）
+//
+// 公開はシミュレーター自身が行う。値の複製（引き継ぎと再複製）は既定では止め、-Rで
+// 有効にする（複製のルックアップは非同期で、仮想時刻のtickで進む）。
+//
+// -Pを指定すると2・3の代わりにパブサブを測る。ランダムに選んだノードが1つのトピックを
+// 購読し（ランデブーの検索の代わりに、他の購読者をSIM_TOPIC_BOOTSTRAP個ずつ教える）、
+// メッシュができるのを待ってから、購読者が一定間隔でメッセージを公開する。各メッセージが
+// 購読者に届くまでの時間（ファンアウトの遅延）と配送率、重複、IHAVE/IWANTの量を報告する。
+// ハートビートはメンテナンスと同じく仮想時刻の1秒ごとに呼ぶ。
+// k・alphaはdht.hの定数で、コンパイル時に変えて比べる
+// （例: make clean && make dht-sim CFLAGS="-O2 -pthread -DDHT_K=16"）。
+
+#define SIM_BASE_ADDR 0x0A000001     // 10.0.0.1から順にアドレスを割り当てる
+#define SIM_PORT 7000
+#define SIM_POLL_MS 20               // ルックアップのタイムアウトを確認する間隔（lookup_waitと同じ）
+#define SIM_JOIN_CONTACTS 8          // 参加するノードに教える既存ノードの数
+#define SIM_MAX_HOPS 16              // ホップ数の分布の上限（これ以上はまとめる）
+#define SIM_MESSAGE_TYPES (DHT_CACHE_STORE + 1)
+#define SIM_PUBSUB_TYPES (PUBSUB_PRUNE + 1)
+#define SIM_TOPIC "/sim/topic"
+#define SIM_TOPIC_BOOTSTRAP 8        // 購読するノードに教える他の購読者の数
+#define SIM_MESH_WARMUP_MS 5000      // 公開を始める前にメッシュを作る時間
+#define SIM_DRAIN_MS 10000           // 最後の公開の後に配送を待つ時間
+
+// 設定
+typedef struct {
+    int nodes;
+    int keys;
+    int gets;
+    int concurrency;             // 同時に進めるルックアップの数
+    int latency_ms;              // 片道の遅延の平均（一様分布で0.5倍から1.5倍）
+    double loss;                 // パケットの損失率
+    double churn;                // 1分あたりに入れ替えるノードの割合
+    bool join;                   // プロトコルで1つずつ参加させる
+    bool cache;                  // 経路キャッシュ
+    bool replication;            // 値の複製
+    uint64_t seed;
+    int topic_members;           // パブサブのトピックの購読者数（0ならDHTのルックアップを測る）
+    int messages;                // 公開するメッセージ数
+    int publish_interval_ms;     // 公開の間隔
+    int payload;                 // メッセージのバイト数
+} SimConfig;
+
+typedef enum {
+    SIM_EVENT_PACKET = 0,
+    SIM_EVENT_TICK,              // 1秒ごとのメンテナンスとチャーン
+    SIM_EVENT_POLL               // ルックアップのタイムアウトの確認
+} SimEventType;
+
+typedef struct {
+    uint64_t at;
+    uint64_t seq;                // 同時刻のイベントは追加した順に処理する
+    SimEventType type;
+    int to;
+    struct sockaddr_in from;
+    uint8_t* data;
+    size_t len;
+} SimEvent;
+
+typedef enum {
+    SIM_OP_JOIN = 0,
+    SIM_OP_PUBLISH,
+    SIM_OP_GET,
+    SIM_OP_READ                  // チャーンの後に全てのキーを読む
+} SimOpKind;
+
+// 進行中のルックアップ
+typedef struct {
+    SimOpKind kind;
+    int node;
+    int key;
+    DhtLookup* lookup;
+    uint64_t started;
+} SimOp;
+
+// ルックアップの結果の集計
+typedef struct {
+    int count;
+    int found;
+    uint32_t* latency;           // 仮想時刻のミリ秒（完了した順）
+    uint64_t queries;
+    uint64_t hops[SIM_MAX_HOPS + 1];
+    uint64_t cached;             // 経路キャッシュから値が返った
+} SimResults;
+
+typedef struct {
+    SimConfig config;
+
+    // ノード（インデックスがアドレスを決める。停止したノードはNULL）
+    Node** nodes;
+    int node_count;
+    int node_cap;
+    int alive;
+
+    // イベントキュー（最小ヒープ）
+    SimEvent* heap;
+    int heap_count;
+    int heap_cap;
+    uint64_t seq;
+    uint64_t now;
+    uint64_t rng;
+    int ticks;
+    double churn_debt;
+
+    // 進行中のルックアップ
+    SimOp* ops;
+    int op_count;
+    int op_cap;
+    SimOpKind phase;
+    int remaining;
+
+    DhtId* keys;
+    SimResults publish;
+    SimResults get;
+    SimResults read;
+
+    // パブサブ（受け取りの遅延はメッセージごとにtopic_members個ずつの領域に記録する）
+    int* members;
+    uint64_t* published_at;
+    int* received;
+    uint32_t* fanout;
+    uint64_t pubsub_by_type[SIM_PUBSUB_TYPES];
+
+    // メッセージ
+    uint64_t sent;
+    uint64_t delivered;
+    uint64_t lost;
+    uint64_t to_dead;
+    uint64_t bytes;
+    uint64_t by_type[SIM_MESSAGE_TYPES];
+    uint64_t events;
+    int killed;
+    int joined;
+} Sim;
+
+static const char* message_names[SIM_MESSAGE_TYPES] = {
+    "?", "PING", "PONG", "FIND_NODE", "FIND_NODE_REPLY", "FIND_VALUE", "FIND_VALUE_REPLY",
+    "STORE", "STORE_REPLY", "CACHE_STORE"
+};
+
+static int saved_stdout = -1;
+
+// 各ノードの初期化・終了のメッセージを捨てる
+static void quiet(bool on) {
+    fflush(stdout);
+    if (on && saved_stdout < 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) {
+            saved_stdout = dup(STDOUT_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+    } else if (!on && saved_stdout >= 0) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+        saved_stdout = -1;
+    }
+}
+
+static double wall_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 常駐メモリ（バイト）
+static size_t resident_bytes() {
+    long pages = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        long size;
+        if (fscanf(fp, "%ld %ld", &size, &pages) != 2) {
+            pages = 0;
+        }
+        fclose(fp);
+    }
+    return (size_t)pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// 再現できる疑似乱数（xorshift64*）
+static uint64_t sim_rand(Sim* sim) {
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+    return sim->rng * 2685821657736338717ULL;
+}
+
+static double sim_uniform(Sim* sim) {
+    return (sim_rand(sim) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// ---- イベントキュー ----
+
+static bool event_before(const SimEvent* a, const SimEvent* b) {
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+static int sim_push(Sim* sim, const SimEvent* event) {
+    if (sim->heap_count == sim->heap_cap) {
+        int cap = sim->heap_cap ? sim->heap_cap * 2 : 4096;
+        SimEvent* heap = (SimEvent*)realloc(sim->heap, sizeof(SimEvent) * cap);
+        if (!heap) {
+            perror("Failed to grow simulator event queue");
+            return -1;
+        }
+        sim->heap = heap;
+        sim->heap_cap = cap;
+    }
+
+    int idx = sim->heap_count++;
+    sim->heap[idx] = *event;
+    sim->heap[idx].seq = sim->seq++;
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+        if (!event_before(&sim->heap[idx], &sim->heap[parent])) {
+            break;
+        }
+        SimEvent tmp = sim->heap[idx];
+        sim->heap[idx] = sim->heap[parent];
+        sim->heap[parent] = tmp;
+        idx = parent;
+    }
+    return 0;
+}
+
+static bool sim_pop(Sim* sim, SimEvent* event) {
+    if (sim->heap_count == 0) {
+        return false;
+    }
+    *event = sim->heap[0];
+    sim->heap[0] = sim->heap[--sim->heap_count];
+
+    int idx = 0;
+    while (1) {
+        int left = idx * 2 + 1;
+        int right = left + 1;
+        int smallest = idx;
+        if (left < sim->heap_count && event_before(&sim->heap[left], &sim->heap[smallest])) {
+            smallest = left;
+        }
+        if (right < sim->heap_count && event_before(&sim->heap[right], &sim->heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == idx) {
+            break;
+        }
+        SimEvent tmp = sim->heap[idx];
+        sim->heap[idx] = sim->heap[smallest];
+        sim->heap[smallest] = tmp;
+        idx = smallest;
+    }
+    return true;
+}
+
+static void sim_schedule(Sim* sim, SimEventType type, uint64_t at) {
+    SimEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.at = at;
+    sim_push(sim, &event);
+}
+
+// ---- トランスポート ----
+
+static int sim_index(const struct sockaddr_in* addr) {
+    uint32_t host = ntohl(addr->sin_addr.s_addr);
+    return host >= SIM_BASE_ADDR ? (int)(host - SIM_BASE_ADDR) : -1;
+}
+
+static uint64_t sim_now_ms(void* ctx) {
+    return ((Sim*)ctx)->now;
+}
+
+static int sim_send(void* ctx, Node* from, const struct sockaddr_in* to, const void* buf, size_t len) {
+    Sim* sim = (Sim*)ctx;
+    int to_idx = sim_index(to);
+    if (to_idx < 0 || to_idx >= sim->node_count) {
+        return -1;
+    }
+
+    sim->sent++;
+    sim->bytes += len;
+    if (pubsub_is_packet(buf, len)) {
+        if (((const uint8_t*)buf)[PUBSUB_MAGIC_LEN + 1] < SIM_PUBSUB_TYPES) {
+            sim->pubsub_by_type[((const uint8_t*)buf)[PUBSUB_MAGIC_LEN + 1]]++;
+        }
+    } else if (len > DHT_WIRE_MAGIC_LEN + 1 && ((const uint8_t*)buf)[DHT_WIRE_MAGIC_LEN + 1] < SIM_MESSAGE_TYPES) {
+        sim->by_type[((const uint8_t*)buf)[DHT_WIRE_MAGIC_LEN + 1]]++;
+    }
+    if (sim->config.loss > 0 && sim_uniform(sim) < sim->config.loss) {
+        sim->lost++;
+        return 0;  // 送信は成功したように見える
+    }
+
+    SimEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = SIM_EVENT_PACKET;
+    event.to = to_idx;
+    event.from = from->addr;
+    event.data = (uint8_t*)malloc(len);
+    if (!event.data) {
+        return -1;
+    }
+    memcpy(event.data, buf, len);
+    event.len = len;
+
+    uint64_t latency = (uint64_t)sim->config.latency_ms / 2;
+    if (sim->config.latency_ms > 0) {
+        latency += sim_rand(sim) % ((uint64_t)sim->config.latency_ms + 1);
+    }
+    event.at = sim->now + latency;
+    if (sim_push(sim, &event) < 0) {
+        free(event.data);
+        return -1;
+    }
+    return 0;
+}
+
+// ---- ノード ----
+
+static void sim_node_info(Sim* sim, int idx, DhtNodeInfo* info) {
+    memset(info, 0, sizeof(DhtNodeInfo));
+    info->id = ((DhtData*)sim->nodes[idx]->dht_data)->routing_table->self_id;
+    inet_ntop(AF_INET, &sim->nodes[idx]->addr.sin_addr, info->ip, sizeof(info->ip));
+    info->port = SIM_PORT;
+}
+
+static Node* sim_add_node(Sim* sim) {
+    if (sim->node_count == sim->node_cap) {
+        int cap = sim->node_cap ? sim->node_cap * 2 : 1024;
+        Node** nodes = (Node**)realloc(sim->nodes, sizeof(Node*) * cap);
+        if (!nodes) {
+            perror("Failed to grow simulator node table");
+            return NULL;
+        }
+        memset(nodes + sim->node_cap, 0, sizeof(Node*) * (cap - sim->node_cap));
+        sim->nodes = nodes;
+        sim->node_cap = cap;
+    }
+
+    Node* node = (Node*)calloc(1, sizeof(Node));
+    if (!node) {
+        perror("Failed to allocate simulated node");
+        return NULL;
+    }
+    int idx = sim->node_count;
+    node->id = idx;
+    node->is_running = true;
+    node->socket_fd = -1;
+    node->addr.sin_family = AF_INET;
+    node->addr.sin_port = htons(SIM_PORT);
+    node->addr.sin_addr.s_addr = htonl(SIM_BASE_ADDR + idx);
+    inet_ntop(AF_INET, &node->addr.sin_addr, node->ip, sizeof(node->ip));
+
+    dht_init_manual(node);
+    if (!node->dht_data) {
+        free(node);
+        return NULL;
+    }
+    DhtTransport transport = { sim_send, sim_now_ms, sim };
+    dht_set_transport(node, &transport);
+    dht_set_replication(node, sim->config.replication, 0);
+    dht_set_path_cache(node, sim->config.cache, 0);
+
+    sim->nodes[idx] = node;
+    sim->node_count++;
+    sim->alive++;
+    return node;
+}
+
+static void sim_remove_node(Sim* sim, int idx) {
+    pubsub_cleanup(sim->nodes[idx]);
+    dht_cleanup(sim->nodes[idx]);
+    free(sim->nodes[idx]);
+    sim->nodes[idx] = NULL;
+    sim->alive--;
+}
+
+static int sim_random_alive(Sim* sim) {
+    if (sim->alive == 0) {
+        return -1;
+    }
+    while (1) {
+        int idx = (int)(sim_rand(sim) % (uint64_t)sim->node_count);
+        if (sim->nodes[idx]) {
+            return idx;
+        }
+    }
+}
+
+// ---- ルックアップ ----
+
+static void sim_start_op(Sim* sim, SimOpKind kind, int node, int key) {
+    if (sim->op_count == sim->op_cap) {
+        int cap = sim->op_cap ? sim->op_cap * 2 : 64;
+        SimOp* ops = (SimOp*)realloc(sim->ops, sizeof(SimOp) * cap);
+        if (!ops) {
+            perror("Failed to grow simulator lookups");
+            return;
+        }
+        sim->ops = ops;
+        sim->op_cap = cap;
+    }
+
+    const DhtId* target = kind == SIM_OP_JOIN ? &((DhtData*)sim->nodes[node]->dht_data)->routing_table->self_id
+                                              : &sim->keys[key];
+    DhtLookup* lookup = dht_lookup_start(sim->nodes[node], target, kind == SIM_OP_GET || kind == SIM_OP_READ,
+                                         DHT_LOOKUP_DEFAULT_TIMEOUT_MS);
+    if (!lookup) {
+        return;
+    }
+    SimOp* op = &sim->ops[sim->op_count++];
+    op->kind = kind;
+    op->node = node;
+    op->key = key;
+    op->lookup = lookup;
+    op->started = sim->now;
+}
+
+static void sim_record(SimResults* results, uint64_t latency, int queries) {
+    results->latency[results->count++] = (uint32_t)latency;
+    results->queries += queries;
+}
+
+// 完了したルックアップの後処理
+static void sim_finish_op(Sim* sim, SimOp* op) {
+    Node* node = sim->nodes[op->node];
+    DhtLookup* lookup = op->lookup;
+    uint64_t latency = sim->now - op->started;
+    char value[64];
+
+    if (op->kind == SIM_OP_JOIN) {
+        dht_lookup_finish(node, lookup, NULL, 0, NULL, NULL);
+        return;
+    }
+
+    snprintf(value, sizeof(value), "sim-value-%d", op->key);
+    if (op->kind == SIM_OP_PUBLISH) {
+        sim_record(&sim->publish, latency, lookup->queries_sent);
+        DhtNodeInfo closest[DHT_K];
+        int count = dht_lookup_finish(node, lookup, closest, DHT_K, NULL, NULL);
+        for (int i = 0; i < count; i++) {
+            dht_replica_send_store(node, &closest[i], &sim->keys[op->key], NULL, value, strlen(value),
+                                   DHT_STORE_DEFAULT_TTL);
+        }
+        sim->publish.found += count > 0;
+        return;
+    }
+
+    SimResults* results = op->kind == SIM_OP_GET ? &sim->get : &sim->read;
+    sim_record(results, latency, lookup->queries_sent);
+    bool found = lookup->value_found;
+    int hops = lookup->value_hops < SIM_MAX_HOPS ? lookup->value_hops : SIM_MAX_HOPS;
+    bool cached = lookup->value_cached;
+    dht_lookup_cache_value(node, lookup);
+
+    uint8_t buf[MAX_BUFFER];
+    size_t buf_len = sizeof(buf);
+    dht_lookup_finish(node, lookup, NULL, 0, buf, &buf_len);
+    if (found && buf_len == strlen(value) && memcmp(buf, value, buf_len) == 0) {
+        results->found++;
+        results->hops[hops]++;
+        results->cached += cached;
+    }
+}
+
+// ノードのルックアップが完了していれば後処理する（node < 0なら全て）
+static void sim_check_ops(Sim* sim, int node) {
+    for (int i = 0; i < sim->op_count;) {
+        SimOp* op = &sim->ops[i];
+        if ((node >= 0 && op->node != node) || !dht_lookup_is_done(sim->nodes[op->node], op->lookup)) {
+            i++;
+            continue;
+        }
+        SimOp done = *op;
+        sim->ops[i] = sim->ops[--sim->op_count];
+        sim_finish_op(sim, &done);
+    }
+}
+
+static bool sim_node_busy(Sim* sim, int idx) {
+    for (int i = 0; i < sim->op_count; i++) {
+        if (sim->ops[i].node == idx) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 新しいノードを既存のノードを教えて参加させる
+static void sim_join(Sim* sim) {
+    Node* node = sim_add_node(sim);
+    if (!node) {
+        return;
+    }
+    int idx = sim->node_count - 1;
+    for (int i = 0; i < SIM_JOIN_CONTACTS && sim->alive > 1; i++) {
+        int peer = sim_random_alive(sim);
+        if (peer == idx) {
+            continue;
+        }
+        DhtNodeInfo info;
+        sim_node_info(sim, peer, &info);
+        dht_add_node(node, &info);
+    }
+    sim_start_op(sim, SIM_OP_JOIN, idx, -1);
+}
+
+// 1秒ごと: 全ノードのメンテナンスとチャーン
+static void sim_tick(Sim* sim) {
+    for (int i = 0; i < sim->node_count; i++) {
+        if (sim->nodes[i]) {
+            dht_maintenance_tick(sim->nodes[i], sim->ticks);
+            if (sim->nodes[i]->pubsub_data) {
+                pubsub_heartbeat(sim->nodes[i]);
+            }
+        }
+    }
+    sim->ticks++;
+
+    if (sim->config.churn > 0 && sim->phase == SIM_OP_GET) {
+        sim->churn_debt += sim->alive * sim->config.churn / 60.0;
+        while (sim->churn_debt >= 1.0) {
+            sim->churn_debt -= 1.0;
+            int victim = sim_random_alive(sim);
+            if (victim >= 0 && !sim_node_busy(sim, victim)) {
+                sim_remove_node(sim, victim);
+                sim->killed++;
+            }
+            sim_join(sim);
+            sim->joined++;
+        }
+    }
+}
+
+static void sim_process(Sim* sim, SimEvent* event) {
+    sim->now = event->at;
+    sim->events++;
+
+    switch (event->type) {
+        case SIM_EVENT_PACKET:
+            if (sim->nodes[event->to] && sim_index(&event->from) < sim->node_count &&
+                sim->nodes[sim_index(&event->from)]) {
+                if (pubsub_is_packet(event->data, event->len)) {
+                    pubsub_handle_packet(sim->nodes[event->to], event->data, event->len, &event->from);
+                } else {
+                    dht_handle_packet(sim->nodes[event->to], event->data, event->len, &event->from);
+                }
+                sim->delivered++;
+                sim_check_ops(sim, event->to);
+            } else {
+                sim->to_dead++;
+            }
+            free(event->data);
+            break;
+        case SIM_EVENT_TICK:
+            sim_tick(sim);
+            sim_schedule(sim, SIM_EVENT_TICK, sim->now + 1000);
+            break;
+        case SIM_EVENT_POLL:
+            sim_check_ops(sim, -1);
+            sim_schedule(sim, SIM_EVENT_POLL, sim->now + SIM_POLL_MS);
+            break;
+    }
+}
+
+// 手順を1つ実行（同時にconcurrency個までのルックアップを進める）
+static void sim_run_phase(Sim* sim, SimOpKind phase, int count) {
+    sim->phase = phase;
+    sim->remaining = count;
+
+    while (1) {
+        int active = 0;
+        for (int i = 0; i < sim->op_count; i++) {
+            active += sim->ops[i].kind == phase;
+        }
+        while (sim->remaining > 0 && active < sim->config.concurrency) {
+            sim->remaining--;
+            if (phase == SIM_OP_JOIN) {
+                sim_join(sim);
+            } else {
+                int node = sim_random_alive(sim);
+                int key = (int)(sim_rand(sim) % (uint64_t)sim->config.keys);
+                sim_start_op(sim, phase, node, phase == SIM_OP_GET ? key : count - sim->remaining - 1);
+            }
+            active++;
+        }
+        if (sim->remaining == 0 && active == 0) {
+            break;
+        }
+
+        SimEvent event;
+        if (!sim_pop(sim, &event)) {
+            break;
+        }
+        sim_process(sim, &event);
+    }
+}
+
+// ---- パブサブ ----
+
+// 仮想時刻untilまでのイベントを処理する
+static void sim_run_until(Sim* sim, uint64_t until) {
+    SimEvent event;
+    while (sim->heap_count > 0 && sim->heap[0].at <= until && sim_pop(sim, &event)) {
+        sim_process(sim, &event);
+    }
+    sim->now = until;
+}
+
+// 購読者がメッセージを受け取った（先頭4バイトがメッセージの番号）
+static void sim_pubsub_deliver(Node* node, const char* topic, const void* data, size_t len, void* arg) {
+    (void)node;
+    (void)topic;
+    Sim* sim = (Sim*)arg;
+    uint32_t msg;
+    if (len < sizeof(msg)) {
+        return;
+    }
+    memcpy(&msg, data, sizeof(msg));
+    if (msg >= (uint32_t)sim->config.messages || sim->received[msg] >= sim->config.topic_members) {
+        return;
+    }
+    size_t slot = (size_t)msg * sim->config.topic_members + sim->received[msg]++;
+    sim->fanout[slot] = (uint32_t)(sim->now - sim->published_at[msg]);
+}
+
+// 購読者を選んでトピックを購読させ、メッシュができるまで進める
+static void sim_pubsub_subscribe(Sim* sim) {
+    int members = sim->config.topic_members;
+    int* order = (int*)malloc(sizeof(int) * sim->node_count);
+    if (!order) {
+        perror("Failed to allocate topic members");
+        return;
+    }
+    for (int i = 0; i < sim->node_count; i++) {
+        order[i] = i;
+    }
+    for (int i = 0; i < members; i++) {
+        int j = i + (int)(sim_rand(sim) % (uint64_t)(sim->node_count - i));
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    memcpy(sim->members, order, sizeof(int) * members);
+    free(order);
+
+    for (int i = 0; i < members; i++) {
+        Node* node = sim->nodes[sim->members[i]];
+        pubsub_init_manual(node);
+        pubsub_set_handler(node, sim_pubsub_deliver, sim);
+        pubsub_subscribe(node, SIM_TOPIC);
+    }
+
+    // ランデブーの検索で見つかる参加者の代わりに、他の購読者をランダムに教える
+    for (int i = 0; i < members; i++) {
+        for (int j = 0; j < SIM_TOPIC_BOOTSTRAP; j++) {
+            int peer = sim->members[sim_rand(sim) % (uint64_t)members];
+            if (peer != sim->members[i]) {
+                pubsub_add_peer(sim->nodes[sim->members[i]], SIM_TOPIC, &sim->nodes[peer]->addr);
+            }
+        }
+    }
+    sim_run_until(sim, sim->now + SIM_MESH_WARMUP_MS);
+}
+
+// ランダムな購読者から一定間隔でメッセージを公開し、配送が落ち着くまで進める
+static void sim_pubsub_publish(Sim* sim) {
+    SimConfig* config = &sim->config;
+    uint8_t* payload = (uint8_t*)calloc(1, config->payload);
+    if (!payload) {
+        perror("Failed to allocate pubsub payload");
+        return;
+    }
+    for (int m = 0; m < config->messages; m++) {
+        int publisher = sim->members[sim_rand(sim) % (uint64_t)config->topic_members];
+        uint32_t msg = (uint32_t)m;
+        memcpy(payload, &msg, sizeof(msg));
+        sim->published_at[m] = sim->now;
+        pubsub_publish(sim->nodes[publisher], SIM_TOPIC, payload, config->payload);
+        sim_run_until(sim, sim->now + config->publish_interval_ms);
+    }
+    sim_run_until(sim, sim->now + SIM_DRAIN_MS);
+    free(payload);
+}
+
+// ---- ルーティングテーブルの構築 ----
+
+typedef struct {
+    DhtId id;
+    int idx;
+} SimId;
+
+static int sim_id_cmp(const void* a, const void* b) {
+    return memcmp(((const SimId*)a)->id.bytes, ((const SimId*)b)->id.bytes, DHT_ID_BITS/8);
+}
+
+// idより小さくない最初の位置
+static int sim_lower_bound(const SimId* ids, int count, const DhtId* id) {
+    int lo = 0;
+    int hi = count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (memcmp(ids[mid].id.bytes, id->bytes, DHT_ID_BITS/8) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// 先頭bitsビットがprefixと同じIDの範囲[*first, *last)
+static void sim_prefix_range(const SimId* ids, int count, const DhtId* prefix, int bits, int* first, int* last) {
+    DhtId low = *prefix;
+    DhtId high = *prefix;
+    for (int b = bits; b < DHT_ID_BITS; b++) {
+        uint8_t bit = (uint8_t)(1 << (7 - b % 8));
+        low.bytes[b / 8] &= ~bit;
+        high.bytes[b / 8] |= bit;
+    }
+    *first = sim_lower_bound(ids, count, &low);
+    *last = sim_lower_bound(ids, count, &high);
+    if (*last < count && memcmp(ids[*last].id.bytes, high.bytes, DHT_ID_BITS/8) == 0) {
+        (*last)++;
+    }
+}
+
+// 全ノードのIDを知っている前提で、各バケットに範囲内のランダムなk個を入れる
+// （参加とバケットの更新が十分に進んだ後の状態）
+static void sim_fill_tables(Sim* sim) {
+    SimId* ids = (SimId*)malloc(sizeof(SimId) * sim->node_count);
+    if (!ids) {
+        perror("Failed to allocate simulator IDs");
+        return;
+    }
+    for (int i = 0; i < sim->node_count; i++) {
+        ids[i].id = ((DhtData*)sim->nodes[i]->dht_data)->routing_table->self_id;
+        ids[i].idx = i;
+    }
+    qsort(ids, sim->node_count, sizeof(SimId), sim_id_cmp);
+
+    for (int i = 0; i < sim->node_count; i++) {
+        const DhtId* self_id = &((DhtData*)sim->nodes[i]->dht_data)->routing_table->self_id;
+        for (int b = 0; b < DHT_ID_BITS; b++) {
+            // 自分と先頭bビットが同じノードが自分だけになったら終わり
+            int first, last;
+            sim_prefix_range(ids, sim->node_count, self_id, b, &first, &last);
+            if (last - first <= 1) {
+                break;
+            }
+
+            // バケットb: 先頭bビットが同じで、bビット目が異なる
+            DhtId sibling = *self_id;
+            sibling.bytes[b / 8] ^= (uint8_t)(1 << (7 - b % 8));
+            sim_prefix_range(ids, sim->node_count, &sibling, b + 1, &first, &last);
+            int range = last - first;
+            int start = range > DHT_K ? (int)(sim_rand(sim) % (uint64_t)range) : 0;
+            for (int j = 0; j < range && j < DHT_K; j++) {
+                DhtNodeInfo info;
+                sim_node_info(sim, ids[first + (start + j) % range].idx, &info);
+                dht_add_node(sim->nodes[i], &info);
+            }
+        }
+    }
+    free(ids);
+}
+
+// ---- 結果 ----
+
+// ワークロードのキーのID（1024個ずつまとめてハッシュする）
+static int sim_hash_keys(DhtId* keys, int count) {
+    enum { CHUNK = 1024 };
+    char (*strs)[32] = malloc(sizeof(*strs) * CHUNK);
+    const char** ptrs = (const char**)malloc(sizeof(char*) * CHUNK);
+    if (!strs || !ptrs) {
+        perror("Failed to allocate key names");
+        free(strs);
+        free(ptrs);
+        return -1;
+    }
+    for (int base = 0; base < count; base += CHUNK) {
+        int n = count - base < CHUNK ? count - base : CHUNK;
+        for (int i = 0; i < n; i++) {
+            snprintf(strs[i], sizeof(strs[i]), "sim-key-%d", base + i);
+            ptrs[i] = strs[i];
+        }
+        dht_hash_strings(ptrs, n, keys + base);
+    }
+    free(strs);
+    free(ptrs);
+    return 0;
+}
+
+static int latency_cmp(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const uint32_t* sorted, int count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    int idx = (int)(p * (count - 1) + 0.5);
+    return sorted[idx];
+}
+
+static void print_lookups(const char* name, SimResults* results) {
+    qsort(results->latency, results->count, sizeof(uint32_t), latency_cmp);
+    double n = results->count > 0 ? results->count : 1;
+    printf("%s: %d lookups, %d succeeded (%.2f%%), %.2f queries each\n", name, results->count, results->found,
+           results->found * 100.0 / n, results->queries / n);
+    printf("  latency ms: p50 %u, p90 %u, p99 %u, max %u\n", percentile(results->latency, results->count, 0.5),
+           percentile(results->latency, results->count, 0.9), percentile(results->latency, results->count, 0.99),
+           results->count > 0 ? results->latency[results->count - 1] : 0);
+}
+
+static void print_report(Sim* sim, double run_sec) {
+    print_lookups("publish", &sim->publish);
+    print_lookups("get", &sim->get);
+
+    double found = sim->get.found > 0 ? sim->get.found : 1;
+    double mean = 0;
+    for (int h = 0; h <= SIM_MAX_HOPS; h++) {
+        mean += h * (double)sim->get.hops[h];
+    }
+    printf("  hops to value (mean %.2f, %.1f%% from path caches):", mean / found, sim->get.cached * 100.0 / found);
+    for (int h = 0; h <= SIM_MAX_HOPS; h++) {
+        if (sim->get.hops[h] > 0) {
+            printf(" %d%s:%.1f%%", h, h == SIM_MAX_HOPS ? "+" : "", sim->get.hops[h] * 100.0 / found);
+        }
+    }
+    printf("\n");
+
+    int lookups = sim->get.count + sim->publish.count;
+    printf("messages: %llu sent (%.1f per lookup), %llu delivered, %llu lost, %llu to stopped nodes, %.1f MB\n",
+           (unsigned long long)sim->sent, sim->sent / (double)(lookups > 0 ? lookups : 1),
+           (unsigned long long)sim->delivered, (unsigned long long)sim->lost, (unsigned long long)sim->to_dead,
+           sim->bytes / 1e6);
+    printf(" ");
+    for (int t = 1; t < SIM_MESSAGE_TYPES; t++) {
+        printf(" %s %llu", message_names[t], (unsigned long long)sim->by_type[t]);
+    }
+    printf("\n");
+
+    DhtMemoryStats total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < sim->node_count; i++) {
+        if (!sim->nodes[i]) {
+            continue;
+        }
+        DhtMemoryStats stats;
+        dht_get_memory_stats(sim->nodes[i], &stats);
+        total.contacts += stats.contacts;
+        total.routing_bytes += stats.routing_bytes;
+        total.store_bytes += stats.store_bytes;
+        total.cache_bytes += stats.cache_bytes;
+        total.total_bytes += stats.total_bytes;
+    }
+    double alive = sim->alive > 0 ? sim->alive : 1;
+    printf("memory: %.1f MB resident, DHT %.1f MB (%.0f bytes/node: routing %.0f, store %.0f, cache %.0f), "
+           "%.1f contacts/node\n",
+           resident_bytes() / 1e6, total.total_bytes / 1e6, total.total_bytes / alive, total.routing_bytes / alive,
+           total.store_bytes / alive, total.cache_bytes / alive, total.contacts / alive);
+    if (sim->config.churn > 0) {
+        printf("churn: %d nodes stopped, %d joined\n", sim->killed, sim->joined);
+        printf("  readable after churn: %d/%d keys (%.2f%%)\n", sim->read.found, sim->read.count,
+               sim->read.found * 100.0 / (sim->read.count > 0 ? sim->read.count : 1));
+    }
+    if (sim->config.replication) {
+        DhtReplicationStats total;
+        memset(&total, 0, sizeof(total));
+        for (int i = 0; i < sim->node_count; i++) {
+            if (!sim->nodes[i]) {
+                continue;
+            }
+            DhtReplicationStats stats;
+            dht_get_replication_stats(sim->nodes[i], &stats);
+            total.stores_sent += stats.stores_sent;
+            total.repair_bytes += stats.repair_bytes;
+            total.handoffs += stats.handoffs;
+            total.throttled += stats.throttled;
+            total.queue_depth += stats.queue_depth;
+        }
+        printf("replication: %llu STOREs sent, %llu handoffs, %.1f MB repair traffic, %llu throttled, "
+               "%d tasks queued\n",
+               (unsigned long long)total.stores_sent, (unsigned long long)total.handoffs, total.repair_bytes / 1e6,
+               (unsigned long long)total.throttled, total.queue_depth);
+    }
+    printf("time: %.1f s simulated, %.1f s wall (%.0f events/s)\n", sim->now / 1000.0, run_sec,
+           sim->events / (run_sec > 0 ? run_sec : 1));
+}
+
+static void print_pubsub_stats(Sim* sim, PubsubStats* total) {
+    memset(total, 0, sizeof(PubsubStats));
+    for (int i = 0; i < sim->config.topic_members; i++) {
+        PubsubStats stats;
+        pubsub_get_stats(sim->nodes[sim->members[i]], &stats);
+        total->published += stats.published;
+        total->delivered += stats.delivered;
+        total->duplicates += stats.duplicates;
+        total->pushed += stats.pushed;
+        total->ihave_sent += stats.ihave_sent;
+        total->iwant_sent += stats.iwant_sent;
+        total->iwant_served += stats.iwant_served;
+        total->grafts_sent += stats.grafts_sent;
+        total->prunes_sent += stats.prunes_sent;
+        total->peers += stats.peers;
+        total->mesh_peers += stats.mesh_peers;
+    }
+}
+
+// 各メッセージが購読者のfraction以上に届くまでの時間の分布
+static void print_reach(Sim* sim, const char* name, double fraction) {
+    int members = sim->config.topic_members;
+    int needed = (int)(fraction * (members - 1) + 0.999);
+    uint32_t* reach = (uint32_t*)malloc(sizeof(uint32_t) * sim->config.messages);
+    if (!reach || needed < 1) {
+        free(reach);
+        return;
+    }
+    int count = 0;
+    for (int m = 0; m < sim->config.messages; m++) {
+        if (sim->received[m] >= needed) {
+            reach[count++] = sim->fanout[(size_t)m * members + needed - 1];
+        }
+    }
+    qsort(reach, count, sizeof(uint32_t), latency_cmp);
+    printf("  time to reach %s of members ms: p50 %u, p90 %u, p99 %u, max %u (%d of %d messages)\n", name,
+           percentile(reach, count, 0.5), percentile(reach, count, 0.9), percentile(reach, count, 0.99),
+           count > 0 ? reach[count - 1] : 0, count, sim->config.messages);
+    free(reach);
+}
+
+static void print_pubsub_report(Sim* sim, const PubsubStats* warmup, double run_sec) {
+    SimConfig* config = &sim->config;
+    int members = config->topic_members;
+    printf("mesh: %.1f peers/member, %.1f in mesh, %llu GRAFT and %llu PRUNE while forming\n",
+           warmup->peers / (double)members, warmup->mesh_peers / (double)members,
+           (unsigned long long)warmup->grafts_sent, (unsigned long long)warmup->prunes_sent);
+
+    // 受け取りの遅延はメッセージごとに並べ、全体の分布は別の配列で求める
+    uint64_t deliveries = 0;
+    for (int m = 0; m < config->messages; m++) {
+        qsort(sim->fanout + (size_t)m * members, sim->received[m], sizeof(uint32_t), latency_cmp);
+        deliveries += sim->received[m];
+    }
+    uint32_t* all = (uint32_t*)malloc(sizeof(uint32_t) * (deliveries > 0 ? deliveries : 1));
+    if (!all) {
+        perror("Failed to allocate pubsub latencies");
+        return;
+    }
+    size_t n = 0;
+    int complete = 0;
+    for (int m = 0; m < config->messages; m++) {
+        memcpy(all + n, sim->fanout + (size_t)m * members, sizeof(uint32_t) * sim->received[m]);
+        n += sim->received[m];
+        complete += sim->received[m] >= members - 1;
+    }
+    qsort(all, n, sizeof(uint32_t), latency_cmp);
+
+    PubsubStats stats;
+    print_pubsub_stats(sim, &stats);
+    uint64_t expected = (uint64_t)config->messages * (members - 1);
+    double per = deliveries > 0 ? (double)deliveries : 1;
+    printf("pubsub: %d members, %d messages of %d bytes every %d ms (%.0f messages/s)\n", members,
+           config->messages, config->payload, config->publish_interval_ms,
+           config->publish_interval_ms > 0 ? 1000.0 / config->publish_interval_ms : 0);
+    printf("  delivered %.2f%% (%llu of %llu), %d of %d messages reached every member\n",
+           deliveries * 100.0 / (double)(expected > 0 ? expected : 1), (unsigned long long)deliveries,
+           (unsigned long long)expected, complete, config->messages);
+    printf("  delivery latency ms: p50 %u, p90 %u, p99 %u, max %u\n", percentile(all, (int)n, 0.5),
+           percentile(all, (int)n, 0.9), percentile(all, (int)n, 0.99), n > 0 ? all[n - 1] : 0);
+    print_reach(sim, "50%", 0.5);
+    print_reach(sim, "99%", 0.99);
+    print_reach(sim, "all", 1.0);
+    printf("  per delivery: %.2f PUBLISH sent, %.2f duplicates; IHAVE %llu, IWANT %llu, "
+           "%llu messages repaired by IWANT (%.2f%%)\n",
+           sim->pubsub_by_type[PUBSUB_PUBLISH] / per, stats.duplicates / per,
+           (unsigned long long)stats.ihave_sent, (unsigned long long)stats.iwant_sent,
+           (unsigned long long)stats.iwant_served, stats.iwant_served * 100.0 / per);
+    free(all);
+
+    printf("messages: %llu sent, %llu lost, %.1f MB;", (unsigned long long)sim->sent,
+           (unsigned long long)sim->lost, sim->bytes / 1e6);
+    static const char* pubsub_names[SIM_PUBSUB_TYPES] = { "?", "PUBLISH", "IHAVE", "IWANT", "GRAFT", "PRUNE" };
+    for (int t = 1; t < SIM_PUBSUB_TYPES; t++) {
+        printf(" %s %llu", pubsub_names[t], (unsigned long long)sim->pubsub_by_type[t]);
+    }
+    printf("\n");
+    printf("time: %.1f s simulated, %.1f s wall (%.0f deliveries/s, %.0f events/s)\n", sim->now / 1000.0, run_sec,
+           deliveries / (run_sec > 0 ? run_sec : 1), sim->events / (run_sec > 0 ? run_sec : 1));
+}
+
+static void usage(const char* prog) {
+    printf("Usage: %s [-n NODES] [-k KEYS] [-g GETS] [-c CONCURRENCY] [-l LATENCY_MS] [-p LOSS]\n"
+           "          [-r CHURN_PER_MIN] [-j] [-C] [-R] [-s SEED] [-P MEMBERS] [-m MESSAGES] [-i INTERVAL_MS]\n"
+           "          [-b BYTES]\n"
+           "  -n  virtual nodes (default 10000)\n"
+           "  -k  keys to publish (default 1000)\n"
+           "  -g  lookups of random keys (default 10000)\n"
+           "  -c  concurrent lookups (default 64)\n"
+           "  -l  mean one-way latency in ms, uniform over 0.5x-1.5x (default 50)\n"
+           "  -p  packet loss rate 0-1 (default 0)\n"
+           "  -r  fraction of nodes replaced per simulated minute during lookups (default 0)\n"
+           "  -j  join nodes one by one over the protocol instead of filling routing tables\n"
+           "  -C  disable the path cache\n"
+           "  -R  enable value replication (hand-off to joining nodes and re-replication)\n"
+           "  -s  random seed\n"
+           "  -P  measure pubsub on a topic with this many members instead of lookups\n"
+           "  -m  pubsub messages to publish (default 200)\n"
+           "  -i  interval between pubsub messages in ms (default 10)\n"
+           "  -b  pubsub message size in bytes (default 256)\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    Sim* sim = (Sim*)calloc(1, sizeof(Sim));
+    if (!sim) {
+        perror("Failed to allocate simulator");
+        return 1;
+    }
+    SimConfig* config = &sim->config;
+    config->nodes = 10000;
+    config->keys = 1000;
+    config->gets = 10000;
+    config->concurrency = 64;
+    config->latency_ms = 50;
+    config->cache = true;
+    config->seed = 1;
+    config->messages = 200;
+    config->publish_interval_ms = 10;
+    config->payload = 256;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:k:g:c:l:p:r:jCRs:P:m:i:b:h")) != -1) {
+        switch (opt) {
+            case 'n': config->nodes = atoi(optarg); break;
+            case 'k': config->keys = atoi(optarg); break;
+            case 'g': config->gets = atoi(optarg); break;
+            case 'c': config->concurrency = atoi(optarg); break;
+            case 'l': config->latency_ms = atoi(optarg); break;
+            case 'p': config->loss = atof(optarg); break;
+            case 'r': config->churn = atof(optarg); break;
+            case 'j': config->join = true; break;
+            case 'C': config->cache = false; break;
+            case 'R': config->replication = true; break;
+            case 's': config->seed = strtoull(optarg, NULL, 10); break;
+            case 'P': config->topic_members = atoi(optarg); break;
+            case 'm': config->messages = atoi(optarg); break;
+            case 'i': config->publish_interval_ms = atoi(optarg); break;
+            case 'b': config->payload = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                free(sim);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (config->nodes < 2 || config->keys < 1 || config->gets < 0 || config->concurrency < 1 ||
+        config->latency_ms < 0 || config->loss < 0 || config->loss >= 1 || config->churn < 0 ||
+        (uint64_t)config->nodes >= (1u << 24) || config->topic_members < 0 ||
+        config->topic_members == 1 || config->topic_members > config->nodes || config->messages < 1 ||
+        config->publish_interval_ms < 0 || config->payload < 4 || config->payload > PUBSUB_MAX_DATA) {
+        usage(argv[0]);
+        free(sim);
+        return 1;
+    }
+    sim->rng = config->seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    sim->keys = (DhtId*)malloc(sizeof(DhtId) * config->keys);
+    sim->publish.latency = (uint32_t*)malloc(sizeof(uint32_t) * config->keys);
+    sim->get.latency = (uint32_t*)malloc(sizeof(uint32_t) * (config->gets > 0 ? config->gets : 1));
+    sim->read.latency = (uint32_t*)malloc(sizeof(uint32_t) * config->keys);
+    if (!sim->keys || !sim->publish.latency || !sim->get.latency || !sim->read.latency) {
+        perror("Failed to allocate simulator workload");
+        return 1;
+    }
+    if (sim_hash_keys(sim->keys, config->keys) < 0) {
+        return 1;
+    }
+    if (config->topic_members > 0) {
+        sim->members = (int*)malloc(sizeof(int) * config->topic_members);
+        sim->published_at = (uint64_t*)calloc(config->messages, sizeof(uint64_t));
+        sim->received = (int*)calloc(config->messages, sizeof(int));
+        sim->fanout = (uint32_t*)malloc(sizeof(uint32_t) * config->messages * (size_t)config->topic_members);
+        if (!sim->members || !sim->published_at || !sim->received || !sim->fanout) {
+            perror("Failed to allocate pubsub workload");
+            return 1;
+        }
+    }
+
+    printf("DHT simulation: %d nodes, k=%d, alpha=%d, latency %d ms, loss %.1f%%, churn %.1f%%/min, "
+           "path cache %s, replication %s, %s\n",
+           config->nodes, DHT_K, DHT_ALPHA, config->latency_ms, config->loss * 100, config->churn * 100,
+           config->cache ? "on" : "off", config->replication ? "on" : "off",
+           config->join ? "protocol join" : "filled routing tables");
+    fflush(stdout);
+
+    double start = wall_sec();
+    sim->now = 1000;
+    sim_schedule(sim, SIM_EVENT_TICK, sim->now + 1000);
+    sim_schedule(sim, SIM_EVENT_POLL, sim->now + SIM_POLL_MS);
+
+    quiet(true);
+    if (config->join) {
+        sim_add_node(sim);
+        sim_run_phase(sim, SIM_OP_JOIN, config->nodes - 1);
+    } else {
+        for (int i = 0; i < config->nodes; i++) {
+            sim_add_node(sim);
+        }
+        sim_fill_tables(sim);
+    }
+    quiet(false);
+    double setup_sec = wall_sec() - start;
+    uint64_t setup_messages = sim->sent;
+
+    // 構築中のメッセージは数えない
+    sim->events = 0;
+    sim->sent = 0;
+    sim->delivered = 0;
+    sim->lost = 0;
+    sim->to_dead = 0;
+    sim->bytes = 0;
+    memset(sim->by_type, 0, sizeof(sim->by_type));
+
+    if (config->topic_members > 0) {
+        // メッシュを作る間のメッセージは数えない
+        quiet(true);
+        sim_pubsub_subscribe(sim);
+        quiet(false);
+        PubsubStats warmup;
+        print_pubsub_stats(sim, &warmup);
+        sim->events = 0;
+        sim->sent = 0;
+        sim->lost = 0;
+        sim->bytes = 0;
+        memset(sim->pubsub_by_type, 0, sizeof(sim->pubsub_by_type));
+
+        start = wall_sec();
+        sim_pubsub_publish(sim);
+        double run_sec = wall_sec() - start;
+
+        printf("setup: %.1f s wall, %llu messages\n", setup_sec, (unsigned long long)setup_messages);
+        print_pubsub_report(sim, &warmup, run_sec);
+    } else {
+        start = wall_sec();
+        quiet(true);
+        sim_run_phase(sim, SIM_OP_PUBLISH, config->keys);
+        sim_run_phase(sim, SIM_OP_GET, config->gets);
+        if (config->churn > 0) {
+            sim_run_phase(sim, SIM_OP_READ, config->keys);
+        }
+        quiet(false);
+        double run_sec = wall_sec() - start;
+
+        printf("setup: %.1f s wall, %llu messages\n", setup_sec, (unsigned long long)setup_messages);
+        print_report(sim, run_sec);
+    }
+
+    // 後片付け
+    quiet(true);
+    for (int i = 0; i < sim->op_count; i++) {
+        dht_lookup_finish(sim->nodes[sim->ops[i].node], sim->ops[i].lookup, NULL, 0, NULL, NULL);
+    }
+    for (int i = 0; i < sim->node_count; i++) {
+        if (sim->nodes[i]) {
+            sim_remove_node(sim, i);
+        }
+    }
+    quiet(false);
+    SimEvent event;
+    while (sim_pop(sim, &event)) {
+        free(event.data);
+    }
+    free(sim->heap);
+    free(sim->nodes);
+    free(sim->ops);
+    free(sim->keys);
+    free(sim->publish.latency);
+    free(sim->get.latency);
+    free(sim->read.latency);
+    free(sim->members);
+    free(sim->published_at);
+    free(sim->received);
+    free(sim->fanout);
+    free(sim);
+    return 0;
+}
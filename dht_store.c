@@ -0,0 +1,669 @@
+#include "dht_store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// DHT値ストア
+//
+// キーはSHA-1由来で一様に分布しているため、先頭ワードをそのままハッシュに使う。
+// ハッシュ表は線形探索のオープンアドレス法で、削除は後方シフトで行い墓標を残さない。
+// ハッシュ表が持つのはエントリ番号だけなので、再配置してもLRUリストは影響を受けない。
+//
+// 1つのキーに複数の値を置く場合、エントリは(キー, メンバーID)で引くindexと、キーで
+// メンバーリストの先頭を引くset_indexの両方から辿れる。メンバーリストは通し番号の
+// 昇順（追加・更新した順）に並び、更新されたメンバーは末尾へ移る。そのため上限に
+// 達したときは先頭（最も長く更新されていないメンバー）を捨てればよく、ページングの
+// カーソルも(通し番号, メンバーID)から1回のハッシュ検索で再開できる。
+
+#define DHT_STORE_EMPTY (-1)
+
+static const DhtId store_no_member;  // 単一の値のメンバーID（全て0）
+
+// キーのハッシュ値
+static inline uint32_t store_key_hash(const DhtId* key, uint32_t mask) {
+    uint64_t h = dht_load_be64(key->bytes) ^ dht_load_be64(key->bytes + 8);
+    return (uint32_t)((h * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+// キーとメンバーIDのハッシュ値（メンバーIDが0なら単一の値と同じ位置）
+static inline uint32_t store_hash(const DhtId* key, const DhtId* member, uint32_t mask) {
+    uint64_t h = dht_load_be64(key->bytes) ^ dht_load_be64(key->bytes + 8);
+    h ^= (dht_load_be64(member->bytes) ^ dht_load_be64(member->bytes + 8)) * 0xC2B2AE3D27D4EB4FULL;
+    return (uint32_t)((h * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+static inline bool id_equal(const DhtId* a, const DhtId* b) {
+    return memcmp(a->bytes, b->bytes, sizeof(a->bytes)) == 0;
+}
+
+// エントリ1つあたりの管理コスト（エントリ本体 + 2つのハッシュ表の平均2スロットずつ）
+static inline size_t entry_overhead() {
+    return sizeof(DhtStoreEntry) + 4 * sizeof(int32_t);
+}
+
+// 値ストアの初期化
+int dht_store_init(DhtValueStore* store, size_t memory_budget) {
+    memset(store, 0, sizeof(DhtValueStore));
+    store->index = (int32_t*)malloc(sizeof(int32_t) * DHT_STORE_MIN_INDEX);
+    store->set_index = (int32_t*)malloc(sizeof(int32_t) * DHT_STORE_MIN_INDEX);
+    if (!store->index || !store->set_index) {
+        perror("Failed to allocate DHT store index");
+        free(store->index);
+        free(store->set_index);
+        store->index = NULL;
+        store->set_index = NULL;
+        return -1;
+    }
+
+    for (int i = 0; i < DHT_STORE_MIN_INDEX; i++) {
+        store->index[i] = DHT_STORE_EMPTY;
+        store->set_index[i] = DHT_STORE_EMPTY;
+    }
+    store->index_mask = DHT_STORE_MIN_INDEX - 1;
+    store->next_seq = 1;
+    store->max_members = DHT_STORE_MAX_MEMBERS;
+    store->free_head = DHT_STORE_EMPTY;
+    store->lru_head = DHT_STORE_EMPTY;
+    store->lru_tail = DHT_STORE_EMPTY;
+    store->memory_budget = memory_budget ? memory_budget : DHT_STORE_DEFAULT_BUDGET;
+    return 0;
+}
+
+// 値ストアの解放
+void dht_store_free(DhtValueStore* store) {
+    free(store->entries);
+    free(store->index);
+    free(store->set_index);
+    free(store->arena);
+    memset(store, 0, sizeof(DhtValueStore));
+}
+
+// 使用中のメモリ量（値 + エントリの管理コスト）
+size_t dht_store_memory_used(const DhtValueStore* store) {
+    return store->arena_live + (size_t)store->entry_count * entry_overhead();
+}
+
+// 確保済みのメモリ量（プール、ハッシュ表、アリーナの容量）
+size_t dht_store_footprint(const DhtValueStore* store) {
+    size_t index_size = store->index ? (size_t)store->index_mask + 1 : 0;
+    return sizeof(DhtStoreEntry) * (size_t)store->entry_cap + 2 * sizeof(int32_t) * index_size +
+           store->arena_cap;
+}
+
+// キーとメンバーIDに対応するハッシュ表のスロットを探す（見つからなければ空きスロット）
+static uint32_t store_find_slot(const DhtValueStore* store, const DhtId* key, const DhtId* member) {
+    uint32_t slot = store_hash(key, member, store->index_mask);
+    while (store->index[slot] != DHT_STORE_EMPTY) {
+        const DhtStoreEntry* entry = &store->entries[store->index[slot]];
+        if (id_equal(&entry->key, key) && id_equal(&entry->member, member)) {
+            break;
+        }
+        slot = (slot + 1) & store->index_mask;
+    }
+    return slot;
+}
+
+// キーのメンバーリストの先頭を指すスロットを探す（見つからなければ空きスロット）
+static uint32_t store_find_set_slot(const DhtValueStore* store, const DhtId* key) {
+    uint32_t slot = store_key_hash(key, store->index_mask);
+    while (store->set_index[slot] != DHT_STORE_EMPTY) {
+        if (id_equal(&store->entries[store->set_index[slot]].key, key)) {
+            break;
+        }
+        slot = (slot + 1) & store->index_mask;
+    }
+    return slot;
+}
+
+// エントリが格納されるべきスロット
+static inline uint32_t store_home_slot(const DhtValueStore* store, const int32_t* table, int32_t idx,
+                                       uint32_t mask) {
+    const DhtStoreEntry* entry = &store->entries[idx];
+    return table == store->set_index ? store_key_hash(&entry->key, mask)
+                                     : store_hash(&entry->key, &entry->member, mask);
+}
+
+// ハッシュ表にエントリを挿入
+static void store_table_insert(const DhtValueStore* store, int32_t* table, uint32_t mask, int32_t idx) {
+    uint32_t slot = store_home_slot(store, table, idx, mask);
+    while (table[slot] != DHT_STORE_EMPTY) {
+        slot = (slot + 1) & mask;
+    }
+    table[slot] = idx;
+}
+
+// ハッシュ表を2倍に拡張（2つの表を同時に）
+static int store_grow_index(DhtValueStore* store) {
+    uint32_t new_size = (store->index_mask + 1) * 2;
+    int32_t* new_index = (int32_t*)malloc(sizeof(int32_t) * new_size);
+    int32_t* new_set_index = (int32_t*)malloc(sizeof(int32_t) * new_size);
+    if (!new_index || !new_set_index) {
+        free(new_index);
+        free(new_set_index);
+        return -1;
+    }
+    for (uint32_t i = 0; i < new_size; i++) {
+        new_index[i] = DHT_STORE_EMPTY;
+        new_set_index[i] = DHT_STORE_EMPTY;
+    }
+
+    uint32_t new_mask = new_size - 1;
+    int32_t* old_set_index = store->set_index;
+    store->set_index = new_set_index;  // store_home_slotが表を見分けられるように先に差し替える
+    for (uint32_t i = 0; i <= store->index_mask; i++) {
+        if (store->index[i] != DHT_STORE_EMPTY) {
+            store_table_insert(store, new_index, new_mask, store->index[i]);
+        }
+        if (old_set_index[i] != DHT_STORE_EMPTY) {
+            store_table_insert(store, new_set_index, new_mask, old_set_index[i]);
+        }
+    }
+
+    free(store->index);
+    free(old_set_index);
+    store->index = new_index;
+    store->index_mask = new_mask;
+    return 0;
+}
+
+// ハッシュ表からスロットを削除（後続のクラスタを後方にシフト）
+static void store_table_delete(DhtValueStore* store, int32_t* table, uint32_t slot) {
+    uint32_t mask = store->index_mask;
+    uint32_t hole = slot;
+    uint32_t next = (slot + 1) & mask;
+
+    while (table[next] != DHT_STORE_EMPTY) {
+        uint32_t home = store_home_slot(store, table, table[next], mask);
+        // nextの本来の位置がholeより後ろ（巡回的に(hole, next]の範囲）でなければ詰める
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            table[hole] = table[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    table[hole] = DHT_STORE_EMPTY;
+}
+
+// メンバーリストの末尾に追加
+static void set_append(DhtValueStore* store, int32_t idx) {
+    DhtStoreEntry* entry = &store->entries[idx];
+    uint32_t slot = store_find_set_slot(store, &entry->key);
+    entry->set_next = DHT_STORE_EMPTY;
+
+    int32_t head = store->set_index[slot];
+    if (head == DHT_STORE_EMPTY) {
+        store->set_index[slot] = idx;
+        entry->set_prev = idx;
+        entry->set_count = 1;
+        return;
+    }
+
+    DhtStoreEntry* head_entry = &store->entries[head];
+    int32_t tail = head_entry->set_prev;
+    store->entries[tail].set_next = idx;
+    entry->set_prev = tail;
+    head_entry->set_prev = idx;
+    head_entry->set_count++;
+}
+
+// メンバーリストから外す
+static void set_unlink(DhtValueStore* store, int32_t idx) {
+    DhtStoreEntry* entry = &store->entries[idx];
+    uint32_t slot = store_find_set_slot(store, &entry->key);
+    int32_t head = store->set_index[slot];
+    DhtStoreEntry* head_entry = &store->entries[head];
+
+    if (idx == head) {
+        if (entry->set_next == DHT_STORE_EMPTY) {
+            store_table_delete(store, store->set_index, slot);
+        } else {
+            // 次のメンバーが先頭になり、末尾とメンバー数を引き継ぐ
+            DhtStoreEntry* next = &store->entries[entry->set_next];
+            next->set_prev = entry->set_prev;
+            next->set_count = entry->set_count - 1;
+            store->set_index[slot] = entry->set_next;
+        }
+    } else {
+        store->entries[entry->set_prev].set_next = entry->set_next;
+        if (entry->set_next != DHT_STORE_EMPTY) {
+            store->entries[entry->set_next].set_prev = entry->set_prev;
+        } else {
+            head_entry->set_prev = entry->set_prev;
+        }
+        head_entry->set_count--;
+    }
+    entry->set_prev = entry->set_next = DHT_STORE_EMPTY;
+}
+
+// 次の通し番号（0はカーソルの「先頭から」に使うため飛ばす）
+static inline uint32_t store_next_seq(DhtValueStore* store) {
+    uint32_t seq = store->next_seq++;
+    if (store->next_seq == 0) {
+        store->next_seq = 1;
+    }
+    return seq;
+}
+
+// LRUリストからエントリを外す
+static void lru_unlink(DhtValueStore* store, int32_t idx) {
+    DhtStoreEntry* entry = &store->entries[idx];
+    if (entry->lru_prev != DHT_STORE_EMPTY) {
+        store->entries[entry->lru_prev].lru_next = entry->lru_next;
+    } else {
+        store->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != DHT_STORE_EMPTY) {
+        store->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    } else {
+        store->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = DHT_STORE_EMPTY;
+}
+
+// LRUリストの先頭に追加
+static void lru_push_front(DhtValueStore* store, int32_t idx) {
+    DhtStoreEntry* entry = &store->entries[idx];
+    entry->lru_prev = DHT_STORE_EMPTY;
+    entry->lru_next = store->lru_head;
+    if (store->lru_head != DHT_STORE_EMPTY) {
+        store->entries[store->lru_head].lru_prev = idx;
+    } else {
+        store->lru_tail = idx;
+    }
+    store->lru_head = idx;
+}
+
+// エントリの確保
+static int32_t store_alloc_entry(DhtValueStore* store) {
+    if (store->free_head != DHT_STORE_EMPTY) {
+        int32_t idx = store->free_head;
+        store->free_head = store->entries[idx].lru_next;
+        return idx;
+    }
+
+    if (store->entry_count + 1 > store->entry_cap) {
+        int32_t new_cap = store->entry_cap ? store->entry_cap * 2 : 16;
+        DhtStoreEntry* new_entries = (DhtStoreEntry*)realloc(store->entries, sizeof(DhtStoreEntry) * new_cap);
+        if (!new_entries) {
+            return DHT_STORE_EMPTY;
+        }
+        // 未使用の新しいエントリをフリーリストに繋ぐ
+        for (int32_t i = new_cap - 1; i > store->entry_cap; i--) {
+            new_entries[i].in_use = false;
+            new_entries[i].lru_next = store->free_head;
+            store->free_head = i;
+        }
+        int32_t idx = store->entry_cap;
+        store->entries = new_entries;
+        store->entry_cap = new_cap;
+        return idx;
+    }
+
+    return DHT_STORE_EMPTY;
+}
+
+// エントリの削除（ハッシュ表・LRU・アリーナの全てから外す）
+static void store_delete_entry(DhtValueStore* store, int32_t idx) {
+    DhtStoreEntry* entry = &store->entries[idx];
+    store_table_delete(store, store->index, store_find_slot(store, &entry->key, &entry->member));
+    set_unlink(store, idx);
+    lru_unlink(store, idx);
+
+    store->arena_live -= entry->value_len;
+    entry->in_use = false;
+    entry->lru_next = store->free_head;
+    store->free_head = idx;
+    store->entry_count--;
+}
+
+// アリーナの有効な値だけを詰め直す
+static int store_compact_arena(DhtValueStore* store, size_t min_cap) {
+    size_t new_cap = store->arena_cap;
+    while (new_cap < min_cap) {
+        new_cap = new_cap ? new_cap * 2 : 4096;
+    }
+
+    uint8_t* new_arena = (uint8_t*)malloc(new_cap);
+    if (!new_arena) {
+        return -1;
+    }
+
+    size_t offset = 0;
+    for (int32_t idx = store->lru_head; idx != DHT_STORE_EMPTY; idx = store->entries[idx].lru_next) {
+        DhtStoreEntry* entry = &store->entries[idx];
+        memcpy(new_arena + offset, store->arena + entry->value_off, entry->value_len);
+        entry->value_off = (uint32_t)offset;
+        offset += entry->value_len;
+    }
+
+    free(store->arena);
+    store->arena = new_arena;
+    store->arena_cap = new_cap;
+    store->arena_used = offset;
+    return 0;
+}
+
+// アリーナから値の領域を確保（返り値はオフセット、失敗時は-1）
+static long store_alloc_value(DhtValueStore* store, size_t len) {
+    if (store->arena_used + len > store->arena_cap) {
+        // 断片化が半分を超えていれば詰め直し、そうでなければ拡張
+        size_t garbage = store->arena_used - store->arena_live;
+        size_t needed = store->arena_live + len;
+        if (garbage >= store->arena_used / 2) {
+            if (store_compact_arena(store, needed) < 0) {
+                return -1;
+            }
+        } else {
+            size_t new_cap = store->arena_cap ? store->arena_cap * 2 : 4096;
+            while (new_cap < store->arena_used + len) {
+                new_cap *= 2;
+            }
+            uint8_t* new_arena = (uint8_t*)realloc(store->arena, new_cap);
+            if (!new_arena) {
+                return -1;
+            }
+            store->arena = new_arena;
+            store->arena_cap = new_cap;
+        }
+    }
+
+    long offset = (long)store->arena_used;
+    store->arena_used += len;
+    store->arena_live += len;
+    return offset;
+}
+
+// メモリ上限を超えないよう最も長く使われていないエントリを追い出す
+static void store_enforce_budget(DhtValueStore* store, size_t incoming, int32_t keep_idx) {
+    while (store->lru_tail != DHT_STORE_EMPTY &&
+           dht_store_memory_used(store) + incoming > store->memory_budget) {
+        int32_t victim = store->lru_tail;
+        if (victim == keep_idx) {
+            victim = store->entries[victim].lru_prev;
+            if (victim == DHT_STORE_EMPTY) {
+                break;
+            }
+        }
+        store_delete_entry(store, victim);
+        store->evictions++;
+    }
+}
+
+// 値を保存（既存のキーは上書き）
+int dht_store_put(DhtValueStore* store, const DhtId* key, const void* value, size_t value_len, time_t expires_at) {
+    return dht_store_put_member(store, key, &store_no_member, value, value_len, expires_at);
+}
+
+// キーのメンバーとして値を保存（同じメンバーIDの値は上書きしてリースを延長）
+int dht_store_put_member(DhtValueStore* store, const DhtId* key, const DhtId* member,
+                         const void* value, size_t value_len, time_t expires_at) {
+    if (!store->index || !key || (!value && value_len > 0)) {
+        return -1;
+    }
+    if (!member) {
+        member = &store_no_member;
+    }
+
+    // 1つの値だけで上限を超える場合は保存しない
+    if (value_len + entry_overhead() > store->memory_budget || value_len > UINT32_MAX) {
+        return -1;
+    }
+
+    uint32_t slot = store_find_slot(store, key, member);
+    int32_t idx = store->index[slot];
+
+    if (idx != DHT_STORE_EMPTY) {
+        // 既存のキーを更新
+        DhtStoreEntry* entry = &store->entries[idx];
+        size_t incoming = value_len > entry->value_len ? value_len - entry->value_len : 0;
+        store_enforce_budget(store, incoming, idx);
+
+        if (value_len <= entry->value_len) {
+            // 同じ場所に上書き
+            memcpy(store->arena + entry->value_off, value, value_len);
+            store->arena_live -= entry->value_len - value_len;
+        } else {
+            store->arena_live -= entry->value_len;
+            entry->value_len = 0;
+            long offset = store_alloc_value(store, value_len);
+            if (offset < 0) {
+                store_delete_entry(store, idx);
+                return -1;
+            }
+            entry = &store->entries[idx];
+            entry->value_off = (uint32_t)offset;
+            memcpy(store->arena + offset, value, value_len);
+        }
+        entry->value_len = (uint32_t)value_len;
+        entry->expires_at = expires_at;
+        entry->seq = store_next_seq(store);
+
+        // 更新したメンバーはリストの末尾へ
+        if (entry->set_next != DHT_STORE_EMPTY) {
+            set_unlink(store, idx);
+            set_append(store, idx);
+        }
+
+        lru_unlink(store, idx);
+        lru_push_front(store, idx);
+        return 0;
+    }
+
+    // 新しいキー（メンバー）を追加
+    store_enforce_budget(store, value_len + entry_overhead(), DHT_STORE_EMPTY);
+
+    // メンバー数が上限なら最も長く更新されていないメンバーを捨てる
+    int32_t head = store->set_index[store_find_set_slot(store, key)];
+    if (head != DHT_STORE_EMPTY && store->entries[head].set_count >= store->max_members) {
+        store_delete_entry(store, head);
+        store->evictions++;
+    }
+
+    // 負荷率を1/2以下に保つ
+    if ((uint32_t)(store->entry_count + 1) * 2 > store->index_mask + 1) {
+        if (store_grow_index(store) < 0) {
+            return -1;
+        }
+    }
+
+    idx = store_alloc_entry(store);
+    if (idx == DHT_STORE_EMPTY) {
+        return -1;
+    }
+
+    long offset = store_alloc_value(store, value_len);
+    if (offset < 0) {
+        store->entries[idx].lru_next = store->free_head;
+        store->free_head = idx;
+        return -1;
+    }
+
+    DhtStoreEntry* entry = &store->entries[idx];
+    entry->key = *key;
+    entry->member = *member;
+    entry->value_off = (uint32_t)offset;
+    entry->value_len = (uint32_t)value_len;
+    entry->expires_at = expires_at;
+    entry->seq = store_next_seq(store);
+    entry->in_use = true;
+    if (value_len > 0) {
+        memcpy(store->arena + offset, value, value_len);
+    }
+
+    store->index[store_find_slot(store, key, member)] = idx;
+    set_append(store, idx);
+    lru_push_front(store, idx);
+    store->entry_count++;
+    return 0;
+}
+
+// 値を検索（value_lenには入力でバッファサイズ、出力でコピーした長さ。expires_atはNULL可）
+int dht_store_get(DhtValueStore* store, const DhtId* key, void* value, size_t* value_len, time_t now,
+                  time_t* expires_at) {
+    return dht_store_get_member(store, key, &store_no_member, value, value_len, now, expires_at);
+}
+
+// キーのメンバーを検索
+int dht_store_get_member(DhtValueStore* store, const DhtId* key, const DhtId* member,
+                         void* value, size_t* value_len, time_t now, time_t* expires_at) {
+    if (!store->index || !key || !value || !value_len) {
+        return -1;
+    }
+    if (!member) {
+        member = &store_no_member;
+    }
+
+    uint32_t slot = store_find_slot(store, key, member);
+    int32_t idx = store->index[slot];
+    if (idx == DHT_STORE_EMPTY) {
+        return -1;
+    }
+
+    DhtStoreEntry* entry = &store->entries[idx];
+    if (entry->expires_at <= now) {
+        // 期限切れのエントリはその場で削除
+        store_delete_entry(store, idx);
+        store->expirations++;
+        return -1;
+    }
+
+    size_t copy_len = (*value_len < entry->value_len) ? *value_len : entry->value_len;
+    memcpy(value, store->arena + entry->value_off, copy_len);
+    *value_len = copy_len;
+    if (expires_at) {
+        *expires_at = entry->expires_at;
+    }
+
+    lru_unlink(store, idx);
+    lru_push_front(store, idx);
+    return 0;
+}
+
+// キーの値を全て削除
+int dht_store_remove(DhtValueStore* store, const DhtId* key) {
+    if (!store->index || !key) {
+        return -1;
+    }
+
+    int32_t head = store->set_index[store_find_set_slot(store, key)];
+    if (head == DHT_STORE_EMPTY) {
+        return -1;
+    }
+
+    // 先頭を消すと次のメンバーが先頭になる
+    while (head != DHT_STORE_EMPTY) {
+        int32_t next = store->entries[head].set_next;
+        store_delete_entry(store, head);
+        head = next;
+    }
+    return 0;
+}
+
+// キーのメンバーを1つ削除
+int dht_store_remove_member(DhtValueStore* store, const DhtId* key, const DhtId* member) {
+    if (!store->index || !key) {
+        return -1;
+    }
+
+    int32_t idx = store->index[store_find_slot(store, key, member ? member : &store_no_member)];
+    if (idx == DHT_STORE_EMPTY) {
+        return -1;
+    }
+
+    store_delete_entry(store, idx);
+    return 0;
+}
+
+// キーのメンバー数（期限切れで未削除のものを含む）
+int dht_store_member_count(const DhtValueStore* store, const DhtId* key) {
+    if (!store->index || !key) {
+        return 0;
+    }
+
+    int32_t head = store->set_index[store_find_set_slot(store, key)];
+    return head == DHT_STORE_EMPTY ? 0 : store->entries[head].set_count;
+}
+
+// キーのメンバーをカーソルの位置から順に返す
+//
+// fnがfalseを返すか末尾に達するまで続け、cursorを最後に返したメンバーに進める。
+// カーソルのメンバーが残っていれば1回のハッシュ検索で再開する。その間に更新・削除
+// された場合だけ、リストを先頭から通し番号で辿り直す。期限切れのメンバーは削除する。
+int dht_store_scan_members(DhtValueStore* store, const DhtId* key, time_t now, DhtStoreCursor* cursor,
+                           DhtStoreMemberFn fn, void* arg) {
+    if (!store->index || !key || !cursor || !fn) {
+        return -1;
+    }
+
+    int32_t idx = store->set_index[store_find_set_slot(store, key)];
+    if (cursor->seq != 0) {
+        int32_t last = store->index[store_find_slot(store, key, &cursor->member)];
+        if (last != DHT_STORE_EMPTY && store->entries[last].seq == cursor->seq) {
+            idx = store->entries[last].set_next;
+        } else {
+            // 通し番号はリスト内で昇順なので、カーソルより後のメンバーから再開
+            while (idx != DHT_STORE_EMPTY && (int32_t)(store->entries[idx].seq - cursor->seq) <= 0) {
+                idx = store->entries[idx].set_next;
+            }
+        }
+    }
+
+    int count = 0;
+    while (idx != DHT_STORE_EMPTY) {
+        DhtStoreEntry* entry = &store->entries[idx];
+        int32_t next = entry->set_next;
+
+        if (entry->expires_at <= now) {
+            store_delete_entry(store, idx);
+            store->expirations++;
+            idx = next;
+            continue;
+        }
+
+        if (!fn(&entry->member, store->arena + entry->value_off, entry->value_len, entry->expires_at, arg)) {
+            cursor->done = false;
+            return count;
+        }
+        cursor->seq = entry->seq;
+        cursor->member = entry->member;
+        count++;
+        idx = next;
+    }
+
+    cursor->done = true;
+    return count;
+}
+
+// 1つのキーに置ける値の数の上限を変更（0で既定値、超過分は次の追加時に捨てる）
+void dht_store_set_max_members(DhtValueStore* store, int max_members) {
+    store->max_members = max_members > 0 ? max_members : DHT_STORE_MAX_MEMBERS;
+}
+
+// 期限切れのエントリを削除（返り値は削除した数）
+int dht_store_expire(DhtValueStore* store, time_t now) {
+    int removed = 0;
+
+    for (int32_t idx = 0; idx < store->entry_cap; idx++) {
+        if (store->entries[idx].in_use && store->entries[idx].expires_at <= now) {
+            store_delete_entry(store, idx);
+            removed++;
+        }
+    }
+
+    store->expirations += removed;
+    return removed;
+}
+
+// メモリ上限の変更（超過分は直ちに追い出す）
+void dht_store_set_budget(DhtValueStore* store, size_t memory_budget) {
+    store->memory_budget = memory_budget ? memory_budget : DHT_STORE_DEFAULT_BUDGET;
+    store_enforce_budget(store, 0, DHT_STORE_EMPTY);
+}
+
+// 全エントリを古い順に走査
+void dht_store_foreach(const DhtValueStore* store, DhtStoreVisitFn fn, void* arg) {
+    for (int32_t idx = store->lru_tail; idx != DHT_STORE_EMPTY; idx = store->entries[idx].lru_prev) {
+        const DhtStoreEntry* entry = &store->entries[idx];
+        fn(&entry->key, &entry->member, store->arena + entry->value_off, entry->value_len, entry->expires_at, arg);
+    }
+}
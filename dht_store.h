@@ -0,0 +1,96 @@
+#ifndef DHT_STORE_H
+#define DHT_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include "dht_id.h"
+
+// 値ストアの設定
+#define DHT_STORE_DEFAULT_TTL 3600                  // 値の既定の有効期間（秒）
+#define DHT_STORE_DEFAULT_BUDGET (4 * 1024 * 1024)  // 既定のメモリ上限（バイト）
+#define DHT_STORE_MIN_INDEX 64                      // ハッシュ表の最小サイズ（2の冪）
+#define DHT_STORE_MAX_MEMBERS 4096                  // 1つのキーに置ける値の数の既定の上限
+
+// 値ストアのエントリ
+//
+// エントリはプール内の番号で参照され、ハッシュ表の再配置やLRUの操作で
+// 番号が変わることはない。値本体はアリーナ内に実際の長さだけ確保する。
+// 1つのキーは複数の値（メンバー）を持つことができ、メンバーIDで重複を除く。
+// 単一の値はメンバーIDが全て0のメンバーとして扱う。
+typedef struct {
+    DhtId key;
+    DhtId member;                // メンバーID（重複除去のキー）
+    uint32_t value_off;          // アリーナ内のオフセット
+    uint32_t value_len;          // 値の長さ
+    time_t expires_at;           // 有効期限（メンバーごとのリース）
+    uint32_t seq;                // 追加・更新の通し番号（ページングのカーソル）
+    int32_t set_prev;            // キー内のリスト（先頭ではprevが末尾を指す）
+    int32_t set_next;
+    int32_t set_count;           // キーのメンバー数（リストの先頭のみ有効）
+    int32_t lru_prev;            // LRUリスト（先頭が最近使われたもの）
+    int32_t lru_next;            // 未使用時はフリーリストの次
+    bool in_use;
+} DhtStoreEntry;
+
+// メンバーの走査位置（seqが0なら先頭から）
+typedef struct {
+    uint32_t seq;                // 最後に返したメンバーの通し番号
+    DhtId member;                // 最後に返したメンバーのID
+    bool done;                   // 末尾まで返した
+} DhtStoreCursor;
+
+// 値ストア（DhtIdをキーとするオープンアドレス法のハッシュ表）
+typedef struct {
+    DhtStoreEntry* entries;      // エントリプール
+    int32_t entry_cap;
+    int32_t entry_count;
+    int32_t free_head;           // 未使用エントリのリスト
+    int32_t* index;              // ハッシュ表（キーとメンバーID → エントリ番号、-1は空き）
+    int32_t* set_index;          // ハッシュ表（キー → メンバーリストの先頭、indexと同じサイズ）
+    uint32_t index_mask;         // ハッシュ表サイズ - 1
+    uint32_t next_seq;           // 次の通し番号
+    int32_t max_members;         // 1つのキーに置ける値の数の上限
+    uint8_t* arena;              // 値のアリーナ
+    size_t arena_used;           // アリーナの使用済み位置
+    size_t arena_cap;
+    size_t arena_live;           // 有効な値の合計バイト数
+    int32_t lru_head;
+    int32_t lru_tail;
+    size_t memory_budget;        // メモリ上限（値 + エントリ）
+    uint64_t evictions;          // LRUで追い出したエントリ数
+    uint64_t expirations;        // 期限切れで削除したエントリ数
+} DhtValueStore;
+
+// 値ストアの走査に使うコールバック
+typedef void (*DhtStoreVisitFn)(const DhtId* key, const DhtId* member, const void* value, size_t value_len,
+                                time_t expires_at, void* arg);
+
+// キーのメンバーの走査に使うコールバック（falseを返すとそのメンバーを返さずに止まる）
+typedef bool (*DhtStoreMemberFn)(const DhtId* member, const void* value, size_t value_len,
+                                 time_t expires_at, void* arg);
+
+// 値ストア関数プロトタイプ
+int dht_store_init(DhtValueStore* store, size_t memory_budget);
+void dht_store_free(DhtValueStore* store);
+int dht_store_put(DhtValueStore* store, const DhtId* key, const void* value, size_t value_len, time_t expires_at);
+int dht_store_get(DhtValueStore* store, const DhtId* key, void* value, size_t* value_len, time_t now,
+                  time_t* expires_at);
+int dht_store_remove(DhtValueStore* store, const DhtId* key);
+int dht_store_put_member(DhtValueStore* store, const DhtId* key, const DhtId* member,
+                         const void* value, size_t value_len, time_t expires_at);
+int dht_store_get_member(DhtValueStore* store, const DhtId* key, const DhtId* member,
+                         void* value, size_t* value_len, time_t now, time_t* expires_at);
+int dht_store_remove_member(DhtValueStore* store, const DhtId* key, const DhtId* member);
+int dht_store_member_count(const DhtValueStore* store, const DhtId* key);
+int dht_store_scan_members(DhtValueStore* store, const DhtId* key, time_t now, DhtStoreCursor* cursor,
+                           DhtStoreMemberFn fn, void* arg);
+void dht_store_set_max_members(DhtValueStore* store, int max_members);
+int dht_store_expire(DhtValueStore* store, time_t now);
+void dht_store_set_budget(DhtValueStore* store, size_t memory_budget);
+size_t dht_store_memory_used(const DhtValueStore* store);
+size_t dht_store_footprint(const DhtValueStore* store);
+void dht_store_foreach(const DhtValueStore* store, DhtStoreVisitFn fn, void* arg);
+
+#endif /* DHT_STORE_H */
@@ -0,0 +1,116 @@
+#include "dht_wire.h"
+
+// DHTのワイヤーフォーマット
+//
+// バージョンの違うパケットもDHTのものとして受け取り（通常のMessageとして解釈しない）、
+// dht_wire_decode_packetで捨てる。
+
+static const uint8_t wire_magic[DHT_WIRE_MAGIC_LEN] = { 'D', 'H', 'T' };
+
+// DHTパケットかどうか（バージョンは問わない）
+bool dht_wire_is_packet(const void* buf, size_t len) {
+    return len >= DHT_WIRE_MAGIC_LEN + 1 && memcmp(buf, wire_magic, DHT_WIRE_MAGIC_LEN) == 0;
+}
+
+// パケットをエンコード（返り値はパケット長、収まらなければ0）
+size_t dht_wire_encode_packet(void* buf, size_t cap, uint8_t type, const DhtId* sender, const DhtId* target,
+                              uint32_t transaction_id, const void* data, size_t data_len) {
+    DhtWireWriter w;
+    dht_wire_writer_init(&w, buf, cap);
+
+    dht_wire_put_bytes(&w, wire_magic, DHT_WIRE_MAGIC_LEN);
+    dht_wire_put_u8(&w, DHT_WIRE_VERSION);
+    dht_wire_put_u8(&w, type);
+    dht_wire_put_u8(&w, target ? DHT_WIRE_HAS_TARGET : 0);
+    dht_wire_put_id(&w, sender);
+    if (target) {
+        dht_wire_put_id(&w, target);
+    }
+    dht_wire_put_varint(&w, transaction_id);
+    dht_wire_put_varint(&w, (uint32_t)data_len);
+    if (data_len > 0) {
+        dht_wire_put_bytes(&w, data, data_len);
+    }
+
+    return w.error ? 0 : w.len;
+}
+
+// パケットをデコード（不正なパケットや未対応のバージョンは-1）
+int dht_wire_decode_packet(const void* buf, size_t len, DhtWireHeader* header) {
+    DhtWireReader r;
+    dht_wire_reader_init(&r, buf, len);
+
+    const uint8_t* magic = dht_wire_take(&r, DHT_WIRE_MAGIC_LEN);
+    if (!magic || memcmp(magic, wire_magic, DHT_WIRE_MAGIC_LEN) != 0) {
+        return -1;
+    }
+    header->version = dht_wire_get_u8(&r);
+    if (header->version != DHT_WIRE_VERSION) {
+        return -1;
+    }
+
+    header->type = dht_wire_get_u8(&r);
+    uint8_t flags = dht_wire_get_u8(&r);
+    header->has_target = (flags & DHT_WIRE_HAS_TARGET) != 0;
+    dht_wire_get_id(&r, &header->sender_id);
+    if (header->has_target) {
+        dht_wire_get_id(&r, &header->target_id);
+    } else {
+        memset(&header->target_id, 0, sizeof(DhtId));
+    }
+    header->transaction_id = dht_wire_get_varint(&r);
+    header->data_len = dht_wire_get_varint(&r);
+    header->data = dht_wire_take(&r, header->data_len);
+
+    return r.error ? -1 : 0;
+}
+
+// ノード一覧を書き込む（IPv4、IPv6の順）
+void dht_wire_put_contacts(DhtWireWriter* w, const DhtWireContact* contacts, int count) {
+    static const uint8_t families[2] = { DHT_WIRE_IPV4, DHT_WIRE_IPV6 };
+
+    for (int f = 0; f < 2; f++) {
+        size_t addr_len = families[f] == DHT_WIRE_IPV6 ? 16 : 4;
+        uint32_t family_count = 0;
+        for (int i = 0; i < count; i++) {
+            family_count += contacts[i].family == families[f];
+        }
+
+        dht_wire_put_varint(w, family_count);
+        for (int i = 0; i < count; i++) {
+            if (contacts[i].family != families[f]) {
+                continue;
+            }
+            dht_wire_put_id(w, &contacts[i].id);
+            dht_wire_put_bytes(w, contacts[i].addr, addr_len);
+            dht_wire_put_u16(w, contacts[i].port);
+        }
+    }
+}
+
+// ノード一覧を読み取る（max_contactsを超えた分は読み飛ばす、返り値は読み取った数）
+int dht_wire_get_contacts(DhtWireReader* r, DhtWireContact* contacts, int max_contacts) {
+    static const uint8_t families[2] = { DHT_WIRE_IPV4, DHT_WIRE_IPV6 };
+    int decoded = 0;
+
+    for (int f = 0; f < 2 && !r->error; f++) {
+        size_t addr_len = families[f] == DHT_WIRE_IPV6 ? 16 : 4;
+        uint32_t family_count = dht_wire_get_varint(r);
+        for (uint32_t i = 0; i < family_count; i++) {
+            const uint8_t* p = dht_wire_take(r, DHT_ID_BITS/8 + addr_len + 2);
+            if (!p) {
+                return decoded;
+            }
+            if (decoded == max_contacts) {
+                continue;
+            }
+            DhtWireContact* contact = &contacts[decoded++];
+            memcpy(contact->id.bytes, p, DHT_ID_BITS/8);
+            contact->family = families[f];
+            memset(contact->addr, 0, sizeof(contact->addr));
+            memcpy(contact->addr, p + DHT_ID_BITS/8, addr_len);
+            contact->port = (uint16_t)((p[DHT_ID_BITS/8 + addr_len] << 8) | p[DHT_ID_BITS/8 + addr_len + 1]);
+        }
+    }
+    return decoded;
+}
@@ -0,0 +1,204 @@
+#ifndef DHT_WIRE_H
+#define DHT_WIRE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "dht_id.h"
+
+// DHTのワイヤーフォーマット（バージョン2）
+//
+// パケット:
+//   "DHT" + バージョン(1) + タイプ(1) + フラグ(1) + 送信者ID(20) + [対象ID(20)]
+//   + トランザクションID(varint) + データ長(varint) + データ
+// 対象IDはフラグにDHT_WIRE_HAS_TARGETが立っているときだけ置く（応答はトランザクションIDで
+// 要求と対応付けるため省く）。
+//
+// 整数は下位から7ビットずつ並べる可変長（最上位ビットが立っていれば続きがある）で、
+// ポートだけは固定長のビッグエンディアン。ノード一覧は IPv4のノードの件数(varint) +
+// ID(20) + アドレス(4) + ポート(2) の並び、続いてIPv6のノードの件数(varint) +
+// ID(20) + アドレス(16) + ポート(2) の並びで表す。
+//
+// 書き込み・読み取りはどちらも呼び出し側のバッファの上で行い、メモリを確保しない。
+// 範囲外の書き込み・読み取りはerrorを立て、以後の操作は何もしない。
+#define DHT_WIRE_VERSION 2
+#define DHT_WIRE_MAGIC_LEN 3                 // "DHT"
+#define DHT_WIRE_HAS_TARGET 0x01             // 対象IDあり
+#define DHT_WIRE_VARINT_MAX 5                // uint32_tの可変長の最大バイト数
+#define DHT_WIRE_MIN_HEADER (DHT_WIRE_MAGIC_LEN + 3 + DHT_ID_BITS/8 + 2)
+#define DHT_WIRE_MAX_HEADER (DHT_WIRE_MAGIC_LEN + 3 + DHT_ID_BITS/8 * 2 + DHT_WIRE_VARINT_MAX * 2)
+#define DHT_WIRE_IPV4_CONTACT (DHT_ID_BITS/8 + 4 + 2)
+#define DHT_WIRE_IPV6_CONTACT (DHT_ID_BITS/8 + 16 + 2)
+
+// アドレスファミリー
+#define DHT_WIRE_IPV4 4
+#define DHT_WIRE_IPV6 6
+
+// 書き込み位置
+typedef struct {
+    uint8_t* buf;
+    size_t cap;
+    size_t len;
+    bool error;                  // 容量を超えた
+} DhtWireWriter;
+
+// 読み取り位置
+typedef struct {
+    const uint8_t* buf;
+    size_t len;
+    size_t pos;
+    bool error;                  // 途中で切れていたか、不正な値だった
+} DhtWireReader;
+
+// ノード（IDとアドレス、アドレスはネットワークバイトオーダー）
+typedef struct {
+    DhtId id;
+    uint8_t family;              // DHT_WIRE_IPV4 / DHT_WIRE_IPV6
+    uint8_t addr[16];            // IPv4は先頭4バイト
+    uint16_t port;
+} DhtWireContact;
+
+// パケットのヘッダー（dataは受信バッファの中を指す）
+typedef struct {
+    uint8_t version;
+    uint8_t type;
+    bool has_target;
+    DhtId sender_id;
+    DhtId target_id;             // 対象IDがなければ全て0
+    uint32_t transaction_id;
+    const uint8_t* data;
+    size_t data_len;
+} DhtWireHeader;
+
+static inline void dht_wire_writer_init(DhtWireWriter* w, void* buf, size_t cap) {
+    w->buf = (uint8_t*)buf;
+    w->cap = cap;
+    w->len = 0;
+    w->error = false;
+}
+
+static inline void dht_wire_reader_init(DhtWireReader* r, const void* buf, size_t len) {
+    r->buf = (const uint8_t*)buf;
+    r->len = len;
+    r->pos = 0;
+    r->error = false;
+}
+
+static inline bool dht_wire_reserve(DhtWireWriter* w, size_t n) {
+    if (w->error || w->cap - w->len < n) {
+        w->error = true;
+        return false;
+    }
+    return true;
+}
+
+static inline void dht_wire_put_u8(DhtWireWriter* w, uint8_t v) {
+    if (dht_wire_reserve(w, 1)) {
+        w->buf[w->len++] = v;
+    }
+}
+
+static inline void dht_wire_put_u16(DhtWireWriter* w, uint16_t v) {
+    if (dht_wire_reserve(w, 2)) {
+        w->buf[w->len] = (uint8_t)(v >> 8);
+        w->buf[w->len + 1] = (uint8_t)v;
+        w->len += 2;
+    }
+}
+
+static inline void dht_wire_put_varint(DhtWireWriter* w, uint32_t v) {
+    uint8_t tmp[DHT_WIRE_VARINT_MAX];
+    size_t n = 0;
+    while (v >= 0x80) {
+        tmp[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    tmp[n++] = (uint8_t)v;
+    if (dht_wire_reserve(w, n)) {
+        memcpy(w->buf + w->len, tmp, n);
+        w->len += n;
+    }
+}
+
+static inline void dht_wire_put_bytes(DhtWireWriter* w, const void* p, size_t n) {
+    if (dht_wire_reserve(w, n)) {
+        memcpy(w->buf + w->len, p, n);
+        w->len += n;
+    }
+}
+
+static inline void dht_wire_put_id(DhtWireWriter* w, const DhtId* id) {
+    dht_wire_put_bytes(w, id->bytes, DHT_ID_BITS/8);
+}
+
+static inline size_t dht_wire_varint_len(uint32_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static inline const uint8_t* dht_wire_take(DhtWireReader* r, size_t n) {
+    if (r->error || r->len - r->pos < n) {
+        r->error = true;
+        return NULL;
+    }
+    const uint8_t* p = r->buf + r->pos;
+    r->pos += n;
+    return p;
+}
+
+static inline uint8_t dht_wire_get_u8(DhtWireReader* r) {
+    const uint8_t* p = dht_wire_take(r, 1);
+    return p ? p[0] : 0;
+}
+
+static inline uint16_t dht_wire_get_u16(DhtWireReader* r) {
+    const uint8_t* p = dht_wire_take(r, 2);
+    return p ? (uint16_t)((p[0] << 8) | p[1]) : 0;
+}
+
+static inline uint32_t dht_wire_get_varint(DhtWireReader* r) {
+    uint32_t v = 0;
+    for (int shift = 0; shift < 7 * DHT_WIRE_VARINT_MAX; shift += 7) {
+        const uint8_t* p = dht_wire_take(r, 1);
+        if (!p) {
+            return 0;
+        }
+        if (shift == 28 && (*p & 0xf0)) {
+            break;  // 32ビットを超える
+        }
+        v |= (uint32_t)(*p & 0x7f) << shift;
+        if (!(*p & 0x80)) {
+            return v;
+        }
+    }
+    r->error = true;
+    return 0;
+}
+
+static inline void dht_wire_get_id(DhtWireReader* r, DhtId* id) {
+    const uint8_t* p = dht_wire_take(r, DHT_ID_BITS/8);
+    if (p) {
+        memcpy(id->bytes, p, DHT_ID_BITS/8);
+    } else {
+        memset(id->bytes, 0, DHT_ID_BITS/8);
+    }
+}
+
+static inline size_t dht_wire_remaining(const DhtWireReader* r) {
+    return r->error ? 0 : r->len - r->pos;
+}
+
+// DHTワイヤーフォーマット関数プロトタイプ
+bool dht_wire_is_packet(const void* buf, size_t len);
+size_t dht_wire_encode_packet(void* buf, size_t cap, uint8_t type, const DhtId* sender, const DhtId* target,
+                              uint32_t transaction_id, const void* data, size_t data_len);
+int dht_wire_decode_packet(const void* buf, size_t len, DhtWireHeader* header);
+void dht_wire_put_contacts(DhtWireWriter* w, const DhtWireContact* contacts, int count);
+int dht_wire_get_contacts(DhtWireReader* r, DhtWireContact* contacts, int max_contacts);
+
+#endif /* DHT_WIRE_H */
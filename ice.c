@@ -4,6 +4,23 @@
 #include <unistd.h>
 #include <time.h>
 #include <pthread.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+// 資格情報の文字列の生成（ice-charの英数字、+、/）
+static int generate_credential(char* out, int len) {
+    static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint8_t random[ICE_PWD_LEN];
+    if (RAND_bytes(random, len) != 1) {
+        fprintf(stderr, "Failed to generate ICE credentials\n");
+        return -1;
+    }
+    for (int i = 0; i < len; i++) {
+        out[i] = chars[random[i] & 63];
+    }
+    out[len] = '\0';
+    return 0;
+}
 
 // ICEの初期化
 int ice_init(Node* node) {
@@ -21,6 +38,11 @@ int ice_init(Node* node) {
     // 初期化
     memset(ice_data, 0, sizeof(IceData));
     ice_data->session.state = ICE_STATE_NEW;
+    if (generate_credential(ice_data->session.local_ufrag, ICE_UFRAG_LEN) < 0 ||
+        generate_credential(ice_data->session.local_pwd, ICE_PWD_LEN) < 0) {
+        free(ice_data);
+        return -1;
+    }
     
     // 制御側かどうかをランダムに決定
     srand(time(NULL) ^ node->id);
@@ -49,6 +71,9 @@ int ice_cleanup(Node* node) {
     
     IceData* ice_data = (IceData*)node->ice_data;
     
+    // リレーアドレスの変更の通知を止める
+    turn_set_relay_handler(node, NULL, NULL);
+    
     // ICEスレッドの停止
     if (ice_data->session.ice_running) {
         ice_data->session.ice_running = false;
@@ -99,6 +124,190 @@ static int calculate_priority(IceCandidateType type, const char* ip) {
     return (type_preference << 24) | (local_preference << 8) | (256 - component_id);
 }
 
+// Relay候補の追加・更新（TURNのアロケーションがあれば。セッションのロックを持って呼ぶ）
+//
+// 事前アロケーション（turn_prealloc）が候補の収集より後に終わったり、フェイルオーバーで
+// リレーアドレスが変わったりしても、接続性チェックの前に呼べば最新のアドレスが入る。
+static void update_relay_candidate(Node* node, IceSession* session) {
+    char relayed_ip[MAX_IP_STR_LEN];
+    int relayed_port;
+    if (!node->turn_data || turn_get_relayed_address(node, relayed_ip, &relayed_port) < 0) {
+        return;
+    }
+    
+    IceCandidate* candidate = NULL;
+    for (int i = 0; i < session->local_candidate_count; i++) {
+        if (session->local_candidates[i].type == ICE_CANDIDATE_RELAY) {
+            candidate = &session->local_candidates[i];
+        }
+    }
+    if (candidate && strcmp(candidate->ip, relayed_ip) == 0 && candidate->port == relayed_port) {
+        return;
+    }
+    if (!candidate) {
+        if (session->local_candidate_count >= 10) {
+            return;
+        }
+        candidate = &session->local_candidates[session->local_candidate_count++];
+    }
+    candidate->type = ICE_CANDIDATE_RELAY;
+    strncpy(candidate->ip, relayed_ip, MAX_IP_STR_LEN - 1);
+    candidate->ip[MAX_IP_STR_LEN - 1] = '\0';
+    candidate->port = relayed_port;
+    candidate->priority = calculate_priority(ICE_CANDIDATE_RELAY, candidate->ip);
+    candidate->nominated = false;
+    
+    printf("ICE gathered relay candidate for node %d: %s:%d (priority: %d)\n", 
+           node->id, candidate->ip, candidate->port, candidate->priority);
+}
+
+// 候補の更新のHMAC（keyは送る側のpwd、usernameは"受け取る側のufrag:送る側のufrag"）
+static void sign_update(const uint8_t* message, const char* key, const char* receiver_ufrag,
+                        const char* sender_ufrag, uint8_t* mac) {
+    uint8_t input[ICE_UPDATE_SIGNED + ICE_UFRAG_LEN * 2 + 1];
+    int len = ICE_UPDATE_SIGNED;
+    memcpy(input, message, ICE_UPDATE_SIGNED);
+    len += snprintf((char*)input + len, sizeof(input) - len, "%s:%s", receiver_ufrag, sender_ufrag);
+    unsigned int mac_len = 0;
+    HMAC(EVP_sha1(), key, (int)strlen(key), input, (size_t)len, mac, &mac_len);
+}
+
+// 候補の更新の組み立て（session->mutexを持って呼ぶ）
+static void build_update(IceSession* session, uint8_t* message, const char* old_ip, int old_port,
+                         const char* new_ip, int new_port) {
+    uint32_t magic = htonl(ICE_UPDATE_MAGIC);
+    uint32_t sequence = htonl(++session->update_sequence);
+    uint16_t port = htons(old_port);
+    struct in_addr addr;
+    memcpy(message, &magic, 4);
+    inet_aton(old_ip, &addr);
+    memcpy(message + 4, &addr.s_addr, 4);
+    memcpy(message + 8, &port, 2);
+    port = htons(new_port);
+    memcpy(message + 10, &port, 2);
+    inet_aton(new_ip, &addr);
+    memcpy(message + 12, &addr.s_addr, 4);
+    memcpy(message + 16, &sequence, 4);
+    sign_update(message, session->local_pwd, session->remote_ufrag, session->local_ufrag,
+                message + ICE_UPDATE_SIGNED);
+}
+
+// TURNのリレーアドレスが変わった（フェイルオーバー）
+static void ice_relay_changed(Node* node, const char* relayed_ip, int relayed_port, void* arg) {
+    (void)arg;
+    if (!node->ice_data) {
+        return;
+    }
+    IceData* ice_data = (IceData*)node->ice_data;
+    IceSession* session = &ice_data->session;
+    
+    pthread_mutex_lock(&session->mutex);
+    
+    // 選択中のペアがRelay候補なら、相手に新しいアドレスを知らせる
+    bool notify = (session->state == ICE_STATE_CONNECTED || session->state == ICE_STATE_COMPLETED) &&
+                  session->selected_pair[0].type == ICE_CANDIDATE_RELAY &&
+                  (strcmp(session->selected_pair[0].ip, relayed_ip) != 0 ||
+                   session->selected_pair[0].port != relayed_port);
+    uint8_t message[ICE_UPDATE_SIZE];
+    IceCandidate remote = session->selected_pair[1];
+    if (notify) {
+        build_update(session, message, session->selected_pair[0].ip, session->selected_pair[0].port,
+                     relayed_ip, relayed_port);
+        snprintf(session->selected_pair[0].ip, sizeof(session->selected_pair[0].ip), "%s", relayed_ip);
+        session->selected_pair[0].port = relayed_port;
+    }
+    update_relay_candidate(node, session);
+    
+    pthread_mutex_unlock(&session->mutex);
+    
+    // 新しいリレー経由で送る（送信元が新しいアドレスになる）
+    if (notify) {
+        for (int i = 0; i < ICE_UPDATE_SENDS; i++) {
+            turn_send_data(node, remote.ip, remote.port, message, sizeof(message));
+        }
+        printf("ICE relay candidate for node %d moved to %s:%d, told %s:%d\n",
+               node->id, relayed_ip, relayed_port, remote.ip, remote.port);
+    }
+}
+
+// 相手からの候補の更新（ICEのパケットならtrueを返す）
+bool ice_handle_packet(Node* node, const void* buf, size_t len, const struct sockaddr_in* from) {
+    uint32_t magic;
+    if (len != ICE_UPDATE_SIZE || !from) {
+        return false;
+    }
+    memcpy(&magic, buf, 4);
+    if (ntohl(magic) != ICE_UPDATE_MAGIC) {
+        return false;
+    }
+    if (!node || !node->ice_data) {
+        return true;
+    }
+    
+    const uint8_t* message = (const uint8_t*)buf;
+    struct in_addr old_addr;
+    struct in_addr new_addr;
+    uint16_t old_port;
+    uint16_t new_port;
+    uint32_t sequence;
+    memcpy(&old_addr.s_addr, message + 4, 4);
+    memcpy(&old_port, message + 8, 2);
+    memcpy(&new_port, message + 10, 2);
+    memcpy(&new_addr.s_addr, message + 12, 4);
+    memcpy(&sequence, message + 16, 4);
+    sequence = ntohl(sequence);
+    
+    // 新しいアドレスから届いたものだけを受け付ける
+    if (new_addr.s_addr != from->sin_addr.s_addr || new_port != from->sin_port) {
+        return true;
+    }
+    char old_ip[MAX_IP_STR_LEN];
+    char new_ip[MAX_IP_STR_LEN];
+    inet_ntop(AF_INET, &old_addr, old_ip, sizeof(old_ip));
+    inet_ntop(AF_INET, &new_addr, new_ip, sizeof(new_ip));
+    
+    IceData* ice_data = (IceData*)node->ice_data;
+    IceSession* session = &ice_data->session;
+    bool moved = false;
+    pthread_mutex_lock(&session->mutex);
+    
+    // 相手のpwdで署名され、前に受け付けたものより新しい更新だけを受け付ける
+    // （同じ更新の再送は2回目から捨てる）
+    uint8_t mac[20];
+    if (session->remote_pwd[0] == '\0' || sequence <= session->remote_update_sequence) {
+        pthread_mutex_unlock(&session->mutex);
+        return true;
+    }
+    sign_update(message, session->remote_pwd, session->local_ufrag, session->remote_ufrag, mac);
+    if (CRYPTO_memcmp(mac, message + ICE_UPDATE_SIGNED, sizeof(mac)) != 0) {
+        pthread_mutex_unlock(&session->mutex);
+        fprintf(stderr, "ICE candidate update for node %d from %s:%d failed authentication\n",
+                node->id, new_ip, ntohs(new_port));
+        return true;
+    }
+    session->remote_update_sequence = sequence;
+    for (int i = 0; i < session->remote_candidate_count; i++) {
+        IceCandidate* candidate = &session->remote_candidates[i];
+        if (strcmp(candidate->ip, old_ip) == 0 && candidate->port == ntohs(old_port)) {
+            snprintf(candidate->ip, sizeof(candidate->ip), "%s", new_ip);
+            candidate->port = ntohs(new_port);
+            moved = true;
+        }
+    }
+    if (moved && strcmp(session->selected_pair[1].ip, old_ip) == 0 &&
+        session->selected_pair[1].port == ntohs(old_port)) {
+        snprintf(session->selected_pair[1].ip, sizeof(session->selected_pair[1].ip), "%s", new_ip);
+        session->selected_pair[1].port = ntohs(new_port);
+    }
+    pthread_mutex_unlock(&session->mutex);
+    
+    if (moved) {
+        printf("ICE remote candidate for node %d moved from %s:%d to %s:%d\n",
+               node->id, old_ip, ntohs(old_port), new_ip, ntohs(new_port));
+    }
+    return true;
+}
+
 // ICE候補の収集
 int ice_gather_candidates(Node* node) {
     if (!node || !node->ice_data) {
@@ -143,28 +352,46 @@ int ice_gather_candidates(Node* node) {
     }
     
     // Relay候補の追加（TURNを使用、もし利用可能なら）
-    if (node->turn_data) {
-        TurnData* turn_data = (TurnData*)node->turn_data;
-        TurnClient* client = &turn_data->client;
-        
-        if (client->state == TURN_STATE_ALLOCATED && ice_data->session.local_candidate_count < 10) {
-            IceCandidate* candidate = &ice_data->session.local_candidates[ice_data->session.local_candidate_count];
-            candidate->type = ICE_CANDIDATE_RELAY;
-            strncpy(candidate->ip, client->relayed_ip, MAX_IP_STR_LEN - 1);
-            candidate->port = client->relayed_port;
-            candidate->priority = calculate_priority(ICE_CANDIDATE_RELAY, candidate->ip);
-            candidate->nominated = false;
-            
-            printf("ICE gathered relay candidate for node %d: %s:%d (priority: %d)\n", 
-                   node->id, candidate->ip, candidate->port, candidate->priority);
-            
-            ice_data->session.local_candidate_count++;
-        }
+    update_relay_candidate(node, &ice_data->session);
+    int candidate_count = ice_data->session.local_candidate_count;
+    
+    pthread_mutex_unlock(&ice_data->session.mutex);
+    
+    // フェイルオーバーでリレーアドレスが変わったら候補を更新して相手に知らせる
+    turn_set_relay_handler(node, ice_relay_changed, NULL);
+    
+    return candidate_count;
+}
+
+// 自分の資格情報の取得（シグナリングで相手に渡す）
+int ice_get_local_credentials(Node* node, char* ufrag, size_t ufrag_size, char* pwd, size_t pwd_size) {
+    if (!node || !node->ice_data || !ufrag || !pwd) {
+        return -1;
     }
     
+    IceData* ice_data = (IceData*)node->ice_data;
+    pthread_mutex_lock(&ice_data->session.mutex);
+    snprintf(ufrag, ufrag_size, "%s", ice_data->session.local_ufrag);
+    snprintf(pwd, pwd_size, "%s", ice_data->session.local_pwd);
     pthread_mutex_unlock(&ice_data->session.mutex);
+    return 0;
+}
+
+// 相手の資格情報の設定（シグナリングで受け取ったもの）
+int ice_set_remote_credentials(Node* node, const char* ufrag, const char* pwd) {
+    if (!node || !node->ice_data || !ufrag || !pwd ||
+        strlen(ufrag) < 4 || strlen(ufrag) > ICE_UFRAG_LEN ||
+        strlen(pwd) < 22 || strlen(pwd) > ICE_PWD_LEN) {
+        return -1;
+    }
     
-    return ice_data->session.local_candidate_count;
+    IceData* ice_data = (IceData*)node->ice_data;
+    pthread_mutex_lock(&ice_data->session.mutex);
+    snprintf(ice_data->session.remote_ufrag, sizeof(ice_data->session.remote_ufrag), "%s", ufrag);
+    snprintf(ice_data->session.remote_pwd, sizeof(ice_data->session.remote_pwd), "%s", pwd);
+    ice_data->session.remote_update_sequence = 0;
+    pthread_mutex_unlock(&ice_data->session.mutex);
+    return 0;
 }
 
 // リモート候補の追加
@@ -198,6 +425,13 @@ int ice_add_remote_candidate(Node* node, IceCandidateType type, const char* ip,
     
     pthread_mutex_unlock(&ice_data->session.mutex);
     
+    // 中継のアロケーションがあれば、直接の接続に失敗したときのためにパーミッションを
+    // 先に作っておく（表に加えるだけで、要求は他の相手とまとめて出す）。ホスト候補は
+    // 相手のLAN内のアドレスで、リレーからは届かないので除く
+    if (node->turn_data && type != ICE_CANDIDATE_HOST) {
+        turn_add_permission(node, ip);
+    }
+    
     return 0;
 }
 
@@ -263,13 +497,18 @@ int ice_send_data(Node* node, const void* data, int data_len) {
         return -1;
     }
     
-    // 選択された候補ペアを使用してデータを送信
-    IceCandidate* remote = &ice_data->session.selected_pair[1];
+    // 選択された候補ペアを使用してデータを送信（送信中はロックを持たない。TURNの
+    // フェイルオーバーはこのスレッドでice_relay_changedを呼ぶことがある）
+    IceCandidate local = ice_data->session.selected_pair[0];
+    IceCandidate remote_copy = ice_data->session.selected_pair[1];
+    IceCandidate* remote = &remote_copy;
+    
+    pthread_mutex_unlock(&ice_data->session.mutex);
     
     // 候補タイプに応じた送信方法の選択
     int result = -1;
     
-    if (ice_data->session.selected_pair[0].type == ICE_CANDIDATE_RELAY) {
+    if (local.type == ICE_CANDIDATE_RELAY) {
         // Relay候補の場合はTURNを使用
         result = turn_send_data(node, remote->ip, remote->port, data, data_len);
     } else {
@@ -292,8 +531,6 @@ int ice_send_data(Node* node, const void* data, int data_len) {
                node->id, remote->ip, remote->port);
     }
     
-    pthread_mutex_unlock(&ice_data->session.mutex);
-    
     return result;
 }
 
@@ -354,6 +591,9 @@ void* ice_thread(void* arg) {
     
     pthread_mutex_lock(&ice_data->session.mutex);
     
+    // 収集の後に事前アロケーションが終わっていればRelay候補も含める
+    update_relay_candidate(node, &ice_data->session);
+    
     // 最適な候補ペアの選択
     select_best_candidate_pair(&ice_data->session);
     
@@ -21,6 +21,29 @@ typedef struct {
     bool nominated;           // 選択された候補かどうか
 } IceCandidate;
 
+// Relay候補の更新
+//
+// TURNのフェイルオーバーでリレーアドレスが変わると（turn_set_relay_handler）、Relay候補を
+// 新しいアドレスにし、選択中のペアがRelay候補なら、相手に候補の更新を新しいリレー経由で
+// 送る（失われても届くようにICE_UPDATE_SENDS回）。相手はノードのソケットで受け取る
+// （自分も中継を使っているなら、TURNのデータハンドラからice_handle_packetに渡す）。
+//
+// 更新にはシグナリングで交換したICEの資格情報（ufragとpwd）でHMAC-SHA1を付ける。鍵は
+// 送る側のpwd、対象は更新の先頭20バイトと"相手のufrag:自分のufrag"。受け取る側は
+// ice_set_remote_credentialsで相手の資格情報を設定しておき、HMACが合い、通し番号が前に
+// 受け付けたものより大きく、送信元が新しいアドレスで、古いアドレスがリモート候補にある
+// ときだけ置き換える。相手の資格情報がなければ更新は受け付けない。
+//
+// 候補の更新（40バイト、ネットワークバイトオーダー）:
+//   マジック(4) | 古いIP(4) | 古いポート(2) | 新しいポート(2) | 新しいIP(4) | 通し番号(4) |
+//   HMAC-SHA1(20)
+#define ICE_UPDATE_MAGIC 0x49434555  // "ICEU"
+#define ICE_UPDATE_SIZE 40
+#define ICE_UPDATE_SIGNED 20         // HMACの対象になる先頭の長さ
+#define ICE_UFRAG_LEN 8              // ufragの長さ（RFC 8445では4文字以上）
+#define ICE_PWD_LEN 24               // pwdの長さ（RFC 8445では22文字以上）
+#define ICE_UPDATE_SENDS 3
+
 // ICE接続状態
 typedef enum {
     ICE_STATE_NEW,
@@ -42,6 +65,12 @@ typedef struct {
     IceConnectionState state;
     bool controlling;         // 制御側かどうか
     uint64_t tie_breaker;     // タイブレーカー値
+    char local_ufrag[ICE_UFRAG_LEN + 1];  // 自分の資格情報（ice_initで生成する）
+    char local_pwd[ICE_PWD_LEN + 1];
+    char remote_ufrag[ICE_UFRAG_LEN + 1]; // 相手の資格情報（空なら候補の更新を受け付けない）
+    char remote_pwd[ICE_PWD_LEN + 1];
+    uint32_t update_sequence;             // 最後に送った候補の更新の通し番号
+    uint32_t remote_update_sequence;      // 最後に受け付けた候補の更新の通し番号
     pthread_t ice_thread;
     bool ice_running;
     pthread_mutex_t mutex;
@@ -57,9 +86,12 @@ int ice_init(Node* node);
 int ice_cleanup(Node* node);
 int ice_gather_candidates(Node* node);
 int ice_add_remote_candidate(Node* node, IceCandidateType type, const char* ip, int port, int priority);
+int ice_get_local_credentials(Node* node, char* ufrag, size_t ufrag_size, char* pwd, size_t pwd_size);
+int ice_set_remote_credentials(Node* node, const char* ufrag, const char* pwd);
 int ice_start_connectivity_checks(Node* node);
 IceConnectionState ice_get_connection_state(Node* node);
 int ice_send_data(Node* node, const void* data, int data_len);
+bool ice_handle_packet(Node* node, const void* buf, size_t len, const struct sockaddr_in* from);
 void* ice_thread(void* arg);
 
 #endif /* ICE_H */
\ No newline at end of file
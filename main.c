@@ -9,8 +9,11 @@
 #include "security.h"
 #include "diagnostics.h"
 #include "dht.h"
+#include "dht_replica.h"
 #include "rendezvous.h"
+#include "pubsub.h"
 #include "turn.h"
+#include "turn_server.h"
 #include "ice.h"
 #include <signal.h>
 #include <getopt.h>
@@ -57,6 +60,13 @@ void init_network(int count, bool use_nat_traversal, bool use_upnp, bool use_dis
     
     printf("Using local IP address: %s\n", local_ip);
 
+    // STUN discoveries for all nodes run in parallel from node creation on
+    struct timespec stun_start;
+    clock_gettime(CLOCK_MONOTONIC, &stun_start);
+    if (use_nat_traversal && stun_init() < 0) {
+        fprintf(stderr, "Failed to initialize STUN client\n");
+    }
+
     // Create nodes
     for (int i = 0; i < count; i++) {
         // ノードIDをランダムに生成（0-999の範囲）
@@ -76,9 +86,9 @@ void init_network(int count, bool use_nat_traversal, bool use_upnp, bool use_dis
         nodes[i]->use_discovery_server = use_discovery_server;
         nodes[i]->firewall_bypass = use_firewall_bypass;
         
-        // Enable NAT traversal if requested
+        // Start discovering the node's public address (results are collected below)
         if (use_nat_traversal) {
-            node_enable_nat_traversal(nodes[i], stun_server);
+            stun_discover_async(nodes[i]->socket_fd, stun_server, NULL, NULL);
         }
         
         // Enable UPnP if requested and not already enabled by NAT traversal
@@ -89,6 +99,20 @@ void init_network(int count, bool use_nat_traversal, bool use_upnp, bool use_dis
         num_nodes++;
     }
 
+    // Enable NAT traversal if requested (waits for the discoveries started above)
+    if (use_nat_traversal) {
+        int mapped = 0;
+        for (int i = 0; i < num_nodes; i++) {
+            if (nodes[i] && node_enable_nat_traversal(nodes[i], stun_server) == 0) {
+                mapped++;
+            }
+        }
+        struct timespec stun_end;
+        clock_gettime(CLOCK_MONOTONIC, &stun_end);
+        printf("STUN mapped %d/%d nodes in %.1f ms\n", mapped, num_nodes,
+               (stun_end.tv_sec - stun_start.tv_sec) * 1000.0 + (stun_end.tv_nsec - stun_start.tv_nsec) / 1e6);
+    }
+
     // If not using discovery, manually connect nodes
     if (!use_discovery) {
         // Add all nodes as peers to each other
@@ -151,16 +175,19 @@ void cleanup_network() {
     // Clean up nodes
     for (int i = 0; i < num_nodes; i++) {
         if (nodes[i]) {
-            // Clean up DHT if used
-            if (use_dht) {
-                dht_cleanup(nodes[i]);
-            }
+            // Clean up pubsub (before the rendezvous keys its topics use)
+            pubsub_cleanup(nodes[i]);
             
-            // Clean up Rendezvous if used
+            // Clean up Rendezvous if used (before the DHT it publishes to)
             if (use_rendezvous) {
                 rendezvous_cleanup(nodes[i]);
             }
             
+            // Clean up DHT if used
+            if (use_dht) {
+                dht_cleanup(nodes[i]);
+            }
+            
             // Clean up ICE if used
             if (use_ice) {
                 ice_cleanup(nodes[i]);
@@ -171,6 +198,9 @@ void cleanup_network() {
                 turn_cleanup(nodes[i]);
             }
             
+            // Stop the TURN relay server if this node runs one
+            turn_server_stop(nodes[i]);
+            
             // Remove UPnP port mappings
             if (nodes[i]->use_upnp) {
                 upnp_delete_port_mapping(BASE_PORT + i, "UDP");
@@ -211,6 +241,12 @@ void maintain_network() {
     }
 }
 
+// Print a message received on a pubsub topic
+void print_pubsub_message(Node* node, const char* topic, const void* data, size_t len, void* arg) {
+    (void)arg;
+    printf("Node %d received on topic %s: %.*s\n", node->id, topic, (int)len, (const char*)data);
+}
+
 // Print usage information
 void print_usage(const char* program_name) {
     printf("Usage: %s [options]\n", program_name);
@@ -222,10 +258,16 @@ void print_usage(const char* program_name) {
     printf("  -E             Disable enhanced peer discovery (enabled by default)\n");
     printf("  -S             Disable discovery server (disabled by default)\n");
     printf("  -F             Disable firewall bypass mode (enabled by default)\n");
-    printf("  -s SERVER      STUN server to use (default: stun.l.google.com)\n");
+    printf("  -s SERVERS     STUN servers, comma-separated HOST[:PORT], queried in parallel\n");
+    printf("                 (default: %s)\n", DEFAULT_STUN_SERVERS);
     printf("  -d SERVER:PORT Discovery server to use (default: %s:%d)\n", 
            DEFAULT_DISCOVERY_SERVER, DEFAULT_DISCOVERY_PORT);
     printf("  -p PEER        Add a remote peer (format: id:ip:port)\n");
+    printf("  -P DIR         Persist DHT state in DIR for fast warm restart\n");
+    printf("  -r PORT        Run a TURN relay server on node 0 and use it for all nodes (requires -K)\n");
+    printf("  -K USER:SECRET TURN long-term credentials for the relay server and clients\n");
+    printf("  -A             Pre-allocate TURN relays in the background and keep them warm\n");
+    printf("  -u SERVER:PORT Add a TURN server (repeatable, up to %d; lowest RTT is used)\n", TURN_MAX_SERVERS);
     printf("  -f             Explicitly enable firewall bypass mode (enabled by default)\n");
     printf("  -h             Display this help message\n");
     printf("\nEnhanced discovery is enabled by default, which allows automatic peer discovery without a central server.\n");
@@ -262,9 +304,16 @@ int main(int argc, char* argv[]) {
     bool disable_rendezvous = false;
     bool disable_turn = false;
     bool disable_ice = false;
-    char stun_server[256] = "stun.l.google.com";
+    char stun_server[256] = DEFAULT_STUN_SERVERS;
     char discovery_server[256] = DEFAULT_DISCOVERY_SERVER;
     int discovery_port = DEFAULT_DISCOVERY_PORT;
+    char dht_state_dir[200] = "";
+    int relay_port = -1;             // TURNリレーサーバーのポート（-1なら起動しない）
+    char turn_servers[TURN_MAX_SERVERS][MAX_IP_STR_LEN + 8]; // -uで指定したTURNサーバー
+    int turn_server_count = 0;
+    bool turn_prealloc_enabled = false; // 起動時に待たずにアロケーションし、保ち続ける
+    char turn_username[64] = "";     // -Kで指定したTURNの資格情報
+    char turn_password[64] = "";
     int opt;
     
     // Remote peers to add
@@ -276,7 +325,7 @@ int main(int argc, char* argv[]) {
     int remote_peer_count = 0;
     
     // Parse command line arguments
-    while ((opt = getopt(argc, argv, "n:TUDFSEHRICs:d:p:t:hf")) != -1) {
+    while ((opt = getopt(argc, argv, "n:TUDFSEHRICAs:d:p:P:r:u:K:t:hf")) != -1) {
         switch (opt) {
             case 'n':
                 node_count = atoi(optarg);
@@ -346,6 +395,40 @@ int main(int argc, char* argv[]) {
                     }
                 }
                 break;
+            case 'P':  // DHT状態の保存先ディレクトリ
+                strncpy(dht_state_dir, optarg, sizeof(dht_state_dir) - 1);
+                dht_state_dir[sizeof(dht_state_dir) - 1] = '\0';
+                break;
+            case 'r':  // ノード0でTURNリレーサーバーを起動
+                relay_port = atoi(optarg);
+                if (relay_port < 0 || relay_port > 65535) {
+                    fprintf(stderr, "Invalid relay port: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'A':  // TURNの事前アロケーション
+                turn_prealloc_enabled = true;
+                break;
+            case 'u':  // TURNサーバーを追加
+                if (turn_server_count < TURN_MAX_SERVERS) {
+                    snprintf(turn_servers[turn_server_count++], sizeof(turn_servers[0]), "%s", optarg);
+                } else {
+                    fprintf(stderr, "Too many TURN servers (max %d)\n", TURN_MAX_SERVERS);
+                }
+                break;
+            case 'K':  // TURNの資格情報（USER:SECRET）
+                {
+                    char* separator = strchr(optarg, ':');
+                    if (!separator || separator == optarg || separator[1] == '\0' ||
+                        separator - optarg >= (int)sizeof(turn_username) ||
+                        strlen(separator + 1) >= sizeof(turn_password)) {
+                        fprintf(stderr, "Invalid TURN credentials. Use USER:SECRET\n");
+                        return 1;
+                    }
+                    snprintf(turn_username, sizeof(turn_username), "%.*s", (int)(separator - optarg), optarg);
+                    snprintf(turn_password, sizeof(turn_password), "%s", separator + 1);
+                }
+                break;
             case 'f':  // ファイアウォール対策モードを明示的に有効化（デフォルトでも有効）
                 use_firewall_bypass = true;
                 printf("Firewall bypass mode enabled. Will try multiple ports.\n");
@@ -371,6 +454,12 @@ int main(int argc, char* argv[]) {
     if (disable_turn) use_turn = false;
     if (disable_ice) use_ice = false;
     
+    // 資格情報のないリレーサーバーは誰でも使えてしまうので起動しない
+    if (relay_port >= 0 && use_turn && turn_username[0] == '\0') {
+        fprintf(stderr, "TURN relay server (-r) requires credentials (-K USER:SECRET)\n");
+        return 1;
+    }
+    
     // Set up signal handler
     signal(SIGINT, handle_signal);
     
@@ -403,7 +492,7 @@ int main(int argc, char* argv[]) {
     printf("┃ ICE                       ┃ %s                    ┃\n", use_ice ? "\033[1;38;5;46mENABLED\033[1;38;5;39m " : "\033[1;38;5;196mDISABLED\033[1;38;5;39m");
     if (use_nat_traversal) {
         printf("┣━━━━━━━━━━━━━━━━━━━━━━━━━━╋━━━━━━━━━━━━━━━━━━━━━━━━━━┫\n");
-        printf("┃ \033[1;38;5;226mSTUN Server\033[1;38;5;39m              ┃ %-26s ┃\n", stun_server);
+        printf("┃ \033[1;38;5;226mSTUN Server\033[1;38;5;39m              ┃ %-26.26s ┃\n", stun_server);
     }
     if (use_discovery_server) {
         printf("┣━━━━━━━━━━━━━━━━━━━━━━━━━━╋━━━━━━━━━━━━━━━━━━━━━━━━━━┫\n");
@@ -422,6 +511,13 @@ int main(int argc, char* argv[]) {
     if (use_dht) {
         for (int i = 0; i < num_nodes; i++) {
             dht_init(nodes[i]);
+            
+            // 前回のDHT状態を復元
+            if (dht_state_dir[0] != '\0') {
+                char state_path[256];
+                snprintf(state_path, sizeof(state_path), "%s/dht-node-%d.state", dht_state_dir, nodes[i]->id);
+                dht_enable_persistence(nodes[i], state_path);
+            }
         }
     }
     
@@ -436,18 +532,53 @@ int main(int argc, char* argv[]) {
         for (int i = 0; i < num_nodes; i++) {
             rendezvous_join(nodes[i], default_rendezvous_key);
         }
+        
+        // ランデブーキーをトピックにしたパブサブ
+        if (use_dht) {
+            for (int i = 0; i < num_nodes; i++) {
+                if (pubsub_init(nodes[i]) == 0) {
+                    pubsub_set_handler(nodes[i], print_pubsub_message, NULL);
+                }
+            }
+        }
     }
     
     // Initialize TURN for all nodes if enabled
     if (use_turn) {
-        // TURNサーバーの設定（Google公開TURNサーバーを使用）
-        const char* turn_server = "turn.navigatorsguild.com";
-        const char* turn_username = "webrtc";
-        const char* turn_password = "webrtc";
+        // -Kがなければ公開TURNサーバー向けの既定の資格情報を使う
+        if (turn_username[0] == '\0') {
+            snprintf(turn_username, sizeof(turn_username), "webrtc");
+            snprintf(turn_password, sizeof(turn_password), "webrtc");
+        }
+        char relay_server[MAX_IP_STR_LEN + 8];
+        const char* servers[TURN_MAX_SERVERS];
+        int server_count = 0;
+        
+        // -r指定時はノード0が自前のリレーサーバーになり、全ノードがそれを使う
+        // （-uのサーバーもあれば、その中からRTTの最小のものを選ぶ）
+        if (relay_port >= 0 && num_nodes > 0 &&
+            turn_server_start(nodes[0], relay_port, NULL, turn_username, turn_password) == 0) {
+            snprintf(relay_server, sizeof(relay_server), "%s:%d", nodes[0]->ip, turn_server_get_port(nodes[0]));
+            servers[server_count++] = relay_server;
+        }
+        for (int i = 0; i < turn_server_count && server_count < TURN_MAX_SERVERS; i++) {
+            servers[server_count++] = turn_servers[i];
+        }
+        if (server_count == 0) {
+            servers[server_count++] = "turn.navigatorsguild.com";
+        }
         
         for (int i = 0; i < num_nodes; i++) {
-            if (turn_init(nodes[i], turn_server, TURN_DEFAULT_PORT, turn_username, turn_password) == 0) {
-                printf("Initialized TURN for node %d using server %s\n", nodes[i]->id, turn_server);
+            if (turn_init_servers(nodes[i], servers, server_count, turn_username, turn_password) == 0) {
+                printf("Initialized TURN for node %d using %d server(s), first %s\n",
+                       nodes[i]->id, server_count, servers[0]);
+                
+                // 事前アロケーションなら待たずに全ノードで並行して始める（ICEは終わった時点で
+                // Relay候補に使う）
+                if (turn_prealloc_enabled) {
+                    turn_prealloc(nodes[i], NULL, NULL);
+                    continue;
+                }
                 
                 // TURNアロケーションの要求
                 if (turn_allocate(nodes[i]) == 0) {
@@ -639,9 +770,81 @@ int main(int argc, char* argv[]) {
                         } else {
                             printf("Usage: dht find <key>\n");
                         }
+                    } else if (strncmp(subcmd, "put ", 4) == 0) {
+                        // 値を保存してk近傍に複製
+                        char *key_str = subcmd + 4;
+                        char *value_str = strchr(key_str, ' ');
+                        if (value_str && value_str[1] != '\0') {
+                            *value_str++ = '\0';
+                            DhtId key = dht_generate_id_from_string(key_str);
+                            if (dht_store_value(nodes[0], &key, value_str, strlen(value_str)) == 0) {
+                                printf("Stored value for key %s (replicating to the %d closest nodes)\n", key_str, DHT_K);
+                            } else {
+                                printf("Failed to store value for key %s\n", key_str);
+                            }
+                        } else {
+                            printf("Usage: dht put <key> <value>\n");
+                        }
+                    } else if (strncmp(subcmd, "get ", 4) == 0) {
+                        // ローカルになければネットワークから取得
+                        char *key_str = subcmd + 4;
+                        if (strlen(key_str) > 0) {
+                            DhtId key = dht_generate_id_from_string(key_str);
+                            char value[MAX_BUFFER + 1];
+                            size_t value_len = MAX_BUFFER;
+                            if (dht_get_value(nodes[0], &key, value, &value_len) == 0) {
+                                value[value_len] = '\0';
+                                printf("%s = %s\n", key_str, value);
+                            } else {
+                                printf("No value found for key %s\n", key_str);
+                            }
+                        } else {
+                            printf("Usage: dht get <key>\n");
+                        }
+                    } else if (strncmp(subcmd, "stats", 5) == 0) {
+                        // 複製の統計
+                        DhtReplicationStats stats;
+                        dht_get_replication_stats(nodes[0], &stats);
+                        printf("DHT replication statistics:\n");
+                        printf("  Published keys:   %d (replicas avg %.1f, min %d)\n",
+                               stats.published_keys, stats.avg_replicas, stats.min_replicas);
+                        printf("  Queued tasks:     %d (%d looking up, dropped %llu, throttled %llu)\n",
+                               stats.queue_depth, stats.lookups, (unsigned long long)stats.dropped_tasks,
+                               (unsigned long long)stats.throttled);
+                        printf("  STOREs:           %llu sent, %llu acked\n",
+                               (unsigned long long)stats.stores_sent, (unsigned long long)stats.stores_acked);
+                        printf("  Publish traffic:  %llu bytes\n", (unsigned long long)stats.publish_bytes);
+                        printf("  Repair traffic:   %llu bytes (%llu rounds, %llu handoffs)\n",
+                               (unsigned long long)stats.repair_bytes, (unsigned long long)stats.republish_rounds,
+                               (unsigned long long)stats.handoffs);
+                        DhtCacheStats cache;
+                        dht_get_cache_stats(nodes[0], &cache);
+                        printf("  Path cache:       %d values (%zu bytes), served %llu, stored %llu\n",
+                               cache.cached_values, cache.cache_bytes, (unsigned long long)cache.served_cache,
+                               (unsigned long long)cache.cache_stores_received);
+                        printf("  Value lookups:    %llu (%.2f hops avg, %llu answered by caches)\n",
+                               (unsigned long long)cache.value_lookups,
+                               cache.value_lookups ? (double)cache.lookup_hops / cache.value_lookups : 0.0,
+                               (unsigned long long)cache.cache_answered);
+                    } else if (strncmp(subcmd, "memory", 6) == 0) {
+                        // ノードごとのメモリ使用量
+                        printf("DHT memory usage:\n");
+                        for (int i = 0; i < num_nodes; i++) {
+                            DhtMemoryStats mem;
+                            dht_get_memory_stats(nodes[i], &mem);
+                            printf("  Node %d: %zu bytes (routing %zu in %d buckets with %d contacts, "
+                                   "store %zu, cache %zu, lookups %zu, replication %zu)\n",
+                                   nodes[i]->id, mem.total_bytes, mem.routing_bytes, mem.buckets_allocated,
+                                   mem.contacts, mem.store_bytes, mem.cache_bytes, mem.lookup_bytes,
+                                   mem.replication_bytes);
+                        }
                     } else {
                         printf("Unknown DHT command. Available commands:\n");
                         printf("  dht find <key> - Find nodes closest to a key\n");
+                        printf("  dht put <key> <value> - Store a value and replicate it\n");
+                        printf("  dht get <key> - Look up a value in the DHT\n");
+                        printf("  dht stats - Show value replication and path cache statistics\n");
+                        printf("  dht memory - Show DHT memory usage per local node\n");
                     }
                 }
             } else if (strncmp(cmd_buffer, "rendezvous", 10) == 0) {
@@ -680,8 +883,7 @@ int main(int argc, char* argv[]) {
                         char *key = subcmd + 5;
                         if (strlen(key) > 0) {
                             int count = rendezvous_find_peers(nodes[0], key);
-                            printf("Finding peers with rendezvous key: %s\n", key);
-                            printf("Sent query to %d DHT nodes\n", count);
+                            printf("Found %d peers with rendezvous key: %s\n", count < 0 ? 0 : count, key);
                         } else {
                             printf("Usage: rendezvous find <key>\n");
                         }
@@ -692,6 +894,102 @@ int main(int argc, char* argv[]) {
                         printf("  rendezvous find <key> - Find peers at a rendezvous point\n");
                     }
                 }
+            } else if (strncmp(cmd_buffer, "pubsub", 6) == 0) {
+                // パブサブ関連のコマンド
+                if (!nodes[0]->pubsub_data) {
+                    printf("Pubsub is not enabled. It requires DHT and rendezvous.\n");
+                } else {
+                    char *subcmd = cmd_buffer + 7; // "pubsub "の後の部分
+                    
+                    if (strncmp(subcmd, "subscribe ", 10) == 0) {
+                        // トピックを購読
+                        char *topic = subcmd + 10;
+                        if (strlen(topic) > 0 && pubsub_subscribe(nodes[0], topic) == 0) {
+                            printf("Subscribed to topic: %s\n", topic);
+                        } else {
+                            printf("Failed to subscribe to topic: %s\n", topic);
+                        }
+                    } else if (strncmp(subcmd, "unsubscribe ", 12) == 0) {
+                        // 購読をやめる
+                        char *topic = subcmd + 12;
+                        if (pubsub_unsubscribe(nodes[0], topic) == 0) {
+                            printf("Unsubscribed from topic: %s\n", topic);
+                        } else {
+                            printf("Not subscribed to topic: %s\n", topic);
+                        }
+                    } else if (strncmp(subcmd, "publish ", 8) == 0) {
+                        // トピックにメッセージを公開
+                        char *topic = subcmd + 8;
+                        char *message = strchr(topic, ' ');
+                        if (message) {
+                            *message++ = '\0';
+                            int count = pubsub_publish(nodes[0], topic, message, strlen(message));
+                            if (count >= 0) {
+                                printf("Published to topic %s (%d peers)\n", topic, count);
+                            } else {
+                                printf("Failed to publish: not subscribed to topic %s\n", topic);
+                            }
+                        } else {
+                            printf("Usage: pubsub publish <topic> <message>\n");
+                        }
+                    } else if (strncmp(subcmd, "stats", 5) == 0) {
+                        // パブサブの統計
+                        for (int i = 0; i < num_nodes; i++) {
+                            PubsubStats stats;
+                            pubsub_get_stats(nodes[i], &stats);
+                            printf("Node %d: %d topics, %d peers (%d in mesh), %llu published, %llu delivered, "
+                                   "%llu duplicates, %llu IHAVE, %llu IWANT (%llu served)\n",
+                                   nodes[i]->id, stats.topics, stats.peers, stats.mesh_peers,
+                                   (unsigned long long)stats.published, (unsigned long long)stats.delivered,
+                                   (unsigned long long)stats.duplicates, (unsigned long long)stats.ihave_sent,
+                                   (unsigned long long)stats.iwant_sent, (unsigned long long)stats.iwant_served);
+                        }
+                    } else {
+                        printf("Unknown pubsub command. Available commands:\n");
+                        printf("  pubsub subscribe <topic> - Subscribe to a topic\n");
+                        printf("  pubsub unsubscribe <topic> - Unsubscribe from a topic\n");
+                        printf("  pubsub publish <topic> <message> - Publish a message to a topic\n");
+                        printf("  pubsub stats - Show pubsub statistics\n");
+                    }
+                }
+            } else if (strcmp(cmd_buffer, "relay") == 0) {
+                // TURNリレーサーバーの統計
+                if (num_nodes == 0 || turn_server_get_port(nodes[0]) < 0) {
+                    printf("TURN relay server is not running. Use -r PORT to start it.\n");
+                } else {
+                    TurnServerStats stats;
+                    turn_server_get_stats(nodes[0], &stats);
+                    printf("TURN relay on port %d: %d allocations, %d permissions, %d channels\n",
+                           turn_server_get_port(nodes[0]), stats.allocations, stats.permissions, stats.channels);
+                    printf("  Requests:  %llu (%llu errors)\n",
+                           (unsigned long long)stats.requests, (unsigned long long)stats.errors);
+                    printf("  Relayed:   %llu packets, %llu bytes in %llu batches\n",
+                           (unsigned long long)stats.relayed_packets, (unsigned long long)stats.relayed_bytes,
+                           (unsigned long long)stats.batches);
+                    printf("  Dropped:   %llu without permission, %llu over quota\n",
+                           (unsigned long long)stats.no_permission, (unsigned long long)stats.over_quota);
+                }
+            } else if (strcmp(cmd_buffer, "turn") == 0) {
+                // TURNサーバーごとの役割とRTT
+                if (!use_turn) {
+                    printf("TURN is not enabled.\n");
+                }
+                for (int i = 0; use_turn && i < num_nodes; i++) {
+                    TurnServerInfo servers[TURN_MAX_SERVERS];
+                    int count = turn_get_servers(nodes[i], servers, TURN_MAX_SERVERS);
+                    printf("Node %d TURN servers:\n", nodes[i]->id);
+                    for (int j = 0; j < count; j++) {
+                        printf("  %s:%d %-8s %-9s rtt %6.1f ms, %llu probes (%llu unanswered), "
+                               "%llu allocate / %llu refresh failures, dropped %llu times\n",
+                               servers[j].server, servers[j].port,
+                               servers[j].primary ? "primary" : servers[j].standby ? "standby" : "-",
+                               servers[j].alive ? "alive" : "unknown", servers[j].rtt_ms,
+                               (unsigned long long)servers[j].probes, (unsigned long long)servers[j].probe_failures,
+                               (unsigned long long)servers[j].allocate_failures,
+                               (unsigned long long)servers[j].refresh_failures,
+                               (unsigned long long)servers[j].failures);
+                    }
+                }
             } else if (strncmp(cmd_buffer, "ice", 3) == 0) {
                 // ICE関連のコマンド
                 if (!use_ice) {
@@ -751,10 +1049,19 @@ int main(int argc, char* argv[]) {
                 printf("\033[1;38;5;219m╠══════════════════════════════════════════════════════════╣\033[0m\n");
                 printf("\033[1;38;5;219m║\033[0m \033[1;38;5;226mAdvanced Features\033[0m                                     \033[1;38;5;219m║\033[0m\n");
                 printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mdht find <key>\033[0m - Find nodes closest to a key in DHT \033[1;38;5;219m║\033[0m\n");
+                printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mdht put <key> <value>\033[0m - Store a DHT value           \033[1;38;5;219m║\033[0m\n");
+                printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mdht get <key>\033[0m - Look up a DHT value                 \033[1;38;5;219m║\033[0m\n");
+                printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mdht stats\033[0m - DHT replication stats                   \033[1;38;5;219m║\033[0m\n");
+                printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mdht memory\033[0m - DHT memory per node                    \033[1;38;5;219m║\033[0m\n");
                 printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mrendezvous join <key>\033[0m - Join a rendezvous point     \033[1;38;5;219m║\033[0m\n");
                 printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mrendezvous leave <key>\033[0m - Leave a rendezvous point   \033[1;38;5;219m║\033[0m\n");
                 printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mrendezvous find <key>\033[0m - Find peers at rendezvous    \033[1;38;5;219m║\033[0m\n");
+                printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mpubsub subscribe <topic>\033[0m - Subscribe to a topic     \033[1;38;5;219m║\033[0m\n");
+                printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mpubsub publish <topic> <msg>\033[0m - Publish to a topic   \033[1;38;5;219m║\033[0m\n");
+                printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mpubsub stats\033[0m - Show pubsub statistics               \033[1;38;5;219m║\033[0m\n");
                 printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mice status\033[0m   - Show ICE connection status           \033[1;38;5;219m║\033[0m\n");
+                printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mrelay\033[0m        - Show TURN relay server statistics    \033[1;38;5;219m║\033[0m\n");
+                printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mturn\033[0m         - Show TURN servers, roles and RTT     \033[1;38;5;219m║\033[0m\n");
                 printf("\033[1;38;5;219m╠══════════════════════════════════════════════════════════╣\033[0m\n");
                 printf("\033[1;38;5;219m║\033[0m \033[1;38;5;226mSystem Commands\033[0m                                       \033[1;38;5;219m║\033[0m\n");
                 printf("\033[1;38;5;219m║\033[0m   \033[1;38;5;159mhelp\033[0m         - Show this help message               \033[1;38;5;219m║\033[0m\n");
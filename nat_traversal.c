@@ -13,18 +13,20 @@ int node_enable_nat_traversal(Node* node, const char* stun_server) {
         return -1;
     }
     
-    // Discover NAT type and public IP/port
-    StunResult* result = stun_discover_nat(stun_server);
-    if (!result) {
+    // Discover the public IP/port of the node's own socket (the receive thread passes the
+    // responses to the STUN client; a discovery already started for this socket is joined)
+    StunResult result;
+    if (stun_discover(node->socket_fd, stun_server, &result) < 0) {
         fprintf(stderr, "Failed to discover NAT using STUN\n");
-        stun_cleanup();
         return -1;
     }
+    printf("STUN mapping for node %d from %s in %.1f ms%s\n", node->id, result.server,
+           result.latency_ms, result.cached ? " (cached)" : "");
     
     // Store public IP and port
-    strncpy(node->public_ip, result->public_ip, MAX_IP_STR_LEN - 1);
+    strncpy(node->public_ip, result.public_ip, MAX_IP_STR_LEN - 1);
     node->public_ip[MAX_IP_STR_LEN - 1] = '\0';
-    node->public_port = result->public_port;
+    node->public_port = result.public_port;
     node->is_behind_nat = true;
     
     printf("\n\033[1;38;5;208m╔══════════════════════════════════════════════════════════╗\033[0m\n");
@@ -40,8 +42,6 @@ int node_enable_nat_traversal(Node* node, const char* stun_server) {
            (int)(42 - strlen(node->public_ip) - 15 - (node->id > 999 ? 4 : (node->id > 99 ? 3 : (node->id > 9 ? 2 : 1))) - (node->public_port > 9999 ? 5 : (node->public_port > 999 ? 4 : (node->public_port > 99 ? 3 : (node->public_port > 9 ? 2 : 1))))), "");
     printf("\033[1;38;5;208m╚══════════════════════════════════════════════════════════╝\033[0m\n");
     
-    free(result);
-    
     // Try to set up UPnP port forwarding if enabled
     if (node->use_upnp) {
         node_enable_upnp(node);
@@ -1,4 +1,10 @@
 #include "node.h"
+#include "dht.h"
+#include "dht_rpc.h"
+#include "rendezvous.h"
+#include "pubsub.h"
+#include "stun.h"
+#include "ice.h"
 #include <errno.h>
 
 // Create a new node
@@ -387,13 +393,17 @@ void* receive_messages(void* arg) {
     Node* node = (Node*)arg;
     
     while (node->is_running) {
-        // Set up buffer for incoming message
+        // Set up buffer for incoming message (large enough for DHT RPC packets too)
+        union {
+            Message msg;
+            uint8_t raw[DHT_RPC_MAX_PACKET];
+        } packet;
         Message msg;
         struct sockaddr_in sender_addr;
         socklen_t sender_len = sizeof(sender_addr);
         
         // Receive message
-        int bytes = recvfrom(node->socket_fd, &msg, sizeof(msg), 0, 
+        int bytes = recvfrom(node->socket_fd, &packet, sizeof(packet), 0, 
                             (struct sockaddr*)&sender_addr, &sender_len);
         
         if (bytes < 0) {
@@ -402,6 +412,37 @@ void* receive_messages(void* arg) {
             }
             continue;
         }
+        
+        // STUN responses are handled by the STUN client
+        if (stun_handle_packet(node->socket_fd, packet.raw, (size_t)bytes, &sender_addr)) {
+            continue;
+        }
+
+        // ICE candidate updates (a peer's relayed address moved after a TURN failover)
+        if (ice_handle_packet(node, packet.raw, (size_t)bytes, &sender_addr)) {
+            continue;
+        }
+
+        // DHT RPC packets are handled by the DHT layer
+        if (dht_is_packet(packet.raw, (size_t)bytes)) {
+            dht_handle_packet(node, packet.raw, (size_t)bytes, &sender_addr);
+            continue;
+        }
+
+        // Pubsub packets are handled by the pubsub layer
+        if (node->pubsub_data && pubsub_is_packet(packet.raw, (size_t)bytes)) {
+            pubsub_handle_packet(node, packet.raw, (size_t)bytes, &sender_addr);
+            continue;
+        }
+
+        // Rendezvous messages are handled by the rendezvous layer
+        if (node->rendezvous_data && rendezvous_is_message(packet.raw, (size_t)bytes)) {
+            RendezvousMessage rendezvous_msg;
+            memcpy(&rendezvous_msg, packet.raw, sizeof(rendezvous_msg));
+            rendezvous_process_message(node, &rendezvous_msg, &sender_addr);
+            continue;
+        }
+        msg = packet.msg;
 
         // Check if message is for this node
         if (msg.to_id == node->id) {
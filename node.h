@@ -53,7 +53,9 @@ typedef struct Node {
     void* dht_data;             // DHT related data (opaque pointer)
     void* rendezvous_data;      // Rendezvous related data (opaque pointer)
     void* turn_data;            // TURN related data (opaque pointer)
+    void* turn_server_data;     // TURN relay server data (opaque pointer)
     void* ice_data;             // ICE related data (opaque pointer)
+    void* pubsub_data;          // Publish/subscribe related data (opaque pointer)
 } Node;
 
 typedef struct {
@@ -0,0 +1,885 @@
+#include "pubsub.h"
+#include "dht_rpc.h"
+#include "dht_wire.h"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define PUBSUB_PACKET_MAX (PUBSUB_HEADER_LEN + 16 + PUBSUB_MAX_DATA)
+#define PUBSUB_SEEN_MIN 64           // 既読集合の表の初期サイズ（2の冪）
+#define PUBSUB_NOT_CACHED (-1)       // 既読だがキャッシュにない
+#define PUBSUB_WANTED (-2)           // IWANTで要求中（まだ受け取っていない）
+
+// トピックのピア
+typedef struct {
+    struct sockaddr_in addr;
+    bool mesh;                   // メッシュに入っている（PUBLISHをすぐに送る）
+} PubsubPeer;
+
+// 購読中のトピック
+typedef struct {
+    char name[MAX_RENDEZVOUS_KEY_LEN];
+    uint64_t id;
+    PubsubPeer peers[PUBSUB_MAX_PEERS];
+    int peer_count;
+    int mesh_count;
+} PubsubTopic;
+
+// メッセージキャッシュのエントリ（IHAVEで知らせ、IWANTに応える）
+typedef struct {
+    uint64_t id;                 // 0なら空き
+    uint64_t topic_id;
+    uint32_t window;             // 入れたときのハートビートの番号
+    uint8_t hops;
+    uint16_t len;
+    uint8_t* data;
+} PubsubCacheEntry;
+
+// 既読のメッセージID
+typedef struct {
+    uint64_t id;                 // 0なら空き
+    int32_t slot;                // キャッシュの位置、PUBSUB_NOT_CACHEDかPUBSUB_WANTED
+    uint32_t wanted_window;      // IWANTを送ったハートビートの番号
+} PubsubSeenEntry;
+
+// 既読集合の1世代（線形探索のオープンアドレス表）
+//
+// 古いIDを1つずつ消す代わりに、PUBSUB_SEEN_TTLの半分ごとに世代を交代して古い世代を
+// まとめて捨てる。表は使った分だけ伸ばし、最大サイズで半分埋まったら早めに交代する。
+typedef struct {
+    PubsubSeenEntry* entries;
+    uint32_t mask;               // 表のサイズ - 1（未確保なら0）
+    int count;
+} PubsubSeen;
+
+// パブサブデータ構造体
+typedef struct {
+    PubsubTopic* topics[PUBSUB_MAX_TOPICS];
+    PubsubCacheEntry cache[PUBSUB_CACHE_SIZE];
+    int cache_next;              // 次に上書きするキャッシュの位置
+    PubsubSeen seen[2];          // [0]が新しい世代
+    uint64_t seen_rotated_ms;
+    uint32_t window;             // ハートビートの番号
+    uint64_t origin;             // メッセージIDの元（ノードごとの乱数）
+    uint64_t seq;
+    uint64_t rng;
+    PubsubHandler handler;
+    void* handler_arg;
+    PubsubStats stats;
+    pthread_t heartbeat_thread;
+    bool heartbeat_running;
+    pthread_mutex_t mutex;
+} PubsubData;
+
+// 疑似乱数（xorshift64*）
+static uint64_t pubsub_rand(PubsubData* data) {
+    data->rng ^= data->rng >> 12;
+    data->rng ^= data->rng << 25;
+    data->rng ^= data->rng >> 27;
+    return data->rng * 2685821657736338717ULL;
+}
+
+static uint64_t pubsub_mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static void pubsub_put_u64(DhtWireWriter* w, uint64_t v) {
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (uint8_t)(v >> (56 - 8 * i));
+    }
+    dht_wire_put_bytes(w, bytes, sizeof(bytes));
+}
+
+static uint64_t pubsub_get_u64(DhtWireReader* r) {
+    const uint8_t* p = dht_wire_take(r, 8);
+    if (!p) {
+        return 0;
+    }
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+// トピック名のID（キーのDHT IDの先頭8バイト）
+static uint64_t pubsub_topic_id(const char* topic) {
+    DhtId dht_id = rendezvous_key_to_dht_id(topic);
+    uint64_t id = 0;
+    for (int i = 0; i < 8; i++) {
+        id = (id << 8) | dht_id.bytes[i];
+    }
+    return id;
+}
+
+static bool pubsub_same_addr(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void pubsub_begin(DhtWireWriter* w, void* buf, size_t cap, PubsubMessageType type, uint64_t topic_id) {
+    dht_wire_writer_init(w, buf, cap);
+    dht_wire_put_bytes(w, "PSB", PUBSUB_MAGIC_LEN);
+    dht_wire_put_u8(w, PUBSUB_VERSION);
+    dht_wire_put_u8(w, (uint8_t)type);
+    pubsub_put_u64(w, topic_id);
+}
+
+static int pubsub_send(Node* node, const struct sockaddr_in* to, const DhtWireWriter* w) {
+    if (w->error) {
+        return -1;
+    }
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    return dht_data->transport.send(dht_data->transport.ctx, node, to, w->buf, w->len);
+}
+
+static size_t pubsub_encode_publish(uint8_t* buf, size_t cap, uint64_t topic_id, uint64_t msg_id, uint8_t hops,
+                                    const void* payload, size_t len, DhtWireWriter* w) {
+    pubsub_begin(w, buf, cap, PUBSUB_PUBLISH, topic_id);
+    pubsub_put_u64(w, msg_id);
+    dht_wire_put_u8(w, hops);
+    dht_wire_put_varint(w, (uint32_t)len);
+    dht_wire_put_bytes(w, payload, len);
+    return w->error ? 0 : w->len;
+}
+
+// ---- 既読集合 ----
+
+static PubsubSeenEntry* pubsub_seen_probe(PubsubSeen* seen, uint64_t id) {
+    if (!seen->entries) {
+        return NULL;
+    }
+    uint32_t i = (uint32_t)((id * 0x9E3779B97F4A7C15ULL) >> 32) & seen->mask;
+    while (seen->entries[i].id != 0) {
+        if (seen->entries[i].id == id) {
+            return &seen->entries[i];
+        }
+        i = (i + 1) & seen->mask;
+    }
+    return &seen->entries[i];
+}
+
+static PubsubSeenEntry* pubsub_seen_find(PubsubData* data, uint64_t id) {
+    for (int g = 0; g < 2; g++) {
+        PubsubSeenEntry* entry = pubsub_seen_probe(&data->seen[g], id);
+        if (entry && entry->id == id) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void pubsub_seen_rotate(PubsubData* data, uint64_t now) {
+    free(data->seen[1].entries);
+    data->seen[1] = data->seen[0];
+    memset(&data->seen[0], 0, sizeof(PubsubSeen));
+    data->seen_rotated_ms = now;
+}
+
+static int pubsub_seen_grow(PubsubSeen* seen) {
+    uint32_t size = seen->entries ? (seen->mask + 1) * 2 : PUBSUB_SEEN_MIN;
+    PubsubSeenEntry* entries = (PubsubSeenEntry*)calloc(size, sizeof(PubsubSeenEntry));
+    if (!entries) {
+        perror("Failed to grow pubsub seen set");
+        return -1;
+    }
+    PubsubSeen grown = { entries, size - 1, seen->count };
+    for (uint32_t i = 0; seen->entries && i <= seen->mask; i++) {
+        if (seen->entries[i].id != 0) {
+            *pubsub_seen_probe(&grown, seen->entries[i].id) = seen->entries[i];
+        }
+    }
+    free(seen->entries);
+    *seen = grown;
+    return 0;
+}
+
+// IDを既読にする（新しい世代に入れ、古い世代にあればそちらを更新する）
+static PubsubSeenEntry* pubsub_seen_insert(PubsubData* data, uint64_t id, uint64_t now) {
+    PubsubSeenEntry* entry = pubsub_seen_find(data, id);
+    if (entry) {
+        return entry;
+    }
+    PubsubSeen* seen = &data->seen[0];
+    if ((uint32_t)(seen->count + 1) * 2 > (seen->entries ? seen->mask + 1 : 0)) {
+        if (seen->entries && seen->mask + 1 >= PUBSUB_SEEN_MAX) {
+            pubsub_seen_rotate(data, now);
+        }
+        if (pubsub_seen_grow(seen) < 0) {
+            return NULL;
+        }
+    }
+    entry = pubsub_seen_probe(seen, id);
+    entry->id = id;
+    entry->slot = PUBSUB_NOT_CACHED;
+    entry->wanted_window = 0;
+    seen->count++;
+    return entry;
+}
+
+// ---- メッセージキャッシュ ----
+
+static void pubsub_cache_put(PubsubData* data, PubsubSeenEntry* entry, uint64_t topic_id, uint8_t hops,
+                             const void* payload, size_t len) {
+    int slot = data->cache_next;
+    PubsubCacheEntry* cached = &data->cache[slot];
+    uint8_t* copy = (uint8_t*)realloc(cached->data, len > 0 ? len : 1);
+    if (!copy) {
+        entry->slot = PUBSUB_NOT_CACHED;
+        return;
+    }
+    memcpy(copy, payload, len);
+    cached->data = copy;
+    cached->id = entry->id;
+    cached->topic_id = topic_id;
+    cached->window = data->window;
+    cached->hops = hops;
+    cached->len = (uint16_t)len;
+    entry->slot = slot;
+    data->cache_next = (slot + 1) % PUBSUB_CACHE_SIZE;
+}
+
+// IWANTに応えられるキャッシュのエントリ
+static PubsubCacheEntry* pubsub_cache_get(PubsubData* data, uint64_t id) {
+    PubsubSeenEntry* entry = pubsub_seen_find(data, id);
+    if (!entry || entry->slot < 0) {
+        return NULL;
+    }
+    PubsubCacheEntry* cached = &data->cache[entry->slot];
+    if (cached->id != id || cached->window + PUBSUB_CACHE_WINDOWS <= data->window) {
+        return NULL;
+    }
+    return cached;
+}
+
+// ---- トピックとピア ----
+
+static PubsubTopic* pubsub_find_topic(PubsubData* data, uint64_t topic_id) {
+    for (int i = 0; i < PUBSUB_MAX_TOPICS; i++) {
+        if (data->topics[i] && data->topics[i]->id == topic_id) {
+            return data->topics[i];
+        }
+    }
+    return NULL;
+}
+
+static int pubsub_find_peer(PubsubTopic* topic, const struct sockaddr_in* addr) {
+    for (int i = 0; i < topic->peer_count; i++) {
+        if (pubsub_same_addr(&topic->peers[i].addr, addr)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// ピアを加える（一杯ならメッシュ外のピアをランダムに1つ入れ替える）
+static int pubsub_add_topic_peer(Node* node, PubsubData* data, PubsubTopic* topic, const struct sockaddr_in* addr) {
+    if (pubsub_same_addr(addr, &node->addr) || addr->sin_port == 0) {
+        return -1;
+    }
+    int idx = pubsub_find_peer(topic, addr);
+    if (idx >= 0) {
+        return idx;
+    }
+    if (topic->peer_count < PUBSUB_MAX_PEERS) {
+        idx = topic->peer_count++;
+    } else {
+        if (topic->mesh_count >= topic->peer_count) {
+            return -1;
+        }
+        do {
+            idx = (int)(pubsub_rand(data) % (uint64_t)topic->peer_count);
+        } while (topic->peers[idx].mesh);
+    }
+    memset(&topic->peers[idx], 0, sizeof(PubsubPeer));
+    topic->peers[idx].addr.sin_family = AF_INET;
+    topic->peers[idx].addr.sin_addr = addr->sin_addr;
+    topic->peers[idx].addr.sin_port = addr->sin_port;
+    return idx;
+}
+
+// 条件に合うピアからランダムにmax個まで選ぶ（選んだ数を返す）
+static int pubsub_pick_peers(PubsubData* data, PubsubTopic* topic, bool mesh, int exclude, int* picked, int max) {
+    int count = 0;
+    for (int i = 0; i < topic->peer_count; i++) {
+        if (topic->peers[i].mesh == mesh && i != exclude) {
+            picked[count++] = i;
+        }
+    }
+    int n = count < max ? count : max;
+    for (int i = 0; i < n; i++) {
+        int j = i + (int)(pubsub_rand(data) % (uint64_t)(count - i));
+        int tmp = picked[i];
+        picked[i] = picked[j];
+        picked[j] = tmp;
+    }
+    return n;
+}
+
+static void pubsub_send_prune(Node* node, PubsubData* data, PubsubTopic* topic, int peer) {
+    uint8_t buf[PUBSUB_HEADER_LEN + DHT_WIRE_VARINT_MAX + PUBSUB_PX_PEERS * 6];
+    DhtWireWriter w;
+    pubsub_begin(&w, buf, sizeof(buf), PUBSUB_PRUNE, topic->id);
+
+    // 代わりに使えるピア（相手自身は除く）
+    int picked[PUBSUB_MAX_PEERS];
+    int n = pubsub_pick_peers(data, topic, false, peer, picked, PUBSUB_PX_PEERS);
+    if (n < PUBSUB_PX_PEERS) {
+        n += pubsub_pick_peers(data, topic, true, peer, picked + n, PUBSUB_PX_PEERS - n);
+    }
+    dht_wire_put_varint(&w, (uint32_t)n);
+    for (int i = 0; i < n; i++) {
+        const struct sockaddr_in* addr = &topic->peers[picked[i]].addr;
+        dht_wire_put_bytes(&w, &addr->sin_addr.s_addr, 4);
+        dht_wire_put_bytes(&w, &addr->sin_port, 2);
+    }
+    pubsub_send(node, &topic->peers[peer].addr, &w);
+    data->stats.prunes_sent++;
+}
+
+static void pubsub_send_graft(Node* node, PubsubData* data, PubsubTopic* topic, int peer) {
+    uint8_t buf[PUBSUB_HEADER_LEN];
+    DhtWireWriter w;
+    pubsub_begin(&w, buf, sizeof(buf), PUBSUB_GRAFT, topic->id);
+    pubsub_send(node, &topic->peers[peer].addr, &w);
+    data->stats.grafts_sent++;
+}
+
+static void pubsub_send_ids(Node* node, PubsubTopic* topic, PubsubMessageType type, const struct sockaddr_in* to,
+                            const uint64_t* ids, int count) {
+    uint8_t buf[PUBSUB_HEADER_LEN + DHT_WIRE_VARINT_MAX + PUBSUB_MAX_IDS * 8];
+    DhtWireWriter w;
+    pubsub_begin(&w, buf, sizeof(buf), type, topic->id);
+    dht_wire_put_varint(&w, (uint32_t)count);
+    for (int i = 0; i < count; i++) {
+        pubsub_put_u64(&w, ids[i]);
+    }
+    pubsub_send(node, to, &w);
+}
+
+// ---- 初期化 ----
+
+static void* pubsub_heartbeat_thread(void* arg) {
+    Node* node = (Node*)arg;
+    PubsubData* data = (PubsubData*)node->pubsub_data;
+
+    while (data->heartbeat_running && node->is_running) {
+        pubsub_heartbeat(node);
+        sleep(1);
+    }
+
+    return NULL;
+}
+
+// パブサブの初期化（ハートビートは呼び出し側がpubsub_heartbeatで進める）
+int pubsub_init_manual(Node* node) {
+    if (!node->dht_data) {
+        return -1;
+    }
+    PubsubData* data = (PubsubData*)calloc(1, sizeof(PubsubData));
+    if (!data) {
+        perror("Failed to allocate pubsub data");
+        return -1;
+    }
+
+    // メッセージIDの元と乱数はDHT ID・アドレス・時刻から作る
+    DhtData* dht_data = (DhtData*)node->dht_data;
+    uint64_t seed = 0;
+    memcpy(&seed, dht_data->routing_table->self_id.bytes, sizeof(seed));
+    seed ^= ((uint64_t)node->addr.sin_addr.s_addr << 16) ^ node->addr.sin_port;
+    seed ^= dht_rpc_now_ms(node) * 0xD6E8FEB86659FD93ULL;
+    data->origin = pubsub_mix(seed);
+    data->rng = pubsub_mix(data->origin) | 1;
+    data->seen_rotated_ms = dht_rpc_now_ms(node);
+    pthread_mutex_init(&data->mutex, NULL);
+
+    node->pubsub_data = data;
+    return 0;
+}
+
+// パブサブの初期化
+int pubsub_init(Node* node) {
+    if (pubsub_init_manual(node) < 0) {
+        return -1;
+    }
+    PubsubData* data = (PubsubData*)node->pubsub_data;
+
+    // ハートビートのスレッドを開始
+    data->heartbeat_running = true;
+    if (pthread_create(&data->heartbeat_thread, NULL, pubsub_heartbeat_thread, node) != 0) {
+        perror("Failed to create pubsub heartbeat thread");
+        data->heartbeat_running = false;
+    }
+
+    printf("Pubsub service initialized for node %d\n", node->id);
+    return 0;
+}
+
+// パブサブのクリーンアップ
+int pubsub_cleanup(Node* node) {
+    if (!node->pubsub_data) {
+        return 0;
+    }
+    PubsubData* data = (PubsubData*)node->pubsub_data;
+
+    if (data->heartbeat_running) {
+        data->heartbeat_running = false;
+        pthread_join(data->heartbeat_thread, NULL);
+    }
+
+    for (int i = 0; i < PUBSUB_MAX_TOPICS; i++) {
+        free(data->topics[i]);
+    }
+    for (int i = 0; i < PUBSUB_CACHE_SIZE; i++) {
+        free(data->cache[i].data);
+    }
+    free(data->seen[0].entries);
+    free(data->seen[1].entries);
+    pthread_mutex_destroy(&data->mutex);
+    free(data);
+    node->pubsub_data = NULL;
+    return 0;
+}
+
+void pubsub_set_handler(Node* node, PubsubHandler handler, void* arg) {
+    PubsubData* data = (PubsubData*)node->pubsub_data;
+    if (!data) {
+        return;
+    }
+    pthread_mutex_lock(&data->mutex);
+    data->handler = handler;
+    data->handler_arg = arg;
+    pthread_mutex_unlock(&data->mutex);
+}
+
+// ---- 購読 ----
+
+// トピックを購読する（ランデブーが有効ならキーに参加し、参加者をピアにする）
+int pubsub_subscribe(Node* node, const char* topic) {
+    PubsubData* data = (PubsubData*)node->pubsub_data;
+    if (!data || !topic || topic[0] == '\0' || strlen(topic) >= MAX_RENDEZVOUS_KEY_LEN) {
+        return -1;
+    }
+    uint64_t topic_id = pubsub_topic_id(topic);
+
+    pthread_mutex_lock(&data->mutex);
+    if (pubsub_find_topic(data, topic_id)) {
+        pthread_mutex_unlock(&data->mutex);
+        return 0;
+    }
+    int slot = -1;
+    for (int i = 0; i < PUBSUB_MAX_TOPICS && slot < 0; i++) {
+        if (!data->topics[i]) {
+            slot = i;
+        }
+    }
+    PubsubTopic* entry = slot >= 0 ? (PubsubTopic*)calloc(1, sizeof(PubsubTopic)) : NULL;
+    if (!entry) {
+        pthread_mutex_unlock(&data->mutex);
+        printf("Node %d failed to subscribe to topic %s\n", node->id, topic);
+        return -1;
+    }
+    strcpy(entry->name, topic);
+    entry->id = topic_id;
+    data->topics[slot] = entry;
+    pthread_mutex_unlock(&data->mutex);
+
+    if (!node->rendezvous_data) {
+        return 0;
+    }
+
+    // 参加者を探してピアにする（メッシュは次のハートビートで作る）
+    rendezvous_join(node, topic);
+    RendezvousSearch* search = rendezvous_search_start(node, topic, RENDEZVOUS_SEARCH_DEFAULT_TARGET,
+                                                       RENDEZVOUS_SEARCH_DEFAULT_TIMEOUT_MS);
+    if (search) {
+        rendezvous_search_wait(node, search);
+        RendezvousPeer peers[PUBSUB_MAX_PEERS];
+        int count = rendezvous_search_finish(node, search, peers, PUBSUB_MAX_PEERS, NULL);
+        for (int i = 0; i < count; i++) {
+            const NodeInfo* info = &peers[i].info;
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(info->is_public ? info->port : info->public_port);
+            if (inet_pton(AF_INET, info->is_public ? info->ip : info->public_ip, &addr.sin_addr) == 1) {
+                pubsub_add_peer(node, topic, &addr);
+            }
+        }
+        printf("Node %d subscribed to topic %s with %d peers\n", node->id, topic, count);
+    }
+    return 0;
+}
+
+// 購読をやめる（メッシュのピアにPRUNEを送る）
+int pubsub_unsubscribe(Node* node, const char* topic) {
+    PubsubData* data = (PubsubData*)node->pubsub_data;
+    if (!data || !topic) {
+        return -1;
+    }
+    uint64_t topic_id = pubsub_topic_id(topic);
+
+    pthread_mutex_lock(&data->mutex);
+    PubsubTopic* entry = NULL;
+    for (int i = 0; i < PUBSUB_MAX_TOPICS && !entry; i++) {
+        if (data->topics[i] && data->topics[i]->id == topic_id) {
+            entry = data->topics[i];
+            data->topics[i] = NULL;
+        }
+    }
+    if (!entry) {
+        pthread_mutex_unlock(&data->mutex);
+        return -1;
+    }
+    for (int i = 0; i < entry->peer_count; i++) {
+        if (entry->peers[i].mesh) {
+            pubsub_send_prune(node, data, entry, i);
+        }
+    }
+    pthread_mutex_unlock(&data->mutex);
+    free(entry);
+
+    if (node->rendezvous_data) {
+        rendezvous_leave(node, topic);
+    }
+    return 0;
+}
+
+// 購読中のトピックにピアを加える
+int pubsub_add_peer(Node* node, const char* topic, const struct sockaddr_in* addr) {
+    PubsubData* data = (PubsubData*)node->pubsub_data;
+    if (!data || !topic || !addr) {
+        return -1;
+    }
+    uint64_t topic_id = pubsub_topic_id(topic);
+
+    pthread_mutex_lock(&data->mutex);
+    PubsubTopic* entry = pubsub_find_topic(data, topic_id);
+    int idx = entry ? pubsub_add_topic_peer(node, data, entry, addr) : -1;
+    pthread_mutex_unlock(&data->mutex);
+    return idx >= 0 ? 0 : -1;
+}
+
+// ---- 公開と受信 ----
+
+// メッセージを公開する（送ったピアの数を返す）
+int pubsub_publish(Node* node, const char* topic, const void* payload, size_t len) {
+    PubsubData* data = (PubsubData*)node->pubsub_data;
+    if (!data || !topic || (!payload && len > 0) || len > PUBSUB_MAX_DATA) {
+        return -1;
+    }
+    uint64_t topic_id = pubsub_topic_id(topic);
+    uint64_t now = dht_rpc_now_ms(node);
+
+    pthread_mutex_lock(&data->mutex);
+    PubsubTopic* entry = pubsub_find_topic(data, topic_id);
+    if (!entry) {
+        pthread_mutex_unlock(&data->mutex);
+        return -1;
+    }
+
+    uint64_t msg_id;
+    do {
+        msg_id = pubsub_mix(data->origin + data->seq++ * 0x9E3779B97F4A7C15ULL);
+    } while (msg_id == 0);
+    PubsubSeenEntry* seen = pubsub_seen_insert(data, msg_id, now);
+    if (seen) {
+        pubsub_cache_put(data, seen, topic_id, 0, payload, len);
+    }
+
+    uint8_t buf[PUBSUB_PACKET_MAX];
+    DhtWireWriter w;
+    pubsub_encode_publish(buf, sizeof(buf), topic_id, msg_id, 1, payload, len, &w);
+
+    // メッシュへ送る（メッシュがまだなければランダムなピアへ）
+    int picked[PUBSUB_MAX_PEERS];
+    int count = pubsub_pick_peers(data, entry, true, -1, picked, PUBSUB_MAX_PEERS);
+    if (count == 0) {
+        count = pubsub_pick_peers(data, entry, false, -1, picked, PUBSUB_MESH_DEGREE);
+    }
+    for (int i = 0; i < count; i++) {
+        pubsub_send(node, &entry->peers[picked[i]].addr, &w);
+    }
+    data->stats.published++;
+    data->stats.pushed += count;
+    pthread_mutex_unlock(&data->mutex);
+    return count;
+}
+
+bool pubsub_is_packet(const void* buf, size_t len) {
+    const uint8_t* p = (const uint8_t*)buf;
+    return len >= PUBSUB_HEADER_LEN && memcmp(p, "PSB", PUBSUB_MAGIC_LEN) == 0 &&
+           p[PUBSUB_MAGIC_LEN] == PUBSUB_VERSION;
+}
+
+// PUBLISHを受け取る（新しいメッセージならtrueを返し、メッシュへ転送する）
+static bool pubsub_on_publish(Node* node, PubsubData* data, PubsubTopic* topic, int from, DhtWireReader* r,
+                              const uint8_t** payload, size_t* len, uint64_t now) {
+    uint64_t msg_id = pubsub_get_u64(r);
+    uint8_t hops = dht_wire_get_u8(r);
+    uint32_t data_len = dht_wire_get_varint(r);
+    const uint8_t* p = dht_wire_take(r, data_len);
+    if (r->error || msg_id == 0 || !p || data_len > PUBSUB_MAX_DATA) {
+        data->stats.dropped++;
+        return false;
+    }
+
+    PubsubSeenEntry* seen = pubsub_seen_find(data, msg_id);
+    if (seen && seen->slot != PUBSUB_WANTED) {
+        data->stats.duplicates++;
+        return false;
+    }
+    if (!seen && !(seen = pubsub_seen_insert(data, msg_id, now))) {
+        return false;
+    }
+    pubsub_cache_put(data, seen, topic->id, hops, p, data_len);
+
+    if (hops < PUBSUB_MAX_HOPS) {
+        uint8_t buf[PUBSUB_PACKET_MAX];
+        DhtWireWriter w;
+        pubsub_encode_publish(buf, sizeof(buf), topic->id, msg_id, (uint8_t)(hops + 1), p, data_len, &w);
+        for (int i = 0; i < topic->peer_count; i++) {
+            if (topic->peers[i].mesh && i != from) {
+                pubsub_send(node, &topic->peers[i].addr, &w);
+                data->stats.pushed++;
+            }
+        }
+    }
+    data->stats.delivered++;
+    *payload = p;
+    *len = data_len;
+    return true;
+}
+
+// パブサブのパケットを処理する
+int pubsub_handle_packet(Node* node, const void* buf, size_t len, const struct sockaddr_in* from) {
+    PubsubData* data = (PubsubData*)node->pubsub_data;
+    if (!data || !pubsub_is_packet(buf, len)) {
+        return -1;
+    }
+    DhtWireReader r;
+    dht_wire_reader_init(&r, buf, len);
+    dht_wire_take(&r, PUBSUB_MAGIC_LEN + 1);
+    uint8_t type = dht_wire_get_u8(&r);
+    uint64_t topic_id = pubsub_get_u64(&r);
+    uint64_t now = dht_rpc_now_ms(node);
+
+    pthread_mutex_lock(&data->mutex);
+    PubsubTopic* topic = pubsub_find_topic(data, topic_id);
+    int peer = topic ? pubsub_add_topic_peer(node, data, topic, from) : -1;
+    if (peer < 0) {
+        // 購読していないトピックのGRAFTには、メッシュに入れないことを伝える
+        if (type == PUBSUB_GRAFT) {
+            uint8_t reply[PUBSUB_HEADER_LEN + 1];
+            DhtWireWriter w;
+            pubsub_begin(&w, reply, sizeof(reply), PUBSUB_PRUNE, topic_id);
+            dht_wire_put_varint(&w, 0);
+            pubsub_send(node, from, &w);
+        }
+        data->stats.dropped++;
+        pthread_mutex_unlock(&data->mutex);
+        return -1;
+    }
+
+    bool deliver = false;
+    const uint8_t* payload = NULL;
+    size_t payload_len = 0;
+    char name[MAX_RENDEZVOUS_KEY_LEN];
+
+    switch (type) {
+        case PUBSUB_PUBLISH:
+            deliver = pubsub_on_publish(node, data, topic, peer, &r, &payload, &payload_len, now);
+            if (deliver) {
+                strcpy(name, topic->name);
+            }
+            break;
+
+        case PUBSUB_IHAVE: {
+            // 持っていないメッセージを要求する（同じハートビートの間は1つのピアにだけ）
+            uint32_t count = dht_wire_get_varint(&r);
+            uint64_t wanted[PUBSUB_MAX_IDS];
+            int want_count = 0;
+            for (uint32_t i = 0; i < count && i < PUBSUB_MAX_IDS && !r.error; i++) {
+                uint64_t msg_id = pubsub_get_u64(&r);
+                if (r.error || msg_id == 0) {
+                    break;
+                }
+                PubsubSeenEntry* seen = pubsub_seen_find(data, msg_id);
+                if (seen && (seen->slot != PUBSUB_WANTED || seen->wanted_window == data->window)) {
+                    continue;
+                }
+                if (!seen && !(seen = pubsub_seen_insert(data, msg_id, now))) {
+                    break;
+                }
+                seen->slot = PUBSUB_WANTED;
+                seen->wanted_window = data->window;
+                wanted[want_count++] = msg_id;
+            }
+            if (want_count > 0) {
+                pubsub_send_ids(node, topic, PUBSUB_IWANT, from, wanted, want_count);
+                data->stats.iwant_sent++;
+            }
+            break;
+        }
+
+        case PUBSUB_IWANT: {
+            // キャッシュにあるメッセージを送る
+            uint32_t count = dht_wire_get_varint(&r);
+            for (uint32_t i = 0; i < count && i < PUBSUB_MAX_IDS; i++) {
+                uint64_t msg_id = pubsub_get_u64(&r);
+                if (r.error) {
+                    break;
+                }
+                PubsubCacheEntry* cached = pubsub_cache_get(data, msg_id);
+                if (!cached) {
+                    continue;
+                }
+                uint8_t out[PUBSUB_PACKET_MAX];
+                DhtWireWriter w;
+                pubsub_encode_publish(out, sizeof(out), topic->id, msg_id, (uint8_t)(cached->hops + 1),
+                                      cached->data, cached->len, &w);
+                pubsub_send(node, from, &w);
+                data->stats.iwant_served++;
+            }
+            break;
+        }
+
+        case PUBSUB_GRAFT:
+            // メッシュに入れる（一杯なら代わりのピアを付けて断る）
+            if (!topic->peers[peer].mesh) {
+                if (topic->mesh_count < PUBSUB_MESH_HIGH) {
+                    topic->peers[peer].mesh = true;
+                    topic->mesh_count++;
+                } else {
+                    pubsub_send_prune(node, data, topic, peer);
+                }
+            }
+            break;
+
+        case PUBSUB_PRUNE: {
+            if (topic->peers[peer].mesh) {
+                topic->peers[peer].mesh = false;
+                topic->mesh_count--;
+            }
+            uint32_t count = dht_wire_get_varint(&r);
+            for (uint32_t i = 0; i < count && i < PUBSUB_PX_PEERS; i++) {
+                const uint8_t* p = dht_wire_take(&r, 6);
+                if (!p) {
+                    break;
+                }
+                struct sockaddr_in addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sin_family = AF_INET;
+                memcpy(&addr.sin_addr.s_addr, p, 4);
+                memcpy(&addr.sin_port, p + 4, 2);
+                pubsub_add_topic_peer(node, data, topic, &addr);
+            }
+            break;
+        }
+
+        default:
+            data->stats.dropped++;
+            break;
+    }
+
+    PubsubHandler handler = data->handler;
+    void* handler_arg = data->handler_arg;
+    pthread_mutex_unlock(&data->mutex);
+
+    // アプリケーションへはロックの外で渡す（ハンドラーから公開できるように）
+    if (deliver && handler) {
+        handler(node, name, payload, payload_len, handler_arg);
+    }
+    return 0;
+}
+
+// ---- ハートビート ----
+
+// メッシュの大きさを保ち、メッシュ外のピアへ最近のメッセージのIDを知らせる
+static void pubsub_topic_heartbeat(Node* node, PubsubData* data, PubsubTopic* topic) {
+    int picked[PUBSUB_MAX_PEERS];
+
+    if (topic->mesh_count < PUBSUB_MESH_LOW) {
+        int n = pubsub_pick_peers(data, topic, false, -1, picked, PUBSUB_MESH_DEGREE - topic->mesh_count);
+        for (int i = 0; i < n; i++) {
+            topic->peers[picked[i]].mesh = true;
+            topic->mesh_count++;
+            pubsub_send_graft(node, data, topic, picked[i]);
+        }
+    } else if (topic->mesh_count > PUBSUB_MESH_HIGH) {
+        int n = pubsub_pick_peers(data, topic, true, -1, picked, topic->mesh_count - PUBSUB_MESH_DEGREE);
+        for (int i = 0; i < n; i++) {
+            topic->peers[picked[i]].mesh = false;
+            topic->mesh_count--;
+            pubsub_send_prune(node, data, topic, picked[i]);
+        }
+    }
+
+    // 直近PUBSUB_GOSSIP_WINDOWS回のハートビートの間に受け取ったメッセージ（新しい順、
+    // PUBSUB_MAX_IDSずつ分けて送る）
+    uint64_t ids[PUBSUB_CACHE_SIZE];
+    int id_count = 0;
+    for (int i = 1; i <= PUBSUB_CACHE_SIZE; i++) {
+        const PubsubCacheEntry* cached = &data->cache[(data->cache_next - i + PUBSUB_CACHE_SIZE) % PUBSUB_CACHE_SIZE];
+        if (cached->id == 0 || cached->window + PUBSUB_GOSSIP_WINDOWS <= data->window) {
+            break;
+        }
+        if (cached->topic_id == topic->id) {
+            ids[id_count++] = cached->id;
+        }
+    }
+    if (id_count == 0) {
+        return;
+    }
+    int n = pubsub_pick_peers(data, topic, false, -1, picked, PUBSUB_GOSSIP_PEERS);
+    for (int i = 0; i < n; i++) {
+        for (int first = 0; first < id_count; first += PUBSUB_MAX_IDS) {
+            int chunk = id_count - first < PUBSUB_MAX_IDS ? id_count - first : PUBSUB_MAX_IDS;
+            pubsub_send_ids(node, topic, PUBSUB_IHAVE, &topic->peers[picked[i]].addr, ids + first, chunk);
+            data->stats.ihave_sent++;
+        }
+    }
+}
+
+// ハートビート（PUBSUB_HEARTBEAT_MSごとに呼ぶ）
+void pubsub_heartbeat(Node* node) {
+    PubsubData* data = (PubsubData*)node->pubsub_data;
+    if (!data) {
+        return;
+    }
+    uint64_t now = dht_rpc_now_ms(node);
+
+    pthread_mutex_lock(&data->mutex);
+    for (int i = 0; i < PUBSUB_MAX_TOPICS; i++) {
+        if (data->topics[i]) {
+            pubsub_topic_heartbeat(node, data, data->topics[i]);
+        }
+    }
+    data->window++;
+    if (now - data->seen_rotated_ms >= (uint64_t)PUBSUB_SEEN_TTL * 1000 / 2) {
+        pubsub_seen_rotate(data, now);
+    }
+    pthread_mutex_unlock(&data->mutex);
+}
+
+void pubsub_get_stats(Node* node, PubsubStats* stats) {
+    memset(stats, 0, sizeof(PubsubStats));
+    PubsubData* data = (PubsubData*)node->pubsub_data;
+    if (!data) {
+        return;
+    }
+    pthread_mutex_lock(&data->mutex);
+    *stats = data->stats;
+    for (int i = 0; i < PUBSUB_MAX_TOPICS; i++) {
+        if (data->topics[i]) {
+            stats->topics++;
+            stats->peers += data->topics[i]->peer_count;
+            stats->mesh_peers += data->topics[i]->mesh_count;
+        }
+    }
+    pthread_mutex_unlock(&data->mutex);
+}
@@ -0,0 +1,89 @@
+#ifndef PUBSUB_H
+#define PUBSUB_H
+
+#include "node.h"
+#include "dht.h"
+#include "rendezvous.h"
+
+// トピックのパブリッシュ／サブスクライブ
+//
+// トピックはランデブーキーで表す。購読するとキーに参加し、ランデブーの検索で見つかった
+// 参加者をトピックのピアにする（ピアからGRAFT・PRUNEで教わったノードも加える）。
+//
+// 各ノードはピアの中からランダムに選んだPUBSUB_MESH_DEGREE前後のメッシュを保ち、
+// メッセージはメッシュへすぐに転送する。メッシュ外のピアにはハートビートごとに最近の
+// メッセージのIDだけを知らせ（IHAVE）、受け取った側は持っていないIDをIWANTで取り寄せる。
+// メッシュが切れていたり損失があってもこの修復で届く。受け取ったメッセージのIDは
+// 既読集合に入れ、2回目以降は捨てる。
+//
+// パケット:
+//   "PSB" + バージョン(1) + タイプ(1) + トピックID(8) + 本体
+//   PUBLISH: メッセージID(8) + ホップ数(1) + データ長(varint) + データ
+//   IHAVE・IWANT: 件数(varint) + メッセージID(8)の並び
+//   GRAFT: なし
+//   PRUNE: 件数(varint) + (アドレス(4) + ポート(2))の並び（代わりに使えるピア）
+// トピックIDはキーのDHT IDの先頭8バイト。送信と時刻はDHTのトランスポートを使う。
+#define PUBSUB_VERSION 1
+#define PUBSUB_MAGIC_LEN 3               // "PSB"
+#define PUBSUB_HEADER_LEN (PUBSUB_MAGIC_LEN + 2 + 8)
+#define PUBSUB_MAX_DATA (MAX_BUFFER - 32) // 1つのメッセージのデータの上限
+#define PUBSUB_MAX_TOPICS 16             // 同時に購読できるトピックの数
+#define PUBSUB_MAX_PEERS 64              // トピックごとに覚えるピアの数
+#define PUBSUB_MESH_DEGREE 6             // メッシュの目標の大きさ
+#define PUBSUB_MESH_LOW 4                // これより少なければGRAFTで補う
+#define PUBSUB_MESH_HIGH 12              // これより多ければPRUNEで減らす
+#define PUBSUB_GOSSIP_PEERS 6            // ハートビートごとにIHAVEを送るメッシュ外のピアの数
+#define PUBSUB_GOSSIP_WINDOWS 3          // IHAVEで知らせる直近のハートビートの数
+#define PUBSUB_CACHE_WINDOWS 5           // IWANTに応えるメッセージを残すハートビートの数
+#define PUBSUB_CACHE_SIZE 512            // メッセージキャッシュのエントリ数
+#define PUBSUB_MAX_IDS 64                // 1つのIHAVE・IWANTに載せるIDの数
+#define PUBSUB_PX_PEERS 8                // PRUNEに載せる代わりのピアの数
+#define PUBSUB_MAX_HOPS 32               // これ以上転送されたメッセージは転送しない
+#define PUBSUB_SEEN_MAX 16384            // 既読集合の1世代の表の最大サイズ（2の冪）
+#define PUBSUB_SEEN_TTL 120              // 既読のIDを覚えておく時間（秒、2世代で交代）
+#define PUBSUB_HEARTBEAT_MS 1000
+
+// パブサブメッセージタイプ
+typedef enum {
+    PUBSUB_PUBLISH = 1,
+    PUBSUB_IHAVE,
+    PUBSUB_IWANT,
+    PUBSUB_GRAFT,
+    PUBSUB_PRUNE
+} PubsubMessageType;
+
+// 受け取ったメッセージを渡す関数（受信スレッドから呼ばれる）
+typedef void (*PubsubHandler)(Node* node, const char* topic, const void* data, size_t len, void* arg);
+
+// パブサブの統計
+typedef struct {
+    uint64_t published;          // 自分が公開したメッセージ
+    uint64_t delivered;          // 受け取って渡したメッセージ
+    uint64_t duplicates;         // 既読で捨てたメッセージ
+    uint64_t pushed;             // メッシュへ送ったPUBLISH（転送を含む）
+    uint64_t ihave_sent;
+    uint64_t iwant_sent;
+    uint64_t iwant_served;       // IWANTに応えて送ったPUBLISH
+    uint64_t grafts_sent;
+    uint64_t prunes_sent;
+    uint64_t dropped;            // 購読していないトピック宛てや壊れたパケット
+    int topics;
+    int peers;                   // 全トピックのピアの合計
+    int mesh_peers;              // 全トピックのメッシュの大きさの合計
+} PubsubStats;
+
+// パブサブ関数プロトタイプ
+int pubsub_init(Node* node);
+int pubsub_init_manual(Node* node);
+int pubsub_cleanup(Node* node);
+void pubsub_set_handler(Node* node, PubsubHandler handler, void* arg);
+int pubsub_subscribe(Node* node, const char* topic);
+int pubsub_unsubscribe(Node* node, const char* topic);
+int pubsub_add_peer(Node* node, const char* topic, const struct sockaddr_in* addr);
+int pubsub_publish(Node* node, const char* topic, const void* data, size_t len);
+void pubsub_heartbeat(Node* node);
+bool pubsub_is_packet(const void* buf, size_t len);
+int pubsub_handle_packet(Node* node, const void* buf, size_t len, const struct sockaddr_in* from);
+void pubsub_get_stats(Node* node, PubsubStats* stats);
+
+#endif /* PUBSUB_H */
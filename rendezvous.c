@@ -1,26 +1,326 @@
 #include "rendezvous.h"
 #include "dht.h"
+#include "dht_hash.h"
+#include "dht_batch.h"
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
-// ノードごとのランデブーキー情報（最大10個のキーを管理）
-#define MAX_RENDEZVOUS_KEYS 10
+// ランデブーキーのレジストリ
+//
+// 参加したキーはキー文字列のハッシュで引く線形探索のオープンアドレス表で管理する。
+// 表が持つのはkeys配列の番号だけで、キー文字列はブロック単位のアリーナにインターン
+// する。離脱したキーも登録は残すため表から削除することはなく、キーの数に上限はない。
+#define RENDEZVOUS_EMPTY (-1)
+#define RENDEZVOUS_MIN_INDEX 16      // ハッシュ表の初期サイズ（2の冪）
+#define RENDEZVOUS_STRING_BLOCK 4096 // キー文字列のアリーナのブロックサイズ
+#define RENDEZVOUS_MAX_LISTED 100  // 検索時に表示する参加者の上限
+
+// キー文字列のアリーナのブロック
+typedef struct RendezvousStringBlock {
+    struct RendezvousStringBlock* next;
+    size_t used;
+    char data[RENDEZVOUS_STRING_BLOCK];
+} RendezvousStringBlock;
 
 // ランデブーデータ構造体
 typedef struct {
-    RendezvousKeyInfo keys[MAX_RENDEZVOUS_KEYS];
+    RendezvousKeyInfo* keys;     // 登録したキー（参加中・離脱済み）
     int key_count;
+    int key_cap;
+    int32_t* index;              // ハッシュ表（キー文字列 → keysの番号、-1は空き）
+    uint32_t index_mask;         // ハッシュ表サイズ - 1
+    RendezvousStringBlock* strings;
+    DhtId member_id;             // このノードのメンバーID
+    struct RendezvousSearch* searches;  // 実行中のピア検索
+    time_t next_refresh;         // 参加中のキーで最も早い再アナウンスの時刻
+    uint64_t rng;                // 再アナウンスの時期をずらす乱数
+    pthread_t refresh_thread;
+    bool refresh_running;
     pthread_mutex_t mutex;
 } RendezvousData;
 
+// ピア検索（searchesのリストとフィールドはRendezvousDataのmutexで保護する）
+struct RendezvousSearch {
+    char key[MAX_RENDEZVOUS_KEY_LEN];
+    int target;                  // 目標の応答者数（0なら期限まで待つ）
+    uint64_t started_ms;
+    uint64_t deadline_ms;
+    RendezvousPeer* peers;       // 重複を除いた応答者（応答順）
+    int peer_cap;
+    RendezvousSearchStats stats;
+    bool done;
+    pthread_cond_t cond;         // 完了通知
+    struct RendezvousSearch* next;
+};
+
+// 単調増加する時刻（ミリ秒）
+static uint64_t rendezvous_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// 自分の情報を載せたメッセージを作る
+static void rendezvous_fill_message(Node* node, RendezvousMessage* msg, RendezvousMessageType type,
+                                    const char* key) {
+    memset(msg, 0, sizeof(*msg));
+    msg->type = type;
+    msg->node_id = node->id;
+    strncpy(msg->rendezvous_key, key, MAX_RENDEZVOUS_KEY_LEN - 1);
+    strncpy(msg->ip, node->ip, MAX_IP_STR_LEN - 1);
+    msg->port = ntohs(node->addr.sin_port);
+    
+    if (node->is_behind_nat) {
+        strncpy(msg->public_ip, node->public_ip, MAX_IP_STR_LEN - 1);
+        msg->public_port = node->public_port;
+        msg->is_public = false;
+    } else {
+        strncpy(msg->public_ip, node->ip, MAX_IP_STR_LEN - 1);
+        msg->public_port = ntohs(node->addr.sin_port);
+        msg->is_public = true;
+    }
+    
+    msg->timestamp = (uint32_t)time(NULL);
+}
+
+// DHTに保存する自分の接続情報
+static void rendezvous_announce_value(Node* node, char* value, size_t value_len) {
+    snprintf(value, value_len, "%d,%s,%d,%s,%d,%d", 
+             node->id, node->ip, ntohs(node->addr.sin_port),
+             node->public_ip, node->public_port, node->is_behind_nat ? 1 : 0);
+}
+
+// 次の再アナウンスまでの秒数（リースの1/2から7/10、mutexを保持して呼ぶ）
+static time_t rendezvous_refresh_delay(RendezvousData* data) {
+    data->rng ^= data->rng << 13;
+    data->rng ^= data->rng >> 7;
+    data->rng ^= data->rng << 17;
+    return RENDEZVOUS_LEASE_TTL / 2 + (time_t)(data->rng % (RENDEZVOUS_LEASE_TTL / 5 + 1));
+}
+
 // ランデブーキーをDHT IDに変換
 DhtId rendezvous_key_to_dht_id(const char* key) {
     return dht_generate_id_from_string(key);
 }
 
+// 参加者のメンバーIDの元になる文字列（同じノードの再アナウンスは上書きになる）
+static void rendezvous_member_name(int node_id, char* buf, size_t buf_len) {
+    snprintf(buf, buf_len, "rendezvous-member-%d", node_id);
+}
+
+// アナウンスに使うキーのIDと参加者のメンバーID（2つのハッシュはまとめて計算する）
+static void rendezvous_announce_ids(const char* key, int node_id, DhtId* dht_id, DhtId* member) {
+    char member_str[32];
+    rendezvous_member_name(node_id, member_str, sizeof(member_str));
+    const char* strs[2] = { key, member_str };
+    DhtId ids[2];
+    dht_hash_strings(strs, 2, ids);
+    *dht_id = ids[0];
+    *member = ids[1];
+}
+
+// キー文字列のハッシュ値（8バイトずつ掛け合わせる）
+static uint32_t rendezvous_key_hash(const char* key, size_t len) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, key + i, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+    }
+    if (i < len) {
+        uint64_t w = 0;
+        memcpy(&w, key + i, len - i);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+    }
+    return (uint32_t)(h >> 32);
+}
+
+// キーを探す（mutexを保持して呼ぶ。見つからなければ-1）
+static int rendezvous_find_key(const RendezvousData* data, const char* key, size_t len, uint32_t hash) {
+    uint32_t slot = hash & data->index_mask;
+    while (data->index[slot] != RENDEZVOUS_EMPTY) {
+        const RendezvousKeyInfo* info = &data->keys[data->index[slot]];
+        if (info->hash == hash && strncmp(info->key, key, len) == 0 && info->key[len] == '\0') {
+            return data->index[slot];
+        }
+        slot = (slot + 1) & data->index_mask;
+    }
+    return RENDEZVOUS_EMPTY;
+}
+
+// ハッシュ表を2倍に拡張
+static int rendezvous_grow_index(RendezvousData* data) {
+    uint32_t new_size = (data->index_mask + 1) * 2;
+    int32_t* new_index = (int32_t*)malloc(sizeof(int32_t) * new_size);
+    if (!new_index) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < new_size; i++) {
+        new_index[i] = RENDEZVOUS_EMPTY;
+    }
+    uint32_t new_mask = new_size - 1;
+    for (int i = 0; i < data->key_count; i++) {
+        uint32_t slot = data->keys[i].hash & new_mask;
+        while (new_index[slot] != RENDEZVOUS_EMPTY) {
+            slot = (slot + 1) & new_mask;
+        }
+        new_index[slot] = i;
+    }
+    free(data->index);
+    data->index = new_index;
+    data->index_mask = new_mask;
+    return 0;
+}
+
+// キー文字列をアリーナにコピー
+static const char* rendezvous_intern(RendezvousData* data, const char* key, size_t len) {
+    RendezvousStringBlock* block = data->strings;
+    if (!block || block->used + len + 1 > RENDEZVOUS_STRING_BLOCK) {
+        block = (RendezvousStringBlock*)malloc(sizeof(RendezvousStringBlock));
+        if (!block) {
+            return NULL;
+        }
+        block->next = data->strings;
+        block->used = 0;
+        data->strings = block;
+    }
+    char* interned = block->data + block->used;
+    memcpy(interned, key, len);
+    interned[len] = '\0';
+    block->used += len + 1;
+    return interned;
+}
+
+// キーを登録（mutexを保持して呼ぶ。失敗すれば-1）
+static int rendezvous_add_key(RendezvousData* data, const char* key, size_t len, uint32_t hash) {
+    // 負荷率を1/2以下に保つ
+    if ((uint32_t)(data->key_count + 1) * 2 > data->index_mask + 1 && rendezvous_grow_index(data) < 0) {
+        return RENDEZVOUS_EMPTY;
+    }
+    if (data->key_count == data->key_cap) {
+        int new_cap = data->key_cap ? data->key_cap * 2 : 16;
+        RendezvousKeyInfo* new_keys = (RendezvousKeyInfo*)realloc(data->keys, sizeof(RendezvousKeyInfo) * new_cap);
+        if (!new_keys) {
+            return RENDEZVOUS_EMPTY;
+        }
+        data->keys = new_keys;
+        data->key_cap = new_cap;
+    }
+
+    const char* interned = rendezvous_intern(data, key, len);
+    if (!interned) {
+        return RENDEZVOUS_EMPTY;
+    }
+
+    int idx = data->key_count++;
+    RendezvousKeyInfo* info = &data->keys[idx];
+    memset(info, 0, sizeof(*info));
+    info->key = interned;
+    info->hash = hash;
+    dht_hash_string(interned, &info->dht_id);
+
+    uint32_t slot = hash & data->index_mask;
+    while (data->index[slot] != RENDEZVOUS_EMPTY) {
+        slot = (slot + 1) & data->index_mask;
+    }
+    data->index[slot] = idx;
+    return idx;
+}
+
+// DHTで見つかった参加者を表示
+static bool rendezvous_print_member(const DhtId* member, const void* value, size_t value_len,
+                                    time_t expires_at, void* arg) {
+    (void)member;
+    int* index = (int*)arg;
+    printf("  %d. %.*s (lease %lds)\n", ++(*index), (int)value_len, (const char*)value,
+           (long)(expires_at - time(NULL)));
+    return true;
+}
+
+// 時期が来たリースをまとめて延長する（1秒ごとに呼ぶ）
+void rendezvous_refresh_tick(Node* node) {
+    RendezvousData* data = (RendezvousData*)node->rendezvous_data;
+    if (!data || !node->dht_data) {
+        return;
+    }
+    
+    time_t now = time(NULL);
+    pthread_mutex_lock(&data->mutex);
+    if (data->next_refresh == 0 || now < data->next_refresh) {
+        pthread_mutex_unlock(&data->mutex);
+        return;
+    }
+    
+    // 時期が来たキーと、RENDEZVOUS_REFRESH_WINDOW秒以内に時期が来るキーを集める
+    DhtBatchItem* items = (DhtBatchItem*)malloc(sizeof(DhtBatchItem) * data->key_count);
+    if (!items) {
+        pthread_mutex_unlock(&data->mutex);
+        return;
+    }
+    DhtId member = data->member_id;
+    int count = 0;
+    data->next_refresh = 0;
+    for (int i = 0; i < data->key_count; i++) {
+        RendezvousKeyInfo* info = &data->keys[i];
+        if (!info->active) {
+            continue;
+        }
+        if (info->next_refresh <= now + RENDEZVOUS_REFRESH_WINDOW) {
+            items[count++].key = info->dht_id;
+            info->next_refresh = now + rendezvous_refresh_delay(data);
+        }
+        if (data->next_refresh == 0 || info->next_refresh < data->next_refresh) {
+            data->next_refresh = info->next_refresh;
+        }
+    }
+    pthread_mutex_unlock(&data->mutex);
+    
+    char value[256];
+    rendezvous_announce_value(node, value, sizeof(value));
+    for (int i = 0; i < count; i++) {
+        items[i].member = &member;
+        items[i].value = value;
+        items[i].value_len = strlen(value) + 1;
+        items[i].ttl = RENDEZVOUS_LEASE_TTL;
+    }
+    
+    // 近いキーはルックアップを共有して公開する
+    int stored = 0;
+    DhtBatch* batch = count > 0 ? dht_batch_put(node, items, count) : NULL;
+    if (batch) {
+        DhtBatchResult result;
+        while (dht_batch_next(batch, &result)) {
+            if (result.status == 0) {
+                stored++;
+            }
+        }
+        dht_batch_free(batch);
+    }
+    free(items);
+    
+    if (count > 0) {
+        printf("Node %d refreshed %d rendezvous leases (%d stored)\n", node->id, count, stored);
+    }
+}
+
+// リースを延長するスレッド
+static void* rendezvous_refresh_thread(void* arg) {
+    Node* node = (Node*)arg;
+    RendezvousData* data = (RendezvousData*)node->rendezvous_data;
+    
+    while (data->refresh_running && node->is_running) {
+        rendezvous_refresh_tick(node);
+        sleep(1);
+    }
+    
+    return NULL;
+}
+
 // ランデブー機能の初期化
 int rendezvous_init(Node* node) {
     // ランデブーデータの確保
@@ -32,11 +332,33 @@ int rendezvous_init(Node* node) {
     
     // 初期化
     memset(data, 0, sizeof(RendezvousData));
+    data->index = (int32_t*)malloc(sizeof(int32_t) * RENDEZVOUS_MIN_INDEX);
+    if (!data->index) {
+        perror("Failed to allocate rendezvous key index");
+        free(data);
+        return -1;
+    }
+    for (int i = 0; i < RENDEZVOUS_MIN_INDEX; i++) {
+        data->index[i] = RENDEZVOUS_EMPTY;
+    }
+    data->index_mask = RENDEZVOUS_MIN_INDEX - 1;
+
+    char member_str[32];
+    rendezvous_member_name(node->id, member_str, sizeof(member_str));
+    dht_hash_string(member_str, &data->member_id);
+    data->rng = ((uint64_t)time(NULL) << 20) ^ ((uint64_t)node->id * 0x9E3779B97F4A7C15ULL) ^ 1;
     pthread_mutex_init(&data->mutex, NULL);
     
     // ノードのユーザーデータとして保存
     node->rendezvous_data = data;
     
+    // リースを延長するスレッドを開始
+    data->refresh_running = true;
+    if (pthread_create(&data->refresh_thread, NULL, rendezvous_refresh_thread, node) != 0) {
+        perror("Failed to create rendezvous refresh thread");
+        data->refresh_running = false;
+    }
+    
     printf("Rendezvous service initialized for node %d\n", node->id);
     return 0;
 }
@@ -49,17 +371,20 @@ int rendezvous_cleanup(Node* node) {
     
     RendezvousData* data = (RendezvousData*)node->rendezvous_data;
     
-    // 全てのアクティブなランデブーキーから離脱
-    pthread_mutex_lock(&data->mutex);
-    for (int i = 0; i < data->key_count; i++) {
-        if (data->keys[i].active) {
-            // DHT上のランデブーポイントから離脱する処理
-            // （実際の実装では、DHT上のデータを削除するなどの処理が必要）
-        }
+    // リースの延長を停止（DHT上の参加者の記録はリースの期限で消える）
+    if (data->refresh_running) {
+        data->refresh_running = false;
+        pthread_join(data->refresh_thread, NULL);
     }
-    pthread_mutex_unlock(&data->mutex);
     
     // リソースの解放
+    while (data->strings) {
+        RendezvousStringBlock* next = data->strings->next;
+        free(data->strings);
+        data->strings = next;
+    }
+    free(data->keys);
+    free(data->index);
     pthread_mutex_destroy(&data->mutex);
     free(data);
     node->rendezvous_data = NULL;
@@ -74,65 +399,54 @@ int rendezvous_join(Node* node, const char* key) {
         return -1;
     }
     
+    // メッセージで運べる長さに限る
+    size_t len = strlen(key);
+    if (len >= MAX_RENDEZVOUS_KEY_LEN) {
+        printf("Node %d failed to join rendezvous key: key too long\n", node->id);
+        return -1;
+    }
+    
     RendezvousData* data = (RendezvousData*)node->rendezvous_data;
+    uint32_t hash = rendezvous_key_hash(key, len);
     
     pthread_mutex_lock(&data->mutex);
     
-    // 既に参加しているか確認
-    for (int i = 0; i < data->key_count; i++) {
-        if (strcmp(data->keys[i].key, key) == 0) {
-            // 既に参加している場合は更新
-            data->keys[i].last_used = time(NULL);
-            data->keys[i].active = true;
+    int idx = rendezvous_find_key(data, key, len, hash);
+    bool updated = idx != RENDEZVOUS_EMPTY;
+    if (!updated) {
+        // 新しいキーを追加
+        idx = rendezvous_add_key(data, key, len, hash);
+        if (idx == RENDEZVOUS_EMPTY) {
             pthread_mutex_unlock(&data->mutex);
-            
-            printf("Node %d updated rendezvous key: %s\n", node->id, key);
-            
-            // DHT上にアナウンス
-            DhtId dht_id = rendezvous_key_to_dht_id(key);
-            
-            // ノード情報をDHTに保存
-            char value[256];
-            snprintf(value, sizeof(value), "%d,%s,%d,%s,%d,%d", 
-                     node->id, node->ip, ntohs(node->addr.sin_port),
-                     node->public_ip, node->public_port, node->is_behind_nat ? 1 : 0);
-            
-            dht_store_value(node, &dht_id, value, strlen(value) + 1);
-            
-            return 0;
+            printf("Node %d failed to join rendezvous key: out of memory\n", node->id);
+            return -1;
         }
     }
     
-    // 新しいキーを追加
-    if (data->key_count < MAX_RENDEZVOUS_KEYS) {
-        strncpy(data->keys[data->key_count].key, key, MAX_RENDEZVOUS_KEY_LEN - 1);
-        data->keys[data->key_count].key[MAX_RENDEZVOUS_KEY_LEN - 1] = '\0';
-        data->keys[data->key_count].last_used = time(NULL);
-        data->keys[data->key_count].active = true;
-        data->key_count++;
-        
-        pthread_mutex_unlock(&data->mutex);
-        
-        printf("Node %d joined rendezvous key: %s\n", node->id, key);
-        
-        // DHT上にアナウンス
-        DhtId dht_id = rendezvous_key_to_dht_id(key);
-        
-        // ノード情報をDHTに保存
-        char value[256];
-        snprintf(value, sizeof(value), "%d,%s,%d,%s,%d,%d", 
-                 node->id, node->ip, ntohs(node->addr.sin_port),
-                 node->public_ip, node->public_port, node->is_behind_nat ? 1 : 0);
-        
-        dht_store_value(node, &dht_id, value, strlen(value) + 1);
-        
-        return 0;
+    RendezvousKeyInfo* info = &data->keys[idx];
+    info->last_used = time(NULL);
+    info->active = true;
+    info->next_refresh = info->last_used + rendezvous_refresh_delay(data);
+    if (data->next_refresh == 0 || info->next_refresh < data->next_refresh) {
+        data->next_refresh = info->next_refresh;
     }
+    DhtId dht_id = info->dht_id;
+    DhtId member = data->member_id;
     
-    // キーの上限に達した場合
     pthread_mutex_unlock(&data->mutex);
-    printf("Node %d failed to join rendezvous key: too many keys\n", node->id);
-    return -1;
+    
+    if (updated) {
+        printf("Node %d updated rendezvous key: %s\n", node->id, key);
+    } else {
+        printf("Node %d joined rendezvous key: %s\n", node->id, key);
+    }
+    
+    // ノード情報をリース付きでDHT上にアナウンス
+    char value[256];
+    rendezvous_announce_value(node, value, sizeof(value));
+    dht_store_value_member(node, &dht_id, &member, value, strlen(value) + 1, RENDEZVOUS_LEASE_TTL);
+    
+    return 0;
 }
 
 // ランデブーキーから離脱
@@ -142,22 +456,29 @@ int rendezvous_leave(Node* node, const char* key) {
     }
     
     RendezvousData* data = (RendezvousData*)node->rendezvous_data;
+    size_t len = strlen(key);
+    uint32_t hash = rendezvous_key_hash(key, len);
     
     pthread_mutex_lock(&data->mutex);
     
     // キーを探す
-    for (int i = 0; i < data->key_count; i++) {
-        if (strcmp(data->keys[i].key, key) == 0) {
-            // キーを非アクティブにする
-            data->keys[i].active = false;
-            pthread_mutex_unlock(&data->mutex);
-            
-            printf("Node %d left rendezvous key: %s\n", node->id, key);
-            
-            // DHT上から削除（実際の実装では、DHT上のデータを削除する処理が必要）
-            
-            return 0;
+    int idx = rendezvous_find_key(data, key, len, hash);
+    if (idx != RENDEZVOUS_EMPTY) {
+        // キーを非アクティブにする（登録は残す）
+        bool was_active = data->keys[idx].active;
+        data->keys[idx].active = false;
+        DhtId dht_id = data->keys[idx].dht_id;
+        DhtId member = data->member_id;
+        pthread_mutex_unlock(&data->mutex);
+        
+        printf("Node %d left rendezvous key: %s\n", node->id, key);
+        
+        // DHT上の参加者の記録を取り下げる
+        if (was_active && node->dht_data) {
+            dht_withdraw_value_member(node, &dht_id, &member);
         }
+        
+        return 0;
     }
     
     // キーが見つからない場合
@@ -166,51 +487,219 @@ int rendezvous_leave(Node* node, const char* key) {
     return -1;
 }
 
-// ランデブーキーに参加しているピアを検索
-int rendezvous_find_peers(Node* node, const char* key) {
-    if (!node->rendezvous_data || !key || strlen(key) == 0) {
-        return -1;
+// 検索の完了判定（mutexを保持して呼ぶ）
+static void search_step(RendezvousSearch* search, uint64_t now) {
+    if (search->done) {
+        return;
+    }
+    if (search->target > 0 && search->stats.peers >= search->target) {
+        search->stats.target_reached = true;
+    } else if (now < search->deadline_ms) {
+        return;
+    }
+    search->done = true;
+    search->stats.elapsed_ms = (uint32_t)(now - search->started_ms);
+    pthread_cond_broadcast(&search->cond);
+}
+
+// 検索に応答を加える（mutexを保持して呼ぶ。完了した検索への応答は数えない）
+static void search_record(RendezvousSearch* search, const RendezvousMessage* msg, uint64_t now) {
+    if (search->done) {
+        return;
     }
     
-    printf("Node %d searching for peers with rendezvous key: %s\n", node->id, key);
+    uint32_t latency = (uint32_t)(now - search->started_ms);
+    if (search->stats.responses++ == 0) {
+        search->stats.first_response_ms = latency;
+    }
+    for (int i = 0; i < search->stats.peers; i++) {
+        if (search->peers[i].info.id == msg->node_id) {
+            search->stats.duplicates++;
+            return;
+        }
+    }
     
-    // DHT上でキーを検索
-    DhtId dht_id = rendezvous_key_to_dht_id(key);
+    if (search->stats.peers == search->peer_cap) {
+        int new_cap = search->peer_cap ? search->peer_cap * 2 : RENDEZVOUS_SEARCH_FANOUT;
+        RendezvousPeer* new_peers = (RendezvousPeer*)realloc(search->peers, sizeof(RendezvousPeer) * new_cap);
+        if (!new_peers) {
+            return;
+        }
+        search->peers = new_peers;
+        search->peer_cap = new_cap;
+    }
     
-    // DHT上のノードを検索
-    DhtNodeInfo results[10];
-    int count = dht_find_node(node, &dht_id, results, 10);
+    RendezvousPeer* peer = &search->peers[search->stats.peers++];
+    memset(peer, 0, sizeof(*peer));
+    peer->info.id = msg->node_id;
+    strncpy(peer->info.ip, msg->ip, MAX_IP_STR_LEN - 1);
+    peer->info.port = msg->port;
+    peer->info.is_public = msg->is_public;
+    if (!msg->is_public) {
+        strncpy(peer->info.public_ip, msg->public_ip, MAX_IP_STR_LEN - 1);
+        peer->info.public_port = msg->public_port;
+    }
+    peer->latency_ms = latency;
     
-    printf("Found %d DHT nodes closest to rendezvous key\n", count);
+    search_step(search, now);
+}
+
+// ピア検索を開始（結果はrendezvous_search_finishで受け取る）
+RendezvousSearch* rendezvous_search_start(Node* node, const char* key, int target_peers, int timeout_ms) {
+    if (!node->rendezvous_data || !key || strlen(key) == 0 || strlen(key) >= MAX_RENDEZVOUS_KEY_LEN) {
+        return NULL;
+    }
     
-    // 各ノードに問い合わせ
+    RendezvousData* data = (RendezvousData*)node->rendezvous_data;
+    RendezvousSearch* search = (RendezvousSearch*)calloc(1, sizeof(RendezvousSearch));
+    if (!search) {
+        perror("Failed to allocate rendezvous search");
+        return NULL;
+    }
+    
+    strncpy(search->key, key, MAX_RENDEZVOUS_KEY_LEN - 1);
+    search->target = target_peers > 0 ? target_peers : 0;
+    search->started_ms = rendezvous_now_ms();
+    search->deadline_ms = search->started_ms +
+                          (timeout_ms > 0 ? timeout_ms : RENDEZVOUS_SEARCH_DEFAULT_TIMEOUT_MS);
+    pthread_cond_init(&search->cond, NULL);
+    
+    // 応答を取りこぼさないよう、問い合わせる前に登録する
+    pthread_mutex_lock(&data->mutex);
+    search->next = data->searches;
+    data->searches = search;
+    pthread_mutex_unlock(&data->mutex);
+    
+    DhtId dht_id = rendezvous_key_to_dht_id(key);
+    DhtNodeInfo results[RENDEZVOUS_SEARCH_FANOUT];
+    int count = dht_find_node(node, &dht_id, results, RENDEZVOUS_SEARCH_FANOUT);
+    
+    // メッセージは送り先によらないので1回だけ作る
+    RendezvousMessage msg;
+    rendezvous_fill_message(node, &msg, RENDEZVOUS_QUERY, key);
+    int queried = 0;
     for (int i = 0; i < count; i++) {
-        // ランデブーメッセージを作成
-        RendezvousMessage msg;
-        memset(&msg, 0, sizeof(msg));
-        
-        msg.type = RENDEZVOUS_QUERY;
-        msg.node_id = node->id;
-        strncpy(msg.rendezvous_key, key, MAX_RENDEZVOUS_KEY_LEN - 1);
-        strncpy(msg.ip, node->ip, MAX_IP_STR_LEN - 1);
-        msg.port = ntohs(node->addr.sin_port);
-        
-        if (node->is_behind_nat) {
-            strncpy(msg.public_ip, node->public_ip, MAX_IP_STR_LEN - 1);
-            msg.public_port = node->public_port;
-            msg.is_public = false;
-        } else {
-            strncpy(msg.public_ip, node->ip, MAX_IP_STR_LEN - 1);
-            msg.public_port = ntohs(node->addr.sin_port);
-            msg.is_public = true;
+        if (rendezvous_send_message(node, &msg, results[i].ip, results[i].port) == 0) {
+            queried++;
         }
+    }
+    
+    pthread_mutex_lock(&data->mutex);
+    search->stats.queried = queried;
+    pthread_mutex_unlock(&data->mutex);
+    
+    return search;
+}
+
+// 検索が完了したか（期限の処理も行う）
+bool rendezvous_search_is_done(Node* node, RendezvousSearch* search) {
+    RendezvousData* data = (RendezvousData*)node->rendezvous_data;
+    
+    pthread_mutex_lock(&data->mutex);
+    search_step(search, rendezvous_now_ms());
+    bool done = search->done;
+    pthread_mutex_unlock(&data->mutex);
+    
+    return done;
+}
+
+// 検索の完了を待つ
+void rendezvous_search_wait(Node* node, RendezvousSearch* search) {
+    RendezvousData* data = (RendezvousData*)node->rendezvous_data;
+    
+    pthread_mutex_lock(&data->mutex);
+    while (!search->done) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 20 * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&search->cond, &data->mutex, &ts);
+        search_step(search, rendezvous_now_ms());
+    }
+    pthread_mutex_unlock(&data->mutex);
+}
+
+// 検索を終了し、応答者をピアリストに加えてまとめてCONNECTを送る。見つかったピアの数を返す
+// （peersがNULLでなければ最大max_peers個を応答順に書く）
+int rendezvous_search_finish(Node* node, RendezvousSearch* search, RendezvousPeer* peers, int max_peers,
+                             RendezvousSearchStats* stats) {
+    RendezvousData* data = (RendezvousData*)node->rendezvous_data;
+    
+    pthread_mutex_lock(&data->mutex);
+    search_step(search, rendezvous_now_ms());
+    if (!search->done) {
+        // 待たずに終了した場合もここまでの結果を使う
+        search->done = true;
+        search->stats.elapsed_ms = (uint32_t)(rendezvous_now_ms() - search->started_ms);
+    }
+    for (RendezvousSearch** p = &data->searches; *p; p = &(*p)->next) {
+        if (*p == search) {
+            *p = search->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&data->mutex);
+    
+    // 接続の準備（CONNECTのメッセージは送り先によらないので1回だけ作る）
+    RendezvousMessage connect_msg;
+    rendezvous_fill_message(node, &connect_msg, RENDEZVOUS_CONNECT, search->key);
+    for (int i = 0; i < search->stats.peers; i++) {
+        NodeInfo* info = &search->peers[i].info;
+        add_peer_info(node, info);
         
-        msg.timestamp = (uint32_t)time(NULL);
-        
-        // メッセージを送信
-        rendezvous_send_message(node, &msg, results[i].ip, results[i].port);
+        const char* target_ip = info->is_public ? info->ip : info->public_ip;
+        int target_port = info->is_public ? info->port : info->public_port;
+        if (rendezvous_send_message(node, &connect_msg, target_ip, target_port) == 0) {
+            search->stats.connects++;
+        }
+    }
+    
+    int count = search->stats.peers;
+    for (int i = 0; peers && i < count && i < max_peers; i++) {
+        peers[i] = search->peers[i];
+    }
+    if (stats) {
+        *stats = search->stats;
+    }
+    
+    pthread_cond_destroy(&search->cond);
+    free(search->peers);
+    free(search);
+    return count;
+}
+
+// ランデブーキーに参加しているピアを検索（見つかったピアの数を返す）
+int rendezvous_find_peers(Node* node, const char* key) {
+    if (!node->rendezvous_data || !key || strlen(key) == 0) {
+        return -1;
     }
     
+    printf("Node %d searching for peers with rendezvous key: %s\n", node->id, key);
+    
+    // DHTに保存されている参加者
+    DhtId dht_id = rendezvous_key_to_dht_id(key);
+    int member_index = 0;
+    dht_get_values(node, &dht_id, rendezvous_print_member, &member_index, RENDEZVOUS_MAX_LISTED);
+    printf("Found %d announced participants for rendezvous key\n", member_index);
+    
+    // キーに近いノードに問い合わせ、応答した参加者に接続する
+    RendezvousSearch* search = rendezvous_search_start(node, key, RENDEZVOUS_SEARCH_DEFAULT_TARGET,
+                                                       RENDEZVOUS_SEARCH_DEFAULT_TIMEOUT_MS);
+    if (!search) {
+        return -1;
+    }
+    rendezvous_search_wait(node, search);
+    
+    RendezvousSearchStats stats;
+    int count = rendezvous_search_finish(node, search, NULL, 0, &stats);
+    printf("Rendezvous search: %d peers from %d responses (%d duplicates) of %d queried nodes "
+           "in %u ms (first response %u ms%s), %d connects\n",
+           stats.peers, stats.responses, stats.duplicates, stats.queried, stats.elapsed_ms,
+           stats.first_response_ms, stats.target_reached ? ", target reached" : "", stats.connects);
+    
     return count;
 }
 
@@ -230,14 +719,18 @@ int rendezvous_process_message(Node* node, RendezvousMessage* msg, struct sockad
             
             // DHT上に保存
             {
-                DhtId dht_id = rendezvous_key_to_dht_id(msg->rendezvous_key);
+                DhtId dht_id, member;
+                rendezvous_announce_ids(msg->rendezvous_key, msg->node_id, &dht_id, &member);
                 
                 char value[256];
                 snprintf(value, sizeof(value), "%d,%s,%d,%s,%d,%d", 
                          msg->node_id, msg->ip, msg->port,
                          msg->public_ip, msg->public_port, msg->is_public ? 0 : 1);
                 
-                dht_store_value(node, &dht_id, value, strlen(value) + 1);
+                // 参加者ごとに別のメンバーとして保存し、他の参加者を上書きしない
+                // （自分の公開にはせず、送信元が再アナウンスしなければリースの期限で消える）
+                dht_store_replica(node, &dht_id, &member, value, strlen(value) + 1,
+                                  time(NULL) + RENDEZVOUS_LEASE_TTL);
             }
             break;
             
@@ -246,39 +739,21 @@ int rendezvous_process_message(Node* node, RendezvousMessage* msg, struct sockad
             printf("Node %d received rendezvous query from node %d for key %s\n", 
                    node->id, msg->node_id, msg->rendezvous_key);
             
-            // 自分がこのキーに参加しているか確認
-            pthread_mutex_lock(&data->mutex);
+            // 自分がこのキーに参加しているか確認（終端のないキーは参加しているはずがない）
             bool participating = false;
-            for (int i = 0; i < data->key_count; i++) {
-                if (strcmp(data->keys[i].key, msg->rendezvous_key) == 0 && data->keys[i].active) {
-                    participating = true;
-                    break;
-                }
+            size_t key_len = strnlen(msg->rendezvous_key, MAX_RENDEZVOUS_KEY_LEN);
+            if (key_len < MAX_RENDEZVOUS_KEY_LEN) {
+                uint32_t hash = rendezvous_key_hash(msg->rendezvous_key, key_len);
+                pthread_mutex_lock(&data->mutex);
+                int idx = rendezvous_find_key(data, msg->rendezvous_key, key_len, hash);
+                participating = idx != RENDEZVOUS_EMPTY && data->keys[idx].active;
+                pthread_mutex_unlock(&data->mutex);
             }
-            pthread_mutex_unlock(&data->mutex);
             
             if (participating) {
                 // 応答を送信
                 RendezvousMessage response;
-                memset(&response, 0, sizeof(response));
-                
-                response.type = RENDEZVOUS_RESPONSE;
-                response.node_id = node->id;
-                strncpy(response.rendezvous_key, msg->rendezvous_key, MAX_RENDEZVOUS_KEY_LEN - 1);
-                strncpy(response.ip, node->ip, MAX_IP_STR_LEN - 1);
-                response.port = ntohs(node->addr.sin_port);
-                
-                if (node->is_behind_nat) {
-                    strncpy(response.public_ip, node->public_ip, MAX_IP_STR_LEN - 1);
-                    response.public_port = node->public_port;
-                    response.is_public = false;
-                } else {
-                    strncpy(response.public_ip, node->ip, MAX_IP_STR_LEN - 1);
-                    response.public_port = ntohs(node->addr.sin_port);
-                    response.is_public = true;
-                }
-                
-                response.timestamp = (uint32_t)time(NULL);
+                rendezvous_fill_message(node, &response, RENDEZVOUS_RESPONSE, msg->rendezvous_key);
                 
                 // 送信元に応答
                 const char* target_ip = msg->is_public ? msg->ip : msg->public_ip;
@@ -293,50 +768,27 @@ int rendezvous_process_message(Node* node, RendezvousMessage* msg, struct sockad
             printf("Node %d received rendezvous response from node %d for key %s\n", 
                    node->id, msg->node_id, msg->rendezvous_key);
             
-            // ピア情報を追加
+            // 同じキーの検索に加える（接続は検索の終了時にまとめて行う）
             {
-                NodeInfo peer_info;
-                memset(&peer_info, 0, sizeof(peer_info));
-                
-                peer_info.id = msg->node_id;
-                strncpy(peer_info.ip, msg->ip, MAX_IP_STR_LEN - 1);
-                peer_info.port = msg->port;
-                
-                if (!msg->is_public) {
-                    strncpy(peer_info.public_ip, msg->public_ip, MAX_IP_STR_LEN - 1);
-                    peer_info.public_port = msg->public_port;
+                size_t key_len = strnlen(msg->rendezvous_key, MAX_RENDEZVOUS_KEY_LEN);
+                if (key_len == MAX_RENDEZVOUS_KEY_LEN || msg->node_id == node->id) {
+                    break;
                 }
                 
-                // ピアリストに追加
-                add_peer_info(node, &peer_info);
-                
-                // 接続要求を送信
-                RendezvousMessage connect_msg;
-                memset(&connect_msg, 0, sizeof(connect_msg));
-                
-                connect_msg.type = RENDEZVOUS_CONNECT;
-                connect_msg.node_id = node->id;
-                strncpy(connect_msg.rendezvous_key, msg->rendezvous_key, MAX_RENDEZVOUS_KEY_LEN - 1);
-                strncpy(connect_msg.ip, node->ip, MAX_IP_STR_LEN - 1);
-                connect_msg.port = ntohs(node->addr.sin_port);
-                
-                if (node->is_behind_nat) {
-                    strncpy(connect_msg.public_ip, node->public_ip, MAX_IP_STR_LEN - 1);
-                    connect_msg.public_port = node->public_port;
-                    connect_msg.is_public = false;
-                } else {
-                    strncpy(connect_msg.public_ip, node->ip, MAX_IP_STR_LEN - 1);
-                    connect_msg.public_port = ntohs(node->addr.sin_port);
-                    connect_msg.is_public = true;
+                uint64_t now = rendezvous_now_ms();
+                int matched = 0;
+                pthread_mutex_lock(&data->mutex);
+                for (RendezvousSearch* search = data->searches; search; search = search->next) {
+                    if (strcmp(search->key, msg->rendezvous_key) == 0) {
+                        search_record(search, msg, now);
+                        matched++;
+                    }
                 }
+                pthread_mutex_unlock(&data->mutex);
                 
-                connect_msg.timestamp = (uint32_t)time(NULL);
-                
-                // 送信
-                const char* target_ip = msg->is_public ? msg->ip : msg->public_ip;
-                int target_port = msg->is_public ? msg->port : msg->public_port;
-                
-                rendezvous_send_message(node, &connect_msg, target_ip, target_port);
+                if (matched == 0) {
+                    printf("Node %d ignored rendezvous response: no search in progress\n", node->id);
+                }
             }
             break;
             
@@ -376,6 +828,16 @@ int rendezvous_process_message(Node* node, RendezvousMessage* msg, struct sockad
     return 0;
 }
 
+// ランデブーメッセージか（ノード間メッセージとは長さで見分ける）
+bool rendezvous_is_message(const void* buf, size_t len) {
+    if (len != sizeof(RendezvousMessage)) {
+        return false;
+    }
+    RendezvousMessageType type;
+    memcpy(&type, buf, sizeof(type));
+    return type >= RENDEZVOUS_ANNOUNCE && type <= RENDEZVOUS_CONNECT;
+}
+
 // ランデブーメッセージの送信
 int rendezvous_send_message(Node* node, RendezvousMessage* msg, const char* target_ip, int target_port) {
     if (!node || !msg || !target_ip) {
@@ -7,6 +7,16 @@
 // ランデブーキーの最大長
 #define MAX_RENDEZVOUS_KEY_LEN 64
 
+// 参加のリース
+//
+// 参加者の記録はRENDEZVOUS_LEASE_TTL秒のリースでDHTに保存し、期限より前に再アナウンス
+// して延長する。再アナウンスの時期はキーごとにリースの1/2から7/10の間でずらし
+// （DHTの再公開はリースの3/4なので、リースが続く限りそちらは動かない）、どれかのキーの
+// 時期が来たらRENDEZVOUS_REFRESH_WINDOW秒以内に時期が来るキーもまとめて1回のバッチで
+// 公開する。離脱したキーは有効期間0のSTOREで取り下げる。
+#define RENDEZVOUS_LEASE_TTL 300         // 参加者の記録の有効期間（秒）
+#define RENDEZVOUS_REFRESH_WINDOW 60     // 一緒に再アナウンスするキーの時期の幅（秒）
+
 // ランデブーメッセージタイプ
 typedef enum {
     RENDEZVOUS_ANNOUNCE = 1,  // ランデブーポイントへの参加通知
@@ -30,19 +40,59 @@ typedef struct {
 
 // ランデブーキーの情報
 typedef struct {
-    char key[MAX_RENDEZVOUS_KEY_LEN];
+    const char* key;             // インターンしたキー文字列（クリーンアップまで有効）
+    uint32_t hash;               // キー文字列のハッシュ値（レジストリの索引）
+    DhtId dht_id;                // キーのDHT ID
     time_t last_used;
-    bool active;
+    time_t next_refresh;         // 次に再アナウンスする時刻
+    bool active;                 // 離脱したキーも登録は残し、再参加ではそのまま使う
 } RendezvousKeyInfo;
 
+// 非同期のピア検索
+//
+// キーのDHT IDに近いノードへRENDEZVOUS_QUERYを送り、RENDEZVOUS_RESPONSEを集める。
+// 同じノードからの応答は1つにまとめ、目標数の応答者が揃うか期限に達した時点で完了する。
+// 応答者への接続（ピアリストへの追加とCONNECT）は応答ごとではなく、
+// rendezvous_search_finishでまとめて行う。
+#define RENDEZVOUS_SEARCH_FANOUT 10              // 問い合わせるノード数
+#define RENDEZVOUS_SEARCH_DEFAULT_TARGET 8       // rendezvous_find_peersの目標数
+#define RENDEZVOUS_SEARCH_DEFAULT_TIMEOUT_MS 2000
+
+// 検索で見つかったピア
+typedef struct {
+    NodeInfo info;
+    uint32_t latency_ms;         // 検索開始から最初の応答までの時間
+} RendezvousPeer;
+
+// 検索の統計
+typedef struct {
+    int queried;                 // RENDEZVOUS_QUERYを送ったノード数
+    int responses;               // 受け取った応答（重複を含む）
+    int duplicates;              // 既に応答したノードからの応答
+    int peers;                   // 重複を除いた応答者
+    int connects;                // まとめて送ったCONNECT
+    uint32_t first_response_ms;  // 最初の応答までの時間（応答がなければ0）
+    uint32_t elapsed_ms;         // 検索開始から完了までの時間
+    bool target_reached;         // 目標数に達して打ち切った
+} RendezvousSearchStats;
+
+typedef struct RendezvousSearch RendezvousSearch;
+
 // ランデブー関数プロトタイプ
 int rendezvous_init(Node* node);
 int rendezvous_cleanup(Node* node);
 int rendezvous_join(Node* node, const char* key);
 int rendezvous_leave(Node* node, const char* key);
 int rendezvous_find_peers(Node* node, const char* key);
+void rendezvous_refresh_tick(Node* node);
 int rendezvous_process_message(Node* node, RendezvousMessage* msg, struct sockaddr_in* sender_addr);
 int rendezvous_send_message(Node* node, RendezvousMessage* msg, const char* target_ip, int target_port);
+bool rendezvous_is_message(const void* buf, size_t len);
+RendezvousSearch* rendezvous_search_start(Node* node, const char* key, int target_peers, int timeout_ms);
+bool rendezvous_search_is_done(Node* node, RendezvousSearch* search);
+void rendezvous_search_wait(Node* node, RendezvousSearch* search);
+int rendezvous_search_finish(Node* node, RendezvousSearch* search, RendezvousPeer* peers, int max_peers,
+                             RendezvousSearchStats* stats);
 
 // ユーティリティ関数
 DhtId rendezvous_key_to_dht_id(const char* key);
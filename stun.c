@@ -1,73 +1,193 @@
 #include "stun.h"
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <openssl/rand.h>
+
+// A server queried by a discovery
+typedef struct {
+    struct sockaddr_in addr;
+    char name[64];
+    uint8_t transaction_id[12];  // Reused by the retransmissions
+    bool failed;                 // Answered with an error response
+} StunServerState;
+
+// A callback waiting for a discovery
+typedef struct StunWaiterEntry {
+    StunCallback callback;
+    void* arg;
+    struct StunWaiterEntry* next;
+} StunWaiterEntry;
+
+// Cached or pending mapping of one local socket
+typedef struct {
+    bool active;
+    int socket_fd;
+    uint16_t local_port;         // Tells a reused descriptor apart
+    bool pending;
+    StunServerState servers[STUN_MAX_SERVERS];
+    int server_count;
+    int sends;
+    int rto_ms;
+    uint64_t started_us;
+    uint64_t next_send_us;
+    uint64_t deadline_us;
+    StunWaiterEntry* waiters;
+    bool has_result;
+    StunResult result;
+    time_t expires;
+} StunQuery;
+
+// Resolved server name
+typedef struct {
+    char name[128];
+    struct sockaddr_in addr;
+    bool ok;
+    time_t resolved_at;          // Failures are retried after STUN_RESOLVE_RETRY seconds
+} StunResolved;
+
+// A finished discovery whose waiters are called after the lock is released
+typedef struct {
+    int socket_fd;
+    bool ok;
+    StunResult result;
+    StunWaiterEntry* waiters;
+} StunCompletion;
+
+#define STUN_RESOLVED_MAX 16
+#define STUN_RESOLVE_RETRY 30
 
 static int stun_socket = -1;
+static pthread_mutex_t stun_mutex = PTHREAD_MUTEX_INITIALIZER;
+static StunQuery stun_queries[STUN_MAX_QUERIES];
+static StunResolved stun_resolved[STUN_RESOLVED_MAX];
+static int stun_resolved_count = 0;
+static pthread_t stun_thread;
+static bool stun_running = false;
+
+static void* stun_thread_main(void* arg);
+
+static uint64_t stun_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-// Initialize STUN client
+// Initialize STUN client (safe to call more than once)
 int stun_init() {
+    pthread_mutex_lock(&stun_mutex);
+    if (stun_running) {
+        pthread_mutex_unlock(&stun_mutex);
+        return 0;
+    }
+    
     stun_socket = socket(AF_INET, SOCK_DGRAM, 0);
     if (stun_socket < 0) {
         perror("Failed to create STUN socket");
+        pthread_mutex_unlock(&stun_mutex);
         return -1;
     }
     
-    // Set socket timeout
-    struct timeval tv;
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
-    if (setsockopt(stun_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        perror("Failed to set socket timeout");
+    // The STUN thread reads the client's own socket and drives the retransmissions
+    stun_running = true;
+    if (pthread_create(&stun_thread, NULL, stun_thread_main, NULL) != 0) {
+        perror("Failed to create STUN thread");
+        stun_running = false;
         close(stun_socket);
         stun_socket = -1;
+        pthread_mutex_unlock(&stun_mutex);
         return -1;
     }
     
+    pthread_mutex_unlock(&stun_mutex);
     return 0;
 }
 
+// Call the waiters of finished discoveries (without the lock)
+static void stun_run_completions(StunCompletion* completions, int count) {
+    for (int i = 0; i < count; i++) {
+        StunWaiterEntry* waiter = completions[i].waiters;
+        while (waiter) {
+            StunWaiterEntry* next = waiter->next;
+            if (waiter->callback) {
+                waiter->callback(completions[i].socket_fd, completions[i].ok ? &completions[i].result : NULL,
+                                 waiter->arg);
+            }
+            free(waiter);
+            waiter = next;
+        }
+    }
+}
+
+// Finish a discovery (called with the lock held)
+static void stun_complete(StunQuery* query, const StunResult* result, StunCompletion* completion) {
+    completion->socket_fd = query->socket_fd;
+    completion->ok = result != NULL;
+    completion->waiters = query->waiters;
+    if (result) {
+        completion->result = *result;
+        query->result = *result;
+        query->has_result = true;
+        query->expires = time(NULL) + STUN_CACHE_TTL;
+    } else {
+        query->has_result = false;
+    }
+    query->waiters = NULL;
+    query->pending = false;
+}
+
 // Clean up STUN client
 void stun_cleanup() {
-    if (stun_socket >= 0) {
-        close(stun_socket);
-        stun_socket = -1;
+    pthread_mutex_lock(&stun_mutex);
+    if (!stun_running) {
+        pthread_mutex_unlock(&stun_mutex);
+        return;
+    }
+    stun_running = false;
+    pthread_mutex_unlock(&stun_mutex);
+    pthread_join(stun_thread, NULL);
+    
+    // Fail the discoveries still in flight and drop the cache
+    StunCompletion completions[STUN_MAX_QUERIES];
+    int count = 0;
+    pthread_mutex_lock(&stun_mutex);
+    for (int i = 0; i < STUN_MAX_QUERIES; i++) {
+        if (stun_queries[i].active && stun_queries[i].pending) {
+            stun_complete(&stun_queries[i], NULL, &completions[count++]);
+        }
+        stun_queries[i].active = false;
     }
+    close(stun_socket);
+    stun_socket = -1;
+    pthread_mutex_unlock(&stun_mutex);
+    stun_run_completions(completions, count);
 }
 
 // Create a STUN binding request
-static void create_stun_request(uint8_t* request, size_t* request_size) {
+static void create_stun_request(uint8_t* request, size_t* request_size, const uint8_t* transaction_id) {
     StunHeader* header = (StunHeader*)request;
     
     // Fill header
     header->message_type = htons(STUN_BINDING_REQUEST);
     header->message_length = htons(0); // No attributes
     header->magic_cookie = htonl(STUN_MAGIC_COOKIE);
-    
-    // Generate random transaction ID
-    for (int i = 0; i < 12; i++) {
-        header->transaction_id[i] = rand() % 256;
-    }
+    memcpy(header->transaction_id, transaction_id, 12);
     
     *request_size = STUN_HEADER_SIZE;
 }
 
 // Parse STUN response to extract mapped address
+// (silent: responses come in on node sockets, so callers report only matched ones)
 static int parse_stun_response(const uint8_t* response, size_t response_size, StunResult* result) {
     if (response_size < STUN_HEADER_SIZE) {
-        fprintf(stderr, "STUN response too short\n");
         return -1;
     }
     
     const StunHeader* header = (const StunHeader*)response;
     
-    // Check message type
-    uint16_t msg_type = ntohs(header->message_type);
-    if (msg_type != STUN_BINDING_RESPONSE) {
-        fprintf(stderr, "Not a STUN binding response: %04x\n", msg_type);
-        return -1;
-    }
-    
-    // Check magic cookie
-    if (ntohl(header->magic_cookie) != STUN_MAGIC_COOKIE) {
-        fprintf(stderr, "Invalid magic cookie\n");
+    // Check message type and magic cookie
+    if (ntohs(header->message_type) != STUN_BINDING_RESPONSE ||
+        ntohl(header->magic_cookie) != STUN_MAGIC_COOKIE) {
         return -1;
     }
     
@@ -78,8 +198,10 @@ static int parse_stun_response(const uint8_t* response, size_t response_size, St
     while (attr_size >= 4) {
         uint16_t attr_type = ntohs(*(uint16_t*)attr);
         uint16_t attr_length = ntohs(*((uint16_t*)attr + 1));
+        size_t padded_length = ((size_t)attr_length + 3) & ~(size_t)3;
         
-        if (attr_size < 4 + attr_length) {
+        // The attribute and its padding must fit in what is left
+        if (attr_size < 4 + padded_length) {
             break;
         }
         
@@ -123,71 +245,410 @@ static int parse_stun_response(const uint8_t* response, size_t response_size, St
             }
         }
         
-        attr += 4 + ((attr_length + 3) & ~3); // Move to next attribute (with padding)
-        attr_size -= 4 + ((attr_length + 3) & ~3);
+        attr += 4 + padded_length; // Move to next attribute (with padding)
+        attr_size -= 4 + padded_length;
     }
     
-    fprintf(stderr, "No mapped address found in STUN response\n");
     return -1;
 }
 
-// Discover public IP and port using STUN
-StunResult* stun_discover_nat(const char* stun_server) {
-    if (stun_socket < 0) {
+// Resolve a server name, once per name (getaddrinfo is thread-safe, gethostbyname is not)
+static int stun_resolve(const char* host, struct sockaddr_in* addr) {
+    time_t now = time(NULL);
+    StunResolved* entry = NULL;
+    pthread_mutex_lock(&stun_mutex);
+    for (int i = 0; i < stun_resolved_count; i++) {
+        if (strcmp(stun_resolved[i].name, host) == 0) {
+            entry = &stun_resolved[i];
+            break;
+        }
+    }
+    if (entry && (entry->ok || now - entry->resolved_at < STUN_RESOLVE_RETRY)) {
+        bool ok = entry->ok;
+        *addr = entry->addr;
+        pthread_mutex_unlock(&stun_mutex);
+        return ok ? 0 : -1;
+    }
+    pthread_mutex_unlock(&stun_mutex);
+    
+    struct addrinfo hints;
+    struct addrinfo* info = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    bool ok = getaddrinfo(host, NULL, &hints, &info) == 0 && info;
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    if (ok) {
+        addr->sin_addr = ((struct sockaddr_in*)info->ai_addr)->sin_addr;
+        freeaddrinfo(info);
+    } else {
+        fprintf(stderr, "Failed to resolve STUN server: %s\n", host);
+    }
+    
+    // Remember the outcome (a failure only for a while)
+    pthread_mutex_lock(&stun_mutex);
+    if (!entry && stun_resolved_count < STUN_RESOLVED_MAX && strlen(host) < sizeof(stun_resolved[0].name)) {
+        entry = &stun_resolved[stun_resolved_count++];
+        strcpy(entry->name, host);
+    }
+    if (entry) {
+        entry->addr = *addr;
+        entry->ok = ok;
+        entry->resolved_at = now;
+    }
+    pthread_mutex_unlock(&stun_mutex);
+    return ok ? 0 : -1;
+}
+
+// Parse a comma-separated list of "host" or "host:port" and resolve each server
+static int stun_parse_servers(const char* stun_servers, StunServerState* servers) {
+    int count = 0;
+    const char* p = stun_servers;
+    while (p && *p && count < STUN_MAX_SERVERS) {
+        const char* end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        char host[128];
+        if (len > 0 && len < sizeof(host)) {
+            memcpy(host, p, len);
+            host[len] = '\0';
+            int port = STUN_PORT;
+            char* colon = strrchr(host, ':');
+            if (colon) {
+                *colon = '\0';
+                port = atoi(colon + 1);
+            }
+            StunServerState* server = &servers[count];
+            memset(server, 0, sizeof(*server));
+            if (port > 0 && port <= 65535 && stun_resolve(host, &server->addr) == 0) {
+                server->addr.sin_port = htons(port);
+                snprintf(server->name, sizeof(server->name), "%.50s:%d", host, port);
+                count++;
+            }
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return count;
+}
+
+// Send (or resend) the request to every server still in the race (called with the lock held)
+static void stun_send_requests(StunQuery* query, uint64_t now) {
+    for (int i = 0; i < query->server_count; i++) {
+        StunServerState* server = &query->servers[i];
+        if (server->failed) {
+            continue;
+        }
+        uint8_t request[STUN_HEADER_SIZE];
+        size_t request_size;
+        create_stun_request(request, &request_size, server->transaction_id);
+        if (sendto(query->socket_fd, request, request_size, 0,
+                   (struct sockaddr*)&server->addr, sizeof(server->addr)) < 0 && errno != ECONNREFUSED) {
+            perror("Failed to send STUN request");
+        }
+    }
+    
+    // RFC 5389 7.2.1: the RTO doubles after each request; after the last one wait Rm * RTO
+    query->sends++;
+    if (query->sends < STUN_RC) {
+        query->next_send_us = now + (uint64_t)query->rto_ms * 1000;
+        query->rto_ms *= 2;
+    } else {
+        query->next_send_us = UINT64_MAX;
+        query->deadline_us = now + (uint64_t)STUN_RM * STUN_RTO_MS * 1000;
+    }
+}
+
+// Start discovering the mapped address of socket_fd. The callback gets the first valid
+// response from any of stun_servers, the cached mapping, or NULL on failure.
+int stun_discover_async(int socket_fd, const char* stun_servers, StunCallback callback, void* arg) {
+    if (socket_fd < 0 || !stun_servers) {
+        return -1;
+    }
+    if (!stun_running) {
         fprintf(stderr, "STUN client not initialized\n");
-        return NULL;
+        return -1;
     }
     
-    // Resolve STUN server
-    struct hostent* server = gethostbyname(stun_server);
-    if (server == NULL) {
-        fprintf(stderr, "Failed to resolve STUN server: %s\n", stun_server);
-        return NULL;
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    memset(&local, 0, sizeof(local));
+    getsockname(socket_fd, (struct sockaddr*)&local, &local_len);
+    
+    StunWaiterEntry* waiter = (StunWaiterEntry*)malloc(sizeof(StunWaiterEntry));
+    if (!waiter) {
+        perror("Failed to allocate STUN waiter");
+        return -1;
     }
+    waiter->callback = callback;
+    waiter->arg = arg;
+    waiter->next = NULL;
     
-    // Set up server address
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-    server_addr.sin_port = htons(STUN_PORT);
+    pthread_mutex_lock(&stun_mutex);
+    StunQuery* query = NULL;
+    StunQuery* free_slot = NULL;
+    StunQuery* oldest = NULL;
+    for (int i = 0; i < STUN_MAX_QUERIES; i++) {
+        StunQuery* q = &stun_queries[i];
+        if (q->active && q->socket_fd == socket_fd && q->local_port == local.sin_port) {
+            query = q;
+            break;
+        }
+        if (!q->active && !free_slot) {
+            free_slot = q;
+        } else if (q->active && !q->pending && (!oldest || q->expires < oldest->expires)) {
+            oldest = q;
+        }
+    }
     
-    // Create STUN request
-    uint8_t request[STUN_HEADER_SIZE];
-    size_t request_size;
-    create_stun_request(request, &request_size);
+    // A fresh cached mapping answers at once
+    if (query && !query->pending && query->has_result && query->expires > time(NULL)) {
+        StunResult result = query->result;
+        pthread_mutex_unlock(&stun_mutex);
+        result.cached = true;
+        free(waiter);
+        if (callback) {
+            callback(socket_fd, &result, arg);
+        }
+        return 0;
+    }
     
-    // Send request
-    if (sendto(stun_socket, request, request_size, 0, 
-               (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Failed to send STUN request");
-        return NULL;
+    // A discovery in flight for the same socket is joined
+    if (query && query->pending) {
+        waiter->next = query->waiters;
+        query->waiters = waiter;
+        pthread_mutex_unlock(&stun_mutex);
+        return 0;
     }
+    pthread_mutex_unlock(&stun_mutex);
     
-    // Receive response
-    uint8_t response[1024];
-    struct sockaddr_in from_addr;
-    socklen_t from_len = sizeof(from_addr);
+    // Resolve the servers without holding the lock
+    StunServerState servers[STUN_MAX_SERVERS];
+    int server_count = stun_parse_servers(stun_servers, servers);
+    if (server_count == 0) {
+        free(waiter);
+        return -1;
+    }
     
-    ssize_t received = recvfrom(stun_socket, response, sizeof(response), 0,
-                               (struct sockaddr*)&from_addr, &from_len);
+    pthread_mutex_lock(&stun_mutex);
+    if (!query) {
+        query = free_slot ? free_slot : oldest;
+    }
+    if (!query || (query->active && query->pending) || !stun_running) {
+        // The table is full of discoveries in flight (or one started for this socket meanwhile)
+        pthread_mutex_unlock(&stun_mutex);
+        free(waiter);
+        fprintf(stderr, "Too many STUN discoveries in flight\n");
+        return -1;
+    }
+    memset(query, 0, sizeof(*query));
+    query->active = true;
+    query->pending = true;
+    query->socket_fd = socket_fd;
+    query->local_port = local.sin_port;
+    memcpy(query->servers, servers, sizeof(StunServerState) * server_count);
+    query->server_count = server_count;
+    // Responses are matched by transaction ID, so the IDs must not be predictable (RFC 5389)
+    for (int i = 0; i < server_count; i++) {
+        if (RAND_bytes(query->servers[i].transaction_id, 12) != 1) {
+            for (int j = 0; j < 12; j++) {
+                query->servers[i].transaction_id[j] = rand() % 256;
+            }
+        }
+    }
+    query->rto_ms = STUN_RTO_MS;
+    query->started_us = stun_now_us();
+    query->waiters = waiter;
+    stun_send_requests(query, query->started_us);
+    pthread_mutex_unlock(&stun_mutex);
     
-    if (received < 0) {
-        perror("Failed to receive STUN response");
+    return 0;
+}
+
+// Wait for a discovery
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool done;
+    bool ok;
+    StunResult result;
+} StunWaiter;
+
+static void stun_waiter_done(int socket_fd, const StunResult* result, void* arg) {
+    (void)socket_fd;
+    StunWaiter* waiter = (StunWaiter*)arg;
+    pthread_mutex_lock(&waiter->mutex);
+    waiter->ok = result != NULL;
+    if (result) {
+        waiter->result = *result;
+    }
+    waiter->done = true;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->mutex);
+}
+
+// Discover the mapped address of socket_fd and wait for it. Must not be called from the
+// thread that reads socket_fd.
+int stun_discover(int socket_fd, const char* stun_servers, StunResult* result) {
+    StunWaiter waiter;
+    pthread_mutex_init(&waiter.mutex, NULL);
+    pthread_cond_init(&waiter.cond, NULL);
+    waiter.done = false;
+    waiter.ok = false;
+    
+    int status = stun_discover_async(socket_fd, stun_servers, stun_waiter_done, &waiter);
+    if (status == 0) {
+        pthread_mutex_lock(&waiter.mutex);
+        while (!waiter.done) {
+            pthread_cond_wait(&waiter.cond, &waiter.mutex);
+        }
+        pthread_mutex_unlock(&waiter.mutex);
+        status = waiter.ok ? 0 : -1;
+        if (waiter.ok && result) {
+            *result = waiter.result;
+        }
+    }
+    pthread_mutex_destroy(&waiter.mutex);
+    pthread_cond_destroy(&waiter.cond);
+    return status;
+}
+
+// Discover public IP and port of the STUN client's own socket
+StunResult* stun_discover_nat(const char* stun_server) {
+    if (stun_socket < 0) {
+        fprintf(stderr, "STUN client not initialized\n");
         return NULL;
     }
     
-    // Parse response
     StunResult* result = (StunResult*)malloc(sizeof(StunResult));
     if (!result) {
         perror("Failed to allocate memory for STUN result");
         return NULL;
     }
     
-    if (parse_stun_response(response, received, result) < 0) {
+    if (stun_discover(stun_socket, stun_server, result) < 0) {
         free(result);
         return NULL;
     }
     
     return result;
-}
\ No newline at end of file
+}
+
+// Whether a packet looks like a STUN response
+bool stun_is_packet(const void* buf, size_t len) {
+    const uint8_t* p = (const uint8_t*)buf;
+    if (len < STUN_HEADER_SIZE || (p[0] & 0xC0) != 0) {
+        return false;
+    }
+    const StunHeader* header = (const StunHeader*)buf;
+    uint16_t type = ntohs(header->message_type);
+    return (type == STUN_BINDING_RESPONSE || type == STUN_BINDING_ERROR_RESPONSE) &&
+           ntohl(header->magic_cookie) == STUN_MAGIC_COOKIE &&
+           (ntohs(header->message_length) & 3) == 0 &&
+           (size_t)ntohs(header->message_length) + STUN_HEADER_SIZE == len;
+}
+
+// Match a response received on socket_fd to a discovery (returns true if it was ours)
+bool stun_handle_packet(int socket_fd, const void* buf, size_t len, const struct sockaddr_in* from) {
+    if (!stun_is_packet(buf, len) || !from) {
+        return false;
+    }
+    const StunHeader* header = (const StunHeader*)buf;
+    uint16_t type = ntohs(header->message_type);
+    
+    // Only a response to one of our requests is parsed (matched by transaction ID and server)
+    StunResult result;
+    memset(&result, 0, sizeof(result));
+    StunCompletion completion;
+    bool completed = false;
+    bool matched = false;
+    bool unusable = false;
+    char server_name[64] = "";
+    pthread_mutex_lock(&stun_mutex);
+    for (int i = 0; i < STUN_MAX_QUERIES && !matched; i++) {
+        StunQuery* query = &stun_queries[i];
+        if (!query->active || !query->pending || query->socket_fd != socket_fd) {
+            continue;
+        }
+        for (int j = 0; j < query->server_count; j++) {
+            StunServerState* server = &query->servers[j];
+            if (memcmp(server->transaction_id, header->transaction_id, 12) != 0 ||
+                server->addr.sin_addr.s_addr != from->sin_addr.s_addr || server->addr.sin_port != from->sin_port) {
+                continue;
+            }
+            matched = true;
+            bool parsed = type == STUN_BINDING_RESPONSE && parse_stun_response((const uint8_t*)buf, len, &result) == 0;
+            if (parsed) {
+                // First valid response wins
+                snprintf(result.server, sizeof(result.server), "%s", server->name);
+                result.latency_ms = (stun_now_us() - query->started_us) / 1000.0;
+                stun_complete(query, &result, &completion);
+                completed = true;
+            } else {
+                // The server dropped out of the race; fail once every server has
+                unusable = type == STUN_BINDING_RESPONSE;
+                snprintf(server_name, sizeof(server_name), "%s", server->name);
+                server->failed = true;
+                bool all_failed = true;
+                for (int k = 0; k < query->server_count; k++) {
+                    all_failed &= query->servers[k].failed;
+                }
+                if (all_failed) {
+                    stun_complete(query, NULL, &completion);
+                    completed = true;
+                }
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stun_mutex);
+    
+    if (unusable) {
+        fprintf(stderr, "No mapped address found in STUN response from %s\n", server_name);
+    }
+    if (completed) {
+        stun_run_completions(&completion, 1);
+    }
+    return matched;
+}
+
+// STUN thread: reads the client's own socket and retransmits or times out discoveries
+static void* stun_thread_main(void* arg) {
+    (void)arg;
+    uint8_t buffer[1024];
+    StunCompletion completions[STUN_MAX_QUERIES];
+    
+    while (stun_running) {
+        struct pollfd pfd = { stun_socket, POLLIN, 0 };
+        if (poll(&pfd, 1, STUN_POLL_MS) > 0) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            ssize_t received;
+            while ((received = recvfrom(stun_socket, buffer, sizeof(buffer), MSG_DONTWAIT,
+                                        (struct sockaddr*)&from, &from_len)) > 0) {
+                stun_handle_packet(stun_socket, buffer, (size_t)received, &from);
+                from_len = sizeof(from);
+            }
+        }
+        
+        int count = 0;
+        uint64_t now = stun_now_us();
+        pthread_mutex_lock(&stun_mutex);
+        for (int i = 0; i < STUN_MAX_QUERIES; i++) {
+            StunQuery* query = &stun_queries[i];
+            if (!query->active || !query->pending) {
+                continue;
+            }
+            if (query->deadline_us && now >= query->deadline_us) {
+                fprintf(stderr, "STUN discovery timed out after %d requests to %d server(s)\n",
+                        query->sends, query->server_count);
+                stun_complete(query, NULL, &completions[count++]);
+            } else if (now >= query->next_send_us) {
+                stun_send_requests(query, now);
+            }
+        }
+        pthread_mutex_unlock(&stun_mutex);
+        stun_run_completions(completions, count);
+    }
+    
+    return NULL;
+}
@@ -5,6 +5,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -15,9 +18,35 @@
 #define STUN_MAGIC_COOKIE 0x2112A442
 #define STUN_BINDING_REQUEST 0x0001
 #define STUN_BINDING_RESPONSE 0x0101
+#define STUN_BINDING_ERROR_RESPONSE 0x0111
 #define STUN_ATTR_MAPPED_ADDRESS 0x0001
 #define STUN_ATTR_XOR_MAPPED_ADDRESS 0x0020
 
+// Asynchronous STUN client
+//
+// A discovery sends a Binding request to every configured server at once from the
+// caller's socket and completes with the first valid response (matching transaction
+// ID and server address). Unanswered requests are retransmitted with the RFC 5389
+// timers: the RTO starts at STUN_RTO_MS and doubles, STUN_RC requests are sent, and
+// the discovery fails STUN_RM * STUN_RTO_MS after the last one. Server names are
+// resolved once and cached.
+//
+// Whoever reads the socket passes STUN packets to stun_handle_packet (the node's
+// receive thread does this for node sockets; the client's own socket used by
+// stun_discover_nat is read by the STUN thread). The mapped address is cached per
+// local socket for STUN_CACHE_TTL seconds, and discoveries started while one is in
+// flight for the same socket join it.
+#define STUN_RTO_MS 500                  // Initial retransmission timeout
+#define STUN_RC 7                        // Number of requests sent per server
+#define STUN_RM 16                       // Wait after the last request (multiple of the RTO)
+#define STUN_MAX_SERVERS 8               // Servers queried by one discovery
+#define STUN_MAX_QUERIES 64              // Sockets with a cached or pending mapping
+#define STUN_CACHE_TTL 300               // Seconds a mapped address is reused
+#define STUN_POLL_MS 20                  // Timer granularity of the STUN thread
+
+// Servers queried when none are configured
+#define DEFAULT_STUN_SERVERS "stun.l.google.com:19302,stun1.l.google.com:19302,stun.cloudflare.com:3478"
+
 typedef struct {
     uint16_t message_type;
     uint16_t message_length;
@@ -28,11 +57,23 @@ typedef struct {
 typedef struct {
     char public_ip[INET6_ADDRSTRLEN];
     int public_port;
+    char server[64];            // Server that answered first ("host:port")
+    double latency_ms;          // From the first request to the response (of the original discovery if cached)
+    bool cached;                // Answered from the per-socket cache
 } StunResult;
 
+// Called once per discovery with the mapped address, or NULL on failure. Runs on the
+// thread that completed it (receive thread, STUN thread, or the caller on a cache hit)
+// and must not block.
+typedef void (*StunCallback)(int socket_fd, const StunResult* result, void* arg);
+
 // Function prototypes
 int stun_init();
+int stun_discover_async(int socket_fd, const char* stun_servers, StunCallback callback, void* arg);
+int stun_discover(int socket_fd, const char* stun_servers, StunResult* result);
 StunResult* stun_discover_nat(const char* stun_server);
+bool stun_is_packet(const void* buf, size_t len);
+bool stun_handle_packet(int socket_fd, const void* buf, size_t len, const struct sockaddr_in* from);
 void stun_cleanup();
 
-#endif /* STUN_H */
\ No newline at end of file
+#endif /* STUN_H */
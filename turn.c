@@ -2,12 +2,18 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <time.h>
 #include <netinet/in.h>
+#include <openssl/evp.h>
 #include <openssl/hmac.h>
 #include <openssl/sha.h>
+#include <openssl/rand.h>
 #include <pthread.h>
 
 // TURNクライアントデータの実装
@@ -26,11 +32,87 @@ typedef struct {
     uint16_t length;
 } TurnAttributeHeader;
 
-// TURNクライアントの初期化
+static void turn_maintain_channels(TurnClient* client);
+static void* turn_receive_thread(void* arg);
+static void complete_transaction(Node* node, TurnClient* client, const TurnTransaction* transaction,
+                                 const uint8_t* response, int response_len);
+static int probe_servers(TurnData* turn_data);
+static void assign_role(TurnClient* client, bool allocated);
+static void drop_server(TurnClient* client, const char* reason, bool failed);
+static void sync_standby(TurnData* turn_data, TurnClient* primary, time_t now);
+static int process_client_data(TurnClient* client, const void* data, int data_len, char* from_ip,
+                               int* from_port, const void** payload_out);
+
+// サーバーごとのクライアントの初期化（ソケットと受信スレッド）
+static int init_client(Node* node, TurnClient* client, int index, const char* server, int port,
+                       const char* username, const char* password) {
+    // クライアント情報の設定
+    client->node = node;
+    client->index = index;
+    snprintf(client->server, sizeof(client->server), "%s", server);
+    client->port = port;
+    strncpy(client->username, username, sizeof(client->username) - 1);
+    strncpy(client->password, password, sizeof(client->password) - 1);
+    client->state = TURN_STATE_IDLE;
+    client->next_channel = TURN_CHANNEL_MIN;
+    client->use_channels = true;
+    
+    // ソケットの作成
+    client->socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (client->socket_fd < 0) {
+        perror("Failed to create TURN socket");
+        return -1;
+    }
+    
+    // サーバーアドレスの設定（connectしておくと、サーバーが落ちたときにICMPのエラーが
+    // 受信で返る）
+    memset(&client->server_addr, 0, sizeof(client->server_addr));
+    client->server_addr.sin_family = AF_INET;
+    client->server_addr.sin_addr.s_addr = inet_addr(server);
+    client->server_addr.sin_port = htons(port);
+    connect(client->socket_fd, (struct sockaddr*)&client->server_addr, sizeof(client->server_addr));
+    
+    // ミューテックスの初期化
+    pthread_mutex_init(&client->mutex, NULL);
+    pthread_mutex_init(&client->channel_mutex, NULL);
+    memset(client->permission_index, 0xFF, sizeof(client->permission_index));
+    
+    // 受信スレッドの開始（応答とデータはこのスレッドだけが読む）
+    client->receive_running = true;
+    if (pthread_create(&client->receive_thread, NULL, turn_receive_thread, client) != 0) {
+        perror("Failed to create TURN receive thread");
+        client->receive_running = false;
+        close(client->socket_fd);
+        pthread_mutex_destroy(&client->mutex);
+        pthread_mutex_destroy(&client->channel_mutex);
+        return -1;
+    }
+    
+    printf("TURN client initialized for node %d using server %s:%d\n", 
+           node->id, server, port);
+    return 0;
+}
+
+// TURNクライアントの初期化（サーバーが1つの場合）
 int turn_init(Node* node, const char* server, int port, const char* username, const char* password) {
-    if (!node || !server || !username || !password) {
+    if (!server) {
+        return -1;
+    }
+    char spec[MAX_IP_STR_LEN + 8];
+    snprintf(spec, sizeof(spec), "%s:%d", server, port);
+    const char* servers[1] = { spec };
+    return turn_init_servers(node, servers, 1, username, password);
+}
+
+// TURNクライアントの初期化（serversは"アドレス"か"アドレス:ポート"、最大TURN_MAX_SERVERS個）
+int turn_init_servers(Node* node, const char* const* servers, int server_count,
+                      const char* username, const char* password) {
+    if (!node || !servers || server_count <= 0 || !username || !password) {
         return -1;
     }
+    if (server_count > TURN_MAX_SERVERS) {
+        server_count = TURN_MAX_SERVERS;
+    }
     
     // TURNデータの確保
     TurnData* turn_data = (TurnData*)malloc(sizeof(TurnData));
@@ -41,36 +123,29 @@ int turn_init(Node* node, const char* server, int port, const char* username, co
     
     // 初期化
     memset(turn_data, 0, sizeof(TurnData));
+    turn_data->primary = -1;
+    turn_data->standby = -1;
+    pthread_mutex_init(&turn_data->mutex, NULL);
     
-    // クライアント情報の設定
-    strncpy(turn_data->client.server, server, MAX_IP_STR_LEN - 1);
-    turn_data->client.port = port;
-    strncpy(turn_data->client.username, username, sizeof(turn_data->client.username) - 1);
-    strncpy(turn_data->client.password, password, sizeof(turn_data->client.password) - 1);
-    turn_data->client.state = TURN_STATE_IDLE;
-    
-    // ソケットの作成
-    turn_data->client.socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (turn_data->client.socket_fd < 0) {
-        perror("Failed to create TURN socket");
-        free(turn_data);
-        return -1;
-    }
-    
-    // サーバーアドレスの設定
-    memset(&turn_data->client.server_addr, 0, sizeof(turn_data->client.server_addr));
-    turn_data->client.server_addr.sin_family = AF_INET;
-    turn_data->client.server_addr.sin_addr.s_addr = inet_addr(server);
-    turn_data->client.server_addr.sin_port = htons(port);
-    
-    // ミューテックスの初期化
-    pthread_mutex_init(&turn_data->client.mutex, NULL);
-    
-    // ノードにTURNデータを関連付ける
+    // ノードにTURNデータを関連付ける（受信スレッドが参照する）
     node->turn_data = turn_data;
     
-    printf("TURN client initialized for node %d using server %s:%d\n", 
-           node->id, server, port);
+    for (int i = 0; i < server_count; i++) {
+        char server[MAX_IP_STR_LEN];
+        int port = TURN_DEFAULT_PORT;
+        strncpy(server, servers[i], sizeof(server) - 1);
+        server[sizeof(server) - 1] = '\0';
+        char* colon = strchr(server, ':');
+        if (colon) {
+            *colon = '\0';
+            port = atoi(colon + 1);
+        }
+        if (init_client(node, &turn_data->clients[i], i, server, port, username, password) < 0) {
+            turn_cleanup(node);
+            return -1;
+        }
+        turn_data->server_count++;
+    }
     
     return 0;
 }
@@ -82,20 +157,52 @@ int turn_cleanup(Node* node) {
     }
     
     TurnData* turn_data = (TurnData*)node->turn_data;
+    pthread_mutex_lock(&turn_data->mutex);
+    turn_data->closing = true;
+    pthread_mutex_unlock(&turn_data->mutex);
+    
+    // 受信スレッドの停止（先に止めれば、アロケーションの完了でリフレッシュスレッドが
+    // 新たに始まることはない）
+    for (int i = 0; i < turn_data->server_count; i++) {
+        turn_data->clients[i].receive_running = false;
+        pthread_join(turn_data->clients[i].receive_thread, NULL);
+    }
     
     // リフレッシュスレッドの停止
-    if (turn_data->client.refresh_running) {
-        turn_data->client.refresh_running = false;
-        pthread_join(turn_data->client.refresh_thread, NULL);
+    for (int i = 0; i < turn_data->server_count; i++) {
+        TurnClient* client = &turn_data->clients[i];
+        if (client->refresh_running) {
+            client->refresh_running = false;
+            pthread_join(client->refresh_thread, NULL);
+        }
     }
     
-    // ソケットのクローズ
-    if (turn_data->client.socket_fd >= 0) {
-        close(turn_data->client.socket_fd);
+    // 応答待ちの要求を中止する
+    for (int i = 0; i < turn_data->server_count; i++) {
+        TurnClient* client = &turn_data->clients[i];
+        for (int j = 0; j < TURN_MAX_TRANSACTIONS; j++) {
+            if (client->transactions[j].active) {
+                TurnTransaction transaction = client->transactions[j];
+                client->transactions[j].active = false;
+                complete_transaction(node, client, &transaction, NULL, 0);
+            }
+        }
+        
+        // 要求の表が一杯で待たせていたパーミッションの要求も中止する
+        for (int j = 0; j < client->permission_waiter_count; j++) {
+            client->permission_waiters[j].callback(node, -1, client->permission_waiters[j].arg);
+        }
+        client->permission_waiter_count = 0;
     }
     
-    // ミューテックスの破棄
-    pthread_mutex_destroy(&turn_data->client.mutex);
+    // ソケットのクローズとミューテックスの破棄
+    for (int i = 0; i < turn_data->server_count; i++) {
+        TurnClient* client = &turn_data->clients[i];
+        close(client->socket_fd);
+        pthread_mutex_destroy(&client->mutex);
+        pthread_mutex_destroy(&client->channel_mutex);
+    }
+    pthread_mutex_destroy(&turn_data->mutex);
     
     // メモリの解放
     free(turn_data);
@@ -106,441 +213,2047 @@ int turn_cleanup(Node* node) {
     return 0;
 }
 
-// トランザクションIDの生成
+// 中継に使うクライアント（プライマリがなければNULL）
+static TurnClient* primary_client(TurnData* turn_data) {
+    int primary = __atomic_load_n(&turn_data->primary, __ATOMIC_ACQUIRE);
+    return primary >= 0 ? &turn_data->clients[primary] : NULL;
+}
+
+// トランザクションIDの生成（応答はIDだけで照合するので、予測できない乱数を使う）
 static void generate_transaction_id(uint8_t* transaction_id) {
-    for (int i = 0; i < 12; i++) {
-        transaction_id[i] = rand() % 256;
+    if (RAND_bytes(transaction_id, 12) != 1) {
+        fprintf(stderr, "Failed to generate TURN transaction ID\n");
+        for (int i = 0; i < 12; i++) {
+            transaction_id[i] = rand() % 256;
+        }
     }
 }
 
-// TURNメッセージの送信
-static int send_turn_message(TurnClient* client, uint16_t message_type, 
-                            const void* attributes, uint16_t attributes_length) {
-    // メッセージバッファ
-    uint8_t buffer[TURN_MAX_BUFFER];
-    memset(buffer, 0, sizeof(buffer));
-    
+// 単調増加の時刻（マイクロ秒とミリ秒）
+static uint64_t turn_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t turn_now_ms(void) {
+    return turn_now_us() / 1000;
+}
+
+// TURNメッセージの組み立て（全体の長さを返す）
+static int build_turn_message(uint8_t* buffer, uint16_t message_type, const uint8_t* transaction_id,
+                              const void* attributes, uint16_t attributes_length) {
     // ヘッダの設定
     TurnMessageHeader* header = (TurnMessageHeader*)buffer;
     header->message_type = htons(message_type);
     header->message_length = htons(attributes_length);
     header->magic_cookie = htonl(0x2112A442);  // STUN/TURN magic cookie
-    generate_transaction_id(header->transaction_id);
-    
+    memcpy(header->transaction_id, transaction_id, 12);
+
     // 属性のコピー
     if (attributes && attributes_length > 0) {
         memcpy(buffer + sizeof(TurnMessageHeader), attributes, attributes_length);
     }
-    
+
+    return sizeof(TurnMessageHeader) + attributes_length;
+}
+
+// TURNメッセージの送信
+static int send_turn_message(TurnClient* client, uint16_t message_type,
+                            const void* attributes, uint16_t attributes_length) {
+    // メッセージバッファ
+    uint8_t buffer[TURN_MAX_BUFFER];
+    uint8_t transaction_id[12];
+    generate_transaction_id(transaction_id);
+    int total_length = build_turn_message(buffer, message_type, transaction_id, attributes, attributes_length);
+
     // メッセージの送信
-    int total_length = sizeof(TurnMessageHeader) + attributes_length;
-    if (sendto(client->socket_fd, buffer, total_length, 0, 
+    if (sendto(client->socket_fd, buffer, total_length, 0,
                (struct sockaddr*)&client->server_addr, sizeof(client->server_addr)) < 0) {
-        perror("Failed to send TURN message");
+        if (errno != ECONNREFUSED) {
+            perror("Failed to send TURN message");  // ECONNREFUSEDは呼び出し側が切り替える
+        }
         return -1;
     }
-    
+
     return 0;
 }
 
-// TURNメッセージの受信
-static int receive_turn_message(TurnClient* client, uint8_t* buffer, int buffer_size, 
-                               uint16_t* message_type, uint16_t* message_length) {
-    // タイムアウトの設定
-    struct timeval tv;
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
-    if (setsockopt(client->socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        perror("Failed to set socket timeout");
+// 長期の資格情報の鍵（client->mutexを持って呼ぶ）
+static void derive_key(TurnClient* client) {
+    char input[sizeof(client->username) + sizeof(client->realm) + sizeof(client->password) + 2];
+    int len = snprintf(input, sizeof(input), "%s:%s:%s", client->username, client->realm, client->password);
+    EVP_Digest(input, (size_t)len, client->key, NULL, EVP_md5(), NULL);
+}
+
+// USERNAME・REALM・NONCE・MESSAGE-INTEGRITYを付ける（client->mutexを持って呼ぶ。新しい全体の
+// 長さを返し、収まらなければ-1）
+static int append_credentials(TurnClient* client, uint8_t* message, int length) {
+    static const uint16_t types[3] = { TURN_ATTR_USERNAME, TURN_ATTR_REALM, TURN_ATTR_NONCE };
+    const char* values[3] = { client->username, client->realm, client->nonce };
+    int total = length + TURN_MESSAGE_INTEGRITY_SIZE;
+    for (int i = 0; i < 3; i++) {
+        total += sizeof(TurnAttributeHeader) + ((strlen(values[i]) + 3) & ~3);
     }
-    
-    // メッセージの受信
-    struct sockaddr_in from_addr;
-    socklen_t from_len = sizeof(from_addr);
-    int received = recvfrom(client->socket_fd, buffer, buffer_size, 0, 
-                           (struct sockaddr*)&from_addr, &from_len);
-    
-    if (received < sizeof(TurnMessageHeader)) {
-        if (received < 0) {
-            perror("Failed to receive TURN message");
-        }
+    if (total > TURN_MAX_REQUEST) {
         return -1;
     }
-    
-    // ヘッダの解析
-    TurnMessageHeader* header = (TurnMessageHeader*)buffer;
-    *message_type = ntohs(header->message_type);
-    *message_length = ntohs(header->message_length);
-    
-    return received;
+
+    for (int i = 0; i < 3; i++) {
+        TurnAttributeHeader* attr = (TurnAttributeHeader*)(message + length);
+        int value_len = strlen(values[i]);
+        attr->type = htons(types[i]);
+        attr->length = htons(value_len);
+        length += sizeof(TurnAttributeHeader);
+        memcpy(message + length, values[i], value_len);
+        length += value_len;
+        while (length % 4 != 0) {
+            message[length++] = 0;
+        }
+    }
+
+    // HMACはMESSAGE-INTEGRITYまでを含む長さにしたヘッダーから、その直前までにかける
+    TurnMessageHeader* header = (TurnMessageHeader*)message;
+    header->message_length = htons(length + TURN_MESSAGE_INTEGRITY_SIZE - sizeof(TurnMessageHeader));
+    TurnAttributeHeader* integrity = (TurnAttributeHeader*)(message + length);
+    integrity->type = htons(TURN_ATTR_MESSAGE_INTEGRITY);
+    integrity->length = htons(TURN_MESSAGE_INTEGRITY_SIZE - sizeof(TurnAttributeHeader));
+    HMAC(EVP_sha1(), client->key, sizeof(client->key), message, (size_t)length,
+         message + length + sizeof(TurnAttributeHeader), NULL);
+    return length + TURN_MESSAGE_INTEGRITY_SIZE;
 }
 
-// TURNアロケーションの要求
-int turn_allocate(Node* node) {
-    if (!node || !node->turn_data) {
+// 要求を表に入れて送る（requestのpeer・channel・lifetime・max_sends・callback・argを引き継ぐ。
+// NONCEを受け取った後はBinding以外に資格情報を付ける）
+static int start_transaction(TurnClient* client, const TurnTransaction* request, uint16_t message_type,
+                             const void* attributes, uint16_t attributes_length) {
+    if (sizeof(TurnMessageHeader) + attributes_length > TURN_MAX_REQUEST) {
         return -1;
     }
-    
-    TurnData* turn_data = (TurnData*)node->turn_data;
-    TurnClient* client = &turn_data->client;
-    
+
     pthread_mutex_lock(&client->mutex);
-    
-    // 既にアロケーション済みの場合
-    if (client->state == TURN_STATE_ALLOCATED) {
-        pthread_mutex_unlock(&client->mutex);
-        return 0;
-    }
-    
-    // アロケーション要求の属性
-    uint8_t attributes[256];
-    int attr_offset = 0;
-    
-    // Requested Transport属性（UDPを指定）
-    TurnAttributeHeader* transport_attr = (TurnAttributeHeader*)(attributes + attr_offset);
-    transport_attr->type = htons(TURN_ATTR_REQUESTED_TRANSPORT);
-    transport_attr->length = htons(4);
-    attr_offset += sizeof(TurnAttributeHeader);
-    
-    // UDPプロトコル（17）を指定
-    attributes[attr_offset++] = 17;  // UDP
-    attributes[attr_offset++] = 0;   // Reserved
-    attributes[attr_offset++] = 0;   // Reserved
-    attributes[attr_offset++] = 0;   // Reserved
-    
-    // Username属性（認証が必要な場合）
-    if (strlen(client->username) > 0) {
-        TurnAttributeHeader* username_attr = (TurnAttributeHeader*)(attributes + attr_offset);
-        username_attr->type = htons(TURN_ATTR_USERNAME);
-        int username_len = strlen(client->username);
-        username_attr->length = htons(username_len);
-        attr_offset += sizeof(TurnAttributeHeader);
-        
-        memcpy(attributes + attr_offset, client->username, username_len);
-        attr_offset += username_len;
-        // パディング（4バイト境界に合わせる）
-        while (attr_offset % 4 != 0) {
-            attributes[attr_offset++] = 0;
+    TurnTransaction* transaction = NULL;
+    for (int i = 0; i < TURN_MAX_TRANSACTIONS; i++) {
+        if (!client->transactions[i].active) {
+            transaction = &client->transactions[i];
+            break;
         }
     }
-    
-    // アロケーション要求の送信
-    client->state = TURN_STATE_ALLOCATING;
-    if (send_turn_message(client, TURN_ALLOCATION_REQUEST, attributes, attr_offset) < 0) {
-        client->state = TURN_STATE_IDLE;
+    if (!transaction) {
         pthread_mutex_unlock(&client->mutex);
+        if (message_type != TURN_CREATE_PERMISSION_REQUEST) {
+            fprintf(stderr, "Too many outstanding TURN requests\n");  // CreatePermissionは後で出し直す
+        }
         return -1;
     }
-    
-    // 応答の受信
-    uint8_t response[TURN_MAX_BUFFER];
-    uint16_t response_type, response_length;
-    if (receive_turn_message(client, response, sizeof(response), 
-                            &response_type, &response_length) < 0) {
-        client->state = TURN_STATE_IDLE;
-        pthread_mutex_unlock(&client->mutex);
-        return -1;
+
+    *transaction = *request;
+    transaction->active = true;
+    transaction->type = message_type;
+    generate_transaction_id(transaction->id);
+    transaction->length = build_turn_message(transaction->message, message_type, transaction->id,
+                                             attributes, attributes_length);
+    transaction->auth_offset = transaction->length;
+    if (message_type != TURN_BINDING_REQUEST && client->nonce[0] != '\0') {
+        int length = append_credentials(client, transaction->message, transaction->length);
+        if (length < 0) {
+            transaction->active = false;
+            pthread_mutex_unlock(&client->mutex);
+            fprintf(stderr, "TURN request too large for credentials\n");
+            return -1;
+        }
+        transaction->length = length;
     }
-    
-    // 応答の解析
+    transaction->sends = 1;
+    transaction->rto_ms = request->first_rto_ms > 0 ? request->first_rto_ms : TURN_RTO_MS;
+    transaction->sent_us = turn_now_us();
+    transaction->next_ms = transaction->sent_us / 1000 + transaction->rto_ms;
+
+    // 送信に失敗しても再送に任せる
+    if (sendto(client->socket_fd, transaction->message, transaction->length, 0,
+               (struct sockaddr*)&client->server_addr, sizeof(client->server_addr)) < 0) {
+        perror("Failed to send TURN message");
+    }
+    pthread_mutex_unlock(&client->mutex);
+    return 0;
+}
+
+// 属性の値を探す（見つからなければNULL）
+static const uint8_t* find_attribute(const uint8_t* message, int message_len, uint16_t type, uint16_t* length) {
+    int end = sizeof(TurnMessageHeader) + ntohs(((const TurnMessageHeader*)message)->message_length);
+    if (end > message_len) {
+        end = message_len;
+    }
+    int offset = sizeof(TurnMessageHeader);
+    while (offset + (int)sizeof(TurnAttributeHeader) <= end) {
+        const TurnAttributeHeader* attr = (const TurnAttributeHeader*)(message + offset);
+        uint16_t attr_length = ntohs(attr->length);
+        if (offset + (int)sizeof(TurnAttributeHeader) + attr_length > end) {
+            break;
+        }
+        if (ntohs(attr->type) == type) {
+            *length = attr_length;
+            return message + offset + sizeof(TurnAttributeHeader);
+        }
+
+        // 次の属性へ（4バイト境界に合わせる）
+        offset += sizeof(TurnAttributeHeader) + ((attr_length + 3) & ~3);
+    }
+    return NULL;
+}
+
+// エラー応答のエラーコード（なければ0）
+static int response_error_code(const uint8_t* response, int response_len) {
+    uint16_t length;
+    const uint8_t* value = find_attribute(response, response_len, TURN_ATTR_ERROR_CODE, &length);
+    if (!value || length < 4) {
+        return 0;
+    }
+    return (value[2] & 0x07) * 100 + value[3];
+}
+
+// 文字列の属性をコピーする
+static void copy_string_attribute(const uint8_t* response, int response_len, uint16_t type,
+                                  char* out, size_t out_size) {
+    uint16_t length;
+    const uint8_t* value = find_attribute(response, response_len, type, &length);
+    if (value) {
+        size_t copy = length < out_size ? length : out_size - 1;
+        memcpy(out, value, copy);
+        out[copy] = '\0';
+    }
+}
+
+// 401・438ならREALMとNONCEを受け取って、同じ要求を資格情報付きで1回だけ送り直す
+// （送り直したらtrue）
+static bool retry_with_credentials(TurnClient* client, const TurnTransaction* transaction,
+                                   const uint8_t* response, int response_len) {
+    uint16_t response_type = ntohs(((const TurnMessageHeader*)response)->message_type);
+    if ((response_type & 0x0110) != 0x0110 || transaction->type == TURN_BINDING_REQUEST ||
+        transaction->auth_retried || client->password[0] == '\0') {
+        return false;
+    }
+    int error_code = response_error_code(response, response_len);
+    if (error_code != 401 && error_code != 438) {
+        return false;
+    }
+
+    pthread_mutex_lock(&client->mutex);
+    copy_string_attribute(response, response_len, TURN_ATTR_REALM, client->realm, sizeof(client->realm));
+    copy_string_attribute(response, response_len, TURN_ATTR_NONCE, client->nonce, sizeof(client->nonce));
+    bool ready = client->realm[0] != '\0' && client->nonce[0] != '\0';
+    if (ready) {
+        derive_key(client);
+    }
+    pthread_mutex_unlock(&client->mutex);
+    if (!ready) {
+        return false;
+    }
+
+    TurnTransaction retry = *transaction;
+    retry.auth_retried = true;
+    return start_transaction(client, &retry, transaction->type, transaction->message + sizeof(TurnMessageHeader),
+                             (uint16_t)(transaction->auth_offset - sizeof(TurnMessageHeader))) == 0;
+}
+
+// Allocateの完了（成功なら0、失敗ならエラーコードか-1を返す）
+static int complete_allocate(Node* node, TurnClient* client, const uint8_t* response, int response_len) {
+    uint16_t response_type = response ? ntohs(((const TurnMessageHeader*)response)->message_type) : 0;
+
     if (response_type == TURN_ALLOCATION_RESPONSE) {
-        // アロケーション成功
-        client->state = TURN_STATE_ALLOCATED;
-        client->allocation_expiry = time(NULL) + TURN_ALLOCATION_LIFETIME;
-        
         // リレーアドレスの取得
-        int offset = sizeof(TurnMessageHeader);
-        while (offset < sizeof(TurnMessageHeader) + response_length) {
-            TurnAttributeHeader* attr = (TurnAttributeHeader*)(response + offset);
-            uint16_t attr_type = ntohs(attr->type);
-            uint16_t attr_length = ntohs(attr->length);
-            
-            if (attr_type == TURN_ATTR_XOR_RELAYED_ADDRESS) {
-                // リレーアドレスの解析（XOR処理が必要）
-                uint8_t family = response[offset + sizeof(TurnAttributeHeader) + 1];
-                uint16_t port = ntohs(*(uint16_t*)(response + offset + sizeof(TurnAttributeHeader) + 2));
-                uint32_t ip = ntohl(*(uint32_t*)(response + offset + sizeof(TurnAttributeHeader) + 4));
-                
-                // XOR処理（STUNの仕様に基づく）
-                port ^= (0x2112A442 >> 16);
-                ip ^= 0x2112A442;
-                
-                struct in_addr addr;
-                addr.s_addr = htonl(ip);
-                strncpy(client->relayed_ip, inet_ntoa(addr), MAX_IP_STR_LEN - 1);
-                client->relayed_port = port;
-                
-                printf("TURN allocation successful for node %d. Relayed address: %s:%d\n", 
-                       node->id, client->relayed_ip, client->relayed_port);
-                
-                // リフレッシュスレッドの開始
-                client->refresh_running = true;
-                if (pthread_create(&client->refresh_thread, NULL, turn_refresh_thread, node) != 0) {
-                    perror("Failed to create TURN refresh thread");
-                    client->refresh_running = false;
-                }
-                
-                pthread_mutex_unlock(&client->mutex);
-                return 0;
-            }
-            
-            // 次の属性へ
-            offset += sizeof(TurnAttributeHeader) + attr_length;
-            // パディング（4バイト境界に合わせる）
-            while (offset % 4 != 0) {
-                offset++;
-            }
+        uint16_t length;
+        const uint8_t* value = find_attribute(response, response_len, TURN_ATTR_XOR_RELAYED_ADDRESS, &length);
+        if (!value || length < 8) {
+            // リレーアドレスが見つからなかった
+            pthread_mutex_lock(&client->mutex);
+            client->state = TURN_STATE_FAILED;
+            pthread_mutex_unlock(&client->mutex);
+            assign_role(client, false);
+            return -1;
         }
-        
-        // リレーアドレスが見つからなかった
-        client->state = TURN_STATE_FAILED;
+
+        // リレーアドレスの解析（XOR処理が必要）
+        uint16_t port = ntohs(*(const uint16_t*)(value + 2));
+        uint32_t ip = ntohl(*(const uint32_t*)(value + 4));
+
+        // XOR処理（STUNの仕様に基づく）
+        port ^= (0x2112A442 >> 16);
+        ip ^= 0x2112A442;
+
+        struct in_addr addr;
+        addr.s_addr = htonl(ip);
+
+        // 前のアロケーションのチャネルとパーミッションは新しいアロケーションにはない
+        pthread_mutex_lock(&client->channel_mutex);
+        client->channel_count = 0;
+        client->permission_count = 0;
+        memset(client->permission_index, 0xFF, sizeof(client->permission_index));
+        pthread_mutex_unlock(&client->channel_mutex);
+
+        pthread_mutex_lock(&client->mutex);
+        inet_ntop(AF_INET, &addr, client->relayed_ip, MAX_IP_STR_LEN);
+        client->relayed_port = port;
+        client->allocation_expiry = time(NULL) + TURN_ALLOCATION_LIFETIME;
+        client->state = TURN_STATE_ALLOCATED;
         pthread_mutex_unlock(&client->mutex);
-        return -1;
-    } else if (response_type == TURN_ALLOCATION_ERROR_RESPONSE) {
-        // エラーコードの取得
-        int error_code = 0;
-        int offset = sizeof(TurnMessageHeader);
-        while (offset < sizeof(TurnMessageHeader) + response_length) {
-            TurnAttributeHeader* attr = (TurnAttributeHeader*)(response + offset);
-            uint16_t attr_type = ntohs(attr->type);
-            uint16_t attr_length = ntohs(attr->length);
-            
-            if (attr_type == TURN_ATTR_ERROR_CODE) {
-                error_code = (response[offset + sizeof(TurnAttributeHeader) + 2] * 100) + 
-                             response[offset + sizeof(TurnAttributeHeader) + 3];
-                break;
-            }
-            
-            // 次の属性へ
-            offset += sizeof(TurnAttributeHeader) + attr_length;
-            // パディング（4バイト境界に合わせる）
-            while (offset % 4 != 0) {
-                offset++;
+
+        printf("TURN allocation successful for node %d. Relayed address: %s:%d\n",
+               node->id, client->relayed_ip, client->relayed_port);
+
+        // リフレッシュスレッドの開始
+        if (!client->refresh_running) {
+            client->refresh_running = true;
+            if (pthread_create(&client->refresh_thread, NULL, turn_refresh_thread, client) != 0) {
+                perror("Failed to create TURN refresh thread");
+                client->refresh_running = false;
             }
         }
-        
-        printf("TURN allocation failed for node %d with error code %d\n", 
+        assign_role(client, true);
+        return 0;
+    }
+
+    int error_code = 0;
+    if (response_type == TURN_ALLOCATION_ERROR_RESPONSE) {
+        // エラーコードの取得
+        error_code = response_error_code(response, response_len);
+        // 401はretry_with_credentialsで送り直した後も認証されなかった
+        printf("TURN allocation failed for node %d with error code %d\n",
                node->id, error_code);
-        
-        // 認証が必要な場合（401: Unauthorized）
-        if (error_code == 401) {
-            // Realm, Nonceの取得
-            offset = sizeof(TurnMessageHeader);
-            while (offset < sizeof(TurnMessageHeader) + response_length) {
-                TurnAttributeHeader* attr = (TurnAttributeHeader*)(response + offset);
-                uint16_t attr_type = ntohs(attr->type);
-                uint16_t attr_length = ntohs(attr->length);
-                
-                if (attr_type == TURN_ATTR_REALM) {
-                    memcpy(client->realm, response + offset + sizeof(TurnAttributeHeader), 
-                           attr_length < sizeof(client->realm) ? attr_length : sizeof(client->realm) - 1);
-                    client->realm[attr_length < sizeof(client->realm) ? attr_length : sizeof(client->realm) - 1] = '\0';
-                } else if (attr_type == TURN_ATTR_NONCE) {
-                    memcpy(client->nonce, response + offset + sizeof(TurnAttributeHeader), 
-                           attr_length < sizeof(client->nonce) ? attr_length : sizeof(client->nonce) - 1);
-                    client->nonce[attr_length < sizeof(client->nonce) ? attr_length : sizeof(client->nonce) - 1] = '\0';
-                }
-                
-                // 次の属性へ
-                offset += sizeof(TurnAttributeHeader) + attr_length;
-                // パディング（4バイト境界に合わせる）
-                while (offset % 4 != 0) {
-                    offset++;
-                }
-            }
-            
-            // 認証情報を含めて再度アロケーション要求
-            // （実際の実装では、ここでHMAC-SHA1を使用したMessage Integrityの計算が必要）
-            // 簡略化のため、この部分は省略
+    } else if (!response) {
+        printf("TURN allocation timed out for node %d\n", node->id);
+    }
+
+    // 失敗（予期しない応答を含む）
+    pthread_mutex_lock(&client->mutex);
+    client->state = TURN_STATE_FAILED;
+    pthread_mutex_unlock(&client->mutex);
+    assign_role(client, false);
+    return error_code > 0 ? error_code : -1;
+}
+
+// Refreshの完了
+static int complete_refresh(Node* node, TurnClient* client, const TurnTransaction* transaction,
+                            const uint8_t* response, int response_len) {
+    uint16_t response_type = response ? ntohs(((const TurnMessageHeader*)response)->message_type) : 0;
+    int result = -1;
+
+    pthread_mutex_lock(&client->mutex);
+    client->refresh_pending = false;
+    if (response_type == TURN_REFRESH_RESPONSE) {
+        client->allocation_expiry = time(NULL) + transaction->lifetime;
+        result = 0;
+    }
+    if (transaction->lifetime == 0) {
+        client->state = TURN_STATE_IDLE;  // 解放した（失敗してもサーバー上で期限が切れる）
+    }
+    time_t expiry = client->allocation_expiry;
+    pthread_mutex_unlock(&client->mutex);
+
+    if (transaction->lifetime == 0) {
+        drop_server(client, "released", false);
+        return result;
+    }
+    if (result == 0) {
+        printf("TURN refresh successful for node %d. New expiry: %ld\n",
+               node->id, expiry);
+        return 0;
+    }
+
+    // リフレッシュ失敗（サーバーを外し、プライマリならスタンバイへ切り替える）
+    printf("TURN refresh failed for node %d\n", node->id);
+    TurnData* turn_data = (TurnData*)node->turn_data;
+    pthread_mutex_lock(&turn_data->mutex);
+    client->refresh_failures += !turn_data->closing;
+    pthread_mutex_unlock(&turn_data->mutex);
+    drop_server(client, "refresh failed", true);
+    if (response_type == TURN_REFRESH_ERROR_RESPONSE) {
+        int error_code = response_error_code(response, response_len);
+        return error_code > 0 ? error_code : -1;
+    }
+    return -1;
+}
+
+// パーミッションの索引（channel_mutexを持って呼ぶ）
+static uint32_t permission_slot(struct in_addr addr) {
+    uint32_t hash = addr.s_addr * 0x9E3779B1u;
+    return (hash ^ (hash >> 15)) & (TURN_PERMISSION_SLOTS - 1);
+}
+
+static TurnPermission* find_permission(TurnClient* client, struct in_addr addr) {
+    for (uint32_t slot = permission_slot(addr);; slot = (slot + 1) & (TURN_PERMISSION_SLOTS - 1)) {
+        int index = client->permission_index[slot];
+        if (index < 0) {
+            return NULL;
         }
-        
-        client->state = TURN_STATE_FAILED;
-        pthread_mutex_unlock(&client->mutex);
-        return -1;
-    } else {
-        // 予期しない応答
-        client->state = TURN_STATE_FAILED;
+        if (client->permissions[index].addr.s_addr == addr.s_addr) {
+            return &client->permissions[index];
+        }
+    }
+}
+
+static void index_permission(TurnClient* client, int index) {
+    uint32_t slot = permission_slot(client->permissions[index].addr);
+    while (client->permission_index[slot] >= 0) {
+        slot = (slot + 1) & (TURN_PERMISSION_SLOTS - 1);
+    }
+    client->permission_index[slot] = index;
+}
+
+// 相手をパーミッションの表に加える（まだ要求はしない）
+static TurnPermission* add_permission(TurnClient* client, struct in_addr addr, time_t now) {
+    if (client->permission_count >= TURN_MAX_PERMISSIONS) {
+        return NULL;
+    }
+    TurnPermission* permission = &client->permissions[client->permission_count];
+    memset(permission, 0, sizeof(TurnPermission));
+    permission->addr = addr;
+    permission->last_used = now;
+    index_permission(client, client->permission_count++);
+    return permission;
+}
+
+// 表から外す（最後のエントリで埋めて索引を作り直す。外すのはリフレッシュスレッドだけ）
+static void remove_permission(TurnClient* client, int index) {
+    client->permissions[index] = client->permissions[--client->permission_count];
+    memset(client->permission_index, 0xFF, sizeof(client->permission_index));
+    for (int i = 0; i < client->permission_count; i++) {
+        index_permission(client, i);
+    }
+}
+
+// CreatePermissionの送信（表の該当するエントリはpendingにしてから呼ぶ）
+static int send_permission_request(TurnClient* client, const struct in_addr* addrs, int count,
+                                   TurnCallback callback, void* arg) {
+    // パーミッション要求の属性（相手ごとにXOR-Peer-Address属性）
+    uint8_t attributes[TURN_PERMISSION_BATCH * 12];
+    int attr_offset = 0;
+    for (int i = 0; i < count && i < TURN_PERMISSION_BATCH; i++) {
+        TurnAttributeHeader* peer_addr_attr = (TurnAttributeHeader*)(attributes + attr_offset);
+        peer_addr_attr->type = htons(TURN_ATTR_XOR_PEER_ADDRESS);
+        peer_addr_attr->length = htons(8);
+        attr_offset += sizeof(TurnAttributeHeader);
+
+        // アドレスファミリー（IPv4）
+        attributes[attr_offset++] = 0;
+        attributes[attr_offset++] = 1;  // IPv4
+
+        // ポート（XOR処理）
+        uint16_t port = 0;  // ポートは0でよい（IPアドレスのみのパーミッション）
+        *(uint16_t*)(attributes + attr_offset) = htons(port ^ (0x2112A442 >> 16));
+        attr_offset += 2;
+
+        // IPアドレス（XOR処理）
+        *(uint32_t*)(attributes + attr_offset) = addrs[i].s_addr ^ htonl(0x2112A442);
+        attr_offset += 4;
+    }
+
+    TurnTransaction request;
+    memset(&request, 0, sizeof(request));
+    request.callback = callback;
+    request.arg = arg;
+    pthread_mutex_lock(&client->channel_mutex);
+    client->permission_requests++;
+    pthread_mutex_unlock(&client->channel_mutex);
+    if (start_transaction(client, &request, TURN_CREATE_PERMISSION_REQUEST, attributes, attr_offset) < 0) {
+        pthread_mutex_lock(&client->channel_mutex);
+        client->permission_requests--;
+        pthread_mutex_unlock(&client->channel_mutex);
+        return -1;
+    }
+    return 0;
+}
+
+// 要求の表が一杯で出せなかったエントリを戻す（次にどれかの要求が完了したときに出し直す。
+// channel_mutexを持って呼ぶ）
+static void requeue_permissions(TurnClient* client, const struct in_addr* addrs, int count) {
+    for (int i = 0; i < count; i++) {
+        TurnPermission* permission = find_permission(client, addrs[i]);
+        if (permission) {
+            permission->pending = false;
+            permission->requested = true;
+        }
+    }
+    client->permissions_queued = true;
+}
+
+// 相手への通知を表から取り出す（channel_mutexを持って呼ぶ。取り出した数を返す）
+static int take_permission_waiters(TurnClient* client, struct in_addr addr, TurnPermissionWaiter* out) {
+    int count = 0;
+    for (int i = 0; i < client->permission_waiter_count;) {
+        if (client->permission_waiters[i].addr.s_addr == addr.s_addr) {
+            out[count++] = client->permission_waiters[i];
+            client->permission_waiters[i] = client->permission_waiters[--client->permission_waiter_count];
+            continue;
+        }
+        i++;
+    }
+    return count;
+}
+
+// 新しい相手と期限の近いパーミッションをまとめて要求する
+static void request_permissions(TurnClient* client, time_t now) {
+    struct in_addr due[TURN_MAX_PERMISSIONS];
+    int due_count = 0;
+
+    // 終了中は新しい要求を出さない
+    TurnData* turn_data = (TurnData*)client->node->turn_data;
+    pthread_mutex_lock(&turn_data->mutex);
+    bool closing = turn_data->closing;
+    pthread_mutex_unlock(&turn_data->mutex);
+    if (closing) {
+        return;
+    }
+
+    pthread_mutex_lock(&client->channel_mutex);
+    for (int i = 0; i < client->permission_count; i++) {
+        TurnPermission* permission = &client->permissions[i];
+        if (permission->pending) {
+            continue;
+        }
+        if (permission->requested) {
+            permission->requested = false;
+            permission->pending = true;
+            due[due_count++] = permission->addr;
+            continue;
+        }
+        if (permission->retry_at > now || now - permission->last_used >= TURN_PERMISSION_LIFETIME ||
+            permission->expiry - now > TURN_PERMISSION_REFRESH_MARGIN) {
+            continue;
+        }
+
+        // バインド済みのチャネルの再バインドで更新される相手は除く
+        bool by_channel = false;
+        for (int j = 0; j < client->channel_count && permission->expiry != 0 && client->use_channels; j++) {
+            TurnChannel* channel = &client->channels[j];
+            if (channel->peer.sin_addr.s_addr == permission->addr.s_addr && channel->expiry != 0 &&
+                now - channel->last_used < TURN_CHANNEL_LIFETIME) {
+                by_channel = true;
+                break;
+            }
+        }
+        if (!by_channel) {
+            permission->pending = true;
+            due[due_count++] = permission->addr;
+        }
+    }
+    pthread_mutex_unlock(&client->channel_mutex);
+
+    for (int i = 0; i < due_count; i += TURN_PERMISSION_BATCH) {
+        int count = due_count - i < TURN_PERMISSION_BATCH ? due_count - i : TURN_PERMISSION_BATCH;
+        if (send_permission_request(client, due + i, count, NULL, NULL) < 0) {
+            pthread_mutex_lock(&client->channel_mutex);
+            requeue_permissions(client, due + i, count);
+            pthread_mutex_unlock(&client->channel_mutex);
+        }
+    }
+}
+
+// 使われなくなったパーミッションを外し、期限の近いものを更新する（リフレッシュスレッドから呼ばれる）
+static void turn_maintain_permissions(TurnClient* client) {
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&client->channel_mutex);
+    for (int i = 0; i < client->permission_count;) {
+        TurnPermission* permission = &client->permissions[i];
+        if (!permission->pending && now - permission->last_used >= TURN_PERMISSION_LIFETIME &&
+            now >= permission->expiry) {
+            remove_permission(client, i);
+            continue;
+        }
+        i++;
+    }
+    pthread_mutex_unlock(&client->channel_mutex);
+
+    request_permissions(client, now);
+}
+
+// 相手へのパーミッションがあるかどうか
+bool turn_has_permission(Node* node, const char* peer_ip) {
+    struct in_addr addr;
+    if (!node || !node->turn_data || !peer_ip || !inet_aton(peer_ip, &addr)) {
+        return false;
+    }
+    TurnClient* client = primary_client((TurnData*)node->turn_data);
+    if (!client) {
+        return false;
+    }
+    pthread_mutex_lock(&client->channel_mutex);
+    TurnPermission* permission = find_permission(client, addr);
+    bool result = permission && permission->expiry > time(NULL);
+    pthread_mutex_unlock(&client->channel_mutex);
+    return result;
+}
+
+// CreatePermissionの完了（要求に載せた相手全てに結果を反映する）
+static int complete_permission(Node* node, TurnClient* client, const TurnTransaction* transaction,
+                               const uint8_t* response, int response_len) {
+    uint16_t response_type = response ? ntohs(((const TurnMessageHeader*)response)->message_type) : 0;
+    bool created = response_type == TURN_CREATE_PERMISSION_RESPONSE;
+    time_t now = time(NULL);
+    int count = 0;
+    struct in_addr first;
+    first.s_addr = 0;
+    TurnPermissionWaiter waiters[TURN_MAX_PERMISSIONS];
+    int waiter_count = 0;
+
+    pthread_mutex_lock(&client->channel_mutex);
+    for (int offset = sizeof(TurnMessageHeader); offset + 12 <= transaction->length;) {
+        const TurnAttributeHeader* attr = (const TurnAttributeHeader*)(transaction->message + offset);
+        uint16_t attr_length = ntohs(attr->length);
+        if (ntohs(attr->type) == TURN_ATTR_XOR_PEER_ADDRESS && attr_length == 8) {
+            struct in_addr addr;
+            addr.s_addr = *(const uint32_t*)(transaction->message + offset + 8) ^ htonl(0x2112A442);
+            TurnPermission* permission = find_permission(client, addr);
+            if (permission) {
+                if (created) {
+                    permission->expiry = now + TURN_PERMISSION_LIFETIME;
+                } else {
+                    permission->retry_at = now + TURN_PERMISSION_RETRY;
+                }
+                permission->pending = false;
+            }
+            waiter_count += take_permission_waiters(client, addr, waiters + waiter_count);
+            if (count++ == 0) {
+                first = addr;
+            }
+        }
+        offset += sizeof(TurnAttributeHeader) + ((attr_length + 3) & ~3);
+    }
+    client->permission_requests--;
+    pthread_mutex_unlock(&client->channel_mutex);
+
+    // 応答を待つ間に現れた相手をまとめて要求する
+    request_permissions(client, now);
+
+    char peer_ip[MAX_IP_STR_LEN];
+    inet_ntop(AF_INET, &first, peer_ip, sizeof(peer_ip));
+    int result = 0;
+    if (created) {
+        // パーミッション作成成功
+        if (count == 1) {
+            printf("TURN permission created for node %d to peer %s\n",
+                   node->id, peer_ip);
+        } else {
+            printf("TURN permissions created for node %d to %d peers\n", node->id, count);
+        }
+    } else {
+        // パーミッション作成失敗
+        if (count == 1) {
+            printf("TURN permission creation failed for node %d to peer %s\n",
+                   node->id, peer_ip);
+        } else {
+            printf("TURN permission creation failed for node %d to %d peers\n", node->id, count);
+        }
+        int error_code = response_type == TURN_CREATE_PERMISSION_ERROR_RESPONSE
+                             ? response_error_code(response, response_len) : 0;
+        result = error_code > 0 ? error_code : -1;
+    }
+
+    // 要求の表が一杯で待たせていたturn_create_permission_asyncの完了
+    for (int i = 0; i < waiter_count; i++) {
+        waiters[i].callback(node, result, waiters[i].arg);
+    }
+    return result;
+}
+
+// ChannelBindの完了（待つ間に外されたチャネルには何もしない）
+static int complete_channel_bind(Node* node, TurnClient* client, const TurnTransaction* transaction,
+                                 const uint8_t* response, int response_len) {
+    uint16_t response_type = response ? ntohs(((const TurnMessageHeader*)response)->message_type) : 0;
+    bool bound = response_type == TURN_CHANNEL_BIND_RESPONSE;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&client->channel_mutex);
+    for (int i = 0; i < client->channel_count; i++) {
+        TurnChannel* channel = &client->channels[i];
+        if (channel->number == transaction->channel &&
+            channel->peer.sin_addr.s_addr == transaction->peer.sin_addr.s_addr &&
+            channel->peer.sin_port == transaction->peer.sin_port) {
+            if (bound) {
+                channel->expiry = now + TURN_PERMISSION_LIFETIME;
+            } else {
+                channel->retry_at = now + TURN_CHANNEL_RETRY;
+            }
+            channel->binding = false;
+            break;
+        }
+    }
+
+    // ChannelBindは相手へのパーミッションも作成・更新する
+    TurnPermission* permission = bound ? find_permission(client, transaction->peer.sin_addr) : NULL;
+    if (!permission && bound) {
+        permission = add_permission(client, transaction->peer.sin_addr, now);
+    }
+    TurnPermissionWaiter waiters[TURN_MAX_PERMISSIONS];
+    int waiter_count = 0;
+    if (permission) {
+        permission->expiry = now + TURN_PERMISSION_LIFETIME;
+        waiter_count = take_permission_waiters(client, transaction->peer.sin_addr, waiters);
+    }
+    pthread_mutex_unlock(&client->channel_mutex);
+
+    char peer_ip[MAX_IP_STR_LEN];
+    inet_ntop(AF_INET, &transaction->peer.sin_addr, peer_ip, sizeof(peer_ip));
+    int peer_port = ntohs(transaction->peer.sin_port);
+    if (bound) {
+        printf("TURN channel 0x%04x bound for node %d to peer %s:%d\n",
+               transaction->channel, node->id, peer_ip, peer_port);
+        for (int i = 0; i < waiter_count; i++) {
+            waiters[i].callback(node, 0, waiters[i].arg);
+        }
+        return 0;
+    }
+    printf("TURN channel bind failed for node %d to peer %s:%d\n", node->id, peer_ip, peer_port);
+    if (response_type == TURN_CHANNEL_BIND_ERROR_RESPONSE) {
+        int error_code = response_error_code(response, response_len);
+        return error_code > 0 ? error_code : -1;
+    }
+    return -1;
+}
+
+// ---- サーバーの役割（プライマリとスタンバイ） ----
+
+static int start_allocate(TurnClient* client);
+static int start_refresh(TurnClient* client, int lifetime, TurnCallback callback, void* arg);
+
+// RTTの標本を平滑化する（TurnData.mutexを持って呼ぶ。再送した要求は応答がどの送信のものか
+// 分からないので使わない）
+static void record_rtt(TurnClient* client, const TurnTransaction* transaction) {
+    if (transaction->sends != 1) {
+        return;
+    }
+    double sample = (turn_now_us() - transaction->sent_us) / 1000.0;
+    client->rtt_ms = client->rtt_ms == 0 ? sample : client->rtt_ms * 0.875 + sample * 0.125;
+}
+
+// Bindingの送信（応答がなければTURN_PROBE_SENDS回で諦める）
+static int send_probe(TurnClient* client) {
+    TurnTransaction request;
+    memset(&request, 0, sizeof(request));
+    request.max_sends = TURN_PROBE_SENDS;
+    return start_transaction(client, &request, TURN_BINDING_REQUEST, NULL, 0);
+}
+
+// 使っているサーバーの生存確認（リフレッシュスレッドから呼ばれる）
+static void probe_client(TurnClient* client, time_t now) {
+    TurnData* turn_data = (TurnData*)client->node->turn_data;
+    pthread_mutex_lock(&turn_data->mutex);
+    bool due = !client->probe_pending && now - client->last_probe >= TURN_PROBE_INTERVAL;
+    if (due) {
+        client->probe_pending = true;
+        client->last_probe = now;
+    }
+    pthread_mutex_unlock(&turn_data->mutex);
+
+    if (due && send_probe(client) < 0) {
+        pthread_mutex_lock(&turn_data->mutex);
+        client->probe_pending = false;
+        pthread_mutex_unlock(&turn_data->mutex);
+    }
+}
+
+// データが流れている間のプライマリの生存確認（受信スレッドから呼ばれる。次に確認すべき
+// までのミリ秒を返す）
+static int probe_active(TurnClient* client) {
+    TurnData* turn_data = (TurnData*)client->node->turn_data;
+    uint64_t now = turn_now_ms();
+    uint64_t last_data = __atomic_load_n(&client->last_data_ms, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&turn_data->primary, __ATOMIC_ACQUIRE) != client->index ||
+        last_data == 0 || now - last_data >= TURN_ACTIVE_WINDOW_MS) {
+        return TURN_POLL_MS;
+    }
+
+    // 切り替え先がなければ速い確認で外しても仕方がないので、5秒ごとの確認に任せる
+    pthread_mutex_lock(&turn_data->mutex);
+    if (turn_data->standby < 0) {
+        pthread_mutex_unlock(&turn_data->mutex);
+        return TURN_POLL_MS;
+    }
+    uint64_t elapsed = now - client->last_active_probe_ms;
+    bool due = !turn_data->closing && !client->active_probe_pending && elapsed >= TURN_ACTIVE_PROBE_MS;
+    uint64_t rto_ms = (uint64_t)(client->rtt_ms * TURN_ACTIVE_RTO_FACTOR);
+    if (rto_ms < TURN_ACTIVE_RTO_MIN_MS) {
+        rto_ms = TURN_ACTIVE_RTO_MIN_MS;
+    } else if (rto_ms > TURN_RTO_MS) {
+        rto_ms = TURN_RTO_MS;
+    }
+    if (due) {
+        client->active_probe_pending = true;
+        client->last_active_probe_ms = now;
+    }
+    pthread_mutex_unlock(&turn_data->mutex);
+
+    if (!due) {
+        return elapsed < TURN_ACTIVE_PROBE_MS ? (int)(TURN_ACTIVE_PROBE_MS - elapsed) : TURN_ACTIVE_PROBE_MS;
+    }
+    TurnTransaction request;
+    memset(&request, 0, sizeof(request));
+    request.max_sends = TURN_PROBE_SENDS;
+    request.first_rto_ms = rto_ms;
+    request.active_probe = true;
+    if (start_transaction(client, &request, TURN_BINDING_REQUEST, NULL, 0) < 0) {
+        pthread_mutex_lock(&turn_data->mutex);
+        client->active_probe_pending = false;
+        pthread_mutex_unlock(&turn_data->mutex);
+    }
+    return TURN_ACTIVE_PROBE_MS;
+}
+
+// 役割のないサーバー全てに同時にBindingを送る（送った数を返す）
+static int probe_servers(TurnData* turn_data) {
+    TurnClient* targets[TURN_MAX_SERVERS];
+    int count = 0;
+
+    pthread_mutex_lock(&turn_data->mutex);
+    if (turn_data->closing) {
+        pthread_mutex_unlock(&turn_data->mutex);
+        return 0;
+    }
+    time_t now = time(NULL);
+    turn_data->last_select = now;
+    for (int i = 0; i < turn_data->server_count; i++) {
+        TurnClient* client = &turn_data->clients[i];
+        if (client->probe_pending || client->allocating || i == turn_data->primary || i == turn_data->standby) {
+            continue;
+        }
+        client->probe_pending = true;
+        client->last_probe = now;
+        targets[count++] = client;
+    }
+    pthread_mutex_unlock(&turn_data->mutex);
+
+    int started = 0;
+    for (int i = 0; i < count; i++) {
+        if (send_probe(targets[i]) == 0) {
+            started++;
+        } else {
+            pthread_mutex_lock(&turn_data->mutex);
+            targets[i]->probe_pending = false;
+            pthread_mutex_unlock(&turn_data->mutex);
+        }
+    }
+    return started;
+}
+
+// 空いた役割を、Bindingに応答したサーバーのうちRTTの小さい順に埋める
+static void fill_roles(TurnData* turn_data) {
+    TurnClient* chosen[TURN_MAX_SERVERS];
+    int chosen_count = 0;
+
+    pthread_mutex_lock(&turn_data->mutex);
+    int wanted = (turn_data->primary < 0) + (turn_data->standby < 0 && turn_data->server_count > 1);
+    for (int i = 0; i < turn_data->server_count; i++) {
+        wanted -= turn_data->clients[i].allocating;
+    }
+    while (!turn_data->closing && wanted-- > 0) {
+        TurnClient* best = NULL;
+        for (int i = 0; i < turn_data->server_count; i++) {
+            TurnClient* client = &turn_data->clients[i];
+            if (!client->alive || client->allocating || i == turn_data->primary || i == turn_data->standby) {
+                continue;
+            }
+            if (!best || client->rtt_ms < best->rtt_ms) {
+                best = client;
+            }
+        }
+        if (!best) {
+            break;
+        }
+        best->allocating = true;
+        chosen[chosen_count++] = best;
+    }
+    pthread_mutex_unlock(&turn_data->mutex);
+
+    for (int i = 0; i < chosen_count; i++) {
+        if (start_allocate(chosen[i]) < 0) {
+            pthread_mutex_lock(&turn_data->mutex);
+            chosen[i]->allocating = false;
+            chosen[i]->alive = false;
+            pthread_mutex_unlock(&turn_data->mutex);
+        }
+    }
+}
+
+// 調べたサーバーのどれにもアロケーションできなかったらturn_allocate_asyncを失敗で完了する
+static void finish_selection(TurnData* turn_data) {
+    TurnCallback callback = NULL;
+    void* arg = NULL;
+    bool failed = false;
+
+    pthread_mutex_lock(&turn_data->mutex);
+    if (turn_data->selecting && turn_data->primary < 0) {
+        failed = true;
+        for (int i = 0; i < turn_data->server_count; i++) {
+            if (turn_data->clients[i].probe_pending || turn_data->clients[i].allocating) {
+                failed = false;
+            }
+        }
+    }
+    if (failed) {
+        turn_data->selecting = false;
+        callback = turn_data->select_callback;
+        arg = turn_data->select_arg;
+    }
+    pthread_mutex_unlock(&turn_data->mutex);
+
+    if (failed) {
+        printf("TURN allocation failed for node %d on all %d servers\n",
+               turn_data->clients[0].node->id, turn_data->server_count);
+        if (callback) {
+            callback(turn_data->clients[0].node, -1, arg);
+        }
+    }
+}
+
+// アロケーションの結果で役割を決める（空いていなければ余分なアロケーションは解放する）
+// プライマリのリレーアドレスが前に知らせたものと変わっていればrelay_handlerに知らせる
+static void announce_relay(TurnData* turn_data) {
+    Node* node = turn_data->clients[0].node;
+    char relayed_ip[MAX_IP_STR_LEN];
+    int relayed_port;
+    if (turn_get_relayed_address(node, relayed_ip, &relayed_port) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&turn_data->mutex);
+    bool changed = !turn_data->closing && (strcmp(turn_data->announced_ip, relayed_ip) != 0 ||
+                                           turn_data->announced_port != relayed_port);
+    if (changed) {
+        snprintf(turn_data->announced_ip, sizeof(turn_data->announced_ip), "%s", relayed_ip);
+        turn_data->announced_port = relayed_port;
+    }
+    TurnRelayHandler handler = turn_data->relay_handler;
+    void* arg = turn_data->relay_handler_arg;
+    pthread_mutex_unlock(&turn_data->mutex);
+
+    if (changed && handler) {
+        handler(node, relayed_ip, relayed_port, arg);
+    }
+}
+
+static void assign_role(TurnClient* client, bool allocated) {
+    Node* node = client->node;
+    TurnData* turn_data = (TurnData*)node->turn_data;
+    TurnCallback callback = NULL;
+    void* arg = NULL;
+    bool notify = false;
+    bool promoted = false;
+    bool release = false;
+
+    pthread_mutex_lock(&turn_data->mutex);
+    client->allocating = false;
+    if (allocated && !turn_data->closing) {
+        if (turn_data->primary < 0) {
+            __atomic_store_n(&turn_data->primary, client->index, __ATOMIC_RELEASE);
+            promoted = true;
+            if (turn_data->selecting) {
+                turn_data->selecting = false;
+                notify = true;
+                callback = turn_data->select_callback;
+                arg = turn_data->select_arg;
+            }
+        } else if (turn_data->standby < 0 && client->index != turn_data->primary) {
+            turn_data->standby = client->index;
+        } else if (client->index != turn_data->primary && client->index != turn_data->standby) {
+            release = true;
+        }
+    } else if (!allocated) {
+        client->allocate_failures++;
+        client->alive = false;
+    }
+    pthread_mutex_unlock(&turn_data->mutex);
+
+    if (promoted) {
+        announce_relay(turn_data);
+    }
+    if (notify && callback) {
+        callback(node, 0, arg);
+    }
+    if (release) {
+        start_refresh(client, 0, NULL, NULL);
+    }
+    if (!allocated) {
+        fill_roles(turn_data);
+        finish_selection(turn_data);
+    }
+}
+
+// 使っていたサーバーを外す（プライマリならスタンバイへ切り替える。failedがfalseなら
+// 自分で解放した）
+static void drop_server(TurnClient* client, const char* reason, bool failed) {
+    Node* node = client->node;
+    TurnData* turn_data = (TurnData*)node->turn_data;
+    bool was_primary = false;
+    TurnClient* next = NULL;
+
+    pthread_mutex_lock(&turn_data->mutex);
+    if (turn_data->closing ||
+        (client->index != turn_data->primary && client->index != turn_data->standby)) {
+        pthread_mutex_unlock(&turn_data->mutex);
+        return;
+    }
+    if (client->index == turn_data->primary) {
+        was_primary = true;
+        __atomic_store_n(&turn_data->primary, turn_data->standby, __ATOMIC_RELEASE);
+        next = turn_data->standby >= 0 ? &turn_data->clients[turn_data->standby] : NULL;
+        turn_data->standby = -1;
+        turn_data->failovers += next != NULL;
+    } else {
+        turn_data->standby = -1;
+    }
+    if (failed) {
+        client->failures++;
+        client->alive = false;
+    }
+    pthread_mutex_unlock(&turn_data->mutex);
+
+    __atomic_store_n(&client->suspect, false, __ATOMIC_RELAXED);
+    if (failed) {
+        pthread_mutex_lock(&client->mutex);
+        client->state = TURN_STATE_FAILED;
         pthread_mutex_unlock(&client->mutex);
+    }
+
+    if (was_primary && next) {
+        printf("TURN server %s:%d dropped for node %d (%s), switched to %s:%d\n",
+               client->server, client->port, node->id, reason, next->server, next->port);
+        announce_relay(turn_data);
+    } else if (was_primary) {
+        printf("TURN server %s:%d dropped for node %d (%s), no standby\n",
+               client->server, client->port, node->id, reason);
+    } else {
+        printf("TURN standby server %s:%d dropped for node %d (%s)\n",
+               client->server, client->port, node->id, reason);
+    }
+
+    // 空いた役割は残りのサーバーを調べ直して埋める
+    probe_servers(turn_data);
+}
+
+// Bindingの完了（エラー応答でもサーバーは生きている）
+static int complete_probe(Node* node, TurnClient* client, const TurnTransaction* transaction,
+                          const uint8_t* response) {
+    TurnData* turn_data = (TurnData*)node->turn_data;
+    bool answered = response != NULL;
+
+    pthread_mutex_lock(&turn_data->mutex);
+    // 速い確認の間にスタンバイがなくなっていたら外さず、通常のRTOの確認に任せる
+    bool keep = !answered && transaction->active_probe && turn_data->standby < 0;
+    if (transaction->active_probe) {
+        client->active_probe_pending = false;
+    } else {
+        client->probe_pending = false;
+    }
+    client->probes++;
+    client->probe_failures += !answered;
+    if (!keep) {
+        client->alive = answered;
+    }
+    pthread_mutex_unlock(&turn_data->mutex);
+
+    if (answered || keep) {
+        __atomic_store_n(&client->suspect, false, __ATOMIC_RELAXED);
+    }
+    if (answered) {
+        fill_roles(turn_data);
+    } else if (!keep) {
+        drop_server(client, "no response", true);
+    }
+    finish_selection(turn_data);
+    return answered ? 0 : -1;
+}
+
+// 要求の完了（表から外した後に呼ぶ。responseがNULLならタイムアウトか中止）
+static void complete_transaction(Node* node, TurnClient* client, const TurnTransaction* transaction,
+                                 const uint8_t* response, int response_len) {
+    if (response) {
+        TurnData* turn_data = (TurnData*)node->turn_data;
+        pthread_mutex_lock(&turn_data->mutex);
+        record_rtt(client, transaction);
+        pthread_mutex_unlock(&turn_data->mutex);
+    }
+
+    int result = -1;
+    switch (transaction->type) {
+        case TURN_BINDING_REQUEST:
+            result = complete_probe(node, client, transaction, response);
+            break;
+        case TURN_ALLOCATION_REQUEST:
+            result = complete_allocate(node, client, response, response_len);
+            break;
+        case TURN_REFRESH_REQUEST:
+            result = complete_refresh(node, client, transaction, response, response_len);
+            break;
+        case TURN_CREATE_PERMISSION_REQUEST:
+            result = complete_permission(node, client, transaction, response, response_len);
+            break;
+        case TURN_CHANNEL_BIND_REQUEST:
+            result = complete_channel_bind(node, client, transaction, response, response_len);
+            break;
+    }
+
+    // 表が空いたので、一杯で出せなかったパーミッションの要求をまとめて出し直す
+    pthread_mutex_lock(&client->channel_mutex);
+    bool queued = client->permissions_queued;
+    client->permissions_queued = false;
+    pthread_mutex_unlock(&client->channel_mutex);
+    if (queued) {
+        request_permissions(client, time(NULL));
+    }
+
+    if (transaction->callback) {
+        transaction->callback(node, result, transaction->arg);
+    }
+}
+
+// 応答をトランザクションと突き合わせる（該当がなければ捨てる）
+static void handle_response(Node* node, TurnClient* client, const uint8_t* response, int response_len) {
+    const TurnMessageHeader* header = (const TurnMessageHeader*)response;
+    if (header->magic_cookie != htonl(0x2112A442)) {
+        return;
+    }
+
+    TurnTransaction transaction;
+    bool found = false;
+    pthread_mutex_lock(&client->mutex);
+    for (int i = 0; i < TURN_MAX_TRANSACTIONS; i++) {
+        TurnTransaction* candidate = &client->transactions[i];
+        if (candidate->active && memcmp(candidate->id, header->transaction_id, 12) == 0 &&
+            (ntohs(header->message_type) & 0x3EEF) == candidate->type) {
+            transaction = *candidate;
+            candidate->active = false;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&client->mutex);
+
+    if (found && !retry_with_credentials(client, &transaction, response, response_len)) {
+        complete_transaction(node, client, &transaction, response, response_len);
+    }
+}
+
+// 再送とタイムアウト（次に確認すべきまでのミリ秒を返す）
+static int retransmit_transactions(Node* node, TurnClient* client) {
+    TurnTransaction expired[TURN_MAX_TRANSACTIONS];
+    int expired_count = 0;
+    uint64_t now = turn_now_ms();
+    uint64_t next = now + TURN_POLL_MS;
+
+    pthread_mutex_lock(&client->mutex);
+    for (int i = 0; i < TURN_MAX_TRANSACTIONS; i++) {
+        TurnTransaction* transaction = &client->transactions[i];
+        if (!transaction->active) {
+            continue;
+        }
+        int max_sends = transaction->max_sends > 0 ? transaction->max_sends : TURN_RC;
+        if (now >= transaction->next_ms) {
+            if (transaction->sends >= max_sends) {
+                expired[expired_count++] = *transaction;
+                transaction->active = false;
+                continue;
+            }
+
+            // 再送（最後の送信の後はTURN_RM * TURN_RTO_MS待つ。回数を指定した要求はRTOだけ待つ）
+            sendto(client->socket_fd, transaction->message, transaction->length, 0,
+                   (struct sockaddr*)&client->server_addr, sizeof(client->server_addr));
+            transaction->sends++;
+            transaction->rto_ms *= 2;
+            if (transaction->active_probe) {
+                __atomic_store_n(&client->suspect, true, __ATOMIC_RELAXED);
+            }
+            transaction->next_ms = now + (transaction->sends == TURN_RC && transaction->max_sends == 0
+                                              ? (uint64_t)TURN_RM * TURN_RTO_MS
+                                              : transaction->rto_ms);
+        }
+        if (transaction->next_ms < next) {
+            next = transaction->next_ms;
+        }
+    }
+    pthread_mutex_unlock(&client->mutex);
+
+    for (int i = 0; i < expired_count; i++) {
+        complete_transaction(node, client, &expired[i], NULL, 0);
+    }
+    return (int)(next - now);
+}
+
+// TURN受信スレッド（応答の処理、再送、中継されたデータの受け渡し）
+static void* turn_receive_thread(void* arg) {
+    TurnClient* client = (TurnClient*)arg;
+    Node* node = client->node;
+    TurnData* turn_data = (TurnData*)node->turn_data;
+    uint8_t buffer[TURN_MAX_BUFFER];
+
+    while (client->receive_running) {
+        int probe_timeout = probe_active(client);
+        int timeout = retransmit_transactions(node, client);
+        if (probe_timeout < timeout) {
+            timeout = probe_timeout;
+        }
+        struct pollfd pfd;
+        pfd.fd = client->socket_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) <= 0) {
+            continue;
+        }
+
+        // 溜まっているパケットをまとめて処理する
+        int received;
+        while ((received = recv(client->socket_fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+            if ((buffer[0] & 0xC0) == 0 && received >= (int)sizeof(TurnMessageHeader) &&
+                ntohs(((TurnMessageHeader*)buffer)->message_type) != TURN_DATA_INDICATION) {
+                handle_response(node, client, buffer, received);
+                continue;
+            }
+
+            // ChannelDataとData Indication
+            char from_ip[MAX_IP_STR_LEN];
+            int from_port = 0;
+            const void* payload = NULL;
+            int payload_len = process_client_data(client, buffer, received, from_ip, &from_port, &payload);
+            if (payload_len > 0 && turn_data->data_handler) {
+                turn_data->data_handler(node, from_ip, from_port, payload, payload_len,
+                                        turn_data->data_handler_arg);
+            }
+        }
+
+        // サーバーのポートに届かなかった（ICMP）なら、応答を待たずにサーバーを外す
+        if (received < 0 && errno == ECONNREFUSED) {
+            drop_server(client, "port unreachable", true);
+        }
+    }
+
+    return NULL;
+}
+
+// 中継されたデータを受け取る関数の設定
+void turn_set_data_handler(Node* node, TurnDataHandler handler, void* arg) {
+    if (!node || !node->turn_data) {
+        return;
+    }
+    TurnData* turn_data = (TurnData*)node->turn_data;
+    pthread_mutex_lock(&turn_data->mutex);
+    turn_data->data_handler = handler;
+    turn_data->data_handler_arg = arg;
+    pthread_mutex_unlock(&turn_data->mutex);
+}
+
+// リレーアドレスが変わったことを受け取る関数の設定
+void turn_set_relay_handler(Node* node, TurnRelayHandler handler, void* arg) {
+    if (!node || !node->turn_data) {
+        return;
+    }
+    TurnData* turn_data = (TurnData*)node->turn_data;
+    pthread_mutex_lock(&turn_data->mutex);
+    turn_data->relay_handler = handler;
+    turn_data->relay_handler_arg = arg;
+    pthread_mutex_unlock(&turn_data->mutex);
+}
+
+// 応答待ちの要求の数（全てのサーバーの合計）
+int turn_pending_requests(Node* node) {
+    if (!node || !node->turn_data) {
+        return 0;
+    }
+    TurnData* turn_data = (TurnData*)node->turn_data;
+    int count = 0;
+    for (int i = 0; i < turn_data->server_count; i++) {
+        TurnClient* client = &turn_data->clients[i];
+        pthread_mutex_lock(&client->mutex);
+        for (int j = 0; j < TURN_MAX_TRANSACTIONS; j++) {
+            count += client->transactions[j].active;
+        }
+        pthread_mutex_unlock(&client->mutex);
+    }
+    return count;
+}
+
+// 中継に使っているリレーアドレス（プライマリがなければ-1）
+int turn_get_relayed_address(Node* node, char* ip, int* port) {
+    if (!node || !node->turn_data || !ip || !port) {
+        return -1;
+    }
+    TurnClient* client = primary_client((TurnData*)node->turn_data);
+    if (!client) {
+        return -1;
+    }
+    pthread_mutex_lock(&client->mutex);
+    bool allocated = client->state == TURN_STATE_ALLOCATED;
+    if (allocated) {
+        strncpy(ip, client->relayed_ip, MAX_IP_STR_LEN - 1);
+        ip[MAX_IP_STR_LEN - 1] = '\0';
+        *port = client->relayed_port;
+    }
+    pthread_mutex_unlock(&client->mutex);
+    return allocated ? 0 : -1;
+}
+
+// サーバーごとの役割、RTT、失敗の統計（書き込んだ数を返す）
+int turn_get_servers(Node* node, TurnServerInfo* servers, int max_servers) {
+    if (!node || !node->turn_data || !servers) {
+        return 0;
+    }
+    TurnData* turn_data = (TurnData*)node->turn_data;
+    int count = 0;
+    pthread_mutex_lock(&turn_data->mutex);
+    for (int i = 0; i < turn_data->server_count && count < max_servers; i++) {
+        TurnClient* client = &turn_data->clients[i];
+        TurnServerInfo* info = &servers[count++];
+        memset(info, 0, sizeof(*info));
+        strncpy(info->server, client->server, sizeof(info->server) - 1);
+        info->port = client->port;
+        info->primary = i == turn_data->primary;
+        info->standby = i == turn_data->standby;
+        info->alive = client->alive;
+        info->rtt_ms = client->rtt_ms;
+        info->probes = client->probes;
+        info->probe_failures = client->probe_failures;
+        info->allocate_failures = client->allocate_failures;
+        info->refresh_failures = client->refresh_failures;
+        info->failures = client->failures;
+    }
+    pthread_mutex_unlock(&turn_data->mutex);
+
+    for (int i = 0; i < count; i++) {
+        TurnClient* client = &turn_data->clients[i];
+        pthread_mutex_lock(&client->mutex);
+        servers[i].allocated = client->state == TURN_STATE_ALLOCATED;
+        pthread_mutex_unlock(&client->mutex);
+    }
+    return count;
+}
+
+// 完了を待つ（同期版の関数用）
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool done;
+    int result;
+} TurnWaiter;
+
+static void turn_waiter_done(Node* node, int result, void* arg) {
+    (void)node;
+    TurnWaiter* waiter = (TurnWaiter*)arg;
+    pthread_mutex_lock(&waiter->mutex);
+    waiter->result = result;
+    waiter->done = true;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->mutex);
+}
+
+static void turn_waiter_init(TurnWaiter* waiter) {
+    pthread_mutex_init(&waiter->mutex, NULL);
+    pthread_cond_init(&waiter->cond, NULL);
+    waiter->done = false;
+    waiter->result = -1;
+}
+
+// startedが0（要求を出せた）なら完了まで待つ。成功なら0、失敗なら-1を返す
+static int turn_waiter_wait(TurnWaiter* waiter, int started) {
+    if (started == 0) {
+        pthread_mutex_lock(&waiter->mutex);
+        while (!waiter->done) {
+            pthread_cond_wait(&waiter->cond, &waiter->mutex);
+        }
+        pthread_mutex_unlock(&waiter->mutex);
+    }
+    pthread_mutex_destroy(&waiter->mutex);
+    pthread_cond_destroy(&waiter->cond);
+    return started == 0 && waiter->result == 0 ? 0 : -1;
+}
+
+// 受信スレッド（コールバックの中）からは完了を待てない
+static bool turn_can_wait(Node* node) {
+    TurnData* turn_data = (TurnData*)node->turn_data;
+    for (int i = 0; i < turn_data->server_count; i++) {
+        TurnClient* client = &turn_data->clients[i];
+        if (client->receive_running && pthread_equal(pthread_self(), client->receive_thread)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// サーバーへのAllocateの送信（完了はassign_roleが役割に反映する）
+static int start_allocate(TurnClient* client) {
+    pthread_mutex_lock(&client->mutex);
+
+    // 既にアロケーション済みの場合
+    if (client->state == TURN_STATE_ALLOCATED) {
+        pthread_mutex_unlock(&client->mutex);
+        assign_role(client, true);
+        return 0;
+    }
+
+    // 要求中の場合
+    if (client->state == TURN_STATE_ALLOCATING) {
+        pthread_mutex_unlock(&client->mutex);
+        return -1;
+    }
+    client->state = TURN_STATE_ALLOCATING;
+    pthread_mutex_unlock(&client->mutex);
+
+    // アロケーション要求の属性
+    uint8_t attributes[256];
+    int attr_offset = 0;
+
+    // Requested Transport属性（UDPを指定）
+    TurnAttributeHeader* transport_attr = (TurnAttributeHeader*)(attributes + attr_offset);
+    transport_attr->type = htons(TURN_ATTR_REQUESTED_TRANSPORT);
+    transport_attr->length = htons(4);
+    attr_offset += sizeof(TurnAttributeHeader);
+
+    // UDPプロトコル（17）を指定
+    attributes[attr_offset++] = 17;  // UDP
+    attributes[attr_offset++] = 0;   // Reserved
+    attributes[attr_offset++] = 0;   // Reserved
+    attributes[attr_offset++] = 0;   // Reserved
+
+    // アロケーション要求の送信（資格情報はstart_transactionが付ける）
+    TurnTransaction request;
+    memset(&request, 0, sizeof(request));
+    if (start_transaction(client, &request, TURN_ALLOCATION_REQUEST, attributes, attr_offset) < 0) {
+        pthread_mutex_lock(&client->mutex);
+        client->state = TURN_STATE_IDLE;
+        pthread_mutex_unlock(&client->mutex);
+        return -1;
+    }
+
+    return 0;
+}
+
+// TURNアロケーションの要求（既にプライマリがあればすぐにコールバックを呼ぶ）
+//
+// サーバーが複数なら全てにBindingを送り、応答の早い順にプライマリとスタンバイを
+// アロケーションする。プライマリができた時点で完了する
+int turn_allocate_async(Node* node, TurnCallback callback, void* arg) {
+    if (!node || !node->turn_data) {
+        return -1;
+    }
+
+    TurnData* turn_data = (TurnData*)node->turn_data;
+    pthread_mutex_lock(&turn_data->mutex);
+    if (turn_data->primary >= 0) {
+        pthread_mutex_unlock(&turn_data->mutex);
+        if (callback) {
+            callback(node, 0, arg);
+        }
+        return 0;
+    }
+    if (turn_data->selecting) {
+        pthread_mutex_unlock(&turn_data->mutex);
+        return -1;
+    }
+    turn_data->selecting = true;
+    turn_data->select_callback = callback;
+    turn_data->select_arg = arg;
+    bool single = turn_data->server_count == 1;
+    if (single) {
+        turn_data->clients[0].allocating = true;
+    }
+    pthread_mutex_unlock(&turn_data->mutex);
+
+    // サーバーが1つなら調べずにアロケーションする
+    bool started;
+    if (single) {
+        started = start_allocate(&turn_data->clients[0]) == 0;
+    } else {
+        started = probe_servers(turn_data) > 0;
+    }
+    if (!started) {
+        pthread_mutex_lock(&turn_data->mutex);
+        turn_data->selecting = false;
+        turn_data->clients[0].allocating &= !single;
+        pthread_mutex_unlock(&turn_data->mutex);
         return -1;
     }
+    return 0;
 }
 
-// TURNアロケーションのリフレッシュ
-int turn_refresh(Node* node, int lifetime) {
+// 起動時の事前アロケーション（待たずに始め、失敗してもリフレッシュスレッドが作り直す）
+int turn_prealloc(Node* node, TurnCallback callback, void* arg) {
     if (!node || !node->turn_data) {
         return -1;
     }
-    
+
+    // まだアロケーションのないうちからリフレッシュスレッドを動かし、空いた役割を埋めさせる
+    // （要求より先に始めるので、アロケーションの完了と競合しない）
     TurnData* turn_data = (TurnData*)node->turn_data;
-    TurnClient* client = &turn_data->client;
-    
+    TurnClient* client = &turn_data->clients[0];
+    pthread_mutex_lock(&turn_data->mutex);
+    turn_data->last_select = time(NULL);
+    pthread_mutex_unlock(&turn_data->mutex);
+    if (!client->refresh_running) {
+        client->refresh_running = true;
+        if (pthread_create(&client->refresh_thread, NULL, turn_refresh_thread, client) != 0) {
+            perror("Failed to create TURN refresh thread");
+            client->refresh_running = false;
+            return -1;
+        }
+    }
+
+    if (turn_allocate_async(node, callback, arg) < 0) {
+        printf("TURN preallocation for node %d will be retried\n", node->id);
+        if (callback) {
+            callback(node, -1, arg);
+        }
+    }
+    return 0;
+}
+
+// TURNアロケーション（完了まで待つ）
+int turn_allocate(Node* node) {
+    if (!node || !node->turn_data || !turn_can_wait(node)) {
+        return -1;
+    }
+    TurnWaiter waiter;
+    turn_waiter_init(&waiter);
+    return turn_waiter_wait(&waiter, turn_allocate_async(node, turn_waiter_done, &waiter));
+}
+
+// サーバーへのRefreshの送信（lifetimeが0ならアロケーションを解放する）
+static int start_refresh(TurnClient* client, int lifetime, TurnCallback callback, void* arg) {
     pthread_mutex_lock(&client->mutex);
-    
+
     // アロケーションされていない場合
     if (client->state != TURN_STATE_ALLOCATED) {
         pthread_mutex_unlock(&client->mutex);
         return -1;
     }
-    
+    client->refresh_pending = true;
+    pthread_mutex_unlock(&client->mutex);
+
     // リフレッシュ要求の属性
     uint8_t attributes[256];
     int attr_offset = 0;
-    
+
     // Lifetime属性
     TurnAttributeHeader* lifetime_attr = (TurnAttributeHeader*)(attributes + attr_offset);
     lifetime_attr->type = htons(TURN_ATTR_LIFETIME);
     lifetime_attr->length = htons(4);
     attr_offset += sizeof(TurnAttributeHeader);
-    
+
     // Lifetime値（秒単位）
     *(uint32_t*)(attributes + attr_offset) = htonl(lifetime);
     attr_offset += 4;
-    
+
     // リフレッシュ要求の送信
-    if (send_turn_message(client, TURN_REFRESH_REQUEST, attributes, attr_offset) < 0) {
+    TurnTransaction request;
+    memset(&request, 0, sizeof(request));
+    request.lifetime = lifetime;
+    request.callback = callback;
+    request.arg = arg;
+    if (start_transaction(client, &request, TURN_REFRESH_REQUEST, attributes, attr_offset) < 0) {
+        pthread_mutex_lock(&client->mutex);
+        client->refresh_pending = false;
         pthread_mutex_unlock(&client->mutex);
         return -1;
     }
-    
-    // 応答の受信
-    uint8_t response[TURN_MAX_BUFFER];
-    uint16_t response_type, response_length;
-    if (receive_turn_message(client, response, sizeof(response), 
-                            &response_type, &response_length) < 0) {
-        pthread_mutex_unlock(&client->mutex);
+
+    return 0;
+}
+
+// TURNアロケーションのリフレッシュの要求（プライマリのアロケーション）
+int turn_refresh_async(Node* node, int lifetime, TurnCallback callback, void* arg) {
+    if (!node || !node->turn_data) {
         return -1;
     }
-    
-    // 応答の解析
-    if (response_type == TURN_REFRESH_RESPONSE) {
-        // リフレッシュ成功
-        client->allocation_expiry = time(NULL) + lifetime;
-        
-        printf("TURN refresh successful for node %d. New expiry: %ld\n", 
-               node->id, client->allocation_expiry);
-        
-        pthread_mutex_unlock(&client->mutex);
-        return 0;
-    } else {
-        // リフレッシュ失敗
-        printf("TURN refresh failed for node %d\n", node->id);
-        
-        pthread_mutex_unlock(&client->mutex);
+    TurnClient* client = primary_client((TurnData*)node->turn_data);
+    return client ? start_refresh(client, lifetime, callback, arg) : -1;
+}
+
+// TURNアロケーションのリフレッシュ（完了まで待つ）
+int turn_refresh(Node* node, int lifetime) {
+    if (!node || !node->turn_data || !turn_can_wait(node)) {
         return -1;
     }
+    TurnWaiter waiter;
+    turn_waiter_init(&waiter);
+    return turn_waiter_wait(&waiter, turn_refresh_async(node, lifetime, turn_waiter_done, &waiter));
 }
 
-// TURNリフレッシュスレッド
+// 空いた役割があれば、TURN_PROBE_INTERVAL秒ごとに残りのサーバーを調べ直す
+static void maintain_roles(TurnData* turn_data, time_t now) {
+    pthread_mutex_lock(&turn_data->mutex);
+    bool due = (turn_data->primary < 0 || (turn_data->standby < 0 && turn_data->server_count > 1)) &&
+               now - turn_data->last_select >= TURN_PROBE_INTERVAL;
+    pthread_mutex_unlock(&turn_data->mutex);
+    if (due) {
+        probe_servers(turn_data);
+    }
+}
+
+// TURNリフレッシュスレッド（サーバーごと。argはTurnClient）
 void* turn_refresh_thread(void* arg) {
-    Node* node = (Node*)arg;
-    TurnData* turn_data = (TurnData*)node->turn_data;
-    TurnClient* client = &turn_data->client;
-    
+    TurnClient* client = (TurnClient*)arg;
+    TurnData* turn_data = (TurnData*)client->node->turn_data;
+
     while (client->refresh_running) {
-        // アロケーション期限の80%経過時にリフレッシュ
+        // アロケーション期限の80%経過時にリフレッシュ（応答は待たない）
         time_t now = time(NULL);
+        pthread_mutex_lock(&client->mutex);
+        bool allocated = client->state == TURN_STATE_ALLOCATED;
         time_t refresh_time = client->allocation_expiry - (TURN_ALLOCATION_LIFETIME * 0.2);
-        
-        if (now >= refresh_time) {
-            turn_refresh(node, TURN_ALLOCATION_LIFETIME);
+        bool due = allocated && now >= refresh_time && !client->refresh_pending;
+        pthread_mutex_unlock(&client->mutex);
+
+        if (due) {
+            start_refresh(client, TURN_ALLOCATION_LIFETIME, NULL, NULL);
         }
-        
-        // 10秒ごとにチェック
-        sleep(10);
+
+        if (allocated) {
+            // サーバーの生存確認
+            probe_client(client, now);
+
+            // プライマリで使われている相手をスタンバイにも記録する
+            sync_standby(turn_data, client, now);
+
+            // 新しい相手のチャネルのバインドと期限の近いチャネルの再バインド
+            turn_maintain_channels(client);
+
+            // 使われているパーミッションの更新
+            turn_maintain_permissions(client);
+        }
+        maintain_roles(turn_data, now);
+
+        // 1秒ごとにチェック（新しい相手はすぐにChannelDataへ切り替える）
+        sleep(1);
     }
-    
+
     return NULL;
 }
 
-// TURNパーミッションの作成
-int turn_create_permission(Node* node, const char* peer_ip) {
+// TURNパーミッションの作成の要求（表に記録し、以後は期限の前に自動で更新する）
+int turn_create_permission_async(Node* node, const char* peer_ip, TurnCallback callback, void* arg) {
     if (!node || !node->turn_data || !peer_ip) {
         return -1;
     }
     
-    TurnData* turn_data = (TurnData*)node->turn_data;
-    TurnClient* client = &turn_data->client;
+    TurnClient* client = primary_client((TurnData*)node->turn_data);
+    struct in_addr addr;
+    if (!client || !inet_aton(peer_ip, &addr)) {
+        return -1;
+    }
+    
+    // アロケーションされていない場合
+    pthread_mutex_lock(&client->mutex);
+    bool allocated = client->state == TURN_STATE_ALLOCATED;
+    pthread_mutex_unlock(&client->mutex);
+    if (!allocated) {
+        return -1;
+    }
+    
+    // 表への記録
+    time_t now = time(NULL);
+    pthread_mutex_lock(&client->channel_mutex);
+    TurnPermission* permission = find_permission(client, addr);
+    if (!permission) {
+        permission = add_permission(client, addr, now);
+    }
+    if (permission) {
+        permission->last_used = now;
+        permission->pending = true;
+    }
+    pthread_mutex_unlock(&client->channel_mutex);
+    
+    // パーミッション要求の送信（要求の表が一杯なら、表のエントリを次の要求にまとめて出し直し、
+    // 完了はそのときに知らせる）
+    if (send_permission_request(client, &addr, 1, callback, arg) < 0) {
+        pthread_mutex_lock(&client->channel_mutex);
+        bool queued = permission && (!callback || client->permission_waiter_count < TURN_MAX_PERMISSIONS);
+        if (queued) {
+            requeue_permissions(client, &addr, 1);
+            if (callback) {
+                TurnPermissionWaiter* waiter = &client->permission_waiters[client->permission_waiter_count++];
+                waiter->addr = addr;
+                waiter->callback = callback;
+                waiter->arg = arg;
+            }
+        } else if (permission) {
+            permission->pending = false;
+        }
+        pthread_mutex_unlock(&client->channel_mutex);
+        return queued ? 0 : -1;
+    }
+    return 0;
+}
+
+// 相手をパーミッションの表に加える（要求は新しい相手の送信と同じく、応答待ちの要求がなければ
+// その場で、あればその完了時にまとめて出す。アロケーションの前ならリフレッシュスレッドが出す）
+int turn_add_permission(Node* node, const char* peer_ip) {
+    if (!node || !node->turn_data || !peer_ip) {
+        return -1;
+    }
+    
+    TurnClient* client = primary_client((TurnData*)node->turn_data);
+    struct in_addr addr;
+    if (!client || !inet_aton(peer_ip, &addr)) {
+        return -1;
+    }
     
     pthread_mutex_lock(&client->mutex);
+    bool allocated = client->state == TURN_STATE_ALLOCATED;
+    pthread_mutex_unlock(&client->mutex);
+    
+    time_t now = time(NULL);
+    pthread_mutex_lock(&client->channel_mutex);
+    TurnPermission* permission = find_permission(client, addr);
+    if (!permission) {
+        permission = add_permission(client, addr, now);
+    }
+    bool request = false;
+    if (permission) {
+        permission->last_used = now;
+        request = allocated && permission->expiry <= now && !permission->pending && client->permission_requests == 0;
+    }
+    pthread_mutex_unlock(&client->channel_mutex);
+    if (!permission) {
+        return -1;
+    }
+    
+    if (request) {
+        request_permissions(client, now);
+    }
+    return 0;
+}
+
+// TURNパーミッションの作成（完了まで待つ）
+int turn_create_permission(Node* node, const char* peer_ip) {
+    if (!node || !node->turn_data || !turn_can_wait(node)) {
+        return -1;
+    }
+    TurnWaiter waiter;
+    turn_waiter_init(&waiter);
+    return turn_waiter_wait(&waiter, turn_create_permission_async(node, peer_ip, turn_waiter_done, &waiter));
+}
+
+// 相手のチャネル（channel_mutexを持って呼ぶ）
+static TurnChannel* find_channel_by_peer(TurnClient* client, const struct sockaddr_in* peer) {
+    for (int i = 0; i < client->channel_count; i++) {
+        if (client->channels[i].peer.sin_addr.s_addr == peer->sin_addr.s_addr &&
+            client->channels[i].peer.sin_port == peer->sin_port) {
+            return &client->channels[i];
+        }
+    }
+    return NULL;
+}
+
+static TurnChannel* find_channel_by_number(TurnClient* client, uint16_t number) {
+    for (int i = 0; i < client->channel_count; i++) {
+        if (client->channels[i].number == number) {
+            return &client->channels[i];
+        }
+    }
+    return NULL;
+}
+
+// 相手にチャネル番号を割り当てる（バインドはまだ）
+static TurnChannel* add_channel(TurnClient* client, const struct sockaddr_in* peer) {
+    if (client->channel_count >= TURN_MAX_CHANNELS) {
+        return NULL;
+    }
+    
+    // 使用中の番号は飛ばす
+    uint16_t number = client->next_channel;
+    while (find_channel_by_number(client, number)) {
+        number = number == TURN_CHANNEL_MAX ? TURN_CHANNEL_MIN : number + 1;
+    }
+    client->next_channel = number == TURN_CHANNEL_MAX ? TURN_CHANNEL_MIN : number + 1;
+    
+    TurnChannel* channel = &client->channels[client->channel_count++];
+    memset(channel, 0, sizeof(TurnChannel));
+    channel->peer = *peer;
+    channel->number = number;
+    channel->last_used = time(NULL);
+    return channel;
+}
+
+static int make_peer_addr(const char* peer_ip, int peer_port, struct sockaddr_in* peer) {
+    memset(peer, 0, sizeof(*peer));
+    peer->sin_family = AF_INET;
+    peer->sin_port = htons(peer_port);
+    return inet_aton(peer_ip, &peer->sin_addr) ? 0 : -1;
+}
+
+// ChannelDataの送信（ヘッダーとデータを別々のバッファのまま送る）
+static int send_channel_data(TurnClient* client, uint16_t number, const void* data, int data_len) {
+    uint8_t header[TURN_CHANNEL_HEADER];
+    header[0] = number >> 8;
+    header[1] = number & 0xFF;
+    header[2] = (data_len >> 8) & 0xFF;
+    header[3] = data_len & 0xFF;
+    
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = data_len;
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &client->server_addr;
+    msg.msg_namelen = sizeof(client->server_addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (sendmsg(client->socket_fd, &msg, 0) < 0) {
+        if (errno != ECONNREFUSED) {
+            perror("Failed to send TURN channel data");  // ECONNREFUSEDは呼び出し側が切り替える
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// サーバーへのChannelBindの送信（既にバインドしていれば更新する）
+static int start_bind(TurnClient* client, const char* peer_ip, int peer_port, TurnCallback callback, void* arg) {
+    TurnTransaction request;
+    memset(&request, 0, sizeof(request));
+    if (make_peer_addr(peer_ip, peer_port, &request.peer) < 0) {
+        return -1;
+    }
+    request.callback = callback;
+    request.arg = arg;
     
     // アロケーションされていない場合
-    if (client->state != TURN_STATE_ALLOCATED) {
-        pthread_mutex_unlock(&client->mutex);
+    pthread_mutex_lock(&client->mutex);
+    bool allocated = client->state == TURN_STATE_ALLOCATED;
+    pthread_mutex_unlock(&client->mutex);
+    if (!allocated) {
         return -1;
     }
     
-    // パーミッション要求の属性
-    uint8_t attributes[256];
+    // チャネル番号の割り当て
+    pthread_mutex_lock(&client->channel_mutex);
+    TurnChannel* channel = find_channel_by_peer(client, &request.peer);
+    if (!channel) {
+        channel = add_channel(client, &request.peer);
+    }
+    if (channel) {
+        request.channel = channel->number;
+        channel->binding = true;
+    }
+    pthread_mutex_unlock(&client->channel_mutex);
+    if (!channel) {
+        return -1;
+    }
+    
+    // Channel Bind要求の属性
+    uint8_t attributes[32];
     int attr_offset = 0;
     
+    // Channel-Number属性（番号 + 予約2バイト）
+    TurnAttributeHeader* number_attr = (TurnAttributeHeader*)(attributes + attr_offset);
+    number_attr->type = htons(TURN_ATTR_CHANNEL_NUMBER);
+    number_attr->length = htons(4);
+    attr_offset += sizeof(TurnAttributeHeader);
+    *(uint16_t*)(attributes + attr_offset) = htons(request.channel);
+    *(uint16_t*)(attributes + attr_offset + 2) = 0;
+    attr_offset += 4;
+    
     // XOR-Peer-Address属性
     TurnAttributeHeader* peer_addr_attr = (TurnAttributeHeader*)(attributes + attr_offset);
     peer_addr_attr->type = htons(TURN_ATTR_XOR_PEER_ADDRESS);
     peer_addr_attr->length = htons(8);
     attr_offset += sizeof(TurnAttributeHeader);
-    
-    // アドレスファミリー（IPv4）
     attributes[attr_offset++] = 0;
     attributes[attr_offset++] = 1;  // IPv4
-    
-    // ポート（XOR処理）
-    uint16_t port = 0;  // ポートは0でよい（IPアドレスのみのパーミッション）
-    *(uint16_t*)(attributes + attr_offset) = htons(port ^ (0x2112A442 >> 16));
+    *(uint16_t*)(attributes + attr_offset) = htons(peer_port ^ (0x2112A442 >> 16));
     attr_offset += 2;
-    
-    // IPアドレス（XOR処理）
-    struct in_addr addr;
-    inet_aton(peer_ip, &addr);
-    *(uint32_t*)(attributes + attr_offset) = addr.s_addr ^ htonl(0x2112A442);
+    *(uint32_t*)(attributes + attr_offset) = request.peer.sin_addr.s_addr ^ htonl(0x2112A442);
     attr_offset += 4;
     
-    // パーミッション要求の送信
-    if (send_turn_message(client, TURN_CREATE_PERMISSION_REQUEST, attributes, attr_offset) < 0) {
-        pthread_mutex_unlock(&client->mutex);
+    // Channel Bind要求の送信（要求を出せなければ後で再試行する）
+    if (start_transaction(client, &request, TURN_CHANNEL_BIND_REQUEST, attributes, attr_offset) < 0) {
+        pthread_mutex_lock(&client->channel_mutex);
+        channel = find_channel_by_peer(client, &request.peer);
+        if (channel && channel->number == request.channel) {
+            channel->binding = false;
+            channel->retry_at = time(NULL) + TURN_CHANNEL_RETRY;
+        }
+        pthread_mutex_unlock(&client->channel_mutex);
         return -1;
     }
     
-    // 応答の受信
-    uint8_t response[TURN_MAX_BUFFER];
-    uint16_t response_type, response_length;
-    if (receive_turn_message(client, response, sizeof(response), 
-                            &response_type, &response_length) < 0) {
-        pthread_mutex_unlock(&client->mutex);
+    return 0;
+}
+
+// TURNチャネルのバインドの要求（プライマリのアロケーション）
+int turn_bind_channel_async(Node* node, const char* peer_ip, int peer_port, TurnCallback callback, void* arg) {
+    if (!node || !node->turn_data || !peer_ip) {
         return -1;
     }
-    
-    // 応答の解析
-    if (response_type == TURN_CREATE_PERMISSION_RESPONSE) {
-        // パーミッション作成成功
-        printf("TURN permission created for node %d to peer %s\n", 
-               node->id, peer_ip);
-        
-        pthread_mutex_unlock(&client->mutex);
-        return 0;
-    } else {
-        // パーミッション作成失敗
-        printf("TURN permission creation failed for node %d to peer %s\n", 
-               node->id, peer_ip);
-        
-        pthread_mutex_unlock(&client->mutex);
+    TurnClient* client = primary_client((TurnData*)node->turn_data);
+    return client ? start_bind(client, peer_ip, peer_port, callback, arg) : -1;
+}
+
+// TURNチャネルのバインド（完了まで待つ）
+int turn_bind_channel(Node* node, const char* peer_ip, int peer_port) {
+    if (!node || !node->turn_data || !turn_can_wait(node)) {
         return -1;
     }
+    TurnWaiter waiter;
+    turn_waiter_init(&waiter);
+    return turn_waiter_wait(&waiter, turn_bind_channel_async(node, peer_ip, peer_port, turn_waiter_done, &waiter));
 }
 
-// TURNを使用したデータ送信
-int turn_send_data(Node* node, const char* peer_ip, int peer_port, const void* data, int data_len) {
-    if (!node || !node->turn_data || !peer_ip || !data || data_len <= 0) {
-        return -1;
+// 相手ごとのチャネルを使うかどうか（使わなければ常にSend Indicationで送る）
+void turn_set_channel_binding(Node* node, bool enabled) {
+    if (!node || !node->turn_data) {
+        return;
     }
-    
     TurnData* turn_data = (TurnData*)node->turn_data;
-    TurnClient* client = &turn_data->client;
+    for (int i = 0; i < turn_data->server_count; i++) {
+        TurnClient* client = &turn_data->clients[i];
+        pthread_mutex_lock(&client->channel_mutex);
+        client->use_channels = enabled;
+        pthread_mutex_unlock(&client->channel_mutex);
+    }
+}
+
+// プライマリで使われているチャネルとパーミッションをスタンバイにも記録する
+// （バインドと作成はスタンバイのリフレッシュスレッドが行う）
+static void sync_standby(TurnData* turn_data, TurnClient* primary, time_t now) {
+    pthread_mutex_lock(&turn_data->mutex);
+    TurnClient* standby = turn_data->standby >= 0 && turn_data->primary == primary->index
+                              ? &turn_data->clients[turn_data->standby] : NULL;
+    pthread_mutex_unlock(&turn_data->mutex);
+    if (!standby) {
+        return;
+    }
+
+    struct sockaddr_in peers[TURN_MAX_CHANNELS];
+    time_t peer_used[TURN_MAX_CHANNELS];
+    struct in_addr addrs[TURN_MAX_PERMISSIONS];
+    time_t addr_used[TURN_MAX_PERMISSIONS];
+    int peer_count = 0;
+    int addr_count = 0;
+
+    pthread_mutex_lock(&primary->channel_mutex);
+    bool use_channels = primary->use_channels;
+    for (int i = 0; i < primary->channel_count; i++) {
+        if (now - primary->channels[i].last_used < TURN_CHANNEL_LIFETIME) {
+            peers[peer_count] = primary->channels[i].peer;
+            peer_used[peer_count++] = primary->channels[i].last_used;
+        }
+    }
+    for (int i = 0; i < primary->permission_count; i++) {
+        if (now - primary->permissions[i].last_used < TURN_PERMISSION_LIFETIME) {
+            addrs[addr_count] = primary->permissions[i].addr;
+            addr_used[addr_count++] = primary->permissions[i].last_used;
+        }
+    }
+    pthread_mutex_unlock(&primary->channel_mutex);
+
+    pthread_mutex_lock(&standby->channel_mutex);
+    standby->use_channels = use_channels;
+    for (int i = 0; i < peer_count; i++) {
+        TurnChannel* channel = find_channel_by_peer(standby, &peers[i]);
+        if (!channel) {
+            channel = add_channel(standby, &peers[i]);
+        }
+        if (channel && channel->last_used < peer_used[i]) {
+            channel->last_used = peer_used[i];
+        }
+    }
+    for (int i = 0; i < addr_count; i++) {
+        TurnPermission* permission = find_permission(standby, addrs[i]);
+        if (!permission) {
+            permission = add_permission(standby, addrs[i], addr_used[i]);
+        }
+        if (permission && permission->last_used < addr_used[i]) {
+            permission->last_used = addr_used[i];
+        }
+    }
+    pthread_mutex_unlock(&standby->channel_mutex);
+}
+
+// チャネルのバインドと再バインド（リフレッシュスレッドから呼ばれる）
+static void turn_maintain_channels(TurnClient* client) {
+    struct sockaddr_in due[TURN_MAX_CHANNELS];
+    int due_count = 0;
+    time_t now = time(NULL);
+    
+    pthread_mutex_lock(&client->channel_mutex);
+    for (int i = 0; i < client->channel_count;) {
+        TurnChannel* channel = &client->channels[i];
+        bool idle = now - channel->last_used >= TURN_CHANNEL_LIFETIME;
+        
+        // 使われなくなったチャネルは、サーバー上でも切れてから外す（同じ相手に別の番号を
+        // バインドできるのはその後）
+        if (idle && now >= channel->expiry + (TURN_CHANNEL_LIFETIME - TURN_PERMISSION_LIFETIME)) {
+            client->channels[i] = client->channels[--client->channel_count];
+            continue;
+        }
+        if (!idle && client->use_channels && !channel->binding && channel->retry_at <= now &&
+            channel->expiry - now <= TURN_CHANNEL_REFRESH_MARGIN) {
+            due[due_count++] = channel->peer;
+        }
+        i++;
+    }
+    pthread_mutex_unlock(&client->channel_mutex);
     
-    pthread_mutex_lock(&client->mutex);
+    // 応答は待たない（完了は受信スレッドがチャネルに反映する）
+    for (int i = 0; i < due_count; i++) {
+        char peer_ip[MAX_IP_STR_LEN];
+        inet_ntop(AF_INET, &due[i].sin_addr, peer_ip, sizeof(peer_ip));
+        start_bind(client, peer_ip, ntohs(due[i].sin_port), NULL, NULL);
+    }
+}
+
+// サーバー経由のデータ送信
+static int send_data_via(TurnClient* client, const char* peer_ip, int peer_port, const void* data, int data_len) {
+    // バインド済みのチャネルがあればChannelDataで送る（なければ割り当てだけして、
+    // バインドはリフレッシュスレッドに任せる）
+    struct sockaddr_in peer;
+    if (data_len > 0xFFFF || make_peer_addr(peer_ip, peer_port, &peer) < 0) {
+        return -1;
+    }
+    time_t now = time(NULL);
+    __atomic_store_n(&client->last_data_ms, turn_now_ms(), __ATOMIC_RELAXED);  // 受信スレッドがプライマリを頻繁に調べる
+    uint16_t number = 0;
+    pthread_mutex_lock(&client->channel_mutex);
+    if (client->use_channels) {
+        TurnChannel* channel = find_channel_by_peer(client, &peer);
+        if (!channel && client->state == TURN_STATE_ALLOCATED) {
+            channel = add_channel(client, &peer);
+        }
+        if (channel) {
+            channel->last_used = now;
+            if (channel->expiry > now) {
+                number = channel->number;
+            }
+        }
+    }
+    
+    // Send Indicationで送るならパーミッションの表を引く（ないか切れていればその場で要求する。
+    // 応答待ちの要求があれば、その応答が来たときにまとめて要求する）
+    bool request = false;
+    if (number == 0 && client->state == TURN_STATE_ALLOCATED) {
+        TurnPermission* permission = find_permission(client, peer.sin_addr);
+        if (!permission) {
+            permission = add_permission(client, peer.sin_addr, now);
+        }
+        if (permission) {
+            permission->last_used = now;
+            request = permission->expiry <= now && !permission->pending && permission->retry_at <= now &&
+                      client->permission_requests == 0;
+        }
+    }
+    pthread_mutex_unlock(&client->channel_mutex);
+    if (number != 0) {
+        return send_channel_data(client, number, data, data_len);
+    }
+    if (request) {
+        request_permissions(client, now);
+    }
     
     // アロケーションされていない場合
-    if (client->state != TURN_STATE_ALLOCATED) {
-        pthread_mutex_unlock(&client->mutex);
+    pthread_mutex_lock(&client->mutex);
+    bool allocated = client->state == TURN_STATE_ALLOCATED;
+    pthread_mutex_unlock(&client->mutex);
+    if (!allocated) {
         return -1;
     }
     
@@ -582,28 +2295,84 @@ int turn_send_data(Node* node, const char* peer_ip, int peer_port, const void* d
         attributes[attr_offset++] = 0;
     }
     
-    // Send Indicationの送信
+    // Send Indicationの送信（応答はないので要求の表は使わない）
+    // （ChannelDataと同じく、データごとには表示しない）
     if (send_turn_message(client, TURN_SEND_INDICATION, attributes, attr_offset) < 0) {
-        pthread_mutex_unlock(&client->mutex);
         return -1;
     }
     
-    printf("TURN data sent from node %d to %s:%d (%d bytes)\n", 
-           node->id, peer_ip, peer_port, data_len);
-    
-    pthread_mutex_unlock(&client->mutex);
     return 0;
 }
 
-// TURNからのデータ処理
-int turn_process_data(Node* node, const void* data, int data_len, char* from_ip, int* from_port) {
-    if (!node || !node->turn_data || !data || data_len <= 0 || !from_ip || !from_port) {
+// TURNを使用したデータ送信（プライマリのサーバー経由。プライマリの応答が遅れている間は
+// スタンバイ経由でも送る）
+int turn_send_data(Node* node, const char* peer_ip, int peer_port, const void* data, int data_len) {
+    if (!node || !node->turn_data || !peer_ip || !data || data_len <= 0) {
+        return -1;
+    }
+    
+    TurnData* turn_data = (TurnData*)node->turn_data;
+    TurnClient* client = primary_client(turn_data);
+    if (!client) {
         return -1;
     }
+    int result = send_data_via(client, peer_ip, peer_port, data, data_len);
+    if (__atomic_load_n(&client->suspect, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&turn_data->mutex);
+        TurnClient* standby = turn_data->standby >= 0 ? &turn_data->clients[turn_data->standby] : NULL;
+        pthread_mutex_unlock(&turn_data->mutex);
+        if (standby && send_data_via(standby, peer_ip, peer_port, data, data_len) == 0) {
+            result = 0;
+        }
+    }
     
+    // 送信でサーバーが落ちていると分かったら（ICMP）、スタンバイへ切り替えて送り直す
+    if (result < 0 && errno == ECONNREFUSED) {
+        drop_server(client, "port unreachable", true);
+        TurnClient* next = primary_client(turn_data);
+        if (next && next != client) {
+            result = send_data_via(next, peer_ip, peer_port, data, data_len);
+        }
+    }
+    return result;
+}
+
+// サーバーから届いたデータの処理（ChannelDataのチャネルはそのサーバーのもの）
+static int process_client_data(TurnClient* client, const void* data, int data_len, char* from_ip,
+                               int* from_port, const void** payload_out) {
     // TURNメッセージの解析
     const uint8_t* buffer = (const uint8_t*)data;
     
+    // ChannelData（先頭2ビットが01、チャネル番号 + 長さ + データ）
+    if ((buffer[0] & 0xC0) == 0x40) {
+        if (data_len < TURN_CHANNEL_HEADER) {
+            return -1;
+        }
+        uint16_t number = (buffer[0] << 8) | buffer[1];
+        int length = (buffer[2] << 8) | buffer[3];
+        if (length == 0 || length > data_len - TURN_CHANNEL_HEADER) {
+            return -1;
+        }
+        
+        pthread_mutex_lock(&client->channel_mutex);
+        TurnChannel* channel = find_channel_by_number(client, number);
+        struct sockaddr_in peer;
+        if (channel) {
+            peer = channel->peer;
+        }
+        pthread_mutex_unlock(&client->channel_mutex);
+        if (!channel) {
+            return -1;
+        }
+        
+        inet_ntop(AF_INET, &peer.sin_addr, from_ip, MAX_IP_STR_LEN);
+        *from_port = ntohs(peer.sin_port);
+        if (payload_out) {
+            *payload_out = buffer + TURN_CHANNEL_HEADER;
+        }
+        return length;
+    }
+    
     // ヘッダの確認
     if (data_len < sizeof(TurnMessageHeader)) {
         return -1;
@@ -655,13 +2424,23 @@ int turn_process_data(Node* node, const void* data, int data_len, char* from_ip,
         
         // ペイロードが見つかった場合
         if (payload && payload_len > 0) {
-            printf("TURN data received by node %d from %s:%d (%d bytes)\n", 
-                   node->id, from_ip, *from_port, payload_len);
-            
             // ペイロードを返す
+            if (payload_out) {
+                *payload_out = payload;
+            }
             return payload_len;
         }
     }
     
     return -1;
-}
\ No newline at end of file
+}
+
+// TURNからのデータ処理（プライマリのサーバーから届いたもの）
+int turn_process_data(Node* node, const void* data, int data_len, char* from_ip, int* from_port,
+                      const void** payload_out) {
+    if (!node || !node->turn_data || !data || data_len <= 0 || !from_ip || !from_port) {
+        return -1;
+    }
+    TurnClient* client = primary_client((TurnData*)node->turn_data);
+    return client ? process_client_data(client, data, data_len, from_ip, from_port, payload_out) : -1;
+}
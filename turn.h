@@ -11,6 +11,109 @@ typedef struct TurnData TurnData;
 #define TURN_MAX_BUFFER 1500
 #define TURN_ALLOCATION_LIFETIME 600  // 10分（秒単位）
 
+// チャネル
+//
+// 相手ごとにチャネル番号をバインドし、データは4バイトのChannelData（チャネル番号と長さ）
+// で送受信する。Send Indication（20バイトのSTUNヘッダーとXOR-PEER-ADDRESS・DATA属性）
+// より36バイト以上小さく、データもコピーしない。初めての相手にはSend Indicationで送り、
+// リフレッシュスレッドがバインドする。ChannelBindは相手へのパーミッションも更新するが、
+// パーミッションは5分で切れるため、期限のTURN_CHANNEL_REFRESH_MARGIN秒前に再バインドする。
+// TURN_CHANNEL_LIFETIMEの間使わなかったチャネルは更新せずに外す。
+#define TURN_CHANNEL_MIN 0x4000          // チャネル番号の範囲
+#define TURN_CHANNEL_MAX 0x4FFF
+#define TURN_MAX_CHANNELS 64             // バインドする相手の数
+#define TURN_CHANNEL_LIFETIME 600        // サーバー上のチャネルの有効期間（秒）
+#define TURN_PERMISSION_LIFETIME 300     // パーミッションの有効期間（秒）
+#define TURN_CHANNEL_REFRESH_MARGIN 60   // 期限のこの秒数前に再バインドする
+#define TURN_CHANNEL_RETRY 30            // バインドに失敗したら再試行までこの秒数待つ
+#define TURN_CHANNEL_HEADER 4            // ChannelDataのヘッダー長
+
+// パーミッション
+//
+// 相手のIPアドレスごとのパーミッションを期限付きで表に記録する。送信は表を引くだけで、
+// 初めての相手にはその場でCreatePermissionを出す（応答は待たない）。要求の応答待ちの間に
+// 現れた相手は、応答が来たときにまとめて次の要求に載せる。使われているパーミッションは
+// 期限のTURN_PERMISSION_REFRESH_MARGIN秒前にまとめて更新する
+// （1つのCreatePermissionに最大TURN_PERMISSION_BATCH個のXOR-PEER-ADDRESSを載せる）。
+// バインド済みのチャネルがある相手はChannelBindの再バインドで更新されるので除く。
+// TURN_PERMISSION_LIFETIMEの間使われず期限の切れたパーミッションは表から外す。
+// 要求の表（TURN_MAX_TRANSACTIONS）が一杯で出せなかった相手は表に残し、次にどれかの要求が
+// 完了したときにまとめて出し直す（turn_create_permission_asyncの完了もそのときに知らせる）。
+// turn_add_permissionは相手を表に加えるだけで、要求は送信と同じくまとめて出す。
+#define TURN_MAX_PERMISSIONS 256         // 記録する相手の数
+#define TURN_PERMISSION_SLOTS 512        // 索引のハッシュ表の大きさ（2の冪）
+#define TURN_PERMISSION_BATCH 32         // 1つの要求に載せる相手の数
+#define TURN_PERMISSION_REFRESH_MARGIN 60 // 期限のこの秒数前に更新する
+#define TURN_PERMISSION_RETRY 30         // 失敗したら再試行までこの秒数待つ
+
+// トランザクション
+//
+// 要求（Allocate・Refresh・CreatePermission・ChannelBind）はトランザクションIDで表に入れて
+// すぐに戻り、完了はコールバックで知らせる。ソケットは受信スレッドだけが読み、応答は表と
+// 突き合わせて完了させ、ChannelDataとData Indicationはデータハンドラへ渡す。応答を待つ間も
+// データの送受信は止まらず、複数の要求を同時に出せる。
+//
+// 応答がなければRFC 5389のタイマーで再送する（RTOはTURN_RTO_MSから倍々、TURN_RC回送り、
+// 最後の送信からTURN_RM * TURN_RTO_MS待っても応答がなければ失敗）。
+#define TURN_RTO_MS 500                  // 最初の再送までの時間
+#define TURN_RC 7                        // 要求を送る回数
+#define TURN_RM 16                       // 最後の送信の後に待つ時間（RTOの倍数）
+#define TURN_MAX_TRANSACTIONS 32         // 同時に出せる要求の数
+#define TURN_MAX_REQUEST 1024            // 要求メッセージの最大長（認証の属性を含む）
+
+// 認証（RFC 5766の長期の資格情報）
+//
+// 最初のAllocateは資格情報なしで送り、サーバーが401でREALMとNONCEを返したら、
+// 鍵 = MD5(ユーザー名:REALM:パスワード)を作って同じ要求を1回だけ送り直す。以後の要求
+// （Bindingを除く）にはUSERNAME・REALM・NONCE・MESSAGE-INTEGRITY（HMAC-SHA1）を付ける。
+// NONCEが期限切れ（438）なら新しいNONCEで1回だけ送り直す。Indication・ChannelDataには
+// 付けない（RFC 5766と同じく、アロケーションのクライアントのアドレスで受け付けられる）。
+#define TURN_MESSAGE_INTEGRITY_SIZE 24   // MESSAGE-INTEGRITY属性（ヘッダー + HMAC-SHA1）
+#define TURN_POLL_MS 100                 // 受信スレッドが停止を確認する間隔
+
+// 複数のサーバー
+//
+// サーバーごとにクライアント（ソケット、受信スレッド、要求の表、チャネルとパーミッション）を
+// 持つ。アロケーションの前に全てのサーバーへ同時にBindingを送り、最初に応答したサーバー
+// （RTTが最小）にアロケーションして中継に使い（プライマリ）、次に応答したサーバーに予備の
+// アロケーションを持つ（スタンバイ）。プライマリで使われているチャネルとパーミッションは
+// リフレッシュスレッドがスタンバイにも写し、スタンバイのサーバー上でもバインドしておく。
+//
+// アロケーション済みのサーバーにはTURN_PROBE_INTERVAL秒ごとにBindingを送り、応答がないか、
+// ICMPでポートに届かないと分かるか、Refreshに失敗すればそのサーバーを外す。プライマリを
+// 外したらすぐにスタンバイへ切り替えるので、以後の送信はそのままスタンバイのチャネルで
+// 中継される。空いた役割は残りのサーバーを改めて調べて埋める。
+//
+// プライマリでデータを送っている間（最後の送信からTURN_ACTIVE_WINDOW_MS以内）は、受信
+// スレッドがTURN_ACTIVE_PROBE_MSごとにBindingを送る。RTOはRTTのTURN_ACTIVE_RTO_FACTOR倍
+// （TURN_ACTIVE_RTO_MIN_MS以上）で、TURN_PROBE_SENDS回続けて応答がなければ、5秒ごとの確認を
+// 待たずにプライマリを外す（RTTが数ミリ秒なら0.1秒ほど、30ミリ秒なら0.6秒ほどで切り替わる）。
+// 速い確認はスタンバイがあるときだけ行う。切り替え先がなければ一時的な遅れで唯一の
+// アロケーションを失うだけなので、通常のRTO（TURN_RTO_MS）の確認で判断する。
+// 速い確認のBindingを再送し始めたら（最初の送信に応答がない）、外すかどうか決まるまで
+// 相手への送信をスタンバイにも複製するので、送る側で失われるのは最初のRTOの間だけになる。
+// 相手からの送信は相手が新しいリレーアドレスを知るまで古いプライマリへ届くので、切り替え
+// までの分は失われる。
+//
+// 切り替えで中継に使うリレーアドレスが変わると、turn_set_relay_handlerで設定した関数に
+// 知らせる。相手はまだ古いアドレスへ送っているので、新しいアドレスを伝えるのは呼び出し側
+// （ICEはRelay候補を更新し、新しいリレー経由で相手に候補の更新を送る）。
+#define TURN_MAX_SERVERS 4               // 設定できるサーバーの数
+#define TURN_PROBE_INTERVAL 5            // アロケーション済みのサーバーを調べる間隔（秒）
+#define TURN_PROBE_SENDS 3               // Bindingを送る回数（最後の送信の後はRTOだけ待つ）
+#define TURN_ACTIVE_WINDOW_MS 1000       // 最後の送信からこの時間はデータが流れているとみなす
+#define TURN_ACTIVE_PROBE_MS 25          // データが流れている間にプライマリを調べる間隔
+#define TURN_ACTIVE_RTO_FACTOR 3         // その間のBindingのRTO（平滑化したRTTの倍数）
+#define TURN_ACTIVE_RTO_MIN_MS 10
+
+// 事前アロケーション
+//
+// turn_preallocはノードの起動時（turn_initの直後）に呼び、応答を待たずにアロケーションを
+// 始める。直接の接続に失敗した相手へ中継に切り替えるときには、アロケーションが済んでいて、
+// 最初のデータはその場のパーミッションの要求の後ろに続けて送るだけになる。アロケーションは
+// ノードの全ての相手で共有する。最初のアロケーションに失敗しても、リフレッシュスレッドが
+// TURN_PROBE_INTERVAL秒ごとにサーバーを調べ直して作り直す（使えるアロケーションを保つ）。
+
 // TURNメッセージタイプ
 typedef enum {
     TURN_ALLOCATION_REQUEST = 0x0003,
@@ -26,7 +129,10 @@ typedef enum {
     TURN_CREATE_PERMISSION_ERROR_RESPONSE = 0x0118,
     TURN_CHANNEL_BIND_REQUEST = 0x0009,
     TURN_CHANNEL_BIND_RESPONSE = 0x0109,
-    TURN_CHANNEL_BIND_ERROR_RESPONSE = 0x0119
+    TURN_CHANNEL_BIND_ERROR_RESPONSE = 0x0119,
+    TURN_BINDING_REQUEST = 0x0001,
+    TURN_BINDING_RESPONSE = 0x0101,
+    TURN_BINDING_ERROR_RESPONSE = 0x0111
 } TurnMessageType;
 
 // TURNメッセージ属性タイプ
@@ -54,14 +160,80 @@ typedef enum {
     TURN_STATE_FAILED
 } TurnClientState;
 
-// TURNクライアント構造体
+// チャネル（expiryが0ならバインド待ち）
 typedef struct {
+    struct sockaddr_in peer;
+    uint16_t number;
+    time_t expiry;               // パーミッションの期限（ChannelBindの成功から）
+    time_t last_used;
+    time_t retry_at;             // 失敗したバインドを再試行する時刻
+    bool binding;                // ChannelBindの応答待ち
+} TurnChannel;
+
+// パーミッション（expiryが0ならまだない）
+typedef struct {
+    struct in_addr addr;
+    time_t expiry;
+    time_t last_used;
+    time_t retry_at;             // 失敗した要求を再試行する時刻
+    bool pending;                // CreatePermissionの応答待ち
+    bool requested;              // 次のまとめた要求に必ず載せる（要求の表が一杯で出せなかった）
+} TurnPermission;
+
+// 要求の完了を知らせる関数（受信スレッドから呼ばれる。中でturn_allocateなどの
+// 完了を待つ関数は呼べない）
+// resultは成功なら0、エラー応答ならそのエラーコード、タイムアウトや中止なら-1
+typedef void (*TurnCallback)(Node* node, int result, void* arg);
+
+// 中継されたデータを渡す関数（受信スレッドから呼ばれる）
+typedef void (*TurnDataHandler)(Node* node, const char* from_ip, int from_port,
+                                const void* data, int data_len, void* arg);
+
+// 中継に使うリレーアドレスが変わったことを知らせる関数（切り替えたスレッドから、TURNの
+// ロックを持たずに呼ばれる。中でturn_send_dataを呼んでよい）
+typedef void (*TurnRelayHandler)(Node* node, const char* relayed_ip, int relayed_port, void* arg);
+
+// 応答待ちの要求
+typedef struct {
+    bool active;
+    uint8_t id[12];              // トランザクションID
+    uint16_t type;               // 要求のメッセージタイプ
+    uint8_t message[TURN_MAX_REQUEST];
+    int length;
+    int auth_offset;             // 資格情報の属性の前までの長さ（送り直すときはそこまでを使う）
+    bool auth_retried;           // 401・438の後に送り直した要求
+    int sends;                   // これまでに送った回数
+    uint64_t rto_ms;
+    uint64_t next_ms;            // 次に再送する（最後の送信の後は失敗にする）時刻
+    struct sockaddr_in peer;     // ChannelBindの相手（CreatePermissionの相手はmessageから読む）
+    uint16_t channel;            // ChannelBindのチャネル番号
+    int lifetime;                // Refreshの有効期間
+    int max_sends;               // 送る回数（0ならTURN_RC）
+    uint64_t first_rto_ms;       // 最初のRTO（0ならTURN_RTO_MS）
+    bool active_probe;           // データが流れている間のBinding
+    uint64_t sent_us;            // 最初に送った時刻（再送しなかった要求の応答でRTTを測る）
+    TurnCallback callback;
+    void* arg;
+} TurnTransaction;
+
+// 要求の表が一杯で待たせているturn_create_permission_asyncの完了の通知
+typedef struct {
+    struct in_addr addr;
+    TurnCallback callback;
+    void* arg;
+} TurnPermissionWaiter;
+
+// TURNクライアント構造体（サーバーごとに1つ）
+typedef struct {
+    Node* node;
+    int index;                   // TurnData.clientsの中の位置
     char server[MAX_IP_STR_LEN];
     int port;
     char username[64];
     char password[64];
     char realm[128];
     char nonce[128];
+    uint8_t key[16];             // MD5(username:realm:password)（nonceが空なら未設定）
     int socket_fd;
     struct sockaddr_in server_addr;
     char relayed_ip[MAX_IP_STR_LEN];
@@ -70,22 +242,102 @@ typedef struct {
     time_t allocation_expiry;
     pthread_t refresh_thread;
     bool refresh_running;
-    pthread_mutex_t mutex;
+    bool refresh_pending;        // Refreshの応答待ち
+    pthread_t receive_thread;
+    bool receive_running;
+    pthread_mutex_t mutex;       // 状態とトランザクションの表の保護
+    TurnTransaction transactions[TURN_MAX_TRANSACTIONS];
+    TurnChannel channels[TURN_MAX_CHANNELS];
+    int channel_count;
+    uint16_t next_channel;       // 次に割り当てるチャネル番号
+    bool use_channels;           // 相手ごとにチャネルをバインドする
+    TurnPermission permissions[TURN_MAX_PERMISSIONS];
+    int permission_count;
+    int16_t permission_index[TURN_PERMISSION_SLOTS]; // アドレスのハッシュ → permissionsの位置（-1は空き）
+    int permission_requests;     // 応答待ちのCreatePermissionの数
+    bool permissions_queued;     // 要求の表が一杯で出せなかった相手がいる
+    TurnPermissionWaiter permission_waiters[TURN_MAX_PERMISSIONS];
+    int permission_waiter_count;
+    pthread_mutex_t channel_mutex; // channels・permissions・permission_waitersの保護（mutexとは別）
+    // 以下はTurnData.mutexで保護する
+    bool alive;                  // 最後のBindingに応答した
+    bool probe_pending;          // Bindingの応答待ち
+    bool active_probe_pending;   // データが流れている間のBindingの応答待ち
+    bool allocating;             // 役割を埋めるためのAllocateの応答待ち
+    time_t last_probe;
+    uint64_t last_active_probe_ms;
+    double rtt_ms;               // 平滑化したRTT（0ならまだ測っていない）
+    uint64_t probes;
+    uint64_t probe_failures;
+    uint64_t allocate_failures;
+    uint64_t refresh_failures;
+    uint64_t failures;           // 使っていたサーバーを外した回数
+    uint64_t last_data_ms;       // 最後にデータを送った時刻（送信側が書く。読むだけならロック不要）
+    bool suspect;                // データが流れている間のBindingを再送した（ロック不要）
 } TurnClient;
 
+// サーバーごとの統計
+typedef struct {
+    char server[MAX_IP_STR_LEN];
+    int port;
+    bool primary;
+    bool standby;
+    bool allocated;
+    bool alive;
+    double rtt_ms;
+    uint64_t probes;
+    uint64_t probe_failures;
+    uint64_t allocate_failures;
+    uint64_t refresh_failures;
+    uint64_t failures;
+} TurnServerInfo;
+
 // TURNクライアントデータ
 struct TurnData {
-    TurnClient client;
+    TurnClient clients[TURN_MAX_SERVERS];
+    int server_count;
+    int primary;                 // 中継に使うクライアント（-1ならなし。読むだけならロック不要）
+    int standby;                 // 予備のアロケーションを持つクライアント（-1ならなし）
+    bool selecting;              // turn_allocate_asyncの完了待ち
+    bool closing;                // turn_cleanupの最中（役割を埋め直さない）
+    TurnCallback select_callback;
+    void* select_arg;
+    time_t last_select;          // 空いた役割のために最後にサーバーを調べた時刻
+    uint64_t failovers;          // スタンバイへ切り替えた回数
+    TurnDataHandler data_handler;
+    void* data_handler_arg;
+    TurnRelayHandler relay_handler;
+    void* relay_handler_arg;
+    char announced_ip[MAX_IP_STR_LEN]; // relay_handlerに最後に知らせたリレーアドレス
+    int announced_port;
+    pthread_mutex_t mutex;       // 役割と選択の状態の保護（クライアントのmutexより先に取る）
 };
 
 // 関数プロトタイプ
 int turn_init(Node* node, const char* server, int port, const char* username, const char* password);
+int turn_init_servers(Node* node, const char* const* servers, int server_count,
+                      const char* username, const char* password);
 int turn_cleanup(Node* node);
+void turn_set_data_handler(Node* node, TurnDataHandler handler, void* arg);
+void turn_set_relay_handler(Node* node, TurnRelayHandler handler, void* arg);
+int turn_allocate_async(Node* node, TurnCallback callback, void* arg);
+int turn_prealloc(Node* node, TurnCallback callback, void* arg);
+int turn_refresh_async(Node* node, int lifetime, TurnCallback callback, void* arg);
+int turn_create_permission_async(Node* node, const char* peer_ip, TurnCallback callback, void* arg);
+int turn_add_permission(Node* node, const char* peer_ip);
+int turn_bind_channel_async(Node* node, const char* peer_ip, int peer_port, TurnCallback callback, void* arg);
+int turn_pending_requests(Node* node);
+int turn_get_relayed_address(Node* node, char* ip, int* port);
+int turn_get_servers(Node* node, TurnServerInfo* servers, int max_servers);
 int turn_allocate(Node* node);
 int turn_refresh(Node* node, int lifetime);
 int turn_create_permission(Node* node, const char* peer_ip);
+bool turn_has_permission(Node* node, const char* peer_ip);
+int turn_bind_channel(Node* node, const char* peer_ip, int peer_port);
+void turn_set_channel_binding(Node* node, bool enabled);
 int turn_send_data(Node* node, const char* peer_ip, int peer_port, const void* data, int data_len);
-int turn_process_data(Node* node, const void* data, int data_len, char* from_ip, int* from_port);
+int turn_process_data(Node* node, const void* data, int data_len, char* from_ip, int* from_port,
+                      const void** payload_out);
 void* turn_refresh_thread(void* arg);
 
 #endif /* TURN_H */
\ No newline at end of file
@@ -0,0 +1,1079 @@
+#define _GNU_SOURCE  // recvmmsg・sendmmsg
+#include "turn_server.h"
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <time.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+// TURNリレーサーバーの実装
+
+#define TURN_SERVER_HEADER 20            // STUNヘッダーの長さ
+#define TURN_SERVER_DATA_HEADER (TURN_SERVER_HEADER + 12 + 4) // Data Indicationのデータの前まで
+#define TURN_SERVER_EVENTS 64            // 1回のepoll_waitで受け取るイベントの数
+#define TURN_SERVER_NONCE_LEN 24         // 期限（16進8桁）+ HMACの先頭8バイト（16進16桁）
+
+// 受信のバッチ
+typedef struct {
+    struct mmsghdr msgs[TURN_SERVER_BATCH];
+    struct iovec iov[TURN_SERVER_BATCH];
+    struct sockaddr_in from[TURN_SERVER_BATCH];
+    uint8_t buffers[TURN_SERVER_BATCH][TURN_MAX_BUFFER];
+} TurnInbox;
+
+// 送信のバッチ（同じソケットから送るパケットをまとめる）
+typedef struct {
+    int fd;
+    int count;
+    struct mmsghdr msgs[TURN_SERVER_BATCH];
+    struct iovec iov[TURN_SERVER_BATCH][3];
+    uint8_t headers[TURN_SERVER_BATCH][TURN_SERVER_DATA_HEADER];
+    struct sockaddr_in to[TURN_SERVER_BATCH];
+    uint8_t random[TURN_SERVER_BATCH * 12]; // Data IndicationのトランザクションID（バッチ分ずつまとめて作る）
+    size_t random_used;
+} TurnOutbox;
+
+// Data IndicationのトランザクションID（RAND_bytesはバッチ分ずつ呼ぶ）
+static void next_transaction_id(TurnOutbox* out, uint8_t* transaction_id) {
+    if (out->random_used + 12 > sizeof(out->random)) {
+        if (RAND_bytes(out->random, sizeof(out->random)) != 1) {
+            for (size_t i = 0; i < sizeof(out->random); i++) {
+                out->random[i] = rand() % 256;
+            }
+        }
+        out->random_used = 0;
+    }
+    memcpy(transaction_id, out->random + out->random_used, 12);
+    out->random_used += 12;
+}
+
+// 単調増加の時刻（ミリ秒）
+static uint64_t server_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool same_address(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// ---- アロケーションの索引 ----
+
+static uint32_t allocation_slot(const struct sockaddr_in* client) {
+    uint32_t hash = (client->sin_addr.s_addr ^ ((uint32_t)client->sin_port << 16)) * 0x9E3779B1u;
+    return (hash ^ (hash >> 15)) & (TURN_SERVER_ALLOCATION_SLOTS - 1);
+}
+
+static TurnAllocation* find_allocation(TurnServer* server, const struct sockaddr_in* client) {
+    for (uint32_t slot = allocation_slot(client);; slot = (slot + 1) & (TURN_SERVER_ALLOCATION_SLOTS - 1)) {
+        int index = server->allocation_index[slot];
+        if (index < 0) {
+            return NULL;
+        }
+        if (same_address(&server->allocations[index].client, client)) {
+            return &server->allocations[index];
+        }
+    }
+}
+
+static void index_allocation(TurnServer* server, int index) {
+    uint32_t slot = allocation_slot(&server->allocations[index].client);
+    while (server->allocation_index[slot] >= 0) {
+        slot = (slot + 1) & (TURN_SERVER_ALLOCATION_SLOTS - 1);
+    }
+    server->allocation_index[slot] = index;
+}
+
+// アロケーションを外す（リレー用ソケットを閉じて索引を作り直す）
+static void remove_allocation(TurnServer* server, TurnAllocation* allocation) {
+    close(allocation->relay_fd);
+    allocation->active = false;
+    server->stats.allocations--;
+    memset(server->allocation_index, 0xFF, sizeof(server->allocation_index));
+    for (int i = 0; i < TURN_SERVER_MAX_ALLOCATIONS; i++) {
+        if (server->allocations[i].active) {
+            index_allocation(server, i);
+        }
+    }
+}
+
+// ---- パーミッションとチャネル ----
+
+static TurnServerPermission* find_server_permission(TurnAllocation* allocation, struct in_addr addr, time_t now) {
+    for (int i = 0; i < allocation->permission_count; i++) {
+        if (allocation->permissions[i].addr.s_addr == addr.s_addr) {
+            return allocation->permissions[i].expiry > now ? &allocation->permissions[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+// パーミッションの作成・更新（上限に達していれば-1）
+static int install_permission(TurnAllocation* allocation, struct in_addr addr, time_t now) {
+    for (int i = 0; i < allocation->permission_count; i++) {
+        if (allocation->permissions[i].addr.s_addr == addr.s_addr) {
+            allocation->permissions[i].expiry = now + TURN_PERMISSION_LIFETIME;
+            return 0;
+        }
+    }
+    if (allocation->permission_count >= TURN_SERVER_MAX_PERMISSIONS) {
+        return -1;
+    }
+    TurnServerPermission* permission = &allocation->permissions[allocation->permission_count++];
+    permission->addr = addr;
+    permission->expiry = now + TURN_PERMISSION_LIFETIME;
+    return 0;
+}
+
+static TurnServerChannel* find_server_channel_by_number(TurnAllocation* allocation, uint16_t number, time_t now) {
+    for (int i = 0; i < allocation->channel_count; i++) {
+        if (allocation->channels[i].number == number) {
+            return allocation->channels[i].expiry > now ? &allocation->channels[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+static TurnServerChannel* find_server_channel_by_peer(TurnAllocation* allocation, const struct sockaddr_in* peer,
+                                                      time_t now) {
+    for (int i = 0; i < allocation->channel_count; i++) {
+        if (same_address(&allocation->channels[i].peer, peer)) {
+            return allocation->channels[i].expiry > now ? &allocation->channels[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+// 期限切れのアロケーション・パーミッション・チャネルを外す（mutexを持って呼ぶ）
+static void expire_allocations(TurnServer* server, time_t now) {
+    for (int i = 0; i < TURN_SERVER_MAX_ALLOCATIONS; i++) {
+        TurnAllocation* allocation = &server->allocations[i];
+        if (!allocation->active) {
+            continue;
+        }
+        if (now >= allocation->expiry) {
+            remove_allocation(server, allocation);
+            continue;
+        }
+        for (int j = 0; j < allocation->permission_count;) {
+            if (now >= allocation->permissions[j].expiry) {
+                allocation->permissions[j] = allocation->permissions[--allocation->permission_count];
+                continue;
+            }
+            j++;
+        }
+        for (int j = 0; j < allocation->channel_count;) {
+            if (now >= allocation->channels[j].expiry) {
+                allocation->channels[j] = allocation->channels[--allocation->channel_count];
+                continue;
+            }
+            j++;
+        }
+    }
+}
+
+// 帯域の上限（両方向の合計をトークンバケットで数える）
+static bool take_quota(TurnServer* server, TurnAllocation* allocation, int bytes, uint64_t now_ms) {
+    if (server->rate_limit == 0) {
+        return true;
+    }
+    allocation->tokens += (double)server->rate_limit * (now_ms - allocation->refilled_ms) / 1000.0;
+    allocation->refilled_ms = now_ms;
+    if (allocation->tokens > TURN_SERVER_BURST) {
+        allocation->tokens = TURN_SERVER_BURST;
+    }
+    if (allocation->tokens < bytes) {
+        server->stats.over_quota++;
+        return false;
+    }
+    allocation->tokens -= bytes;
+    return true;
+}
+
+// ---- メッセージの組み立てと解析 ----
+
+// 属性を書き込む（パディング後の次の位置を返す）
+static int put_attribute(uint8_t* message, int offset, uint16_t type, const void* value, uint16_t length) {
+    message[offset] = type >> 8;
+    message[offset + 1] = type & 0xFF;
+    message[offset + 2] = length >> 8;
+    message[offset + 3] = length & 0xFF;
+    memcpy(message + offset + 4, value, length);
+    offset += 4 + length;
+    while (offset % 4 != 0) {
+        message[offset++] = 0;
+    }
+    return offset;
+}
+
+// XORしたアドレス属性（XOR-RELAYED-ADDRESS・XOR-MAPPED-ADDRESS・XOR-PEER-ADDRESS）
+static int put_xor_address(uint8_t* message, int offset, uint16_t type, const struct sockaddr_in* addr) {
+    uint8_t value[8];
+    value[0] = 0;
+    value[1] = 1;  // IPv4
+    uint16_t port = htons(ntohs(addr->sin_port) ^ (0x2112A442 >> 16));
+    memcpy(value + 2, &port, 2);
+    uint32_t ip = addr->sin_addr.s_addr ^ htonl(0x2112A442);
+    memcpy(value + 4, &ip, 4);
+    return put_attribute(message, offset, type, value, sizeof(value));
+}
+
+static void read_xor_address(const uint8_t* value, struct sockaddr_in* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    uint16_t port;
+    memcpy(&port, value + 2, 2);
+    addr->sin_port = htons(ntohs(port) ^ (0x2112A442 >> 16));
+    uint32_t ip;
+    memcpy(&ip, value + 4, 4);
+    addr->sin_addr.s_addr = ip ^ htonl(0x2112A442);
+}
+
+// 応答のヘッダー（要求のトランザクションIDを引き継ぐ）
+static int begin_response(uint8_t* message, const uint8_t* request, uint16_t type) {
+    memcpy(message, request, TURN_SERVER_HEADER);
+    message[0] = type >> 8;
+    message[1] = type & 0xFF;
+    return TURN_SERVER_HEADER;
+}
+
+static void send_response(TurnServer* server, uint8_t* message, int length, const struct sockaddr_in* to) {
+    message[2] = (length - TURN_SERVER_HEADER) >> 8;
+    message[3] = (length - TURN_SERVER_HEADER) & 0xFF;
+    sendto(server->socket_fd, message, length, 0, (const struct sockaddr*)to, sizeof(*to));
+}
+
+// エラー応答の先頭（要求のタイプにエラーのクラスを付けて、ERROR-CODEまで書く）
+static int begin_error(uint8_t* message, const uint8_t* request, int code, const char* reason) {
+    uint16_t request_type = (request[0] << 8) | request[1];
+    int offset = begin_response(message, request, request_type | 0x0110);
+    uint8_t value[64];
+    int reason_len = strlen(reason);
+    value[0] = 0;
+    value[1] = 0;
+    value[2] = code / 100;
+    value[3] = code % 100;
+    memcpy(value + 4, reason, reason_len);
+    return put_attribute(message, offset, TURN_ATTR_ERROR_CODE, value, 4 + reason_len);
+}
+
+static void send_error(TurnServer* server, const uint8_t* request, const struct sockaddr_in* to,
+                       int code, const char* reason) {
+    uint8_t message[128];
+    int offset = begin_error(message, request, code, reason);
+    send_response(server, message, offset, to);
+    server->stats.errors++;
+}
+
+// ---- 認証（RFC 5766の長期の資格情報） ----
+
+// NONCEの期限とクライアントのアドレスにかけるHMAC（16進16桁）
+static void nonce_mac(TurnServer* server, const char* expiry, const struct sockaddr_in* client, char* out) {
+    uint8_t input[8 + 6];
+    memcpy(input, expiry, 8);
+    memcpy(input + 8, &client->sin_addr.s_addr, 4);
+    memcpy(input + 12, &client->sin_port, 2);
+    uint8_t mac[20];
+    HMAC(EVP_sha1(), server->nonce_secret, sizeof(server->nonce_secret), input, sizeof(input), mac, NULL);
+    for (int i = 0; i < 8; i++) {
+        snprintf(out + i * 2, 3, "%02x", mac[i]);
+    }
+}
+
+// クライアントのアドレスに結びついたNONCE（サーバーは状態を持たない）
+static void make_nonce(TurnServer* server, const struct sockaddr_in* client, time_t now,
+                       char nonce[TURN_SERVER_NONCE_LEN + 1]) {
+    snprintf(nonce, 9, "%08x", (uint32_t)(now + TURN_SERVER_NONCE_LIFETIME));
+    nonce_mac(server, nonce, client, nonce + 8);
+}
+
+static bool nonce_valid(TurnServer* server, const uint8_t* nonce, int nonce_len,
+                        const struct sockaddr_in* client, time_t now) {
+    if (nonce_len != TURN_SERVER_NONCE_LEN) {
+        return false;
+    }
+    char expiry[9];
+    memcpy(expiry, nonce, 8);
+    expiry[8] = '\0';
+    char mac[17];
+    nonce_mac(server, expiry, client, mac);
+    return CRYPTO_memcmp(mac, nonce + 8, 16) == 0 && (time_t)strtoul(expiry, NULL, 16) > now;
+}
+
+// 401・438の応答（REALMと新しいNONCEを付ける）
+static void send_challenge(TurnServer* server, const uint8_t* request, const struct sockaddr_in* to,
+                           int code, const char* reason, time_t now) {
+    uint8_t message[256];
+    int offset = begin_error(message, request, code, reason);
+    char nonce[TURN_SERVER_NONCE_LEN + 1];
+    make_nonce(server, to, now, nonce);
+    offset = put_attribute(message, offset, TURN_ATTR_REALM, TURN_SERVER_REALM, strlen(TURN_SERVER_REALM));
+    offset = put_attribute(message, offset, TURN_ATTR_NONCE, nonce, TURN_SERVER_NONCE_LEN);
+    send_response(server, message, offset, to);
+    server->stats.errors++;
+}
+
+// 要求の属性（同じタイプの属性は最初のもの）
+typedef struct {
+    const uint8_t* peer;         // XOR-PEER-ADDRESSの値（8バイト）
+    int peer_count;
+    const uint8_t* data;
+    int data_len;
+    const uint8_t* username;
+    int username_len;
+    const uint8_t* realm;
+    int realm_len;
+    const uint8_t* nonce;
+    int nonce_len;
+    int integrity;               // MESSAGE-INTEGRITYの位置（-1ならなし）
+    int channel;                 // -1ならなし
+    int lifetime;                // -1ならなし
+    int transport;               // -1ならなし
+} TurnRequestAttributes;
+
+// 属性を読む（MESSAGE-INTEGRITYより後ろは見ない。壊れていれば-1）
+static int parse_attributes(const uint8_t* message, int length, TurnRequestAttributes* attrs) {
+    memset(attrs, 0, sizeof(*attrs));
+    attrs->integrity = -1;
+    attrs->channel = -1;
+    attrs->lifetime = -1;
+    attrs->transport = -1;
+
+    int end = TURN_SERVER_HEADER + ((message[2] << 8) | message[3]);
+    if (end > length) {
+        return -1;
+    }
+    for (int offset = TURN_SERVER_HEADER; offset + 4 <= end;) {
+        uint16_t type = (message[offset] << 8) | message[offset + 1];
+        int attr_len = (message[offset + 2] << 8) | message[offset + 3];
+        const uint8_t* value = message + offset + 4;
+        if (offset + 4 + attr_len > end) {
+            return -1;
+        }
+        if (type == TURN_ATTR_XOR_PEER_ADDRESS && attr_len == 8 && value[1] == 1) {
+            if (attrs->peer_count++ == 0) {
+                attrs->peer = value;
+            }
+        } else if (type == TURN_ATTR_DATA && !attrs->data) {
+            attrs->data = value;
+            attrs->data_len = attr_len;
+        } else if (type == TURN_ATTR_USERNAME && !attrs->username) {
+            attrs->username = value;
+            attrs->username_len = attr_len;
+        } else if (type == TURN_ATTR_REALM && !attrs->realm) {
+            attrs->realm = value;
+            attrs->realm_len = attr_len;
+        } else if (type == TURN_ATTR_NONCE && !attrs->nonce) {
+            attrs->nonce = value;
+            attrs->nonce_len = attr_len;
+        } else if (type == TURN_ATTR_MESSAGE_INTEGRITY) {
+            if (attr_len != 20) {
+                return -1;
+            }
+            attrs->integrity = offset;
+            break;
+        } else if (type == TURN_ATTR_CHANNEL_NUMBER && attr_len == 4) {
+            attrs->channel = (value[0] << 8) | value[1];
+        } else if (type == TURN_ATTR_LIFETIME && attr_len == 4) {
+            attrs->lifetime = (value[0] << 24) | (value[1] << 16) | (value[2] << 8) | value[3];
+        } else if (type == TURN_ATTR_REQUESTED_TRANSPORT && attr_len == 4) {
+            attrs->transport = value[0];
+        }
+        offset += 4 + ((attr_len + 3) & ~3);
+    }
+    return 0;
+}
+
+// 要求の認証（通れば0。通らなければ401・438・400を返して-1）
+static int authenticate(TurnServer* server, const uint8_t* request, const TurnRequestAttributes* attrs,
+                        const struct sockaddr_in* from, time_t now) {
+    if (attrs->integrity < 0) {
+        send_challenge(server, request, from, 401, "Unauthorized", now);
+        return -1;
+    }
+    if (!attrs->username || !attrs->realm || !attrs->nonce) {
+        send_error(server, request, from, 400, "Bad Request");
+        return -1;
+    }
+    if (!nonce_valid(server, attrs->nonce, attrs->nonce_len, from, now)) {
+        send_challenge(server, request, from, 438, "Stale Nonce", now);
+        return -1;
+    }
+    if (attrs->username_len != (int)strlen(server->username) ||
+        memcmp(attrs->username, server->username, attrs->username_len) != 0 ||
+        attrs->realm_len != (int)strlen(TURN_SERVER_REALM) ||
+        memcmp(attrs->realm, TURN_SERVER_REALM, attrs->realm_len) != 0) {
+        send_challenge(server, request, from, 401, "Unauthorized", now);
+        return -1;
+    }
+
+    // HMACはMESSAGE-INTEGRITYまでを含む長さにしたヘッダーから、その直前までにかける
+    uint8_t copy[TURN_MAX_BUFFER];
+    int covered = attrs->integrity;
+    memcpy(copy, request, covered);
+    int length = covered + 24 - TURN_SERVER_HEADER;
+    copy[2] = length >> 8;
+    copy[3] = length & 0xFF;
+    uint8_t mac[20];
+    HMAC(EVP_sha1(), server->key, sizeof(server->key), copy, covered, mac, NULL);
+    if (CRYPTO_memcmp(mac, request + covered + 4, sizeof(mac)) != 0) {
+        send_challenge(server, request, from, 401, "Unauthorized", now);
+        return -1;
+    }
+    return 0;
+}
+
+// ---- 送信のバッチ ----
+
+static void outbox_flush(TurnOutbox* out) {
+    int sent = 0;
+    while (sent < out->count) {
+        int n = sendmmsg(out->fd, out->msgs + sent, out->count - sent, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;  // 送れなかった残りは捨てる（UDPなので損失と同じ）
+        }
+        sent += n;
+    }
+    out->count = 0;
+}
+
+// ヘッダー + データ（+ 4バイト境界までのパディング）を送るパケットを加える
+static void outbox_add(TurnOutbox* out, int fd, const struct sockaddr_in* to, const uint8_t* header,
+                       int header_len, const void* data, int data_len, int padding) {
+    static const uint8_t zeros[4] = { 0 };
+    if (out->count > 0 && (out->fd != fd || out->count == TURN_SERVER_BATCH)) {
+        outbox_flush(out);
+    }
+    out->fd = fd;
+
+    int i = out->count++;
+    int iov_count = 0;
+    if (header_len > 0) {
+        memcpy(out->headers[i], header, header_len);
+        out->iov[i][iov_count].iov_base = out->headers[i];
+        out->iov[i][iov_count++].iov_len = header_len;
+    }
+    out->iov[i][iov_count].iov_base = (void*)data;
+    out->iov[i][iov_count++].iov_len = data_len;
+    if (padding > 0) {
+        out->iov[i][iov_count].iov_base = (void*)zeros;
+        out->iov[i][iov_count++].iov_len = padding;
+    }
+    out->to[i] = *to;
+
+    struct msghdr* msg = &out->msgs[i].msg_hdr;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &out->to[i];
+    msg->msg_namelen = sizeof(struct sockaddr_in);
+    msg->msg_iov = out->iov[i];
+    msg->msg_iovlen = iov_count;
+}
+
+// ---- 要求の処理 ----
+
+static void handle_allocate(TurnServer* server, const uint8_t* request, const TurnRequestAttributes* attrs,
+                            const struct sockaddr_in* from, time_t now, uint64_t now_ms) {
+    TurnAllocation* allocation = find_allocation(server, from);
+    if (allocation && memcmp(allocation->transaction_id, request + 8, 12) != 0) {
+        send_error(server, request, from, 437, "Allocation Mismatch");
+        return;
+    }
+
+    if (!allocation) {
+        if (attrs->transport < 0) {
+            send_error(server, request, from, 400, "Bad Request");
+            return;
+        }
+        if (attrs->transport != 17) {
+            send_error(server, request, from, 442, "Unsupported Transport Protocol");
+            return;
+        }
+        int index = -1;
+        for (int i = 0; i < TURN_SERVER_MAX_ALLOCATIONS; i++) {
+            if (!server->allocations[i].active) {
+                index = i;
+                break;
+            }
+        }
+        if (index < 0) {
+            send_error(server, request, from, 486, "Allocation Quota Reached");
+            return;
+        }
+
+        // リレー用ソケット（ポートはOSに任せる）
+        allocation = &server->allocations[index];
+        memset(allocation, 0, sizeof(TurnAllocation));
+        allocation->relay_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        socklen_t addr_len = sizeof(allocation->relay_addr);
+        allocation->relay_addr.sin_family = AF_INET;
+        allocation->relay_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u32 = index + 1;
+        if (allocation->relay_fd < 0 ||
+            bind(allocation->relay_fd, (struct sockaddr*)&allocation->relay_addr, addr_len) < 0 ||
+            getsockname(allocation->relay_fd, (struct sockaddr*)&allocation->relay_addr, &addr_len) < 0 ||
+            fcntl(allocation->relay_fd, F_SETFL, O_NONBLOCK) < 0 ||
+            epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, allocation->relay_fd, &event) < 0) {
+            perror("Failed to create TURN relay socket");
+            if (allocation->relay_fd >= 0) {
+                close(allocation->relay_fd);
+            }
+            send_error(server, request, from, 508, "Insufficient Capacity");
+            return;
+        }
+
+        allocation->active = true;
+        allocation->client = *from;
+        memcpy(allocation->transaction_id, request + 8, 12);
+        allocation->tokens = TURN_SERVER_BURST;
+        allocation->refilled_ms = now_ms;
+        int lifetime = attrs->lifetime < 0 ? TURN_ALLOCATION_LIFETIME : attrs->lifetime;
+        if (lifetime > TURN_SERVER_MAX_LIFETIME) {
+            lifetime = TURN_SERVER_MAX_LIFETIME;
+        }
+        allocation->expiry = now + lifetime;
+        index_allocation(server, index);
+        server->stats.allocations++;
+    }
+
+    // 成功応答（Allocateの再送には同じ内容を返す）
+    uint8_t message[128];
+    int offset = begin_response(message, request, TURN_ALLOCATION_RESPONSE);
+    struct sockaddr_in relayed = allocation->relay_addr;
+    relayed.sin_addr = server->relay_ip;
+    offset = put_xor_address(message, offset, TURN_ATTR_XOR_RELAYED_ADDRESS, &relayed);
+    uint32_t lifetime = htonl((uint32_t)(allocation->expiry - now));
+    offset = put_attribute(message, offset, TURN_ATTR_LIFETIME, &lifetime, 4);
+    offset = put_xor_address(message, offset, TURN_ATTR_XOR_MAPPED_ADDRESS, from);
+    send_response(server, message, offset, from);
+}
+
+static void handle_refresh(TurnServer* server, TurnAllocation* allocation, const uint8_t* request,
+                           const TurnRequestAttributes* attrs, const struct sockaddr_in* from, time_t now) {
+    int lifetime = attrs->lifetime < 0 ? TURN_ALLOCATION_LIFETIME : attrs->lifetime;
+    if (lifetime > TURN_SERVER_MAX_LIFETIME) {
+        lifetime = TURN_SERVER_MAX_LIFETIME;
+    }
+    if (lifetime == 0) {
+        remove_allocation(server, allocation);
+    } else {
+        allocation->expiry = now + lifetime;
+    }
+
+    uint8_t message[64];
+    int offset = begin_response(message, request, TURN_REFRESH_RESPONSE);
+    uint32_t value = htonl(lifetime);
+    offset = put_attribute(message, offset, TURN_ATTR_LIFETIME, &value, 4);
+    send_response(server, message, offset, from);
+}
+
+// 要求に載った全ての相手のパーミッションを作る（1つでも入らなければどれも作らない）
+static void handle_create_permission(TurnServer* server, TurnAllocation* allocation, const uint8_t* request,
+                                     int length, const TurnRequestAttributes* attrs,
+                                     const struct sockaddr_in* from, time_t now) {
+    if (attrs->peer_count == 0) {
+        send_error(server, request, from, 400, "Bad Request");
+        return;
+    }
+
+    // 1回目で全ての相手が入るかを確かめ、2回目で作る
+    struct in_addr addrs[TURN_SERVER_MAX_PERMISSIONS];
+    int new_count = 0;
+    int end = TURN_SERVER_HEADER + ((request[2] << 8) | request[3]);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int offset = TURN_SERVER_HEADER; offset + 4 <= end && end <= length;) {
+            uint16_t type = (request[offset] << 8) | request[offset + 1];
+            int attr_len = (request[offset + 2] << 8) | request[offset + 3];
+            if (type == TURN_ATTR_XOR_PEER_ADDRESS && attr_len == 8) {
+                struct sockaddr_in peer;
+                read_xor_address(request + offset + 4, &peer);
+                if (pass == 1) {
+                    install_permission(allocation, peer.sin_addr, now);
+                } else {
+                    bool known = false;
+                    for (int i = 0; i < allocation->permission_count && !known; i++) {
+                        known = allocation->permissions[i].addr.s_addr == peer.sin_addr.s_addr;
+                    }
+                    for (int i = 0; i < new_count && !known; i++) {
+                        known = addrs[i].s_addr == peer.sin_addr.s_addr;
+                    }
+                    if (!known) {
+                        if (allocation->permission_count + new_count >= TURN_SERVER_MAX_PERMISSIONS) {
+                            send_error(server, request, from, 508, "Insufficient Capacity");
+                            return;
+                        }
+                        addrs[new_count++] = peer.sin_addr;
+                    }
+                }
+            }
+            offset += 4 + ((attr_len + 3) & ~3);
+        }
+    }
+
+    uint8_t message[TURN_SERVER_HEADER];
+    int offset = begin_response(message, request, TURN_CREATE_PERMISSION_RESPONSE);
+    send_response(server, message, offset, from);
+}
+
+static void handle_channel_bind(TurnServer* server, TurnAllocation* allocation, const uint8_t* request,
+                                const TurnRequestAttributes* attrs, const struct sockaddr_in* from, time_t now) {
+    if (!attrs->peer || attrs->channel < TURN_CHANNEL_MIN || attrs->channel > TURN_CHANNEL_MAX) {
+        send_error(server, request, from, 400, "Bad Request");
+        return;
+    }
+    struct sockaddr_in peer;
+    read_xor_address(attrs->peer, &peer);
+
+    // 番号と相手の組は変えられない
+    TurnServerChannel* channel = NULL;
+    for (int i = 0; i < allocation->channel_count; i++) {
+        bool same_number = allocation->channels[i].number == attrs->channel;
+        bool same_peer = same_address(&allocation->channels[i].peer, &peer);
+        if (same_number != same_peer) {
+            send_error(server, request, from, 400, "Bad Request");
+            return;
+        }
+        if (same_number) {
+            channel = &allocation->channels[i];
+        }
+    }
+    bool appended = !channel;
+    if (!channel) {
+        if (allocation->channel_count >= TURN_SERVER_MAX_CHANNELS) {
+            send_error(server, request, from, 508, "Insufficient Capacity");
+            return;
+        }
+        channel = &allocation->channels[allocation->channel_count++];
+        channel->number = attrs->channel;
+        channel->peer = peer;
+    }
+
+    // ChannelBindは相手へのパーミッションも作成・更新する（失敗したら、今加えたチャネルだけ戻す）
+    if (install_permission(allocation, peer.sin_addr, now) < 0) {
+        if (appended) {
+            allocation->channel_count--;
+        }
+        send_error(server, request, from, 508, "Insufficient Capacity");
+        return;
+    }
+    channel->expiry = now + TURN_CHANNEL_LIFETIME;
+
+    uint8_t message[TURN_SERVER_HEADER];
+    int offset = begin_response(message, request, TURN_CHANNEL_BIND_RESPONSE);
+    send_response(server, message, offset, from);
+}
+
+// 制御用ソケットに届いたパケット（要求、Send Indication、ChannelData）
+static void handle_client_packet(TurnServer* server, TurnOutbox* out, const uint8_t* buffer, int length,
+                                 const struct sockaddr_in* from, time_t now, uint64_t now_ms) {
+    // ChannelData
+    if (length >= TURN_CHANNEL_HEADER && (buffer[0] & 0xC0) == 0x40) {
+        uint16_t number = (buffer[0] << 8) | buffer[1];
+        int data_len = (buffer[2] << 8) | buffer[3];
+        TurnAllocation* allocation = find_allocation(server, from);
+        TurnServerChannel* channel = allocation ? find_server_channel_by_number(allocation, number, now) : NULL;
+        if (!channel || data_len > length - TURN_CHANNEL_HEADER) {
+            return;
+        }
+        if (take_quota(server, allocation, data_len, now_ms)) {
+            outbox_add(out, allocation->relay_fd, &channel->peer, NULL, 0, buffer + TURN_CHANNEL_HEADER,
+                       data_len, 0);
+            allocation->relayed_packets++;
+            allocation->relayed_bytes += data_len;
+            server->stats.relayed_packets++;
+            server->stats.relayed_bytes += data_len;
+        }
+        return;
+    }
+
+    // STUNメッセージ
+    if (length < TURN_SERVER_HEADER || (buffer[0] & 0xC0) != 0 ||
+        *(const uint32_t*)(buffer + 4) != htonl(0x2112A442)) {
+        return;
+    }
+    TurnRequestAttributes attrs;
+    if (parse_attributes(buffer, length, &attrs) < 0) {
+        return;
+    }
+    uint16_t type = (buffer[0] << 8) | buffer[1];
+    TurnAllocation* allocation = find_allocation(server, from);
+
+    // Send Indication
+    if (type == TURN_SEND_INDICATION) {
+        if (!allocation || !attrs.peer || !attrs.data) {
+            return;
+        }
+        struct sockaddr_in peer;
+        read_xor_address(attrs.peer, &peer);
+        if (!find_server_permission(allocation, peer.sin_addr, now)) {
+            server->stats.no_permission++;
+            return;
+        }
+        if (take_quota(server, allocation, attrs.data_len, now_ms)) {
+            outbox_add(out, allocation->relay_fd, &peer, NULL, 0, attrs.data, attrs.data_len, 0);
+            allocation->relayed_packets++;
+            allocation->relayed_bytes += attrs.data_len;
+            server->stats.relayed_packets++;
+            server->stats.relayed_bytes += attrs.data_len;
+        }
+        return;
+    }
+
+    // 要求（応答の前に溜まっているデータを送る）
+    if ((type & 0x0110) != 0) {
+        return;
+    }
+    outbox_flush(out);
+    server->stats.requests++;
+    if (type == TURN_BINDING_REQUEST) {
+        // クライアントの生存確認とRTTの測定に使われる
+        uint8_t message[64];
+        int offset = begin_response(message, buffer, TURN_BINDING_RESPONSE);
+        offset = put_xor_address(message, offset, TURN_ATTR_XOR_MAPPED_ADDRESS, from);
+        send_response(server, message, offset, from);
+        return;
+    }
+    if (authenticate(server, buffer, &attrs, from, now) < 0) {
+        return;
+    }
+    if (type == TURN_ALLOCATION_REQUEST) {
+        handle_allocate(server, buffer, &attrs, from, now, now_ms);
+        return;
+    }
+    if (!allocation) {
+        send_error(server, buffer, from, 437, "Allocation Mismatch");
+        return;
+    }
+    switch (type) {
+        case TURN_REFRESH_REQUEST:
+            handle_refresh(server, allocation, buffer, &attrs, from, now);
+            break;
+        case TURN_CREATE_PERMISSION_REQUEST:
+            handle_create_permission(server, allocation, buffer, length, &attrs, from, now);
+            break;
+        case TURN_CHANNEL_BIND_REQUEST:
+            handle_channel_bind(server, allocation, buffer, &attrs, from, now);
+            break;
+        default:
+            send_error(server, buffer, from, 400, "Bad Request");
+            break;
+    }
+}
+
+// リレー用ソケットに届いた相手からのデータ（チャネルがあればChannelData、なければData Indication）
+static void handle_peer_packet(TurnServer* server, TurnOutbox* out, TurnAllocation* allocation,
+                               const uint8_t* buffer, int length, const struct sockaddr_in* from,
+                               time_t now, uint64_t now_ms) {
+    if (length <= 0 || length > TURN_MAX_BUFFER - TURN_SERVER_DATA_HEADER) {
+        return;
+    }
+    if (!find_server_permission(allocation, from->sin_addr, now)) {
+        server->stats.no_permission++;
+        return;
+    }
+    if (!take_quota(server, allocation, length, now_ms)) {
+        return;
+    }
+
+    TurnServerChannel* channel = find_server_channel_by_peer(allocation, from, now);
+    if (channel) {
+        uint8_t header[TURN_CHANNEL_HEADER];
+        header[0] = channel->number >> 8;
+        header[1] = channel->number & 0xFF;
+        header[2] = length >> 8;
+        header[3] = length & 0xFF;
+        outbox_add(out, server->socket_fd, &allocation->client, header, sizeof(header), buffer, length, 0);
+    } else {
+        uint8_t header[TURN_SERVER_DATA_HEADER];
+        int padding = (4 - length % 4) % 4;
+        header[0] = TURN_DATA_INDICATION >> 8;
+        header[1] = TURN_DATA_INDICATION & 0xFF;
+        uint16_t message_length = TURN_SERVER_DATA_HEADER - TURN_SERVER_HEADER + length + padding;
+        header[2] = message_length >> 8;
+        header[3] = message_length & 0xFF;
+        uint32_t cookie = htonl(0x2112A442);
+        memcpy(header + 4, &cookie, 4);
+        next_transaction_id(out, header + 8);
+        int offset = put_xor_address(header, TURN_SERVER_HEADER, TURN_ATTR_XOR_PEER_ADDRESS, from);
+        header[offset] = TURN_ATTR_DATA >> 8;
+        header[offset + 1] = TURN_ATTR_DATA & 0xFF;
+        header[offset + 2] = length >> 8;
+        header[offset + 3] = length & 0xFF;
+        outbox_add(out, server->socket_fd, &allocation->client, header, sizeof(header), buffer, length, padding);
+    }
+    allocation->relayed_packets++;
+    allocation->relayed_bytes += length;
+    server->stats.relayed_packets++;
+    server->stats.relayed_bytes += length;
+}
+
+// ---- サーバースレッド ----
+
+static void* turn_server_thread(void* arg) {
+    TurnServer* server = (TurnServer*)arg;
+    TurnInbox* in = (TurnInbox*)malloc(sizeof(TurnInbox));
+    TurnOutbox* out = (TurnOutbox*)calloc(1, sizeof(TurnOutbox));
+    if (!in || !out) {
+        perror("Failed to allocate TURN server buffers");
+        free(in);
+        free(out);
+        return NULL;
+    }
+    out->random_used = sizeof(out->random);
+    time_t last_expire = 0;
+
+    while (server->running) {
+        struct epoll_event events[TURN_SERVER_EVENTS];
+        int ready = epoll_wait(server->epoll_fd, events, TURN_SERVER_EVENTS, TURN_POLL_MS);
+        time_t now = time(NULL);
+        uint64_t now_ms = server_now_ms();
+
+        pthread_mutex_lock(&server->mutex);
+        for (int e = 0; e < ready; e++) {
+            uint32_t id = events[e].data.u32;
+            TurnAllocation* allocation = id > 0 ? &server->allocations[id - 1] : NULL;
+
+            // 読めるだけ（最大TURN_SERVER_MAX_BATCHESバッチ）まとめて読む
+            for (int batch = 0; batch < TURN_SERVER_MAX_BATCHES; batch++) {
+                if (allocation && !allocation->active) {
+                    break;
+                }
+                int fd = allocation ? allocation->relay_fd : server->socket_fd;
+                for (int i = 0; i < TURN_SERVER_BATCH; i++) {
+                    in->iov[i].iov_base = in->buffers[i];
+                    in->iov[i].iov_len = TURN_MAX_BUFFER;
+                    memset(&in->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+                    in->msgs[i].msg_hdr.msg_name = &in->from[i];
+                    in->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+                    in->msgs[i].msg_hdr.msg_iov = &in->iov[i];
+                    in->msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+                int received = recvmmsg(fd, in->msgs, TURN_SERVER_BATCH, MSG_DONTWAIT, NULL);
+                if (received <= 0) {
+                    break;
+                }
+                server->stats.batches++;
+
+                for (int i = 0; i < received; i++) {
+                    if (allocation && !allocation->active) {
+                        break;  // Refreshの有効期間0で外された
+                    }
+                    int length = (int)in->msgs[i].msg_len;
+                    if (allocation) {
+                        handle_peer_packet(server, out, allocation, in->buffers[i], length, &in->from[i], now, now_ms);
+                    } else {
+                        handle_client_packet(server, out, in->buffers[i], length, &in->from[i], now, now_ms);
+                    }
+                }
+
+                // データは受信バッファを指しているので、次のバッチを読む前に送る
+                outbox_flush(out);
+                if (received < TURN_SERVER_BATCH) {
+                    break;
+                }
+            }
+        }
+
+        // 1秒ごとに期限切れを外す
+        if (now != last_expire) {
+            expire_allocations(server, now);
+            last_expire = now;
+        }
+        pthread_mutex_unlock(&server->mutex);
+    }
+
+    free(in);
+    free(out);
+    return NULL;
+}
+
+// ---- 公開関数 ----
+
+// TURNサーバーの起動（portが0ならOSに任せる。relay_ipがNULLならノードの公開アドレス、
+// なければローカルアドレスをリレーアドレスとして知らせる。資格情報がなければ起動しない）
+int turn_server_start(Node* node, int port, const char* relay_ip, const char* username, const char* password) {
+    if (!node || node->turn_server_data) {
+        return -1;
+    }
+    if (!username || !password || username[0] == '\0' || password[0] == '\0') {
+        fprintf(stderr, "TURN server requires a username and password\n");
+        return -1;
+    }
+    if (strlen(username) >= sizeof(((TurnServer*)NULL)->username) || strlen(password) >= 64) {
+        fprintf(stderr, "TURN server username or password too long\n");  // turn.cのクライアントと同じ上限
+        return -1;
+    }
+
+    TurnServer* server = (TurnServer*)calloc(1, sizeof(TurnServer));
+    if (!server) {
+        perror("Failed to allocate TURN server");
+        return -1;
+    }
+    memset(server->allocation_index, 0xFF, sizeof(server->allocation_index));
+    server->rate_limit = TURN_SERVER_RATE_LIMIT;
+    strncpy(server->username, username, sizeof(server->username) - 1);
+    char key_input[sizeof(server->username) + sizeof(TURN_SERVER_REALM) + 64];
+    int key_len = snprintf(key_input, sizeof(key_input), "%s:%s:%s", username, TURN_SERVER_REALM, password);
+    EVP_Digest(key_input, (size_t)key_len, server->key, NULL, EVP_md5(), NULL);
+    OPENSSL_cleanse(key_input, sizeof(key_input));
+    if (RAND_bytes(server->nonce_secret, sizeof(server->nonce_secret)) != 1) {
+        fprintf(stderr, "Failed to generate TURN nonce secret\n");
+        free(server);
+        return -1;
+    }
+
+    // リレーアドレス
+    if (!relay_ip) {
+        relay_ip = node->public_ip[0] != '\0' ? node->public_ip : node->ip;
+    }
+    if (!inet_aton(relay_ip, &server->relay_ip)) {
+        fprintf(stderr, "Invalid TURN relay address: %s\n", relay_ip);
+        free(server);
+        return -1;
+    }
+
+    // 制御用ソケット
+    server->socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (server->socket_fd < 0) {
+        perror("Failed to create TURN server socket");
+        free(server);
+        return -1;
+    }
+    socklen_t addr_len = sizeof(server->addr);
+    server->addr.sin_family = AF_INET;
+    server->addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server->addr.sin_port = htons(port);
+    if (bind(server->socket_fd, (struct sockaddr*)&server->addr, addr_len) < 0 ||
+        getsockname(server->socket_fd, (struct sockaddr*)&server->addr, &addr_len) < 0) {
+        perror("Failed to bind TURN server socket");
+        close(server->socket_fd);
+        free(server);
+        return -1;
+    }
+    fcntl(server->socket_fd, F_SETFL, O_NONBLOCK);
+
+    // 全てのクライアントのデータが通るので、バーストを受け止められるだけのバッファを持つ
+    int buffer_size = TURN_SERVER_SOCKET_BUFFER;
+    setsockopt(server->socket_fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(server->socket_fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+    // epoll（制御用ソケットは0、リレー用ソケットはアロケーションの位置 + 1）
+    server->epoll_fd = epoll_create1(0);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = 0;
+    if (server->epoll_fd < 0 || epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->socket_fd, &event) < 0) {
+        perror("Failed to set up TURN server epoll");
+        if (server->epoll_fd >= 0) {
+            close(server->epoll_fd);
+        }
+        close(server->socket_fd);
+        free(server);
+        return -1;
+    }
+
+    pthread_mutex_init(&server->mutex, NULL);
+    server->running = true;
+    if (pthread_create(&server->thread, NULL, turn_server_thread, server) != 0) {
+        perror("Failed to create TURN server thread");
+        pthread_mutex_destroy(&server->mutex);
+        close(server->epoll_fd);
+        close(server->socket_fd);
+        free(server);
+        return -1;
+    }
+
+    node->turn_server_data = server;
+    printf("TURN relay server started for node %d on port %d (relay address %s)\n",
+           node->id, ntohs(server->addr.sin_port), relay_ip);
+    return 0;
+}
+
+// TURNサーバーの停止（全てのアロケーションを閉じる）
+int turn_server_stop(Node* node) {
+    if (!node || !node->turn_server_data) {
+        return -1;
+    }
+    TurnServer* server = (TurnServer*)node->turn_server_data;
+
+    server->running = false;
+    pthread_join(server->thread, NULL);
+    for (int i = 0; i < TURN_SERVER_MAX_ALLOCATIONS; i++) {
+        if (server->allocations[i].active) {
+            close(server->allocations[i].relay_fd);
+        }
+    }
+    close(server->epoll_fd);
+    close(server->socket_fd);
+    pthread_mutex_destroy(&server->mutex);
+    free(server);
+    node->turn_server_data = NULL;
+
+    printf("TURN relay server stopped for node %d\n", node->id);
+    return 0;
+}
+
+// アロケーションごとの帯域の上限（バイト/秒、0なら無制限）
+void turn_server_set_rate_limit(Node* node, uint32_t bytes_per_second) {
+    if (!node || !node->turn_server_data) {
+        return;
+    }
+    TurnServer* server = (TurnServer*)node->turn_server_data;
+    pthread_mutex_lock(&server->mutex);
+    server->rate_limit = bytes_per_second;
+    pthread_mutex_unlock(&server->mutex);
+}
+
+// 制御用ソケットのポート
+int turn_server_get_port(Node* node) {
+    if (!node || !node->turn_server_data) {
+        return -1;
+    }
+    return ntohs(((TurnServer*)node->turn_server_data)->addr.sin_port);
+}
+
+void turn_server_get_stats(Node* node, TurnServerStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!node || !node->turn_server_data) {
+        return;
+    }
+    TurnServer* server = (TurnServer*)node->turn_server_data;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&server->mutex);
+    *stats = server->stats;
+    stats->permissions = 0;
+    stats->channels = 0;
+    for (int i = 0; i < TURN_SERVER_MAX_ALLOCATIONS; i++) {
+        TurnAllocation* allocation = &server->allocations[i];
+        if (!allocation->active) {
+            continue;
+        }
+        for (int j = 0; j < allocation->permission_count; j++) {
+            stats->permissions += allocation->permissions[j].expiry > now;
+        }
+        for (int j = 0; j < allocation->channel_count; j++) {
+            stats->channels += allocation->channels[j].expiry > now;
+        }
+    }
+    pthread_mutex_unlock(&server->mutex);
+}
@@ -0,0 +1,107 @@
+#ifndef TURN_SERVER_H
+#define TURN_SERVER_H
+
+#include "node.h"
+#include "turn.h"
+
+// TURNリレーサーバー
+//
+// 公開アドレスを持つノードが、NATの内側のノードのためのTURNサーバーになる。
+// turn.cのクライアントが使うBinding・Allocate・Refresh・CreatePermission・ChannelBind・
+// Send Indication・ChannelDataに対応する。
+//
+// Binding以外の要求はRFC 5766の長期の資格情報で認証する。USERNAME・REALM・NONCEと、
+// MD5(username:realm:password)を鍵にしたMESSAGE-INTEGRITYがなければ、REALMとNONCEを付けた
+// 401を返す。NONCEは期限とクライアントのアドレスにサーバーの秘密でHMACをかけたもので、
+// 期限切れや別のアドレスのものには新しいNONCEを付けた438を返す。資格情報がなければ起動しない。
+//
+// 1つのスレッドがepollで制御用のソケットと全てのリレー用ソケットを待ち、recvmmsgで
+// まとめて受け取って、宛先のソケットごとにsendmmsgでまとめて送る。データはコピーせず、
+// ヘッダーと受信バッファを別々のiovecのまま送る。
+//
+// アロケーションごとにパーミッションとチャネルの数と、中継するバイト数（トークンバケット、
+// 両方向の合計）に上限がある。上限を超えたデータは捨てる。
+#define TURN_SERVER_MAX_ALLOCATIONS 128
+#define TURN_SERVER_ALLOCATION_SLOTS 256 // アロケーションの索引のハッシュ表の大きさ（2の冪）
+#define TURN_SERVER_MAX_PERMISSIONS 64   // アロケーションごとのパーミッションの上限
+#define TURN_SERVER_MAX_CHANNELS TURN_MAX_CHANNELS // アロケーションごとのチャネルの上限
+#define TURN_SERVER_MAX_LIFETIME 3600    // アロケーションの有効期間の上限（秒）
+#define TURN_SERVER_RATE_LIMIT (4 * 1024 * 1024) // アロケーションごとの既定の帯域（バイト/秒）
+#define TURN_SERVER_BURST (256 * 1024)   // トークンバケットの深さ（バイト）
+#define TURN_SERVER_BATCH 32             // recvmmsg・sendmmsgでまとめるパケットの数
+#define TURN_SERVER_MAX_BATCHES 4        // 1つのソケットから続けて読むバッチの数
+#define TURN_SERVER_SOCKET_BUFFER (4 * 1024 * 1024) // 制御用ソケットの受信・送信バッファ
+#define TURN_SERVER_REALM "node_network" // 長期の資格情報のREALM
+#define TURN_SERVER_NONCE_LIFETIME 600   // NONCEの有効期間（秒）
+
+// サーバー上のパーミッション
+typedef struct {
+    struct in_addr addr;
+    time_t expiry;
+} TurnServerPermission;
+
+// サーバー上のチャネル
+typedef struct {
+    uint16_t number;
+    struct sockaddr_in peer;
+    time_t expiry;
+} TurnServerChannel;
+
+// アロケーション（クライアントのアドレスごとに1つ）
+typedef struct {
+    bool active;
+    struct sockaddr_in client;
+    uint8_t transaction_id[12];  // Allocateの再送に同じ応答を返すため
+    int relay_fd;
+    struct sockaddr_in relay_addr;
+    time_t expiry;
+    TurnServerPermission permissions[TURN_SERVER_MAX_PERMISSIONS];
+    int permission_count;
+    TurnServerChannel channels[TURN_SERVER_MAX_CHANNELS];
+    int channel_count;
+    double tokens;               // 中継できる残りのバイト数
+    uint64_t refilled_ms;
+    uint64_t relayed_packets;
+    uint64_t relayed_bytes;
+} TurnAllocation;
+
+// TURNサーバーの統計
+typedef struct {
+    int allocations;
+    int permissions;
+    int channels;
+    uint64_t requests;           // 受け取った要求
+    uint64_t errors;             // エラー応答
+    uint64_t relayed_packets;    // 中継したデータ（両方向）
+    uint64_t relayed_bytes;
+    uint64_t no_permission;      // パーミッションがなくて捨てたデータ
+    uint64_t over_quota;         // 帯域の上限を超えて捨てたデータ
+    uint64_t batches;            // recvmmsgの呼び出し
+} TurnServerStats;
+
+// TURNサーバー
+typedef struct {
+    int socket_fd;
+    struct sockaddr_in addr;     // 制御用ソケットのアドレス
+    struct in_addr relay_ip;     // クライアントに知らせるリレーアドレス
+    char username[64];
+    uint8_t key[16];             // MD5(username:realm:password)
+    uint8_t nonce_secret[16];    // NONCEにかけるHMACの鍵（起動ごとに作る）
+    uint32_t rate_limit;         // アロケーションごとの帯域（バイト/秒、0なら無制限）
+    int epoll_fd;
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t mutex;       // アロケーションと統計の保護（サーバースレッドはバッチごとに持つ）
+    TurnAllocation allocations[TURN_SERVER_MAX_ALLOCATIONS];
+    int16_t allocation_index[TURN_SERVER_ALLOCATION_SLOTS]; // クライアントのアドレスのハッシュ → allocations
+    TurnServerStats stats;
+} TurnServer;
+
+// TURNサーバー関数プロトタイプ
+int turn_server_start(Node* node, int port, const char* relay_ip, const char* username, const char* password);
+int turn_server_stop(Node* node);
+void turn_server_set_rate_limit(Node* node, uint32_t bytes_per_second);
+int turn_server_get_port(Node* node);
+void turn_server_get_stats(Node* node, TurnServerStats* stats);
+
+#endif /* TURN_SERVER_H */